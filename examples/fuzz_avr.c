@@ -0,0 +1,224 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_hex.h"
+#include "sim_fuzz.h"
+
+/*
+ * Fuzzing harness for the UART/TWI input parsers of a firmware.
+ *
+ * The firmware is booted once up to its marker, then every input runs
+ * from a snapshot of that state, in the same process.
+ *
+ *   ./fuzz_avr --firmware=fw.elf --uart=0 [--twi=0:0x50] [--marker=sym]
+ *              [--budget=cycles] [--tail=cycles] [input files...]
+ *
+ * - On its own, runs the input files (or stdin) and prints the findings.
+ * - Built with afl-clang-fast, stdin is read in an __AFL_LOOP() persistent
+ *   loop and the firmware coverage goes in the AFL map.
+ * - Built with -DFUZZ_LIBFUZZER -fsanitize=fuzzer, the same '--' options
+ *   are taken (libFuzzer ignores them) and the coverage goes to the
+ *   extra counters.
+ * Findings abort(), so both fuzzers record them as crashes.
+ */
+
+static avr_fuzz_t fuzz;
+
+static struct {
+	const char *		firmware;
+	const char *		mmcu;
+	uint32_t			frequency;
+	const char *		marker;
+	avr_cycle_count_t	boot;
+	avr_cycle_count_t	budget;
+	avr_cycle_count_t	tail;
+	int					uart;
+	int					twi;
+	int					twi_addr;
+} opt = {
+	.boot = 100000000,
+	.tail = 10000,
+};
+
+static int
+fuzz_option(
+		const char * arg)
+{
+	const char * v = strchr(arg, '=');
+
+	if (strncmp(arg, "--", 2) || !v)
+		return 0;
+	v++;
+	if (!strncmp(arg, "--firmware=", 11))
+		opt.firmware = v;
+	else if (!strncmp(arg, "--mcu=", 6))
+		opt.mmcu = v;
+	else if (!strncmp(arg, "--freq=", 7))
+		opt.frequency = strtoul(v, NULL, 0);
+	else if (!strncmp(arg, "--marker=", 9))
+		opt.marker = v;
+	else if (!strncmp(arg, "--boot=", 7))
+		opt.boot = strtoull(v, NULL, 0);
+	else if (!strncmp(arg, "--budget=", 9))
+		opt.budget = strtoull(v, NULL, 0);
+	else if (!strncmp(arg, "--tail=", 7))
+		opt.tail = strtoull(v, NULL, 0);
+	else if (!strncmp(arg, "--uart=", 7))
+		opt.uart = v[0];
+	else if (!strncmp(arg, "--twi=", 6)) {
+		opt.twi = v[0];
+		opt.twi_addr = v[1] == ':' ? strtoul(v + 2, NULL, 0) : 0x50;
+	} else
+		return 0;
+	return 1;
+}
+
+static int
+fuzz_setup(
+		int argc,
+		char ** argv)
+{
+	elf_firmware_t f = {{0}};
+	avr_t * avr;
+
+	for (int i = 1; i < argc; i++)
+		fuzz_option(argv[i]);
+	if (!opt.firmware) {
+		fprintf(stderr, "%s: --firmware=<file> is required\n", argv[0]);
+		return -1;
+	}
+	if (opt.mmcu)
+		strncpy(f.mmcu, opt.mmcu, sizeof(f.mmcu) - 1);
+	f.frequency = opt.frequency;
+	sim_setup_firmware(opt.firmware, AVR_SEGMENT_OFFSET_FLASH, &f, argv[0]);
+	if (opt.mmcu)
+		strncpy(f.mmcu, opt.mmcu, sizeof(f.mmcu) - 1);
+	if (opt.frequency)
+		f.frequency = opt.frequency;
+	avr = avr_make_mcu_by_name(f.mmcu);
+	if (!avr) {
+		fprintf(stderr, "%s: AVR '%s' not known\n", argv[0], f.mmcu);
+		return -1;
+	}
+	avr_init(avr);
+	avr_load_firmware(avr, &f);
+	if (f.flashbase)
+		avr->pc = f.flashbase;
+
+	avr_fuzz_init(&fuzz, avr);
+	if (opt.budget)
+		fuzz.budget = opt.budget;
+	fuzz.tail = opt.tail;
+	if (opt.uart && avr_fuzz_uart(&fuzz, opt.uart))
+		return -1;
+	if (opt.twi && avr_fuzz_twi(&fuzz, opt.twi, opt.twi_addr))
+		return -1;
+	return avr_fuzz_boot(&fuzz, opt.marker, opt.boot);
+}
+
+#ifdef FUZZ_LIBFUZZER
+
+/* libFuzzer picks these up as extra coverage counters */
+__attribute__((section("__libfuzzer_extra_counters")))
+static uint8_t fuzz_counters[128 * 1024];
+
+int
+LLVMFuzzerInitialize(
+		int * argc,
+		char *** argv)
+{
+	if (fuzz_setup(*argc, *argv))
+		exit(1);
+	return 0;
+}
+
+int
+LLVMFuzzerTestOneInput(
+		const uint8_t * data,
+		size_t size)
+{
+	int res = avr_fuzz_run(&fuzz, data, size);
+
+	for (uint32_t i = 0; i < fuzz.coverage_size && i < sizeof(fuzz_counters); i++)
+		fuzz_counters[i] = fuzz.coverage[i];
+	if (res != AVR_FUZZ_OK) {
+		fprintf(stderr, "FUZZ: %s at pc %04x\n",
+				avr_fuzz_finding_name(res), fuzz.avr->pc);
+		abort();
+	}
+	return 0;
+}
+
+#else
+
+#ifdef __AFL_HAVE_MANUAL_CONTROL
+#ifndef MAP_SIZE
+#define MAP_SIZE	(1 << 16)
+#endif
+extern uint8_t * __afl_area_ptr;
+#else
+#define __AFL_LOOP(_n)	(!_loop++)
+static int _loop;
+#endif
+
+static uint8_t input[64 * 1024];
+
+static int
+fuzz_one(
+		int fd)
+{
+	size_t size = 0;
+	ssize_t r;
+
+	while (size < sizeof(input) &&
+			(r = read(fd, input + size, sizeof(input) - size)) > 0)
+		size += r;
+	int res = avr_fuzz_run(&fuzz, input, size);
+#ifdef __AFL_HAVE_MANUAL_CONTROL
+	for (uint32_t i = 0; i < fuzz.coverage_size; i++)
+		if (fuzz.coverage[i])
+			__afl_area_ptr[(i * 0x9e3779b1) & (MAP_SIZE - 1)] |= fuzz.coverage[i];
+#endif
+	return res;
+}
+
+int
+main(
+		int argc,
+		char ** argv)
+{
+	int files = 0, findings = 0;
+
+	if (fuzz_setup(argc, argv))
+		exit(1);
+	for (int i = 1; i < argc; i++) {
+		if (!strncmp(argv[i], "--", 2))
+			continue;
+		int fd = open(argv[i], O_RDONLY);
+		if (fd == -1) {
+			perror(argv[i]);
+			continue;
+		}
+		int res = fuzz_one(fd);
+		close(fd);
+		printf("%s: %s, SP min %04x\n", argv[i],
+				avr_fuzz_finding_name(res), fuzz.sp_min);
+		files++;
+		findings += res != AVR_FUZZ_OK;
+	}
+	if (files)
+		exit(findings ? 2 : 0);
+	while (__AFL_LOOP(10000)) {
+		if (fuzz_one(0) != AVR_FUZZ_OK)
+			abort();
+	}
+	return 0;
+}
+
+#endif
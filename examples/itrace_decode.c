@@ -0,0 +1,59 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_itrace.h"
+
+/*
+ * Decodes a binary instruction trace, as written by run_avr --itrace
+ * or --flight, into one line of text per instruction:
+ *
+ *   ./itrace_decode trace.bin [firmware.elf]
+ *
+ * With the firmware, the pc and the jump targets are named after its
+ * symbols.
+ */
+int
+main(
+		int argc,
+		char ** argv)
+{
+	avr_itrace_header_t h;
+	avr_itrace_rec_t rec[4096];
+	avr_t symbols = {0};
+	elf_firmware_t f = {{0}};
+	size_t n;
+
+	if (argc < 2) {
+		fprintf(stderr, "%s: <trace file> [firmware.elf]\n", argv[0]);
+		exit(1);
+	}
+	FILE * in = fopen(argv[1], "rb");
+	if (!in) {
+		perror(argv[1]);
+		exit(1);
+	}
+	if (fread(&h, sizeof(h), 1, in) != 1 || h.magic != AVR_ITRACE_MAGIC ||
+			h.version != AVR_ITRACE_VERSION || h.rec_size != sizeof(rec[0])) {
+		fprintf(stderr, "%s: %s is not an instruction trace\n", argv[0], argv[1]);
+		exit(1);
+	}
+	if (argc > 2) {
+		if (elf_read_firmware(argv[2], &f) == -1) {
+			fprintf(stderr, "%s: can't read %s\n", argv[0], argv[2]);
+			exit(1);
+		}
+		symbols.symbol = f.symbol;
+		symbols.symbolcount = f.symbolcount;
+	}
+	printf("# %.16s at %u Hz\n", h.mmcu, h.frequency);
+	while ((n = fread(rec, sizeof(rec[0]), 4096, in)) > 0)
+		for (size_t i = 0; i < n; i++)
+			avr_itrace_print(&rec[i], &symbols, stdout);
+	fclose(in);
+	elf_firmware_free(&f);
+	return 0;
+}
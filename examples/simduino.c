@@ -17,60 +17,20 @@
 #include "uart_pty.h"
 #include "sim_vcd_file.h"
 #include "avr_uart.h"
+#include "avr_flash.h"
+#include "avr_eeprom.h"
 
 uart_pty_t uart_pty;
 avr_t *avr = NULL;
 avr_vcd_t vcd_file;
 
-struct avr_flash
-{
-	char avr_flash_path[1024];
-	int avr_flash_fd;
-};
-
 volatile int stop_simulation = 0;
 
-// avr special flash initalization
-// here: open and map a file to enable a persistent storage for the flash memory
-void avr_special_init(avr_t *avr, void *data)
-{
-	struct avr_flash *flash_data = (struct avr_flash *)data;
-
-	printf("%s\n", __func__);
-	// open the file
-	flash_data->avr_flash_fd = open(flash_data->avr_flash_path,
-									O_RDWR | O_CREAT, 0644);
-	if (flash_data->avr_flash_fd < 0)
-	{
-		perror(flash_data->avr_flash_path);
-		exit(1);
-	}
-	// resize and map the file the file
-	(void)ftruncate(flash_data->avr_flash_fd, avr->flashend + 1);
-	ssize_t r = read(flash_data->avr_flash_fd, avr->flash, avr->flashend + 1);
-	if (r != avr->flashend + 1)
-	{
-		fprintf(stderr, "unable to load flash memory\n");
-		perror(flash_data->avr_flash_path);
-		exit(1);
-	}
-}
-
-// avr special flash deinitalization
-// here: cleanup the persistent storage
+// avr special deinitalization
+// here: stop the pty, the flash and eeprom files are synced when unmapped
 void avr_special_deinit(avr_t *avr, void *data)
 {
-	struct avr_flash *flash_data = (struct avr_flash *)data;
-
 	printf("%s\n", __func__);
-	lseek(flash_data->avr_flash_fd, SEEK_SET, 0);
-	ssize_t r = write(flash_data->avr_flash_fd, avr->flash, avr->flashend + 1);
-	if (r != avr->flashend + 1)
-	{
-		fprintf(stderr, "unable to load flash memory\n");
-		perror(flash_data->avr_flash_path);
-	}
-	close(flash_data->avr_flash_fd);
 	uart_pty_stop(&uart_pty);
 }
 
@@ -101,7 +61,7 @@ int main(int argc, char *argv[])
 {
 	signal(SIGINT, sig_int);
 
-	struct avr_flash flash_data;
+	char path[1024];
 	char boot_path[1024] = "./ATmegaBOOT_168_atmega328.ihex";
 	uint32_t boot_base, boot_size;
 	char *mmcu = "atmega328p";
@@ -140,16 +100,22 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
-	snprintf(flash_data.avr_flash_path, sizeof(flash_data.avr_flash_path),
-			 "simduino_%s_flash.bin", mmcu);
-	flash_data.avr_flash_fd = 0;
 	// register our own functions
-	avr->custom.init = avr_special_init;
 	avr->custom.deinit = avr_special_deinit;
-	avr->custom.data = &flash_data;
 	avr_init(avr);
 	avr->frequency = freq;
 
+	// flash and eeprom persist in files, mapped in place
+	snprintf(path, sizeof(path), "simduino_%s_flash.bin", mmcu);
+	if (avr_ioctl(avr, AVR_IOCTL_FLASH_MAP, path))
+	{
+		fprintf(stderr, "%s: Unable to map %s\n", argv[0], path);
+		exit(1);
+	}
+	snprintf(path, sizeof(path), "simduino_%s_eeprom.bin", mmcu);
+	if (avr_ioctl(avr, AVR_IOCTL_EEPROM_MAP, path))
+		fprintf(stderr, "%s: Unable to map %s\n", argv[0], path);
+
 	memcpy(avr->flash + boot_base, boot, boot_size);
 	free(boot);
 	avr->pc = boot_base;
@@ -42,6 +42,7 @@
 #include "avr_uart.h"
 #include "sim_time.h"
 #include "sim_hex.h"
+#include "sim_reverse.h"
 
 DEFINE_FIFO(uint8_t,uart_pty_fifo);
 
@@ -61,6 +62,9 @@ uart_pty_in_hook(
 {
 	uart_pty_t * p = (uart_pty_t*)param;
 	TRACE(printf("uart_pty_in_hook %02x\n", value);)
+	// going back, that byte was sent already
+	if (avr_reverse_scanning(p->avr))
+		return;
 	uart_pty_fifo_write(&p->pty.in, value);
 
 	if (p->tap.s) {
@@ -76,6 +80,9 @@ static void
 uart_pty_flush_incoming(
 		uart_pty_t * p)
 {
+	// going back, the input of the past is injected from the log
+	if (avr_reverse_scanning(p->avr))
+		return;
 	while (p->xon && !uart_pty_fifo_isempty(&p->pty.out)) {
 		TRACE(int r = p->pty.out.read;)
 		uint8_t byte = uart_pty_fifo_read(&p->pty.out);
@@ -49,8 +49,42 @@ enum {
 	SIMAVR_CMD_VCD_START_TRACE,
 	SIMAVR_CMD_VCD_STOP_TRACE,
 	SIMAVR_CMD_UART_LOOPBACK,
+	SIMAVR_CMD_FUZZ_MARKER,		// firmware is ready for input, see sim_fuzz.h
+	SIMAVR_CMD_SEMIHOST,		// followed by a simavr_semihost_t address
 };
 
+/*
+ * Semihosting, see sim_semihost.h. The firmware fills a block in SRAM,
+ * sends SIMAVR_CMD_SEMIHOST then the block address, low byte first, and
+ * simavr does the operation right there, in no simulated time. 'buf' is
+ * an SRAM address, it is read or written in place.
+ */
+enum {
+	SIMAVR_SEMIHOST_WRITE = 1,	// 'len' bytes of 'buf' to 'fd', 1 is the log
+	SIMAVR_SEMIHOST_READ,		// up to 'len' bytes from 'fd' to 'buf'
+	SIMAVR_SEMIHOST_OPEN,		// path in 'buf', 'fd' is the mode, ret the fd
+	SIMAVR_SEMIHOST_CLOSE,		// 'fd'
+	SIMAVR_SEMIHOST_TIME,		// 8 bytes to 'buf', wall clock in us
+	SIMAVR_SEMIHOST_CYCLES,		// 8 bytes to 'buf', the cycle counter
+	SIMAVR_SEMIHOST_EXIT,		// stops the simulation, 'len' is the status
+};
+
+/* SIMAVR_SEMIHOST_OPEN modes */
+enum {
+	SIMAVR_SEMIHOST_O_READ = 0,
+	SIMAVR_SEMIHOST_O_WRITE,	// created, or truncated
+	SIMAVR_SEMIHOST_O_APPEND,
+};
+
+/* Little endian, as the AVR has it */
+typedef struct simavr_semihost_t {
+	uint8_t		op;
+	uint8_t		fd;
+	uint16_t	buf;
+	uint16_t	len;
+	int16_t		ret;		// filled by simavr, -1 on errors
+} simavr_semihost_t;
+
 #if __AVR__
 /*
  * WARNING. Due to newer GCC being stupid, they introduced a bug that
@@ -302,6 +336,24 @@ struct avr_mmcu_vcd_trace_t {
 		_MAP_1(_SEND_SIMAVR_CMD_BYTE, reg, __VA_ARGS__) \
 	} while(0)
 
+/*
+ * Does a semihosting call through the command register 'reg', returns
+ * b->ret. The barriers make sure the block is in memory before, and
+ * re-read after.
+ */
+static inline int16_t
+simavr_semihost(
+		volatile uint8_t * reg,
+		simavr_semihost_t * b)
+{
+	__asm__ __volatile__ ("" ::: "memory");
+	*reg = SIMAVR_CMD_SEMIHOST;
+	*reg = (uint16_t)b;
+	*reg = (uint16_t)b >> 8;
+	__asm__ __volatile__ ("" ::: "memory");
+	return b->ret;
+}
+
 #endif /* __AVR__ */
 
 #ifdef __cplusplus
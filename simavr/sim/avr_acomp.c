@@ -22,6 +22,7 @@
 #include <stdlib.h>
 #include "avr_acomp.h"
 #include "avr_timer.h"
+#include "sim_snapshot.h"
 
 static uint8_t
 avr_acomp_get_state(
@@ -219,10 +220,28 @@ static const char * irq_names[ACOMP_IRQ_COUNT] = {
 	[ACOMP_IRQ_OUT] = ">out"
 };
 
+static const avr_cycle_timer_t _timers[] = {
+	avr_acomp_sync_state,
+	NULL,
+};
+
+static void
+avr_acomp_snapshot(
+		avr_io_t * port,
+		avr_snapshot_t * snap)
+{
+	avr_acomp_t * p = (avr_acomp_t *)port;
+
+	AVR_SNAPSHOT_FIELD(snap, p->adc_values);
+	AVR_SNAPSHOT_FIELD(snap, p->ain_values);
+}
+
 static avr_io_t _io = {
 	.kind = "ac",
 	.reset = avr_acomp_reset,
 	.irq_names = irq_names,
+	.timers = _timers,
+	.snapshot = avr_acomp_snapshot,
 };
 
 void
@@ -231,6 +250,7 @@ avr_acomp_init(
 	avr_acomp_t * p)
 {
 	p->io = _io;
+	p->io.timer_param = p;
 
 	avr_register_io(avr, &p->io);
 	avr_register_vector(avr, &p->ac);
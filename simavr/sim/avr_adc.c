@@ -24,6 +24,8 @@
 #include <string.h>
 #include "sim_time.h"
 #include "avr_adc.h"
+#include "avr_adc_stim.h"
+#include "sim_snapshot.h"
 
 static avr_cycle_count_t
 avr_adc_int_raise(
@@ -46,6 +48,44 @@ avr_adc_int_raise(
 	return 0;
 }
 
+/*
+ * Reads the stimuli of the channels 'mux' converts, returns non zero if
+ * they all have one, and the host needn't be asked.
+ */
+static int
+avr_adc_stim_read(
+		avr_adc_t * p,
+		avr_adc_mux_t mux,
+		avr_cycle_count_t when)
+{
+	avr_t * avr = p->io.avr;
+	struct avr_adc_stim_t ** s = p->stim;
+	int all = 1;
+
+	switch (mux.kind) {
+		case ADC_MUX_DIFF:
+			if (s[mux.diff])
+				p->adc_values[mux.diff] =
+						avr_adc_stim_sample(avr, s[mux.diff], when);
+			else
+				all = 0;
+			// fall through
+		case ADC_MUX_SINGLE:
+			if (s[mux.src])
+				p->adc_values[mux.src] =
+						avr_adc_stim_sample(avr, s[mux.src], when);
+			else
+				all = 0;
+			return all;
+		case ADC_MUX_TEMP:
+			if (!s[ADC_IRQ_TEMP])
+				return 0;
+			p->temp = avr_adc_stim_sample(avr, s[ADC_IRQ_TEMP], when);
+			return 1;
+	}
+	return 0;
+}
+
 static avr_cycle_count_t
 avr_adc_convert(struct avr_t * avr, avr_cycle_count_t when, void * param)
 {
@@ -56,11 +96,13 @@ avr_adc_convert(struct avr_t * avr, avr_cycle_count_t when, void * param)
         /* Ask the calling program for inputs. */
 
 	avr_adc_mux_t mux = p->muxmode[p->current_muxi];
-        union {
-                avr_adc_mux_t mux;
-                uint32_t v;
-        } e = { .mux = mux };
-        avr_raise_irq(p->io.irq + ADC_IRQ_OUT_TRIGGER, e.v);
+	if (!avr_adc_stim_read(p, mux, when)) {
+		union {
+			avr_adc_mux_t mux;
+			uint32_t v;
+		} e = { .mux = mux };
+		avr_raise_irq(p->io.irq + ADC_IRQ_OUT_TRIGGER, e.v);
+	}
 
 	// optional shift left/right
 	uint8_t shift = p->current_extras.adjust ? 6 : 0; // shift LEFT
@@ -403,15 +445,76 @@ static const char * irq_names[ADC_IRQ_COUNT] = {
 	[ADC_IRQ_OUT_TRIGGER] = ">trigger_out",
 };
 
+static const avr_cycle_timer_t _timers[] = {
+	avr_adc_convert,
+	avr_adc_int_raise,
+	NULL,
+};
+
+static void
+avr_adc_snapshot(
+		avr_io_t * port,
+		avr_snapshot_t * snap)
+{
+	avr_adc_t * p = (avr_adc_t *)port;
+
+	AVR_SNAPSHOT_FIELD(snap, p->adts_mode);
+	AVR_SNAPSHOT_FIELD(snap, p->adc_values);
+	AVR_SNAPSHOT_FIELD(snap, p->temp);
+	AVR_SNAPSHOT_FIELD(snap, p->first);
+	AVR_SNAPSHOT_FIELD(snap, p->read_status);
+	AVR_SNAPSHOT_FIELD(snap, p->current_muxi);
+	AVR_SNAPSHOT_FIELD(snap, p->current_refi);
+	AVR_SNAPSHOT_FIELD(snap, p->current_prescale);
+	AVR_SNAPSHOT_FIELD(snap, p->current_extras);
+	AVR_SNAPSHOT_FIELD(snap, p->result);
+}
+
+static int
+avr_adc_ioctl(
+		struct avr_io_t * port,
+		uint32_t ctl,
+		void * io_param)
+{
+	avr_adc_t * p = (avr_adc_t *)port;
+
+	if ((ctl & ~0xff) != AVR_IOCTL_ADC_SET_STIM(0))
+		return -1;
+	int chan = ctl & 0xff;
+	if (chan > ADC_IRQ_TEMP)
+		return -1;
+	if (p->stim[chan] != io_param)
+		avr_adc_stim_free(p->stim[chan]);
+	p->stim[chan] = io_param;
+	return 0;
+}
+
+static void
+avr_adc_dealloc(
+		struct avr_io_t * port)
+{
+	avr_adc_t * p = (avr_adc_t *)port;
+
+	for (int i = 0; i <= ADC_IRQ_TEMP; i++) {
+		avr_adc_stim_free(p->stim[i]);
+		p->stim[i] = NULL;
+	}
+}
+
 static	avr_io_t	_io = {
 	.kind = "adc",
 	.reset = avr_adc_reset,
+	.ioctl = avr_adc_ioctl,
+	.dealloc = avr_adc_dealloc,
 	.irq_names = irq_names,
+	.timers = _timers,
+	.snapshot = avr_adc_snapshot,
 };
 
 void avr_adc_init(avr_t * avr, avr_adc_t * p)
 {
 	p->io = _io;
+	p->io.timer_param = p;
 
 	avr_register_io(avr, &p->io);
 	avr_register_vector(avr, &p->adc);
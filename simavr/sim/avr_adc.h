@@ -38,6 +38,9 @@ extern "C" {
  * ADC_IRQ_OUT_TRIGGER irq, and at that point send any of the
  * ADC_IRQ_ADC* with Millivolts as value.
  *
+ * A channel can also be given a stimulus, that the conversion reads
+ * without asking, see avr_adc_stim.h
+ *
  * External trigger is not done yet.
  */
 
@@ -55,6 +58,8 @@ enum {
 
 // Get the internal IRQ corresponding to the INT
 #define AVR_IOCTL_ADC_GETIRQ AVR_IOCTL_DEF('a','d','c','0')
+// Attach a avr_adc_stim_t to ADC_IRQ_ADC0..ADC_IRQ_TEMP, NULL detaches
+#define AVR_IOCTL_ADC_SET_STIM(_chan) AVR_IOCTL_DEF('a','d','s',(_chan))
 
 /*
  * Definition of a ADC mux mode.
@@ -141,6 +146,8 @@ typedef struct avr_adc_t {
 	uint16_t		temp;		// temp sensor reading
 	uint8_t			first;
 	uint8_t			read_status;	// marked one when adcl is read
+	// read by the conversion instead of the above, see avr_adc_stim.h
+	struct avr_adc_stim_t * stim[ADC_IRQ_TEMP + 1];
 
         /* Conversion parameters saved at start (ADSC is set). */
 
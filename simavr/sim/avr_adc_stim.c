@@ -0,0 +1,417 @@
+/*
+	avr_adc_stim.c
+
+	ADC stimuli, waveforms, sample files and host rings.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "avr_adc.h"
+#include "avr_adc_stim.h"
+
+DEFINE_FIFO(avr_adc_stim_point_t, avr_adc_stim_fifo);
+
+static uint16_t
+_stim_clamp(
+		double mv)
+{
+	if (mv <= 0)
+		return 0;
+	if (mv >= 0xffff)
+		return 0xffff;
+	return mv + 0.5;
+}
+
+static avr_adc_stim_t *
+_stim_new(
+		int kind)
+{
+	avr_adc_stim_t * s = calloc(1, sizeof(*s));
+
+	s->kind = kind;
+	return s;
+}
+
+avr_adc_stim_t *
+avr_adc_stim_wave(
+		int kind,
+		double hz,
+		int32_t offset,
+		int32_t amplitude)
+{
+	if (kind != ADC_STIM_SINE && kind != ADC_STIM_RAMP)
+		return NULL;
+	avr_adc_stim_t * s = _stim_new(kind);
+	s->hz = hz;
+	s->offset = offset;
+	s->amplitude = amplitude;
+	if (kind == ADC_STIM_SINE) {
+		s->count = ADC_STIM_TABLE;
+		s->sample = malloc(s->count * sizeof(s->sample[0]));
+		for (int i = 0; i < s->count; i++)
+			s->sample[i] = _stim_clamp(offset +
+					amplitude * sin(2 * M_PI * i / s->count));
+		s->rate = hz * s->count;
+		s->loop = 1;
+	}
+	return s;
+}
+
+avr_adc_stim_t *
+avr_adc_stim_noise(
+		int32_t offset,
+		int32_t amplitude,
+		uint32_t seed)
+{
+	avr_adc_stim_t * s = _stim_new(ADC_STIM_NOISE);
+
+	s->offset = offset;
+	s->amplitude = amplitude;
+	s->seed = seed;
+	return s;
+}
+
+avr_adc_stim_t *
+avr_adc_stim_samples(
+		const uint16_t * mv,
+		uint32_t count,
+		double rate,
+		int loop)
+{
+	if (!count || rate <= 0)
+		return NULL;
+	avr_adc_stim_t * s = _stim_new(ADC_STIM_SAMPLES);
+	s->sample = malloc(count * sizeof(s->sample[0]));
+	memcpy(s->sample, mv, count * sizeof(s->sample[0]));
+	s->count = count;
+	s->rate = rate;
+	s->loop = loop;
+	return s;
+}
+
+static uint32_t
+_wav32(
+		const uint8_t * b)
+{
+	return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+static uint16_t
+_wav16(
+		const uint8_t * b)
+{
+	return b[0] | (b[1] << 8);
+}
+
+static avr_adc_stim_t *
+_stim_load_wav(
+		const uint8_t * b,
+		size_t size,
+		uint16_t low,
+		uint16_t high,
+		int loop)
+{
+	const uint8_t * fmt = NULL, * data = NULL;
+	uint32_t data_size = 0;
+
+	for (size_t o = 12; o + 8 <= size; ) {
+		uint32_t len = _wav32(b + o + 4);
+		if (len > size - o - 8)
+			len = size - o - 8;
+		if (!memcmp(b + o, "fmt ", 4) && len >= 16)
+			fmt = b + o + 8;
+		else if (!memcmp(b + o, "data", 4)) {
+			data = b + o + 8;
+			data_size = len;
+		}
+		o += 8 + len + (len & 1);
+	}
+	if (!fmt || !data)
+		return NULL;
+	uint16_t format = _wav16(fmt), channels = _wav16(fmt + 2);
+	uint32_t rate = _wav32(fmt + 4);
+	uint16_t bits = _wav16(fmt + 14);
+	// WAVE_FORMAT_EXTENSIBLE keeps the real one in the sub format
+	if (format == 0xfffe && _wav16(fmt - 4) >= 40)
+		format = _wav16(fmt + 24);
+	if (!channels || !rate ||
+			!((format == 1 && (bits == 8 || bits == 16)) ||
+			(format == 3 && bits == 32)))
+		return NULL;
+	uint32_t frame = channels * bits / 8;
+	uint32_t count = data_size / frame;
+	if (!count)
+		return NULL;
+
+	avr_adc_stim_t * s = _stim_new(ADC_STIM_SAMPLES);
+	s->sample = malloc(count * sizeof(s->sample[0]));
+	s->count = count;
+	s->rate = rate;
+	s->loop = loop;
+	for (uint32_t i = 0; i < count; i++) {
+		const uint8_t * d = data + i * frame;
+		double v;	// -1 to 1
+		switch (bits) {
+			case 8:
+				v = (d[0] - 128) / 128.0;
+				break;
+			case 16:
+				v = (int16_t)_wav16(d) / 32768.0;
+				break;
+			default: {
+				union { uint32_t u; float f; } u = { .u = _wav32(d) };
+				v = u.f;
+			}
+		}
+		s->sample[i] = _stim_clamp(low + (v + 1) * (high - low) / 2);
+	}
+	return s;
+}
+
+static avr_adc_stim_t *
+_stim_load_text(
+		FILE * f,
+		double rate,
+		int loop)
+{
+	double * t = NULL, * v = NULL;
+	uint32_t count = 0, size = 0;
+	int timed = -1;
+	char line[256];
+
+	while (fgets(line, sizeof(line), f)) {
+		char * e, * l = line;
+		double a = strtod(l, &e);
+		if (e == l)		// headers, comments
+			continue;
+		l = e + strspn(e, " \t,;");
+		double b = strtod(l, &e);
+		if (timed == -1)
+			timed = e != l;
+		if (count == size) {
+			size = size ? size * 2 : 1024;
+			t = realloc(t, size * sizeof(t[0]));
+			v = realloc(v, size * sizeof(v[0]));
+		}
+		t[count] = a;
+		v[count++] = timed ? b : a;
+	}
+	avr_adc_stim_t * s = NULL;
+	if (!count)
+		goto out;
+	if (!timed) {
+		if (rate <= 0)
+			goto out;
+		s = _stim_new(ADC_STIM_SAMPLES);
+		s->sample = malloc(count * sizeof(s->sample[0]));
+		for (uint32_t i = 0; i < count; i++)
+			s->sample[i] = _stim_clamp(v[i]);
+		s->count = count;
+		goto done;
+	}
+	// timed points are resampled once here, the conversions just index
+	if (rate <= 0) {
+		double dt = 0;
+		for (uint32_t i = 1; i < count; i++)
+			if (t[i] > t[i - 1] && (!dt || t[i] - t[i - 1] < dt))
+				dt = t[i] - t[i - 1];
+		rate = dt ? 1 / dt : 1;
+	}
+	uint32_t n = t[count - 1] > 0 ? t[count - 1] * rate + 1 : 1;
+	s = _stim_new(ADC_STIM_SAMPLES);
+	s->sample = malloc(n * sizeof(s->sample[0]));
+	s->count = n;
+	for (uint32_t i = 0, j = 0; i < n; i++) {
+		double at = i / rate;
+		while (j + 1 < count && t[j + 1] <= at)
+			j++;
+		double mv = v[j];
+		if (at > t[j] && j + 1 < count && t[j + 1] > t[j])
+			mv += (v[j + 1] - v[j]) * (at - t[j]) / (t[j + 1] - t[j]);
+		s->sample[i] = _stim_clamp(mv);
+	}
+done:
+	s->rate = rate;
+	s->loop = loop;
+out:
+	free(t);
+	free(v);
+	return s;
+}
+
+avr_adc_stim_t *
+avr_adc_stim_load(
+		const char * filename,
+		double rate,
+		uint16_t low,
+		uint16_t high,
+		int loop)
+{
+	FILE * f = fopen(filename, "rb");
+	if (!f) {
+		perror(filename);
+		return NULL;
+	}
+	avr_adc_stim_t * s = NULL;
+	uint8_t head[12];
+	if (fread(head, 1, sizeof(head), f) == sizeof(head) &&
+			!memcmp(head, "RIFF", 4) && !memcmp(head + 8, "WAVE", 4)) {
+		fseek(f, 0, SEEK_END);
+		size_t size = ftell(f);
+		uint8_t * b = malloc(size);
+		fseek(f, 0, SEEK_SET);
+		if (fread(b, 1, size, f) == size)
+			s = _stim_load_wav(b, size, low, high, loop);
+		free(b);
+	} else {
+		rewind(f);
+		s = _stim_load_text(f, rate, loop);
+	}
+	fclose(f);
+	if (!s)
+		fprintf(stderr, "%s: %s: no usable samples\n", __func__, filename);
+	return s;
+}
+
+avr_adc_stim_t *
+avr_adc_stim_ring(void)
+{
+	return _stim_new(ADC_STIM_RING);
+}
+
+avr_adc_stim_t *
+avr_adc_stim_callback(
+		avr_adc_stim_callback_t callback,
+		void * param)
+{
+	avr_adc_stim_t * s = _stim_new(ADC_STIM_CALLBACK);
+
+	s->callback = callback;
+	s->param = param;
+	return s;
+}
+
+void
+avr_adc_stim_free(
+		avr_adc_stim_t * s)
+{
+	if (!s)
+		return;
+	free(s->sample);
+	free(s);
+}
+
+int
+avr_adc_stim_push(
+		avr_adc_stim_t * s,
+		avr_cycle_count_t when,
+		uint16_t mv)
+{
+	avr_adc_stim_point_t p = { .when = when, .mv = mv };
+
+	return avr_adc_stim_fifo_write(&s->fifo, p);
+}
+
+static uint16_t
+_stim_buffer(
+		struct avr_t * avr,
+		avr_adc_stim_t * s,
+		avr_cycle_count_t t)
+{
+	if (s->frequency != avr->frequency) {
+		s->frequency = avr->frequency;
+		s->step = s->frequency ? s->rate / s->frequency : 0;
+	}
+	double pos = t * s->step;
+	uint64_t i = pos, n;
+	double frac = pos - i;
+
+	if (s->loop) {
+		i %= s->count;
+		n = i + 1 == s->count ? 0 : i + 1;
+	} else {
+		if (i >= s->count - 1)
+			return s->sample[s->count - 1];
+		n = i + 1;
+	}
+	return _stim_clamp(s->sample[i] +
+			((int32_t)s->sample[n] - s->sample[i]) * frac);
+}
+
+/* splitmix64, so the noise at a given cycle is always the same */
+static uint64_t
+_stim_hash(
+		uint64_t x)
+{
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+uint16_t
+avr_adc_stim_sample(
+		struct avr_t * avr,
+		avr_adc_stim_t * s,
+		avr_cycle_count_t when)
+{
+	avr_cycle_count_t t = when > s->start ? when - s->start : 0;
+
+	switch (s->kind) {
+		case ADC_STIM_SINE:
+		case ADC_STIM_SAMPLES:
+			return _stim_buffer(avr, s, t);
+		case ADC_STIM_RAMP: {
+			double phase = avr->frequency ?
+					fmod(t * s->hz / avr->frequency, 1.0) : 0;
+			return _stim_clamp(s->offset - s->amplitude +
+					2.0 * s->amplitude * phase);
+		}
+		case ADC_STIM_NOISE: {
+			uint64_t h = _stim_hash(t ^ ((uint64_t)s->seed << 32));
+			double u = (h >> 11) * (1.0 / (1ULL << 53));
+			return _stim_clamp(s->offset + s->amplitude * (2 * u - 1));
+		}
+		case ADC_STIM_RING:
+			while (!avr_adc_stim_fifo_isempty(&s->fifo)) {
+				avr_adc_stim_point_t * p = avr_adc_stim_fifo_read_ptr(&s->fifo);
+				if (p->when > when)
+					break;
+				s->held = p->mv;
+				avr_adc_stim_fifo_read_offset(&s->fifo, 1);
+			}
+			return s->held;
+		case ADC_STIM_CALLBACK:
+			return s->callback(avr, when, s->param);
+	}
+	return 0;
+}
+
+int
+avr_adc_stim_attach(
+		struct avr_t * avr,
+		int chan,
+		avr_adc_stim_t * s)
+{
+	if (chan < ADC_IRQ_ADC0 || chan > ADC_IRQ_TEMP)
+		return -1;
+	return avr_ioctl(avr, AVR_IOCTL_ADC_SET_STIM(chan), s);
+}
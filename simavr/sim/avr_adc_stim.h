@@ -0,0 +1,166 @@
+/*
+	avr_adc_stim.h
+
+	ADC stimuli: sources attached to an ADC channel that the conversion
+	reads directly, at the cycle it samples, instead of asking the host
+	through ADC_IRQ_OUT_TRIGGER and waiting for it to raise ADC_IRQ_ADCn.
+
+	Waveforms and sample buffers are a function of the simulated time,
+	so they give the same values when a run is replayed, or gone back
+	over. A ring filled by the host from another thread doesn't.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __AVR_ADC_STIM_H__
+#define __AVR_ADC_STIM_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "sim_avr.h"
+#include "fifo_declare.h"
+
+#define ADC_STIM_TABLE		1024	// points in one period of a sine
+
+enum {
+	ADC_STIM_SINE = 0,
+	ADC_STIM_RAMP,			// sawtooth, from offset - amplitude up
+	ADC_STIM_NOISE,			// uniform, between offset +/- amplitude
+	ADC_STIM_SAMPLES,		// buffer at a fixed rate, interpolated
+	ADC_STIM_RING,			// pushed by the host, held until the next one
+	ADC_STIM_CALLBACK,
+};
+
+typedef struct avr_adc_stim_point_t {
+	avr_cycle_count_t	when;
+	uint16_t			mv;
+} avr_adc_stim_point_t;
+
+DECLARE_FIFO(avr_adc_stim_point_t, avr_adc_stim_fifo, 1024);
+
+struct avr_adc_stim_t;
+
+/* Returns the millivolts of the channel at cycle 'when' */
+typedef uint16_t (*avr_adc_stim_callback_t)(
+		struct avr_t * avr,
+		avr_cycle_count_t when,
+		void * param);
+
+typedef struct avr_adc_stim_t {
+	int					kind;
+	avr_cycle_count_t	start;		// cycle of the time 0 of the stimulus
+	int32_t				offset;		// mV, waveforms
+	int32_t				amplitude;	// mV
+	double				hz;
+	uint32_t			seed;		// noise
+
+	// ADC_STIM_SAMPLES, the sine table too
+	uint16_t *			sample;		// mV
+	uint32_t			count;
+	double				rate;		// samples per second
+	int					loop;
+	// samples per cycle, redone when the core frequency changes
+	uint32_t			frequency;
+	double				step;
+
+	// ADC_STIM_RING
+	avr_adc_stim_fifo_t	fifo;
+	uint16_t			held;
+
+	avr_adc_stim_callback_t	callback;
+	void *				param;
+} avr_adc_stim_t;
+
+/*
+ * ADC_STIM_SINE or ADC_STIM_RAMP of 'hz', around 'offset' mV. The sine is
+ * precomputed over one period.
+ */
+avr_adc_stim_t *
+avr_adc_stim_wave(
+		int kind,
+		double hz,
+		int32_t offset,
+		int32_t amplitude);
+avr_adc_stim_t *
+avr_adc_stim_noise(
+		int32_t offset,
+		int32_t amplitude,
+		uint32_t seed);
+/* 'count' millivolt values at 'rate' per second, copied */
+avr_adc_stim_t *
+avr_adc_stim_samples(
+		const uint16_t * mv,
+		uint32_t count,
+		double rate,
+		int loop);
+/*
+ * Loads a .wav file (PCM 8 or 16 bits, or float, first channel), its
+ * full scale becomes 'low' to 'high' mV. Anything else is taken as text,
+ * one millivolt value per line at 'rate' per second, or "seconds,mV"
+ * lines that are resampled at 'rate' (0 picks their smallest step).
+ */
+avr_adc_stim_t *
+avr_adc_stim_load(
+		const char * filename,
+		double rate,
+		uint16_t low,
+		uint16_t high,
+		int loop);
+/* The host pushes values with avr_adc_stim_push(), from any thread */
+avr_adc_stim_t *
+avr_adc_stim_ring(void);
+avr_adc_stim_t *
+avr_adc_stim_callback(
+		avr_adc_stim_callback_t callback,
+		void * param);
+void
+avr_adc_stim_free(
+		avr_adc_stim_t * s);
+
+/*
+ * Queues 'mv' for cycle 'when' on a ring, the ones in the past are taken
+ * by the next conversion. Returns 0 if the ring is full.
+ */
+int
+avr_adc_stim_push(
+		avr_adc_stim_t * s,
+		avr_cycle_count_t when,
+		uint16_t mv);
+
+/* The value of 's' at cycle 'when', in millivolts */
+uint16_t
+avr_adc_stim_sample(
+		struct avr_t * avr,
+		avr_adc_stim_t * s,
+		avr_cycle_count_t when);
+
+/*
+ * Attaches 's' to channel 'chan' (ADC_IRQ_ADC0 to ADC_IRQ_TEMP) of the
+ * ADC, which then owns it. NULL detaches, and frees the previous one.
+ */
+int
+avr_adc_stim_attach(
+		struct avr_t * avr,
+		int chan,
+		avr_adc_stim_t * s);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __AVR_ADC_STIM_H__ */
@@ -25,6 +25,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "avr_eeprom.h"
+#include "sim_snapshot.h"
 
 static avr_cycle_count_t
 avr_eempe_clear(
@@ -47,6 +48,52 @@ static avr_cycle_count_t
 	return 0;
 }
 
+static avr_cycle_count_t
+avr_eeprom_flush(
+		struct avr_t * avr,
+		avr_cycle_count_t when,
+		void * param)
+{
+	avr_eeprom_t * p = (avr_eeprom_t *)param;
+	avr_persist_flush(p->persist);
+	return 0;
+}
+
+/* A flush is pending as long as a page is dirty */
+static void
+avr_eeprom_dirty(
+		avr_eeprom_t * p,
+		uint16_t offset,
+		uint32_t size)
+{
+	if (p->persist && avr_persist_dirty(p->persist, offset, size))
+		avr_cycle_timer_register_usec(p->io.avr, AVR_PERSIST_PERIOD,
+				avr_eeprom_flush, p);
+}
+
+static int
+avr_eeprom_map(
+		avr_eeprom_t * p,
+		const char * filename)
+{
+	avr_t * avr = p->io.avr;
+
+	if (p->persist || !filename)
+		return -2;
+	p->persist = malloc(sizeof(*p->persist));
+	if (avr_persist_open(avr, p->persist, filename, p->size, 0, p->eeprom)) {
+		free(p->persist);
+		p->persist = NULL;
+		return -2;
+	}
+	free(p->eeprom);
+	p->eeprom = p->persist->mem;
+	if (p->persist->dirty_count)
+		avr_cycle_timer_register_usec(avr, AVR_PERSIST_PERIOD,
+				avr_eeprom_flush, p);
+	return 0;
+}
+
 static void
 avr_eeprom_write(
 		avr_t * avr,
@@ -80,6 +127,7 @@ avr_eeprom_write(
 	if (eempe && avr_regbit_get(avr, p->eepe)) {	// write operation
 		//	printf("eeprom write %04x <- %02x\n", addr, avr->data[p->r_eedr]);
 		p->eeprom[ee_addr] = avr->data[p->r_eedr];
+		avr_eeprom_dirty(p, ee_addr, 1);
 		// Automatically clears that bit (?)
 		avr_regbit_clear(avr, p->eempe);
 
@@ -113,6 +161,7 @@ avr_eeprom_ioctl(
 				return -2;
 			}
 			memcpy(p->eeprom + desc->offset, desc->ee, desc->size);
+			avr_eeprom_dirty(p, desc->offset, desc->size);
 			AVR_LOG(port->avr, LOG_TRACE, "EEPROM: %s: AVR_IOCTL_EEPROM_SET Loaded %d at offset %d\n",
 					__FUNCTION__, desc->size, desc->offset);
 			res = 0;
@@ -130,25 +179,64 @@ avr_eeprom_ioctl(
 				desc->ee = p->eeprom + desc->offset;
 			res = 0;
 		}	break;
+		case AVR_IOCTL_EEPROM_MAP:
+			res = avr_eeprom_map(p, (const char *)io_param);
+			break;
 	}
 
 	return res;
 }
 
+static void
+avr_eeprom_reset(
+		struct avr_io_t * port)
+{
+	avr_eeprom_t * p = (avr_eeprom_t *)port;
+
+	// the reset dropped the pending flush timer
+	if (p->persist)
+		avr_persist_flush(p->persist);
+}
+
 static void
 avr_eeprom_dealloc(
 		struct avr_io_t * port)
 {
 	avr_eeprom_t * p = (avr_eeprom_t *)port;
-	if (p->eeprom)
+	if (p->persist) {
+		avr_persist_close(p->persist);
+		free(p->persist);
+		p->persist = NULL;
+	} else if (p->eeprom)
 		free(p->eeprom);
 	p->eeprom = NULL;
 }
 
+static const avr_cycle_timer_t _timers[] = {
+	avr_eempe_clear,
+	avr_eei_raise,
+	avr_eeprom_flush,
+	NULL,
+};
+
+static void
+avr_eeprom_snapshot(
+		avr_io_t * port,
+		avr_snapshot_t * snap)
+{
+	avr_eeprom_t * p = (avr_eeprom_t *)port;
+
+	if (p->eeprom)
+		avr_snapshot_field(snap, p->eeprom, p->size);
+}
+
 static	avr_io_t	_io = {
 	.kind = "eeprom",
 	.ioctl = avr_eeprom_ioctl,
+	.reset = avr_eeprom_reset,
 	.dealloc = avr_eeprom_dealloc,
+	.timers = _timers,
+	.snapshot = avr_eeprom_snapshot,
 };
 
 void
@@ -157,6 +245,7 @@ avr_eeprom_init(
 		avr_eeprom_t * p)
 {
 	p->io = _io;
+	p->io.timer_param = p;
 //	printf("%s init (%d bytes) EEL/H:%02x/%02x EED=%02x EEC=%02x\n",
 //			__FUNCTION__, p->size, p->r_eearl, p->r_eearh, p->r_eedr, p->r_eecr);
 
@@ -27,6 +27,7 @@ extern "C" {
 #endif
 
 #include "sim_avr.h"
+#include "sim_persist.h"
 
 typedef struct avr_eeprom_t {
 	avr_io_t	io;
@@ -46,6 +47,8 @@ typedef struct avr_eeprom_t {
 	avr_regbit_t 	eere;	// eeprom read enable
 	
 	avr_int_vector_t ready;	// EERIE vector
+
+	avr_persist_t *	persist;	// when eeprom is mapped from a file
 } avr_eeprom_t;
 
 void avr_eeprom_init(avr_t * avr, avr_eeprom_t * port);
@@ -58,6 +61,12 @@ typedef struct avr_eeprom_desc_t {
 
 #define AVR_IOCTL_EEPROM_GET	AVR_IOCTL_DEF('e','e','g','p')
 #define AVR_IOCTL_EEPROM_SET	AVR_IOCTL_DEF('e','e','s','p')
+/*
+ * Maps the EEPROM from the file named by the ioctl parameter, created
+ * blank if needed. Written bytes are synced AVR_PERSIST_PERIOD later,
+ * and when the core terminates.
+ */
+#define AVR_IOCTL_EEPROM_MAP	AVR_IOCTL_DEF('e','e','m','p')
 
 
 /*
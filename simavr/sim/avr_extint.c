@@ -25,44 +25,47 @@
 #include <string.h>
 #include "avr_extint.h"
 #include "avr_ioport.h"
+#include "sim_snapshot.h"
 
-typedef struct avr_extint_poll_context_t {
-	uint32_t	eint_no; // index of particular interrupt source we are monitoring
-	avr_extint_t *extint;
-} avr_extint_poll_context_t;
-
-static avr_cycle_count_t avr_extint_poll_level_trig(
+/* Returns 0 once pin 'eint_no' doesn't need polling anymore */
+static int avr_extint_poll_pin(
 		struct avr_t * avr,
-		avr_cycle_count_t when,
-		void * param)
+		avr_extint_t * p,
+		int eint_no)
 {
-	avr_extint_poll_context_t *poll = (avr_extint_poll_context_t *)param;
-	avr_extint_t * p = poll->extint;
-
 	/* Check for change of interrupt mode. */
 
-	if (avr_regbit_get_array(avr, p->eint[poll->eint_no].isc, 2))
-		goto terminate_poll;
+	if (avr_regbit_get_array(avr, p->eint[eint_no].isc, 2))
+		return 0;
 
-	uint8_t port = p->eint[poll->eint_no].port_ioctl & 0xFF;
+	uint8_t port = p->eint[eint_no].port_ioctl & 0xFF;
 	avr_ioport_state_t iostate;
 	if (avr_ioctl(avr, AVR_IOCTL_IOPORT_GETSTATE( port ), &iostate) < 0)
-		goto terminate_poll;
-	uint8_t bit = ( iostate.pin >> p->eint[poll->eint_no].port_pin ) & 1;
+		return 0;
+	uint8_t bit = ( iostate.pin >> p->eint[eint_no].port_pin ) & 1;
 	if (bit)
-		goto terminate_poll; // Only poll while pin level remains low
+		return 0; // Only poll while pin level remains low
 
 	if (avr->sreg[S_I]) {
-		uint8_t raised = avr_regbit_get(avr, p->eint[poll->eint_no].vector.raised) || p->eint[poll->eint_no].vector.pending;
+		uint8_t raised = avr_regbit_get(avr, p->eint[eint_no].vector.raised) || p->eint[eint_no].vector.pending;
 		if (!raised)
-			avr_raise_interrupt(avr, &p->eint[poll->eint_no].vector);
+			avr_raise_interrupt(avr, &p->eint[eint_no].vector);
 	}
+	return 1;
+}
+
+static avr_cycle_count_t avr_extint_poll_level_trig(
+		struct avr_t * avr,
+		avr_cycle_count_t when,
+		void * param)
+{
+	avr_extint_t * p = (avr_extint_t *)param;
 
-	return when+1;
+	for (int i = 0; i < EXTINT_COUNT; i++)
+		if ((p->poll & (1 << i)) && !avr_extint_poll_pin(avr, p, i))
+			p->poll &= ~(1 << i);
 
-terminate_poll:
-	free(poll);
-	return 0;
+	return p->poll ? when+1 : 0;
 }
 
 static avr_extint_t * avr_extint_get(avr_t * avr)
@@ -151,12 +154,8 @@ static void avr_extint_irq_notify(struct avr_irq_t * irq, uint32_t value, void *
 							avr_raise_interrupt(avr, &p->eint[irq->irq].vector);
 					}
 					if (p->eint[irq->irq].strict_lvl_trig) {
-						avr_extint_poll_context_t *poll = malloc(sizeof(avr_extint_poll_context_t));
-						if (poll) {
-							poll->eint_no = irq->irq;
-							poll->extint = p;
-							avr_cycle_timer_register(avr, 1, avr_extint_poll_level_trig, poll);
-						}
+						p->poll |= 1 << irq->irq;
+						avr_cycle_timer_register(avr, 1, avr_extint_poll_level_trig, p);
 					}
 				}
 			}
@@ -180,6 +179,7 @@ static void avr_extint_reset(avr_io_t * port)
 {
 	avr_extint_t * p = (avr_extint_t *)port;
 
+	p->poll = 0;
 	for (int i = 0; i < EXTINT_COUNT; i++) {
 		if (p->eint[i].port_ioctl) {
 			avr_irq_register_notify(p->io.irq + i, avr_extint_irq_notify, p);
@@ -205,15 +205,35 @@ static const char * irq_names[EXTINT_COUNT] = {
 	[EXTINT_IRQ_OUT_INT7] = "<int7",
 };
 
+static const avr_cycle_timer_t _timers[] = {
+	avr_extint_poll_level_trig,
+	NULL,
+};
+
+static void avr_extint_snapshot(avr_io_t * port, avr_snapshot_t * snap)
+{
+	avr_extint_t * p = (avr_extint_t *)port;
+
+	for (int i = 0; i < EXTINT_COUNT; i++)
+		AVR_SNAPSHOT_FIELD(snap, p->eint[i].strict_lvl_trig);
+	AVR_SNAPSHOT_FIELD(snap, p->poll);
+	// keeps polling the pins that were held low
+	if (snap->restore && p->poll)
+		avr_cycle_timer_register(p->io.avr, 1, avr_extint_poll_level_trig, p);
+}
+
 static	avr_io_t	_io = {
 	.kind = "extint",
 	.reset = avr_extint_reset,
 	.irq_names = irq_names,
+	.timers = _timers,
+	.snapshot = avr_extint_snapshot,
 };
 
 void avr_extint_init(avr_t * avr, avr_extint_t * p)
 {
 	p->io = _io;
+	p->io.timer_param = p;
 
 	avr_register_io(avr, &p->io);
 	for (int i = 0; i < EXTINT_COUNT; i++) {
@@ -60,6 +60,7 @@ typedef struct avr_extint_t {
 		uint8_t			port_pin;		// pin number in said port
 		uint8_t			strict_lvl_trig;// enforces a repetitive interrupt triggering while the pin is held low
 	}	eint[EXTINT_COUNT];
+	uint8_t		poll;	// level triggered pins held low, polled every cycle
 
 } avr_extint_t;
 
@@ -23,6 +23,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "avr_flash.h"
+#include "sim_snapshot.h"
 
 static avr_cycle_count_t
 avr_progen_clear(
@@ -37,6 +38,52 @@ avr_progen_clear(
 }
 
 
+static avr_cycle_count_t
+avr_flash_flush(
+		struct avr_t * avr,
+		avr_cycle_count_t when,
+		void * param)
+{
+	avr_flash_t * p = (avr_flash_t *)param;
+	avr_persist_flush(p->persist);
+	return 0;
+}
+
+/* A flush is pending as long as a page is dirty */
+static void
+avr_flash_dirty(
+		avr_flash_t * p,
+		avr_flashaddr_t z)
+{
+	if (p->persist && avr_persist_dirty(p->persist, z, p->spm_pagesize))
+		avr_cycle_timer_register_usec(p->io.avr, AVR_PERSIST_PERIOD,
+				avr_flash_flush, p);
+}
+
+static int
+avr_flash_map(
+		avr_flash_t * p,
+		const char * filename)
+{
+	avr_t * avr = p->io.avr;
+
+	if (p->persist || !filename)
+		return -2;
+	p->persist = malloc(sizeof(*p->persist));
+	if (avr_persist_open(avr, p->persist, filename,
+			avr->flashend + 1, 4, avr->flash)) {
+		free(p->persist);
+		p->persist = NULL;
+		return -2;
+	}
+	free(avr->flash);
+	avr->flash = p->persist->mem;
+	if (p->persist->dirty_count)
+		avr_cycle_timer_register_usec(avr, AVR_PERSIST_PERIOD,
+				avr_flash_flush, p);
+	return 0;
+}
+
 static void
 avr_flash_write(
 		avr_t * avr,
@@ -64,6 +111,101 @@ avr_flash_clear_temppage(
 	}
 }
 
+static avr_flashaddr_t
+avr_flash_z(
+		avr_t * avr)
+{
+	avr_flashaddr_t z = avr->data[R_ZL] | (avr->data[R_ZH] << 8);
+	if (avr->rampz)
+		z |= avr->data[avr->rampz] << 16;
+	return z;
+}
+
+void
+avr_flash_lpm(
+		avr_flash_t * p,
+		uint8_t * result)
+{
+	avr_t * avr = p->io.avr;
+	avr_flashaddr_t z = avr_flash_z(avr);
+
+	if (avr_regbit_get(avr, p->selfprgen)) {
+		avr_cycle_timer_cancel(avr, avr_progen_clear, p);
+		if (avr_regbit_get(avr, p->blbset)) {
+			AVR_LOG(avr, LOG_TRACE, "FLASH: Reading fuse/lock byte %02x\n", z);
+			switch (z) {
+				case 0x0: *result = avr->fuse[0]; break; // LFuse
+				case 0x1: *result = avr->lockbits; break; // lock bits
+				case 0x2: *result = avr->fuse[2]; break; // EFuse
+				case 0x3: *result = avr->fuse[1]; break; // HFuse
+			}
+		} else if (avr_regbit_get(avr, p->sigrd)) {
+			AVR_LOG(avr, LOG_TRACE, "FLASH: Reading signature&serial byte %02x\n", z);
+			switch (z) {
+				case 0x00: *result = avr->signature[0]; break;
+				case 0x02: *result = avr->signature[1]; break;
+				case 0x04: *result = avr->signature[2]; break;
+				case 0x01: *result = 0x55; break;	// OSC Cal
+				/* serial# bytes are ordered bizarelly */
+				/* NOTE: Not all AVR that have sigrd have a
+				 * serial number, currenly we return one anyway */
+				case 0x0e ... 0x17: {
+					static const uint8_t idx[] = {
+						1,0,3,2,5,4,0,6,7,8
+					};
+					z -= 0x0e;
+					*result = avr->serial[idx[z]]; break;
+				}	break;
+			}
+		}
+	}
+	avr_regbit_clear(avr, p->selfprgen);
+}
+
+void
+avr_flash_spm(
+		avr_flash_t * p)
+{
+	avr_t * avr = p->io.avr;
+	avr_flashaddr_t z = avr_flash_z(avr);
+
+	uint16_t r01 = avr->data[0] | (avr->data[1] << 8);
+
+//	printf("AVR_IOCTL_FLASH_SPM %02x Z:%04x R01:%04x\n", avr->data[p->r_spm], z,r01);
+	if (avr_regbit_get(avr, p->selfprgen)) {
+		avr_cycle_timer_cancel(avr, avr_progen_clear, p);
+
+		if (avr_regbit_get(avr, p->pgers)) {
+			z &= ~1;
+			AVR_LOG(avr, LOG_TRACE, "FLASH: Erasing page %04x (%d)\n", (z / p->spm_pagesize), p->spm_pagesize);
+			avr_flash_dirty(p, z);
+			for (int i = 0; i < p->spm_pagesize; i++)
+				avr->flash[z++] = 0xff;
+		} else if (avr_regbit_get(avr, p->pgwrt)) {
+			z &= ~(p->spm_pagesize - 1);
+			AVR_LOG(avr, LOG_TRACE, "FLASH: Writing page %04x (%d)\n", (z / p->spm_pagesize), p->spm_pagesize);
+			avr_flash_dirty(p, z);
+			for (int i = 0; i < p->spm_pagesize / 2; i++) {
+				avr->flash[z++] = p->tmppage[i];
+				avr->flash[z++] = p->tmppage[i] >> 8;
+			}
+			avr_flash_clear_temppage(p);
+		} else if (avr_regbit_get(avr, p->blbset)) {
+			AVR_LOG(avr, LOG_TRACE, "FLASH: Setting lock bits (ignored)\n");
+		} else if (p->flags & AVR_SELFPROG_HAVE_RWW && avr_regbit_get(avr, p->rwwsre)) {
+			avr_flash_clear_temppage(p);
+		} else {
+			AVR_LOG(avr, LOG_TRACE, "FLASH: Writing temppage %08x (%04x)\n", z, r01);
+			z >>= 1;
+			if (!p->tmppage_used[z % (p->spm_pagesize / 2)]) {
+				p->tmppage[z % (p->spm_pagesize / 2)] = r01;
+				p->tmppage_used[z % (p->spm_pagesize / 2)] = 1;
+			}
+		}
+	}
+	avr_regbit_clear(avr, p->selfprgen);
+}
+
 static int
 avr_flash_ioctl(
 		struct avr_io_t * port,
@@ -71,94 +213,18 @@ avr_flash_ioctl(
 		void * io_param)
 {
 	avr_flash_t * p = (avr_flash_t *)port;
-	avr_t * avr = p->io.avr;
-	int res = -1;
 
-	avr_flashaddr_t z = avr->data[R_ZL] | (avr->data[R_ZH] << 8);
-	if (avr->rampz)
-		z |= avr->data[avr->rampz] << 16;
-#if 0
-	printf("%s %4.4s spm:%02x z:%04x EN:%d BLB:%d SIG:%d\n",
-			__func__, (char*)&ctl, avr->data[p->r_spm], z,
-			avr_regbit_get(avr, p->selfprgen),
-			avr_regbit_get(avr, p->blbset),
-			avr_regbit_get(avr, p->sigrd));
-#endif
 	switch (ctl) {
-		case AVR_IOCTL_FLASH_LPM: {
-			uint8_t *result = io_param;
-			if (avr_regbit_get(avr, p->selfprgen)) {
-				avr_cycle_timer_cancel(avr, avr_progen_clear, p);
-				if (avr_regbit_get(avr, p->blbset)) {
-					AVR_LOG(avr, LOG_TRACE, "FLASH: Reading fuse/lock byte %02x\n", z);
-					switch (z) {
-						case 0x0: *result = avr->fuse[0]; break; // LFuse
-						case 0x1: *result = avr->lockbits; break; // lock bits
-						case 0x2: *result = avr->fuse[2]; break; // EFuse
-						case 0x3: *result = avr->fuse[1]; break; // HFuse
-					}
-				} else if (avr_regbit_get(avr, p->sigrd)) {
-					AVR_LOG(avr, LOG_TRACE, "FLASH: Reading signature&serial byte %02x\n", z);
-					switch (z) {
-						case 0x00: *result = avr->signature[0]; break;
-						case 0x02: *result = avr->signature[1]; break;
-						case 0x04: *result = avr->signature[2]; break;
-						case 0x01: *result = 0x55; break;	// OSC Cal
-						/* serial# bytes are ordered bizarelly */
-						/* NOTE: Not all AVR that have sigrd have a
-						 * serial number, currenly we return one anyway */
-						case 0x0e ... 0x17: {
-							static const uint8_t idx[] = {
-								1,0,3,2,5,4,0,6,7,8
-							};
-							z -= 0x0e;
-							*result = avr->serial[idx[z]]; break;
-						}	break;
-					}
-				}
-			}
-			res = 0;
-		}	break;
-		case AVR_IOCTL_FLASH_SPM: {
-			uint16_t r01 = avr->data[0] | (avr->data[1] << 8);
-
-		//	printf("AVR_IOCTL_FLASH_SPM %02x Z:%04x R01:%04x\n", avr->data[p->r_spm], z,r01);
-			if (avr_regbit_get(avr, p->selfprgen)) {
-				avr_cycle_timer_cancel(avr, avr_progen_clear, p);
-
-				if (avr_regbit_get(avr, p->pgers)) {
-					z &= ~1;
-					AVR_LOG(avr, LOG_TRACE, "FLASH: Erasing page %04x (%d)\n", (z / p->spm_pagesize), p->spm_pagesize);
-					for (int i = 0; i < p->spm_pagesize; i++)
-						avr->flash[z++] = 0xff;
-				} else if (avr_regbit_get(avr, p->pgwrt)) {
-					z &= ~(p->spm_pagesize - 1);
-					AVR_LOG(avr, LOG_TRACE, "FLASH: Writing page %04x (%d)\n", (z / p->spm_pagesize), p->spm_pagesize);
-					for (int i = 0; i < p->spm_pagesize / 2; i++) {
-						avr->flash[z++] = p->tmppage[i];
-						avr->flash[z++] = p->tmppage[i] >> 8;
-					}
-					avr_flash_clear_temppage(p);
-				} else if (avr_regbit_get(avr, p->blbset)) {
-					AVR_LOG(avr, LOG_TRACE, "FLASH: Setting lock bits (ignored)\n");
-				} else if (p->flags & AVR_SELFPROG_HAVE_RWW && avr_regbit_get(avr, p->rwwsre)) {
-					avr_flash_clear_temppage(p);
-				} else {
-					AVR_LOG(avr, LOG_TRACE, "FLASH: Writing temppage %08x (%04x)\n", z, r01);
-					z >>= 1;
-					if (!p->tmppage_used[z % (p->spm_pagesize / 2)]) {
-						p->tmppage[z % (p->spm_pagesize / 2)] = r01;
-						p->tmppage_used[z % (p->spm_pagesize / 2)] = 1;
-					}
-				}
-			}
-			res = 0;
-		}	break;
-	    default:
-			return -1;
+		case AVR_IOCTL_FLASH_MAP:
+			return avr_flash_map(p, (const char *)io_param);
+		case AVR_IOCTL_FLASH_LPM:
+			avr_flash_lpm(p, (uint8_t *)io_param);
+			return 0;
+		case AVR_IOCTL_FLASH_SPM:
+			avr_flash_spm(p);
+			return 0;
 	}
-	avr_regbit_clear(avr, p->selfprgen);
-	return res;
+	return -1;
 }
 
 static void
@@ -168,6 +234,9 @@ avr_flash_reset(
 	avr_flash_t * p = (avr_flash_t *) port;
 
 	avr_flash_clear_temppage(p);
+	// the reset dropped the pending flush timer
+	if (p->persist)
+		avr_persist_flush(p->persist);
 }
 
 static void
@@ -180,6 +249,33 @@ avr_flash_dealloc(
 		free(p->tmppage);
 	if (p->tmppage_used)
 		free(p->tmppage_used);
+	// avr_terminate() frees avr->flash otherwise
+	if (p->persist) {
+		avr_persist_close(p->persist);
+		free(p->persist);
+		p->persist = NULL;
+		port->avr->flash = NULL;
+	}
+}
+
+static const avr_cycle_timer_t _timers[] = {
+	avr_progen_clear,
+	avr_flash_flush,
+	NULL,
+};
+
+static void
+avr_flash_snapshot(
+		avr_io_t * port,
+		avr_snapshot_t * snap)
+{
+	avr_flash_t * p = (avr_flash_t *)port;
+
+	AVR_SNAPSHOT_FIELD(snap, p->flags);
+	if (p->tmppage) {
+		avr_snapshot_field(snap, p->tmppage, p->spm_pagesize);
+		avr_snapshot_field(snap, p->tmppage_used, p->spm_pagesize / 2);
+	}
 }
 
 static	avr_io_t	_io = {
@@ -187,6 +283,8 @@ static	avr_io_t	_io = {
 	.ioctl = avr_flash_ioctl,
 	.reset = avr_flash_reset,
 	.dealloc = avr_flash_dealloc,
+	.timers = _timers,
+	.snapshot = avr_flash_snapshot,
 };
 
 void
@@ -195,6 +293,7 @@ avr_flash_init(
 		avr_flash_t * p)
 {
 	p->io = _io;
+	p->io.timer_param = p;
 	// printf("%s init SPM %04x BLB %d SIGRD %d\n",
 	//		__FUNCTION__, p->r_spm, p->blbset.bit, p->sigrd.bit);
 
@@ -206,6 +305,7 @@ avr_flash_init(
 
 	avr_register_io(avr, &p->io);
 	avr_register_vector(avr, &p->flash);
+	avr->selfprog = p;
 
 	avr_register_io_write(avr, p->r_spm, avr_flash_write, p);
 }
@@ -28,6 +28,7 @@ extern "C" {
 #endif
 
 #include "sim_avr.h"
+#include "sim_persist.h"
 
 /*
  * Handles self-programming subsystem if the core
@@ -50,6 +51,8 @@ typedef struct avr_flash_t {
 	avr_regbit_t sigrd;		// signature (and serial number) byte read
 
 	avr_int_vector_t flash;	// Interrupt vector
+
+	avr_persist_t *	persist;	// when avr->flash is mapped from a file
 } avr_flash_t;
 
 /* Set if the flash supports a Read While Write section */
@@ -57,10 +60,25 @@ typedef struct avr_flash_t {
 #define AVR_SELFPROG_HAVE_SIGRD (1 << 1)
 
 void avr_flash_init(avr_t * avr, avr_flash_t * p);
+/*
+ * LPM/ELPM and SPM, the core calls these directly, same as the ioctls.
+ * avr_flash_lpm() only changes 'result' for the fuse, lock and
+ * signature reads.
+ */
+void avr_flash_lpm(avr_flash_t * p, uint8_t * result);
+void avr_flash_spm(avr_flash_t * p);
 
 
 #define AVR_IOCTL_FLASH_SPM		AVR_IOCTL_DEF('f','s','p','m')
 #define AVR_IOCTL_FLASH_LPM		AVR_IOCTL_DEF('f','l','p','m')
+/*
+ * Maps avr->flash from the file named by the ioctl parameter, the file
+ * wins if it exists, otherwise it's created with the current content.
+ * Pages written by SPM are synced AVR_PERSIST_PERIOD later, and when
+ * the core terminates. Anything written to avr->flash otherwise (the
+ * firmware loader...) goes to the file too, but isn't synced.
+ */
+#define AVR_IOCTL_FLASH_MAP		AVR_IOCTL_DEF('f','m','a','p')
 
 #define AVR_SELFPROG_DECLARE_INTERNAL(_spmr, _spen, _vector) \
 		.r_spm = _spmr,\
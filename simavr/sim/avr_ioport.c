@@ -21,6 +21,7 @@
 
 #include <stdio.h>
 #include "avr_ioport.h"
+#include "sim_snapshot.h"
 
 #define D(_w)
 
@@ -67,7 +68,9 @@ avr_ioport_update_irqs(
 	// otherwise, if there is an 'external' pullup, set it
 	// otherwise, if the PORT pin was 1 to indicate an
 	// internal pullup, set that.
+	uint8_t internal = p->internal;
 	for (int i = 0; i < 8; i++) {
+		p->internal = 1 << i;
 		if (ddr & (1 << i))
 			avr_raise_irq(p->io.irq + i, (avr->data[p->r_port] >> i) & 1);
 		else if (p->external.pull_mask & (1 << i))
@@ -75,6 +78,7 @@ avr_ioport_update_irqs(
 		else if ((avr->data[p->r_port] >> i) & 1)
 			avr_raise_irq(p->io.irq + i, 1);
 	}
+	p->internal = internal;
 	uint8_t pin = (avr->data[p->r_pin] & ~ddr) | (avr->data[p->r_port] & ddr);
 	pin = (pin & ~p->external.pull_mask) | p->external.pull_value;
 	avr_raise_irq(p->io.irq + IOPORT_IRQ_PIN_ALL, pin);
@@ -313,11 +317,22 @@ static const char * irq_names[IOPORT_IRQ_COUNT] = {
 	[IOPORT_IRQ_REG_PIN] = "8>pin",
 };
 
+static void
+avr_ioport_snapshot(
+		avr_io_t * port,
+		avr_snapshot_t * snap)
+{
+	avr_ioport_t * p = (avr_ioport_t *)port;
+
+	AVR_SNAPSHOT_FIELD(snap, p->external);
+}
+
 static	avr_io_t	_io = {
 	.kind = "port",
 	.reset = avr_ioport_reset,
 	.ioctl = avr_ioport_ioctl,
 	.irq_names = irq_names,
+	.snapshot = avr_ioport_snapshot,
 };
 
 void avr_ioport_init(avr_t * avr, avr_ioport_t * p)
@@ -121,6 +121,8 @@ typedef struct avr_ioport_t {
 	struct {
 		uint8_t pull_mask, pull_value;
 	} external;
+	// pin the port is raising itself, see sim_replay.c
+	uint8_t internal;
 } avr_ioport_t;
 
 void avr_ioport_init(avr_t * avr, avr_ioport_t * port);
@@ -22,6 +22,18 @@
 
 #include <stdio.h>
 #include "avr_spi.h"
+#include "avr_ioport.h"
+#include "sim_snapshot.h"
+
+static avr_spi_slave_t *
+_avr_spi_selected(
+		avr_spi_t * p)
+{
+	for (avr_spi_slave_t * s = p->slaves; s; s = s->next)
+		if (s->selected)
+			return s;
+	return NULL;
+}
 
 static avr_cycle_count_t
 avr_spi_raise(
@@ -34,6 +46,13 @@ avr_spi_raise(
 	if (avr_regbit_get(avr, p->spe)) {
 		// in master mode, any byte is sent as it comes..
 		if (avr_regbit_get(avr, p->mstr)) {
+			avr_spi_slave_t * s = _avr_spi_selected(p);
+			if (s) {
+				uint8_t in = s->xfer(s, avr->data[p->r_spdr]);
+				avr_core_watch_write(avr, p->r_spdr, in);
+				avr_raise_interrupt(avr, &p->spi);
+				return 0;
+			}
 			avr_raise_interrupt(avr, &p->spi);
 			avr_raise_irq(p->io.irq + SPI_IRQ_OUTPUT, avr->data[p->r_spdr]);
 		}
@@ -104,12 +123,87 @@ avr_spi_irq_input(
 	}
 }
 
+static void
+avr_spi_slave_cs(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	avr_spi_slave_t * s = (avr_spi_slave_t *)param;
+
+	if (s->selected == !value)
+		return;
+	s->selected = !value;
+	if (s->select)
+		s->select(s, s->selected);
+}
+
+/*
+ * A chip select the port drives, as an output or with its pull-up, has
+ * its level in the pin IRQ already. Otherwise the slave is deselected,
+ * and the next raise of the pin is notified even if it stays at 0, as
+ * the pin IRQs are filtered.
+ */
+static void
+avr_spi_slave_sync(
+		avr_spi_t * p,
+		avr_spi_slave_t * s)
+{
+	avr_t * avr = p->io.avr;
+	avr_irq_t * cs = avr_io_getirq(avr,
+			AVR_IOCTL_IOPORT_GETIRQ(s->cs_port), s->cs_pin);
+	avr_ioport_state_t state;
+
+	if (avr_ioctl(avr, AVR_IOCTL_IOPORT_GETSTATE(s->cs_port), &state) == 0 &&
+			((state.ddr | state.port) >> s->cs_pin) & 1) {
+		avr_spi_slave_cs(cs, cs->value, s);
+		return;
+	}
+	avr_spi_slave_cs(cs, 1, s);
+	avr_irq_set_flags(cs, avr_irq_get_flags(cs) | IRQ_FLAG_INIT);
+}
+
 void
 avr_spi_reset(
 		struct avr_io_t *io)
 {
 	avr_spi_t * p = (avr_spi_t *)io;
 	avr_irq_register_notify(p->io.irq + SPI_IRQ_INPUT, avr_spi_irq_input, p);
+	// the port was reset too
+	for (avr_spi_slave_t * s = p->slaves; s; s = s->next)
+		if (s->cs_port)
+			avr_spi_slave_sync(p, s);
+}
+
+static int
+avr_spi_ioctl(
+		struct avr_io_t * port,
+		uint32_t ctl,
+		void * io_param)
+{
+	avr_spi_t * p = (avr_spi_t *)port;
+	avr_spi_slave_t * s = (avr_spi_slave_t *)io_param;
+	avr_spi_slave_t ** l = &p->slaves;
+
+	if (ctl != AVR_IOCTL_SPI_ATTACH(p->name) || !s)
+		return -1;
+	s->next = NULL;
+	s->selected = !s->cs_port;
+	if (s->cs_port) {
+		avr_irq_t * cs = avr_io_getirq(p->io.avr,
+				AVR_IOCTL_IOPORT_GETIRQ(s->cs_port), s->cs_pin);
+		if (!cs) {
+			AVR_LOG(p->io.avr, LOG_ERROR, "SPI: no chip select pin %c%d\n",
+					s->cs_port, s->cs_pin);
+			return -1;
+		}
+		avr_spi_slave_sync(p, s);
+		avr_irq_register_notify(cs, avr_spi_slave_cs, s);
+	}
+	while (*l)
+		l = &(*l)->next;
+	*l = s;
+	return 0;
 }
 
 static const char * irq_names[SPI_IRQ_COUNT] = {
@@ -117,10 +211,17 @@ static const char * irq_names[SPI_IRQ_COUNT] = {
 	[SPI_IRQ_OUTPUT] = "8<out",
 };
 
+static const avr_cycle_timer_t _timers[] = {
+	avr_spi_raise,
+	NULL,
+};
+
 static	avr_io_t	_io = {
 	.kind = "spi",
 	.reset = avr_spi_reset,
+	.ioctl = avr_spi_ioctl,
 	.irq_names = irq_names,
+	.timers = _timers,
 };
 
 void
@@ -129,6 +230,7 @@ avr_spi_init(
 		avr_spi_t * p)
 {
 	p->io = _io;
+	p->io.timer_param = p;
 
 	avr_register_io(avr, &p->io);
 	avr_register_vector(avr, &p->spi);
@@ -138,3 +240,12 @@ avr_spi_init(
 	avr_register_io_write(avr, p->r_spdr, avr_spi_write, p);
 	avr_register_io_read(avr, p->r_spdr, avr_spi_read, p);
 }
+
+int
+avr_spi_attach(
+		avr_t * avr,
+		char name,
+		avr_spi_slave_t * s)
+{
+	return avr_ioctl(avr, AVR_IOCTL_SPI_ATTACH(name), s);
+}
@@ -37,6 +37,30 @@ enum {
 
 // add port number to get the real IRQ
 #define AVR_IOCTL_SPI_GETIRQ(_name) AVR_IOCTL_DEF('s','p','i',(_name))
+// attach a avr_spi_slave_t, see avr_spi_attach()
+#define AVR_IOCTL_SPI_ATTACH(_name) AVR_IOCTL_DEF('s','p','a',(_name))
+
+/*
+ * A slave model on the bus of the SPI, selected by its own chip select
+ * pin. When the AVR is master and a slave model is selected, the bytes
+ * are exchanged with it directly instead of going through SPI_IRQ_OUTPUT
+ * and SPI_IRQ_INPUT; the timing is the same.
+ */
+typedef struct avr_spi_slave_t {
+	struct avr_spi_slave_t * next;
+	char		cs_port;	// 'B'... , 0 if always selected
+	uint8_t		cs_pin;		// active low
+	uint8_t		selected;
+	/* The chip select changed, optional */
+	void (*select)(
+			struct avr_spi_slave_t * s,
+			int selected);
+	/* Takes the byte the master shifts out, returns the one shifted in */
+	uint8_t (*xfer)(
+			struct avr_spi_slave_t * s,
+			uint8_t out);
+	void *		param;
+} avr_spi_slave_t;
 
 typedef struct avr_spi_t {
 	avr_io_t	io;
@@ -52,6 +76,8 @@ typedef struct avr_spi_t {
 	avr_regbit_t spr[4];	// clock divider
 
 	avr_int_vector_t spi;	// spi interrupt
+
+	avr_spi_slave_t * slaves;
 } avr_spi_t;
 
 void
@@ -59,6 +85,13 @@ avr_spi_init(
 		avr_t * avr,
 		avr_spi_t * port);
 
+/* Attaches the slave model 's' to SPI 'name', they can't be detached */
+int
+avr_spi_attach(
+		avr_t * avr,
+		char name,
+		avr_spi_slave_t * s);
+
 #define AVR_SPIX_DECLARE(_name, _prr, _prspi) \
 	.spi = { \
 		.name = '0' + _name,\
@@ -0,0 +1,507 @@
+/*
+	avr_spi_devices.c
+
+	Slave models for the SPI bus, SD/MMC card in SPI mode.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "avr_spi_devices.h"
+#include "sim_time.h"
+
+enum {
+	SD_CMD = 0,			// waiting for a command
+	SD_READ_MULTI,		// sending blocks until CMD12
+	SD_WRITE_TOKEN,		// waiting for a data token
+	SD_WRITE_DATA,
+	SD_WRITE_MULTI_TOKEN,
+	SD_WRITE_MULTI_DATA,
+};
+
+enum {
+	R1_IDLE		= 0x01,
+	R1_ILLEGAL	= 0x04,
+	R1_CRC		= 0x08,
+	R1_ADDRESS	= 0x20,
+	R1_PARAM	= 0x40,
+};
+
+static uint8_t
+_sd_crc7(
+		const uint8_t * b,
+		int len)
+{
+	uint8_t crc = 0;
+
+	for (int i = 0; i < len; i++)
+		for (int bit = 7; bit >= 0; bit--) {
+			int in = ((b[i] >> bit) ^ (crc >> 6)) & 1;
+			crc = ((crc << 1) & 0x7f) ^ (in ? 0x09 : 0);
+		}
+	return (crc << 1) | 1;
+}
+
+static uint16_t
+_sd_crc16(
+		const uint8_t * b,
+		int len)
+{
+	static uint16_t table[256];
+
+	if (!table[1])
+		for (int i = 0; i < 256; i++) {
+			uint16_t c = i << 8;
+			for (int bit = 0; bit < 8; bit++)
+				c = c & 0x8000 ? (c << 1) ^ 0x1021 : c << 1;
+			table[i] = c;
+		}
+	uint16_t crc = 0;
+	for (int i = 0; i < len; i++)
+		crc = (crc << 8) ^ table[(crc >> 8) ^ b[i]];
+	return crc;
+}
+
+/* Sets bits 'msb' to 'lsb' of a big endian register, CSD style */
+static void
+_sd_bits(
+		uint8_t * r,
+		int size,
+		int msb,
+		int lsb,
+		uint32_t v)
+{
+	for (int bit = lsb; bit <= msb; bit++, v >>= 1) {
+		int byte = size - 1 - bit / 8;
+		if (v & 1)
+			r[byte] |= 1 << (bit % 8);
+		else
+			r[byte] &= ~(1 << (bit % 8));
+	}
+}
+
+static void
+_sd_csd(
+		avr_spi_sdcard_t * c,
+		uint8_t * csd)
+{
+	memset(csd, 0, 16);
+	_sd_bits(csd, 16, 119, 112, 0x0e);		// TAAC
+	_sd_bits(csd, 16, 103, 96, 0x32);		// TRAN_SPEED, 25MHz
+	_sd_bits(csd, 16, 95, 84, 0x5b5);		// CCC
+	_sd_bits(csd, 16, 46, 46, 1);			// ERASE_BLK_EN
+	_sd_bits(csd, 16, 45, 39, 0x7f);		// SECTOR_SIZE
+	_sd_bits(csd, 16, 28, 26, 2);			// R2W_FACTOR
+	_sd_bits(csd, 16, 25, 22, 9);			// WRITE_BL_LEN
+	if (c->hc) {
+		_sd_bits(csd, 16, 127, 126, 1);
+		_sd_bits(csd, 16, 83, 80, 9);
+		_sd_bits(csd, 16, 69, 48, c->size / (512 * 1024) - 1);
+	} else {
+		// (C_SIZE + 1) * 512 blocks of 1 << READ_BL_LEN bytes
+		int bl = 9;
+		while ((c->size >> (bl + 9)) > 4096)
+			bl++;
+		_sd_bits(csd, 16, 83, 80, bl);
+		_sd_bits(csd, 16, 79, 79, 1);		// READ_BL_PARTIAL
+		_sd_bits(csd, 16, 73, 62, (c->size >> (bl + 9)) - 1);
+		_sd_bits(csd, 16, 61, 50, 0xfff);	// VDD currents
+		_sd_bits(csd, 16, 49, 47, 7);		// C_SIZE_MULT
+	}
+	csd[15] = _sd_crc7(csd, 15);
+}
+
+static void
+_sd_cid(
+		uint8_t * cid)
+{
+	static const uint8_t _cid[15] = {
+		0x02, 'S', 'M', 'S', 'I', 'M', 'A', 'V',	// MID, OID, PNM
+		0x10, 0x12, 0x34, 0x56, 0x78,				// PRV, PSN
+		0x01, 0x5a,									// MDT
+	};
+	memcpy(cid, _cid, 15);
+	cid[15] = _sd_crc7(cid, 15);
+}
+
+/* Ncr, and the response to a command */
+static void
+_sd_reply(
+		avr_spi_sdcard_t * c,
+		const uint8_t * r,
+		int len)
+{
+	c->out[0] = 0xff;
+	memcpy(c->out + 1, r, len);
+	c->out_len = len + 1;
+	c->out_pos = 0;
+}
+
+/* Nac, the start token, the data and its CRC, after what's queued */
+static void
+_sd_data(
+		avr_spi_sdcard_t * c,
+		const uint8_t * d,
+		int len)
+{
+	uint8_t * o = c->out + c->out_len;
+
+	*o++ = 0xff;
+	*o++ = 0xfe;
+	memcpy(o, d, len);
+	uint16_t crc = c->crc_on ? _sd_crc16(d, len) : 0xffff;
+	o[len] = crc >> 8;
+	o[len + 1] = crc;
+	c->out_len += len + 4;
+}
+
+static void
+_sd_read_sector(
+		avr_spi_sdcard_t * c)
+{
+	_sd_data(c, c->mem + (uint64_t)c->sector * AVR_SDCARD_SECTOR,
+			AVR_SDCARD_SECTOR);
+	c->sector++;
+	c->stats.read++;
+}
+
+static void
+_sd_write_sector(
+		avr_spi_sdcard_t * c)
+{
+	uint8_t token = 0x05;	// accepted
+
+	if (c->crc_on && _sd_crc16(c->in, AVR_SDCARD_SECTOR) !=
+			((c->in[AVR_SDCARD_SECTOR] << 8) | c->in[AVR_SDCARD_SECTOR + 1]))
+		token = 0x0b;
+	else if (c->sector >= c->sectors)
+		token = 0x0d;
+	else {
+		memcpy(c->mem + (uint64_t)c->sector * AVR_SDCARD_SECTOR,
+				c->in, AVR_SDCARD_SECTOR);
+		if (!(c->dirty[c->sector / 8] & (1 << (c->sector % 8)))) {
+			c->dirty[c->sector / 8] |= 1 << (c->sector % 8);
+			c->dirty_count++;
+		}
+		c->sector++;
+		c->stats.written++;
+		c->busy = c->avr->cycle +
+				avr_usec_to_cycles(c->avr, AVR_SDCARD_BUSY);
+	}
+	c->out[0] = token;
+	c->out_len = 1;
+	c->out_pos = 0;
+	c->state = c->state == SD_WRITE_MULTI_DATA && token == 0x05 ?
+			SD_WRITE_MULTI_TOKEN : SD_CMD;
+}
+
+/* The sector of a read or write command, 0 if it's out of the card */
+static uint8_t
+_sd_address(
+		avr_spi_sdcard_t * c,
+		uint32_t arg)
+{
+	if (!c->hc && (arg % AVR_SDCARD_SECTOR))
+		return R1_ADDRESS;
+	c->sector = c->hc ? arg : arg / AVR_SDCARD_SECTOR;
+	return c->sector < c->sectors ? 0 : R1_PARAM;
+}
+
+static void
+_sd_command(
+		avr_spi_sdcard_t * c)
+{
+	uint8_t idx = c->cmd[0] & 0x3f;
+	uint32_t arg = (c->cmd[1] << 24) | (c->cmd[2] << 16) |
+			(c->cmd[3] << 8) | c->cmd[4];
+	int app = c->app_cmd;
+	uint8_t r[8] = { c->idle ? R1_IDLE : 0 }, reg[16];
+	int len = 1;
+
+	c->app_cmd = 0;
+	c->stats.commands++;
+	// the card is still in SD mode for CMD0, and CMD8 is always checked
+	if ((c->crc_on || idx == 0 || idx == 8) &&
+			_sd_crc7(c->cmd, 5) != (c->cmd[5] | 1)) {
+		r[0] |= R1_CRC;
+		_sd_reply(c, r, 1);
+		return;
+	}
+	if (c->state == SD_READ_MULTI && idx != 12)
+		c->state = SD_CMD;
+	switch (idx) {
+		case 0:
+			c->idle = 1;
+			c->tries = 0;
+			c->crc_on = 0;
+			c->state = SD_CMD;
+			r[0] = R1_IDLE;
+			break;
+		case 1:
+		case 41:
+			if (idx == 41 && !app) {
+				r[0] |= R1_ILLEGAL;
+				break;
+			}
+			if (c->tries++ >= AVR_SDCARD_INIT_TRIES)
+				c->idle = 0;
+			r[0] = c->idle ? R1_IDLE : 0;
+			break;
+		case 8:
+			r[3] = (arg >> 8) & 0xf;
+			r[4] = arg;
+			len = 5;
+			break;
+		case 9:
+		case 10:
+			if (idx == 9)
+				_sd_csd(c, reg);
+			else
+				_sd_cid(reg);
+			_sd_reply(c, r, 1);
+			_sd_data(c, reg, 16);
+			return;
+		case 12:
+			c->state = SD_CMD;
+			// stuff byte, then R1
+			r[1] = r[0];
+			r[0] = 0xff;
+			len = 2;
+			break;
+		case 13:
+			len = 2;
+			break;
+		case 16:
+			if (!c->hc && arg != AVR_SDCARD_SECTOR)
+				r[0] |= R1_PARAM;
+			break;
+		case 17:
+		case 18:
+			r[0] |= _sd_address(c, arg);
+			_sd_reply(c, r, 1);
+			if (r[0] & ~R1_IDLE)
+				return;
+			_sd_read_sector(c);
+			if (idx == 18)
+				c->state = SD_READ_MULTI;
+			return;
+		case 23:
+			break;
+		case 24:
+		case 25:
+			r[0] |= _sd_address(c, arg);
+			if (!(r[0] & ~R1_IDLE))
+				c->state = idx == 24 ? SD_WRITE_TOKEN : SD_WRITE_MULTI_TOKEN;
+			break;
+		case 55:
+			c->app_cmd = 1;
+			break;
+		case 58:
+			r[1] = c->idle ? 0 : 0x80 | (c->hc ? 0x40 : 0);
+			r[2] = 0xff;
+			r[3] = 0x80;
+			len = 5;
+			break;
+		case 59:
+			c->crc_on = arg & 1;
+			break;
+		default:
+			AVR_LOG(c->avr, LOG_TRACE, "SD: %sCMD%d %08x not supported\n",
+					app ? "A" : "", idx, arg);
+			r[0] |= R1_ILLEGAL;
+	}
+	_sd_reply(c, r, len);
+}
+
+static uint8_t
+_sd_out(
+		avr_spi_sdcard_t * c)
+{
+	if (c->out_pos == c->out_len) {
+		if (c->avr->cycle < c->busy)
+			return 0x00;
+		if (c->state != SD_READ_MULTI)
+			return 0xff;
+		c->out_len = c->out_pos = 0;
+		if (c->sector >= c->sectors) {
+			c->state = SD_CMD;
+			return 0xff;
+		}
+		_sd_read_sector(c);
+	}
+	return c->out[c->out_pos++];
+}
+
+static void
+_sd_in(
+		avr_spi_sdcard_t * c,
+		uint8_t b)
+{
+	switch (c->state) {
+		case SD_WRITE_TOKEN:
+		case SD_WRITE_MULTI_TOKEN:
+			if (b == 0xfe || (b == 0xfc && c->state == SD_WRITE_MULTI_TOKEN)) {
+				c->state++;
+				c->in_len = 0;
+			} else if (b == 0xfd && c->state == SD_WRITE_MULTI_TOKEN) {
+				c->state = SD_CMD;
+				c->busy = c->avr->cycle +
+						avr_usec_to_cycles(c->avr, AVR_SDCARD_BUSY);
+			} else if (b != 0xff && c->state == SD_WRITE_TOKEN)
+				c->state = SD_CMD;	// gave up, a command maybe
+			if (c->state != SD_CMD)
+				return;
+			break;
+		case SD_WRITE_DATA:
+		case SD_WRITE_MULTI_DATA:
+			c->in[c->in_len++] = b;
+			if (c->in_len == sizeof(c->in))
+				_sd_write_sector(c);
+			return;
+	}
+	// a command, a read stream can be stopped by CMD12
+	if (!c->cmd_len && (b & 0xc0) != 0x40)
+		return;
+	c->cmd[c->cmd_len++] = b;
+	if (c->cmd_len == sizeof(c->cmd)) {
+		c->cmd_len = 0;
+		_sd_command(c);
+	}
+}
+
+static uint8_t
+_sd_xfer(
+		avr_spi_slave_t * s,
+		uint8_t b)
+{
+	avr_spi_sdcard_t * c = (avr_spi_sdcard_t *)s->param;
+	// both ways at once, what goes out was decided before
+	uint8_t res = _sd_out(c);
+
+	_sd_in(c, b);
+	return res;
+}
+
+static void
+_sd_select(
+		avr_spi_slave_t * s,
+		int selected)
+{
+	avr_spi_sdcard_t * c = (avr_spi_sdcard_t *)s->param;
+
+	if (selected)
+		return;
+	c->cmd_len = 0;
+	c->out_len = c->out_pos = 0;
+	if (c->state == SD_READ_MULTI)
+		c->state = SD_CMD;
+}
+
+int
+avr_spi_sdcard_init(
+		avr_t * avr,
+		avr_spi_sdcard_t * c,
+		char name,
+		char cs_port,
+		uint8_t cs_pin,
+		const char * filename,
+		uint64_t size)
+{
+	struct stat st;
+
+	memset(c, 0, sizeof(*c));
+	c->avr = avr;
+	c->fd = open(filename, O_RDWR | O_CREAT, 0644);
+	if (c->fd < 0 || fstat(c->fd, &st))
+		goto error;
+	if (size > st.st_size && ftruncate(c->fd, size))
+		goto error;
+	c->size = (size > st.st_size ? size : st.st_size) &
+			~(uint64_t)(AVR_SDCARD_SECTOR - 1);
+	if (!c->size) {
+		AVR_LOG(avr, LOG_ERROR, "SD: %s: empty image\n", filename);
+		close(c->fd);
+		return -1;
+	}
+	c->mem = mmap(NULL, c->size, PROT_READ | PROT_WRITE, MAP_SHARED, c->fd, 0);
+	if (c->mem == MAP_FAILED) {
+		c->mem = NULL;
+		goto error;
+	}
+	c->sectors = c->size / AVR_SDCARD_SECTOR;
+	c->hc = c->size > 2ULL * 1024 * 1024 * 1024;
+	c->dirty = calloc(1, (c->sectors + 7) / 8);
+	c->idle = 1;
+
+	c->slave.cs_port = cs_port;
+	c->slave.cs_pin = cs_pin;
+	c->slave.select = _sd_select;
+	c->slave.xfer = _sd_xfer;
+	c->slave.param = c;
+	AVR_LOG(avr, LOG_TRACE, "SD: %s, %llu sectors, SD%s\n", filename,
+			(unsigned long long)c->sectors, c->hc ? "HC" : "SC");
+	return avr_spi_attach(avr, name, &c->slave);
+error:
+	AVR_LOG(avr, LOG_ERROR, "SD: %s: %s\n", filename, strerror(errno));
+	if (c->fd >= 0)
+		close(c->fd);
+	c->fd = -1;
+	return -1;
+}
+
+void
+avr_spi_sdcard_sync(
+		avr_spi_sdcard_t * c)
+{
+	long page = sysconf(_SC_PAGESIZE);
+
+	for (uint32_t i = 0; i < c->sectors && c->dirty_count; i++) {
+		if (!(c->dirty[i / 8] & (1 << (i % 8))))
+			continue;
+		// runs of dirty sectors go in one call
+		uint32_t end = i;
+		while (end < c->sectors && (c->dirty[end / 8] & (1 << (end % 8)))) {
+			c->dirty[end / 8] &= ~(1 << (end % 8));
+			c->dirty_count--;
+			end++;
+		}
+		uint64_t start = ((uint64_t)i * AVR_SDCARD_SECTOR) & ~(uint64_t)(page - 1);
+		msync(c->mem + start, (uint64_t)end * AVR_SDCARD_SECTOR - start, MS_SYNC);
+		i = end;
+	}
+}
+
+void
+avr_spi_sdcard_free(
+		avr_spi_sdcard_t * c)
+{
+	if (!c->mem)
+		return;
+	avr_spi_sdcard_sync(c);
+	munmap(c->mem, c->size);
+	close(c->fd);
+	free(c->dirty);
+	c->mem = NULL;
+	c->dirty = NULL;
+	c->fd = -1;
+}
@@ -0,0 +1,101 @@
+/*
+	avr_spi_devices.h
+
+	Slave models for the SPI bus: a SD/MMC card in SPI mode. See
+	avr_spi_attach().
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __AVR_SPI_DEVICES_H__
+#define __AVR_SPI_DEVICES_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "avr_spi.h"
+
+#define AVR_SDCARD_SECTOR		512
+#define AVR_SDCARD_BUSY			250		// us, programming a block
+#define AVR_SDCARD_INIT_TRIES	2		// ACMD41 answered 'idle' before ready
+
+/*
+ * The card is a SDSC one, byte addressed, up to 2GB, and a SDHC one,
+ * block addressed, above. Its image is mapped from a file; a sector
+ * the master wrote is copied there in one go and marked dirty until
+ * avr_spi_sdcard_sync().
+ */
+typedef struct avr_spi_sdcard_t {
+	avr_spi_slave_t		slave;
+	avr_t *				avr;
+	uint8_t *			mem;
+	uint64_t			size;
+	uint32_t			sectors;
+	int					fd;
+	int					hc;
+	uint8_t *			dirty;		// a bit per sector
+	uint32_t			dirty_count;
+
+	uint8_t				idle, app_cmd, crc_on, tries;
+	int					state;
+	uint8_t				cmd[6];
+	int					cmd_len;
+	uint32_t			sector;		// next one of a multiple block command
+	avr_cycle_count_t	busy;		// end of the block programming
+
+	// what the card shifts out next, a response, or a whole data block
+	uint8_t				out[AVR_SDCARD_SECTOR + 8];
+	uint16_t			out_len, out_pos;
+	// data block being received
+	uint8_t				in[AVR_SDCARD_SECTOR + 2];
+	uint16_t			in_len;
+
+	struct {
+		uint64_t		commands;
+		uint64_t		read;		// sectors
+		uint64_t		written;
+	} stats;
+} avr_spi_sdcard_t;
+
+/*
+ * Attaches a card to SPI 'name', selected by pin 'cs_pin' of port
+ * 'cs_port'. The image is 'filename', it is extended to 'size' bytes
+ * if it's smaller; 0 takes it as it is.
+ */
+int
+avr_spi_sdcard_init(
+		avr_t * avr,
+		avr_spi_sdcard_t * c,
+		char name,
+		char cs_port,
+		uint8_t cs_pin,
+		const char * filename,
+		uint64_t size);
+/* Writes the dirty sectors back to the image file */
+void
+avr_spi_sdcard_sync(
+		avr_spi_sdcard_t * c);
+/* Syncs and unmaps the image, the card stays attached, so last thing */
+void
+avr_spi_sdcard_free(
+		avr_spi_sdcard_t * c);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __AVR_SPI_DEVICES_H__ */
@@ -30,6 +30,7 @@
 #include "avr_timer.h"
 #include "avr_ioport.h"
 #include "sim_time.h"
+#include "sim_snapshot.h"
 
 /*
  * The timers are /always/ 16 bits here, if the higher byte register
@@ -70,6 +71,60 @@ _timer_get_icr(
 	return p->io.avr->data[p->r_icr] |
 				(p->r_tcnth ? (p->io.avr->data[p->r_icrh] << 8) : 0);
 }
+
+/*
+ * A compare match that changes nothing doesn't need its cycle timer:
+ * the interrupt is off with its flag already up, and nothing follows
+ * the pin. avr_timer_rearm() brings it back when that changes.
+ */
+static int
+_timer_comp_idle(
+		avr_timer_t * p,
+		int compi)
+{
+	avr_t * avr = p->io.avr;
+	avr_int_vector_t * v = &p->comp[compi].interrupt;
+
+	if (avr_regbit_get(avr, v->enable))
+		return 0;
+	if (v->raised.reg && !avr_regbit_get(avr, v->raised))
+		return 0;
+	return p->no_edges ||
+			avr_regbit_get(avr, p->comp[compi].com) == avr_timer_com_normal;
+}
+
+/* Overflows and compare matches are cycle timers, not Tn pin edges */
+static int
+_timer_cycle_clocked(
+		avr_timer_t * p)
+{
+	return p->tov_cycles > 1 &&
+			(!(p->ext_clock_flags & (AVR_TIMER_EXTCLK_FLAG_TN | AVR_TIMER_EXTCLK_FLAG_AS2)) ||
+			(p->ext_clock_flags & AVR_TIMER_EXTCLK_FLAG_VIRT));
+}
+
+/*
+ * Same for the overflow, once none of the compare matches are needed
+ * either the timer stops, and TCNT is worked out from where it was.
+ * Only when clocked internally, with a whole number of cycles.
+ */
+static int
+_timer_tov_idle(
+		avr_timer_t * p)
+{
+	avr_t * avr = p->io.avr;
+
+	if (!_timer_cycle_clocked(p) || p->tov_cycles_fract != 0.0f)
+		return 0;
+	if (avr_regbit_get(avr, p->overflow.enable))
+		return 0;
+	if (p->overflow.raised.reg && !avr_regbit_get(avr, p->overflow.raised))
+		return 0;
+	for (int compi = 0; compi < AVR_TIMER_COMP_COUNT; compi++)
+		if (p->comp[compi].comp_cycles && !_timer_comp_idle(p, compi))
+			return 0;
+	return 1;
+}
 static avr_cycle_count_t
 avr_timer_comp(
 		avr_timer_t *p,
@@ -90,6 +145,9 @@ avr_timer_comp(
 		if (p->comp[comp].com_pin.reg)	// we got a physical pin
 				flags |= AVR_IOPORT_OUTPUT;
 		AVR_LOG(avr, LOG_TRACE, "Timer comp: irq %p, mode %d @%d\n", irq, mode, when);
+	// only the duty cycle is followed, see avr_timer_pwm_update()
+	if (p->no_edges)
+		mode = avr_timer_com_normal;
 	switch (mode) {
 		case avr_timer_com_normal: // Normal mode OCnA disconnected
 			break;
@@ -127,6 +185,8 @@ avr_timer_comp_on_tov(
 	uint8_t mode = avr_regbit_get(avr, p->comp[comp].com);
 	avr_irq_t * irq = &p->io.irq[TIMER_IRQ_OUT_COMP + comp];
 
+	if (p->no_edges)
+		return;
 	// only PWM modes have special behaviour on overflow
 	if((p->wgm_op_mode_kind != avr_timer_wgm_pwm) &&
 	   (p->wgm_op_mode_kind != avr_timer_wgm_fast_pwm))
@@ -318,7 +378,7 @@ avr_timer_tov(
 		{ avr_timer_compa, avr_timer_compb, avr_timer_compc };
 
 	for (int compi = 0; compi < AVR_TIMER_COMP_COUNT; compi++) {
-		if (p->comp[compi].comp_cycles) {
+		if (p->comp[compi].comp_cycles && !_timer_comp_idle(p, compi)) {
 			if (p->comp[compi].comp_cycles < p->tov_cycles && p->comp[compi].comp_cycles >= (avr->cycle - when)) {
 				avr_timer_comp_on_tov(p, when, compi);
 				avr_cycle_timer_register(avr,
@@ -329,9 +389,59 @@ avr_timer_tov(
 		}
 	}
 
+	// nobody needs the next one, avr_timer_rearm() starts again
+	if (_timer_tov_idle(p))
+		return 0;
 	return next + p->tov_cycles;
 }
 
+/*
+ * The timer stopped a few periods ago, if idle, brings tov_base to the
+ * start of the current one.
+ */
+static void
+_timer_catch_up(
+		avr_timer_t * p)
+{
+	avr_t * avr = p->io.avr;
+
+	if (!_timer_cycle_clocked(p))
+		return;
+	if (!avr_cycle_timer_status(avr, avr_timer_tov, p))
+		p->tov_base += ((avr->cycle - p->tov_base) / p->tov_cycles) * p->tov_cycles;
+}
+
+/*
+ * Registers the overflow and compare matches avr_timer_tov() left out
+ * again, if they are needed now.
+ */
+static void
+avr_timer_rearm(
+		avr_timer_t * p)
+{
+	avr_t * avr = p->io.avr;
+	static const avr_cycle_timer_t dispatch[AVR_TIMER_COMP_COUNT] =
+		{ avr_timer_compa, avr_timer_compb, avr_timer_compc };
+
+	// clocked from the Tn pin, these aren't cycle timers
+	if (!_timer_cycle_clocked(p))
+		return;
+	if (!avr_cycle_timer_status(avr, avr_timer_tov, p)) {
+		if (_timer_tov_idle(p))
+			return;
+		_timer_catch_up(p);
+		avr_cycle_timer_register(avr,
+				p->tov_base + p->tov_cycles - avr->cycle, avr_timer_tov, p);
+	}
+	for (int compi = 0; compi < AVR_TIMER_COMP_COUNT; compi++) {
+		avr_cycle_count_t at = p->tov_base + p->comp[compi].comp_cycles;
+		if (p->comp[compi].comp_cycles &&
+				p->comp[compi].comp_cycles < p->tov_cycles &&
+				at > avr->cycle && !_timer_comp_idle(p, compi))
+			avr_cycle_timer_register(avr, at - avr->cycle, dispatch[compi], p);
+	}
+}
+
 static uint16_t
 _avr_timer_get_current_tcnt(
 		avr_timer_t * p)
@@ -341,7 +451,8 @@ _avr_timer_get_current_tcnt(
 			(p->ext_clock_flags & AVR_TIMER_EXTCLK_FLAG_VIRT)
 			) {
 		if (p->tov_cycles) {
-			uint64_t when = avr->cycle - p->tov_base;
+			// tov_base isn't kept up to date when the timer is idle
+			uint64_t when = (avr->cycle - p->tov_base) % p->tov_cycles;
 
 			return (when * (((uint32_t)p->tov_top)+1)) / p->tov_cycles;
 		}
@@ -563,12 +674,86 @@ avr_timer_configure(
 
 }
 
+/*
+ * Works out what each comparator output does over a period, from the
+ * mode and the registers, so the duty cycle can be followed without
+ * watching every edge.
+ */
+static void
+avr_timer_pwm_update(
+		avr_timer_t * p)
+{
+	avr_t * avr = p->io.avr;
+
+	for (int compi = 0; compi < AVR_TIMER_COMP_COUNT; compi++) {
+		avr_timer_comp_p comp = &p->comp[compi];
+		if (!comp->r_ocr)
+			continue;
+		uint8_t mode = avr_regbit_get(avr, comp->com);
+		uint64_t top = p->tov_top, ocr = _timer_get_ocr(p, compi);
+		uint64_t period = 0, high = 0;
+		uint8_t level = p->io.irq[TIMER_IRQ_OUT_COMP + compi].value & 1;
+		avr_timer_pwm_t pwm = {
+			.connected = mode != avr_timer_com_normal,
+			.inverted = mode == avr_timer_com_set,
+		};
+		// one run of the counter, up and down in phase correct modes
+		uint64_t span = p->tov_cycles;
+		if (p->wgm_op_mode_kind == avr_timer_wgm_pwm ||
+				p->wgm_op_mode_kind == avr_timer_wgm_fc_pwm)
+			span = (2 * p->tov_cycles * top) / (top + 1);
+		if (ocr > top)
+			ocr = top;
+
+		if (!pwm.connected || p->tov_cycles <= 1) {
+			// stopped, the pin stays where it is
+			high = pwm.connected && level;
+		} else if (mode == avr_timer_com_toggle) {
+			// toggles on each match, if there is one
+			if (comp->comp_cycles) {
+				period = 2 * span;
+				high = span;
+			} else
+				high = level;
+		} else switch (p->wgm_op_mode_kind) {
+			case avr_timer_wgm_fast_pwm:
+				period = span;
+				high = (period * (ocr + 1)) / (top + 1);
+				break;
+			case avr_timer_wgm_pwm:
+			case avr_timer_wgm_fc_pwm:
+				// cleared on the way up, set on the way down
+				period = span;
+				high = top ? (period * ocr) / top : 0;
+				break;
+			default:
+				// cleared or set by the first match, then static
+				high = pwm.inverted;
+				break;
+		}
+		if (period && pwm.inverted)
+			high = period - high;
+		pwm.period = period;
+		pwm.duty = high;
+
+		if (pwm.period == comp->pwm.period && pwm.duty == comp->pwm.duty &&
+				pwm.inverted == comp->pwm.inverted &&
+				pwm.connected == comp->pwm.connected)
+			continue;
+		comp->pwm = pwm;
+		avr_raise_irq(p->io.irq + TIMER_IRQ_OUT_DUTY + compi,
+				period ? (high << 16) / period : high ? 0x10000 : 0);
+	}
+}
+
 static void
 avr_timer_reconfigure(
 		avr_timer_t * p, uint8_t reset)
 {
 	avr_t * avr = p->io.avr;
 
+	// the phase is kept, from the current period
+	_timer_catch_up(p);
 	// cancel everything
 	avr_timer_cancel_all_cycle_timers(avr, p, 1);
 
@@ -602,6 +787,7 @@ avr_timer_reconfigure(
 					__FUNCTION__, p->name, mode, p->mode.kind);
 		}
 	}
+	avr_timer_pwm_update(p);
 }
 
 static void
@@ -656,6 +842,7 @@ avr_timer_write_ocr(
 			avr_timer_reconfigure(timer, 0);
 			break;
 	}
+	avr_timer_pwm_update(timer);
 }
 
 static void
@@ -689,6 +876,7 @@ avr_timer_write(
 
 			AVR_LOG(avr, LOG_TRACE, "TIMER: %s-%c clock turned off\n",
 					__func__, p->name);
+			avr_timer_pwm_update(p);
 			return;
 		}
 
@@ -714,6 +902,9 @@ avr_timer_write(
 
 		avr_timer_reconfigure(p, 1);
 	}
+	// the compare output modes live in there too
+	avr_timer_rearm(p);
+	avr_timer_pwm_update(p);
 }
 
 /*
@@ -764,6 +955,42 @@ avr_timer_write_pending(
 			avr_clear_interrupt(avr, &p->comp[compi].interrupt);
 		}
 	}
+	// the next compare match has a flag to raise again
+	avr_timer_rearm(p);
+}
+
+/*
+ * write to the interrupt mask, a compare match that was left out might
+ * have an interrupt to raise now.
+ */
+static void
+avr_timer_write_mask(
+		struct avr_t * avr,
+		avr_io_addr_t addr,
+		uint8_t v,
+		void * param)
+{
+	avr_timer_t * p = (avr_timer_t *)param;
+
+	avr_core_watch_write(avr, addr, v);
+	avr_timer_rearm(p);
+}
+
+/*
+ * ICR is TOP in some modes, and was only picked up when the mode changed
+ */
+static void
+avr_timer_write_icr(
+		struct avr_t * avr,
+		avr_io_addr_t addr,
+		uint8_t v,
+		void * param)
+{
+	avr_timer_t * p = (avr_timer_t *)param;
+
+	avr_core_watch_write(avr, addr, v);
+	if (p->mode.top == avr_timer_wgm_reg_icr && p->cs_div_value)
+		avr_timer_reconfigure(p, 0);
 }
 
 static void
@@ -805,7 +1032,15 @@ avr_timer_ioctl(
 	avr_timer_t * p = (avr_timer_t *)port;
 	int res = -1;
 
-	if (ctl == AVR_IOCTL_TIMER_SET_TRACE(p->name)) {
+	if (ctl == AVR_IOCTL_TIMER_GETPWM(p->name)) {
+		avr_timer_pwm_t * pwm = (avr_timer_pwm_t *)io_param;
+		for (int compi = 0; compi < AVR_TIMER_COMP_COUNT; compi++)
+			pwm[compi] = p->comp[compi].pwm;
+		return 0;
+	} else if (ctl == AVR_IOCTL_TIMER_SET_EDGES(p->name)) {
+		p->no_edges = !*((uint8_t*)io_param);
+		res = 0;
+	} else if (ctl == AVR_IOCTL_TIMER_SET_TRACE(p->name)) {
 		/* Allow setting individual trace flags */
 		p->trace = *((uint32_t*)io_param);
 		res = 0;
@@ -857,6 +1092,7 @@ avr_timer_reset(
 	// it's own IRQ
 	for (int compi = 0; compi < AVR_TIMER_COMP_COUNT; compi++) {
 		p->comp[compi].comp_cycles = 0;
+		p->comp[compi].pwm = (avr_timer_pwm_t) {};
 
 		avr_ioport_getirq_t req = {
 			.bit = p->comp[compi].com_pin
@@ -892,13 +1128,48 @@ static const char * irq_names[TIMER_IRQ_COUNT] = {
 	[TIMER_IRQ_OUT_COMP + 0] = ">compa",
 	[TIMER_IRQ_OUT_COMP + 1] = ">compb",
 	[TIMER_IRQ_OUT_COMP + 2] = ">compc",
+	[TIMER_IRQ_OUT_DUTY + 0] = "17>dutya",
+	[TIMER_IRQ_OUT_DUTY + 1] = "17>dutyb",
+	[TIMER_IRQ_OUT_DUTY + 2] = "17>dutyc",
 };
 
+static const avr_cycle_timer_t _timers[] = {
+	avr_timer_tov,
+	avr_timer_compa,
+	avr_timer_compb,
+	avr_timer_compc,
+	NULL,
+};
+
+static void
+avr_timer_snapshot(
+		avr_io_t * port,
+		avr_snapshot_t * snap)
+{
+	avr_timer_t * p = (avr_timer_t *)port;
+
+	AVR_SNAPSHOT_FIELD(snap, p->mode);
+	AVR_SNAPSHOT_FIELD(snap, p->wgm_op_mode_kind);
+	AVR_SNAPSHOT_FIELD(snap, p->wgm_op_mode_size);
+	AVR_SNAPSHOT_FIELD(snap, p->cs_div_value);
+	AVR_SNAPSHOT_FIELD(snap, p->ext_clock_flags);
+	AVR_SNAPSHOT_FIELD(snap, p->ext_clock);
+	AVR_SNAPSHOT_FIELD(snap, p->tov_cycles);
+	AVR_SNAPSHOT_FIELD(snap, p->tov_cycles_fract);
+	AVR_SNAPSHOT_FIELD(snap, p->phase_accumulator);
+	AVR_SNAPSHOT_FIELD(snap, p->tov_base);
+	AVR_SNAPSHOT_FIELD(snap, p->tov_top);
+	for (int i = 0; i < AVR_TIMER_COMP_COUNT; i++)
+		AVR_SNAPSHOT_FIELD(snap, p->comp[i].comp_cycles);
+}
+
 static	avr_io_t	_io = {
 	.kind = "timer",
 	.irq_names = irq_names,
 	.reset = avr_timer_reset,
 	.ioctl = avr_timer_ioctl,
+	.timers = _timers,
+	.snapshot = avr_timer_snapshot,
 };
 
 void
@@ -907,6 +1178,7 @@ avr_timer_init(
 		avr_timer_t * p)
 {
 	p->io = _io;
+	p->io.timer_param = p;
 
 	avr_register_io(avr, &p->io);
 	avr_register_vector(avr, &p->overflow);
@@ -921,6 +1193,8 @@ avr_timer_init(
 	p->io.irq[TIMER_IRQ_OUT_PWM0].flags |= IRQ_FLAG_FILTERED;
 	p->io.irq[TIMER_IRQ_OUT_PWM1].flags |= IRQ_FLAG_FILTERED;
 	p->io.irq[TIMER_IRQ_OUT_PWM2].flags |= IRQ_FLAG_FILTERED;
+	for (int compi = 0; compi < AVR_TIMER_COMP_COUNT; compi++)
+		p->io.irq[TIMER_IRQ_OUT_DUTY + compi].flags |= IRQ_FLAG_FILTERED;
 
 	if (p->wgm[0].reg) // these are not present on older AVRs
 		avr_register_io_write(avr, p->wgm[0].reg, avr_timer_write, p);
@@ -971,7 +1245,16 @@ avr_timer_init(
 			avr_register_io_write(avr, p->comp[compi].r_ocr, avr_timer_write_ocr, &p->comp[compi]);
 		if (p->comp[compi].foc.reg)
 			avr_register_io_write(avr, p->comp[compi].foc.reg, avr_timer_write_foc, p);
+		// the comparators usually share their mask register
+		avr_io_addr_t mask = p->comp[compi].interrupt.enable.reg;
+		int done = !mask;
+		for (int i = 0; i < compi && !done; i++)
+			done = p->comp[i].interrupt.enable.reg == mask;
+		if (!done)
+			avr_register_io_write(avr, mask, avr_timer_write_mask, p);
 	}
+	if (p->r_icr)
+		avr_register_io_write(avr, p->r_icr, avr_timer_write_icr, p);
 	avr_register_io_write(avr, p->r_tcnt, avr_timer_tcnt_write, p);
 	avr_register_io_read(avr, p->r_tcnt, avr_timer_tcnt_read, p);
 
@@ -42,8 +42,10 @@ enum {
 	TIMER_IRQ_OUT_PWM2,
 	TIMER_IRQ_IN_ICP,	// input capture
 	TIMER_IRQ_OUT_COMP,	// comparator pins output IRQ
+	// duty cycle of the comparator outputs, 0x10000 is always high
+	TIMER_IRQ_OUT_DUTY = TIMER_IRQ_OUT_COMP + AVR_TIMER_COMP_COUNT,
 
-	TIMER_IRQ_COUNT = TIMER_IRQ_OUT_COMP + AVR_TIMER_COMP_COUNT
+	TIMER_IRQ_COUNT = TIMER_IRQ_OUT_DUTY + AVR_TIMER_COMP_COUNT
 };
 
 // Get the internal IRQ corresponding to the INT
@@ -55,6 +57,14 @@ enum {
 #define AVR_IOCTL_TIMER_SET_VIRTCLK(_number) AVR_IOCTL_DEF('t','m','v',(_number))
 // set frequency of the virtual clock generator
 #define AVR_IOCTL_TIMER_SET_FREQCLK(_number) AVR_IOCTL_DEF('t','m','f',(_number))
+// get the avr_timer_pwm_t of each comparator, an array of AVR_TIMER_COMP_COUNT
+#define AVR_IOCTL_TIMER_GETPWM(_number) AVR_IOCTL_DEF('t','m','p',(_number))
+/*
+ * uint8_t parameter, 0 stops the comparator pins from following each
+ * compare match, for when only the duty cycle is of interest. The
+ * interrupts are still raised. 1 is the default.
+ */
+#define AVR_IOCTL_TIMER_SET_EDGES(_number) AVR_IOCTL_DEF('t','m','e',(_number))
 
 // Waveform generation modes
 enum {
@@ -107,6 +117,17 @@ typedef struct avr_timer_wgm_t {
 #define AVR_TIMER_WGM_ICPWM() { .kind = avr_timer_wgm_pwm, .top = avr_timer_wgm_reg_icr }
 #define AVR_TIMER_WGM_ICFASTPWM() { .kind = avr_timer_wgm_fast_pwm, .top = avr_timer_wgm_reg_icr }
 
+/*
+ * What a comparator output does over a period, updated when the timer
+ * registers change; TIMER_IRQ_OUT_DUTY tells when.
+ */
+typedef struct avr_timer_pwm_t {
+	uint32_t	period;		// in cycles, 0 if the output is static
+	uint32_t	duty;		// cycles the output is high, or its level if static
+	uint8_t		inverted;	// set, rather than cleared, on compare match
+	uint8_t		connected;	// the comparator drives its pin
+} avr_timer_pwm_t;
+
 typedef struct avr_timer_comp_t {
 		avr_int_vector_t	interrupt;		// interrupt vector
 		struct avr_timer_t	*timer;			// parent timer
@@ -116,6 +137,7 @@ typedef struct avr_timer_comp_t {
 		avr_regbit_t		com_pin;		// where comparator output is connected
 		uint64_t			comp_cycles;
                 avr_regbit_t            foc;                    // "force compare match" strobe
+		avr_timer_pwm_t		pwm;
 } avr_timer_comp_t, *avr_timer_comp_p;
 
 enum {
@@ -165,6 +187,7 @@ typedef struct avr_timer_t {
 	float			phase_accumulator;
 	uint64_t		tov_base;	// MCU cycle when the last overflow occured; when clocked externally holds external clock count
 	uint16_t		tov_top;	// current top value to calculate tnct
+	uint8_t			no_edges;	// see AVR_IOCTL_TIMER_SET_EDGES
 } avr_timer_t;
 
 void avr_timer_init(avr_t * avr, avr_timer_t * port);
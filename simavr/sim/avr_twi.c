@@ -21,6 +21,7 @@
 
 #include <stdio.h>
 #include "avr_twi.h"
+#include "sim_snapshot.h"
 
 /*
  * This block respectfully nicked straight out from the Atmel sample
@@ -137,6 +138,90 @@ _avr_twi_delay_state(
 			p->io.avr, twi_cycles*clockdiv, avr_twi_set_state_timer, p);
 }
 
+static avr_twi_slave_t *
+_avr_twi_find(
+		avr_twi_t * p,
+		uint8_t addr)
+{
+	for (avr_twi_slave_t * s = p->slaves; s; s = s->next)
+		if ((addr & ~s->mask) == (s->addr & ~s->mask))
+			return s;
+	return NULL;
+}
+
+/* Asks the slave model for the bytes the master is about to read */
+static void
+_avr_twi_xfer_fill(
+		avr_twi_t * p)
+{
+	avr_twi_slave_t * s = p->slave;
+	int len = s->read ? s->read(s, p->xfer, sizeof(p->xfer)) : 0;
+
+	p->xfer_len = len < 0 ? 0 : len > sizeof(p->xfer) ? sizeof(p->xfer) : len;
+	p->xfer_pos = 0;
+}
+
+/* STOP or repeated START, the slave model gets what it was sent */
+static void
+_avr_twi_xfer_end(
+		avr_twi_t * p)
+{
+	avr_twi_slave_t * s = p->slave;
+
+	if (!s)
+		return;
+	p->slave = NULL;
+	if (p->peer_addr & 1) {
+		if (s->read_done && p->xfer_pos)
+			s->read_done(s, p->xfer_pos);
+	} else if (s->write && p->xfer_len)
+		s->write(s, p->xfer, p->xfer_len);
+	p->xfer_len = p->xfer_pos = 0;
+}
+
+/* SLA+R/W, returns non zero if a slave model has that address */
+static int
+_avr_twi_xfer_start(
+		avr_twi_t * p)
+{
+	uint8_t addr = p->peer_addr >> 1;
+	int read = p->peer_addr & 1;
+	avr_twi_slave_t * s = _avr_twi_find(p, addr);
+
+	if (!s)
+		return 0;
+	p->slave = s;
+	p->xfer_len = p->xfer_pos = 0;
+	if (s->address && !s->address(s, addr, read))
+		return 1;
+	p->state |= TWI_COND_ACK;
+	if (read)
+		_avr_twi_xfer_fill(p);
+	return 1;
+}
+
+/* A data byte to or from the slave model, the write ones are acked */
+static void
+_avr_twi_xfer_byte(
+		avr_twi_t * p,
+		int do_read)
+{
+	avr_t * avr = p->io.avr;
+
+	if (do_read) {
+		if (p->xfer_pos == p->xfer_len) {
+			if (p->slave->read_done && p->xfer_pos)
+				p->slave->read_done(p->slave, p->xfer_pos);
+			_avr_twi_xfer_fill(p);
+		}
+		avr->data[p->r_twdr] = p->xfer_pos < p->xfer_len ?
+				p->xfer[p->xfer_pos++] : 0xff;
+	} else if (p->xfer_len < sizeof(p->xfer)) {
+		p->xfer[p->xfer_len++] = avr->data[p->r_twdr];
+		p->state |= TWI_COND_ACK;
+	}
+}
+
 static void
 avr_twi_write(
 		struct avr_t * avr,
@@ -172,6 +257,7 @@ avr_twi_write(
 			_avr_twi_status_set(p, TWI_NO_STATE, 0);
 			p->state = 0;
 			p->peer_addr = 0;
+			p->slave = NULL;
 		}
 		AVR_TRACE(avr, "TWEN: %d\n", twen);
 		if (avr->data[p->r_twar]) {
@@ -184,8 +270,9 @@ avr_twi_write(
 
 	uint8_t cleared = avr_regbit_get(avr, p->twi.raised);
 
-	/*int cleared = */
-	avr_clear_interrupt_if(avr, &p->twi, twint);
+	// writing a one clears TWINT, even if it's 'sticky'
+	if (avr_clear_interrupt_if(avr, &p->twi, twint))
+		avr_regbit_clear(avr, p->twi.raised);
 //	AVR_TRACE(avr, "cleared %d\n", cleared);
 
 	if (!twsto && avr_regbit_get(avr, p->twsto)) {
@@ -194,7 +281,9 @@ avr_twi_write(
 		AVR_TRACE(avr, "<<<<< I2C stop\n");
 #endif
 		if (p->state) { // doing stuff
-			if (p->state & TWI_COND_START) {
+			if (p->slave)
+				_avr_twi_xfer_end(p);
+			else if (p->state & TWI_COND_START) {
 				avr_raise_irq(p->io.irq + TWI_IRQ_OUTPUT,
 						avr_twi_irq_msg(TWI_COND_STOP, p->peer_addr, 1));
 			}
@@ -209,6 +298,7 @@ avr_twi_write(
 		AVR_TRACE(avr, ">>>>> I2C %sstart\n", p->state & TWI_COND_START ? "RE" : "");
 #endif
 		// generate a start condition
+		_avr_twi_xfer_end(p);
 		if (p->state & TWI_COND_START)
 			_avr_twi_delay_state(p, 0, TWI_REP_START);
 		else
@@ -285,8 +375,11 @@ avr_twi_write(
 				// we send an IRQ and we /expect/ a slave to reply
 				// immediately via an IRQ to set the COND_ACK bit
 				// otherwise it's assumed it's been nacked...
-				avr_raise_irq(p->io.irq + TWI_IRQ_OUTPUT,
-						avr_twi_irq_msg(msgv, p->peer_addr, avr->data[p->r_twdr]));
+				if (p->slave)
+					_avr_twi_xfer_byte(p, do_read);
+				else
+					avr_raise_irq(p->io.irq + TWI_IRQ_OUTPUT,
+							avr_twi_irq_msg(msgv, p->peer_addr, avr->data[p->r_twdr]));
 
 				if (do_read) { // read ?
 					_avr_twi_delay_state(p, 9,
@@ -314,8 +407,9 @@ avr_twi_write(
 			// we send an IRQ and we /expect/ a slave to reply
 			// immediately via an IRQ tp set the COND_ACK bit
 			// otherwise it's assumed it's been nacked...
-			avr_raise_irq(p->io.irq + TWI_IRQ_OUTPUT,
-					avr_twi_irq_msg(TWI_COND_START, p->peer_addr, 0));
+			if (!_avr_twi_xfer_start(p))
+				avr_raise_irq(p->io.irq + TWI_IRQ_OUTPUT,
+						avr_twi_irq_msg(TWI_COND_START, p->peer_addr, 0));
 
 			if (p->peer_addr & 1) { // read ?
 				p->state |= TWI_COND_READ;	// always allow read to start with
@@ -474,24 +568,75 @@ void avr_twi_reset(struct avr_io_t *io)
 	avr_twi_t * p = (avr_twi_t *)io;
 	avr_irq_register_notify(p->io.irq + TWI_IRQ_INPUT, avr_twi_irq_input, p);
 	p->state = p->peer_addr = 0;
+	p->slave = NULL;
+	p->xfer_len = p->xfer_pos = 0;
 	avr_regbit_setto_raw(p->io.avr, p->twsr, TWI_NO_STATE);
 }
 
+static int
+avr_twi_ioctl(
+		struct avr_io_t * port,
+		uint32_t ctl,
+		void * io_param)
+{
+	avr_twi_t * p = (avr_twi_t *)port;
+	avr_twi_slave_t ** s = &p->slaves;
+
+	if (ctl != AVR_IOCTL_TWI_ATTACH(p->name) || !io_param)
+		return -1;
+	// first attached, first matched
+	while (*s)
+		s = &(*s)->next;
+	*s = (avr_twi_slave_t *)io_param;
+	(*s)->next = NULL;
+	return 0;
+}
+
 static const char * irq_names[TWI_IRQ_COUNT] = {
 	[TWI_IRQ_INPUT] = "8<input",
 	[TWI_IRQ_OUTPUT] = "32>output",
 	[TWI_IRQ_STATUS] = "8>status",
 };
 
+static const avr_cycle_timer_t _timers[] = {
+	avr_twi_set_state_timer,
+	NULL,
+};
+
+static void
+avr_twi_snapshot(
+		avr_io_t * port,
+		avr_snapshot_t * snap)
+{
+	avr_twi_t * p = (avr_twi_t *)port;
+
+	AVR_SNAPSHOT_FIELD(snap, p->state);
+	AVR_SNAPSHOT_FIELD(snap, p->peer_addr);
+	AVR_SNAPSHOT_FIELD(snap, p->next_twstate);
+
+	uint8_t busy = p->slave != NULL;
+	AVR_SNAPSHOT_FIELD(snap, busy);
+	AVR_SNAPSHOT_FIELD(snap, p->xfer_len);
+	AVR_SNAPSHOT_FIELD(snap, p->xfer_pos);
+	AVR_SNAPSHOT_FIELD(snap, p->xfer);
+	// the models themselves aren't part of it
+	if (snap->restore)
+		p->slave = busy ? _avr_twi_find(p, p->peer_addr >> 1) : NULL;
+}
+
 static	avr_io_t	_io = {
 	.kind = "twi",
 	.reset = avr_twi_reset,
+	.ioctl = avr_twi_ioctl,
 	.irq_names = irq_names,
+	.timers = _timers,
+	.snapshot = avr_twi_snapshot,
 };
 
 void avr_twi_init(avr_t * avr, avr_twi_t * p)
 {
 	p->io = _io;
+	p->io.timer_param = p;
 	avr_register_io(avr, &p->io);
 	avr_register_vector(avr, &p->twi);
 
@@ -519,3 +664,12 @@ avr_twi_irq_msg(
 	};
 	return _msg.u.v;
 }
+
+int
+avr_twi_attach(
+		avr_t * avr,
+		char name,
+		avr_twi_slave_t * s)
+{
+	return avr_ioctl(avr, AVR_IOCTL_TWI_ATTACH(name), s);
+}
@@ -64,6 +64,43 @@ typedef struct avr_twi_msg_irq_t {
 
 // add port number to get the real IRQ
 #define AVR_IOCTL_TWI_GETIRQ(_name) AVR_IOCTL_DEF('t','w','i',(_name))
+// attach a avr_twi_slave_t, see avr_twi_attach()
+#define AVR_IOCTL_TWI_ATTACH(_name) AVR_IOCTL_DEF('t','w','a',(_name))
+
+#define AVR_TWI_XFER_SIZE	260		// a 256 bytes page, and its address
+
+/*
+ * A slave model on the bus of the TWI. When the AVR is master and
+ * addresses one, the transfer doesn't go through TWI_IRQ_OUTPUT messages
+ * any more: the bytes it writes are acked and buffered, and handed over
+ * at the STOP or repeated START, the ones it reads are asked for at the
+ * SLA+R. The bus timing is the same.
+ */
+typedef struct avr_twi_slave_t {
+	struct avr_twi_slave_t * next;
+	uint8_t		addr;		// 7 bits
+	uint8_t		mask;		// address bits that are don't care
+	/* SLA+R/W to 'addr', optional; returns 0 to nack it, when busy */
+	int (*address)(
+			struct avr_twi_slave_t * s,
+			uint8_t addr,
+			int read);
+	/* The master wrote 'len' bytes */
+	void (*write)(
+			struct avr_twi_slave_t * s,
+			const uint8_t * buf,
+			int len);
+	/* Fills up to 'len' bytes the master may read, returns how many */
+	int (*read)(
+			struct avr_twi_slave_t * s,
+			uint8_t * buf,
+			int len);
+	/* The master took 'len' bytes of those, optional */
+	void (*read_done)(
+			struct avr_twi_slave_t * s,
+			int len);
+	void *		param;
+} avr_twi_slave_t;
 
 typedef struct avr_twi_t {
 	avr_io_t	io;
@@ -92,6 +129,11 @@ typedef struct avr_twi_t {
 	uint8_t state;
 	uint8_t peer_addr;
 	uint8_t next_twstate;
+
+	avr_twi_slave_t *	slaves;
+	avr_twi_slave_t *	slave;		// of the current transfer, if any
+	uint8_t		xfer[AVR_TWI_XFER_SIZE];
+	uint16_t	xfer_len, xfer_pos;
 } avr_twi_t;
 
 void
@@ -99,6 +141,16 @@ avr_twi_init(
 		avr_t * avr,
 		avr_twi_t * port);
 
+/*
+ * Attaches the slave model 's' to the bus of TWI 'name', the slave
+ * models of a bus can't be detached.
+ */
+int
+avr_twi_attach(
+		avr_t * avr,
+		char name,
+		avr_twi_slave_t * s);
+
 /*
  * Create a message value for twi including the 'msg' bitfield,
  * 'addr' and data. This value is what is sent as the IRQ value
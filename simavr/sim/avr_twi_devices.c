@@ -0,0 +1,250 @@
+/*
+	avr_twi_devices.c
+
+	Slave models for the TWI bus, 24Cxx EEPROMs and register files.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "avr_twi_devices.h"
+#include "sim_time.h"
+
+static int
+_eeprom_address(
+		avr_twi_slave_t * s,
+		uint8_t addr,
+		int read)
+{
+	avr_twi_eeprom_t * e = (avr_twi_eeprom_t *)s->param;
+	uint32_t low = (1 << (8 * e->addr_bytes)) - 1;
+
+	// busy writing the last page, the firmware polls for the ack
+	if (e->avr->cycle < e->ready)
+		return 0;
+	e->ptr = (e->ptr & low) | ((addr & s->mask) << (8 * e->addr_bytes));
+	return 1;
+}
+
+static void
+_eeprom_write(
+		avr_twi_slave_t * s,
+		const uint8_t * buf,
+		int len)
+{
+	avr_twi_eeprom_t * e = (avr_twi_eeprom_t *)s->param;
+	uint32_t ptr = e->ptr >> (8 * e->addr_bytes);
+
+	if (len < e->addr_bytes)
+		return;
+	for (int i = 0; i < e->addr_bytes; i++)
+		ptr = (ptr << 8) | *buf++;
+	len -= e->addr_bytes;
+	e->ptr = ptr & (e->size - 1);
+	if (!len)
+		return;
+	// the address rolls over in the page
+	uint32_t base = e->ptr & ~(e->page - 1);
+	for (int i = 0; i < len; i++) {
+		e->mem[base + (e->ptr & (e->page - 1))] = buf[i];
+		e->ptr = base + ((e->ptr + 1) & (e->page - 1));
+	}
+	e->ready = e->avr->cycle +
+			avr_usec_to_cycles(e->avr, AVR_TWI_EEPROM_TWR);
+}
+
+static int
+_eeprom_read(
+		avr_twi_slave_t * s,
+		uint8_t * buf,
+		int len)
+{
+	avr_twi_eeprom_t * e = (avr_twi_eeprom_t *)s->param;
+
+	for (int i = 0; i < len; i++)
+		buf[i] = e->mem[(e->ptr + i) & (e->size - 1)];
+	return len;
+}
+
+static void
+_eeprom_read_done(
+		avr_twi_slave_t * s,
+		int len)
+{
+	avr_twi_eeprom_t * e = (avr_twi_eeprom_t *)s->param;
+
+	e->ptr = (e->ptr + len) & (e->size - 1);
+}
+
+static int
+_eeprom_map(
+		avr_twi_eeprom_t * e,
+		const char * filename)
+{
+	struct stat st;
+
+	e->fd = open(filename, O_RDWR | O_CREAT, 0644);
+	if (e->fd < 0 || fstat(e->fd, &st))
+		goto error;
+	if (st.st_size < e->size && ftruncate(e->fd, e->size))
+		goto error;
+	e->mem = mmap(NULL, e->size, PROT_READ | PROT_WRITE, MAP_SHARED, e->fd, 0);
+	if (e->mem == MAP_FAILED) {
+		e->mem = NULL;
+		goto error;
+	}
+	// a new part is blank
+	if (st.st_size < e->size)
+		memset(e->mem + st.st_size, 0xff, e->size - st.st_size);
+	return 0;
+error:
+	AVR_LOG(e->avr, LOG_ERROR, "TWI: %s: %s\n", filename, strerror(errno));
+	if (e->fd >= 0)
+		close(e->fd);
+	e->fd = -1;
+	return -1;
+}
+
+int
+avr_twi_eeprom_init(
+		avr_t * avr,
+		avr_twi_eeprom_t * e,
+		char name,
+		uint8_t addr,
+		uint32_t size,
+		uint16_t page,
+		const char * filename)
+{
+	if (size < 128 || size > 256 * 1024 || (size & (size - 1)) ||
+			(page & (page - 1))) {
+		AVR_LOG(avr, LOG_ERROR, "TWI: no 24Cxx of %u bytes, %u per page\n",
+				size, page);
+		return -1;
+	}
+	memset(e, 0, sizeof(*e));
+	e->avr = avr;
+	e->size = size;
+	e->addr_bytes = size > 2048 ? 2 : 1;
+	e->page = page ? page :
+			size <= 256 ? 8 :
+			size <= 2048 ? 16 :
+			size <= 8192 ? 32 :
+			size <= 32768 ? 64 :
+			size <= 65536 ? 128 : 256;
+	e->fd = -1;
+	if (filename) {
+		if (_eeprom_map(e, filename))
+			return -1;
+	} else {
+		e->mem = malloc(size);
+		memset(e->mem, 0xff, size);
+	}
+	e->slave.addr = addr;
+	e->slave.mask = ((size - 1) >> (8 * e->addr_bytes)) & 0x7;
+	e->slave.address = _eeprom_address;
+	e->slave.write = _eeprom_write;
+	e->slave.read = _eeprom_read;
+	e->slave.read_done = _eeprom_read_done;
+	e->slave.param = e;
+	return avr_twi_attach(avr, name, &e->slave);
+}
+
+void
+avr_twi_eeprom_free(
+		avr_twi_eeprom_t * e)
+{
+	if (!e->mem)
+		return;
+	if (e->fd >= 0) {
+		munmap(e->mem, e->size);
+		close(e->fd);
+		e->fd = -1;
+	} else
+		free(e->mem);
+	e->mem = NULL;
+}
+
+static void
+_regs_write(
+		avr_twi_slave_t * s,
+		const uint8_t * buf,
+		int len)
+{
+	avr_twi_regs_t * r = (avr_twi_regs_t *)s->param;
+	uint8_t first = r->ptr = buf[0];
+
+	for (int i = 1; i < len; i++, r->ptr++)
+		if (!(r->ro[r->ptr / 8] & (1 << (r->ptr % 8))))
+			r->reg[r->ptr] = buf[i];
+	if (len > 1 && r->write)
+		r->write(r, first, len - 1, r->param);
+}
+
+static int
+_regs_read(
+		avr_twi_slave_t * s,
+		uint8_t * buf,
+		int len)
+{
+	avr_twi_regs_t * r = (avr_twi_regs_t *)s->param;
+
+	if (r->read)
+		r->read(r, r->ptr, r->param);
+	if (len > sizeof(r->reg))
+		len = sizeof(r->reg);
+	for (int i = 0; i < len; i++)
+		buf[i] = r->reg[(uint8_t)(r->ptr + i)];
+	return len;
+}
+
+static void
+_regs_read_done(
+		avr_twi_slave_t * s,
+		int len)
+{
+	avr_twi_regs_t * r = (avr_twi_regs_t *)s->param;
+
+	r->ptr += len;
+}
+
+int
+avr_twi_regs_init(
+		avr_t * avr,
+		avr_twi_regs_t * r,
+		char name,
+		uint8_t addr,
+		avr_twi_regs_read_t read,
+		avr_twi_regs_write_t write,
+		void * param)
+{
+	memset(r, 0, sizeof(*r));
+	r->read = read;
+	r->write = write;
+	r->param = param;
+	r->slave.addr = addr;
+	r->slave.write = _regs_write;
+	r->slave.read = _regs_read;
+	r->slave.read_done = _regs_read_done;
+	r->slave.param = r;
+	return avr_twi_attach(avr, name, &r->slave);
+}
@@ -0,0 +1,114 @@
+/*
+	avr_twi_devices.h
+
+	Slave models for the TWI bus: 24Cxx EEPROMs, and a generic register
+	file for sensors and the like. See avr_twi_attach().
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __AVR_TWI_DEVICES_H__
+#define __AVR_TWI_DEVICES_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "avr_twi.h"
+
+#define AVR_TWI_EEPROM_TWR		5000	// us, write cycle time
+
+/*
+ * 24C01 to 24M02. The parts up to 2KB take a one byte address, the bigger
+ * ones two, and the address bits that don't fit are in the device
+ * address. Writes wrap in their page, the part doesn't answer while it
+ * writes it.
+ */
+typedef struct avr_twi_eeprom_t {
+	avr_twi_slave_t		slave;
+	avr_t *				avr;
+	uint8_t *			mem;
+	uint32_t			size;
+	uint16_t			page;
+	uint8_t				addr_bytes;
+	uint32_t			ptr;		// current address
+	avr_cycle_count_t	ready;		// end of the write cycle
+	int					fd;			// of the file it's mapped from
+} avr_twi_eeprom_t;
+
+/*
+ * Attaches a 'size' bytes EEPROM at 'addr' (0x50 usually) to TWI 'name'.
+ * Its content is mapped from 'filename' and persists, it is created as
+ * blank if needed; NULL keeps it in memory. 'page' 0 picks the page size
+ * of the common parts.
+ */
+int
+avr_twi_eeprom_init(
+		avr_t * avr,
+		avr_twi_eeprom_t * e,
+		char name,
+		uint8_t addr,
+		uint32_t size,
+		uint16_t page,
+		const char * filename);
+void
+avr_twi_eeprom_free(
+		avr_twi_eeprom_t * e);
+
+struct avr_twi_regs_t;
+
+/* Called before the master reads from register 'reg' on, optional */
+typedef void (*avr_twi_regs_read_t)(
+		struct avr_twi_regs_t * r,
+		uint8_t reg,
+		void * param);
+/* Called after the master wrote 'count' registers from 'reg' on */
+typedef void (*avr_twi_regs_write_t)(
+		struct avr_twi_regs_t * r,
+		uint8_t reg,
+		int count,
+		void * param);
+
+/*
+ * The register file most sensors have: the first byte written selects
+ * a register, the following ones are written from there, and reads go
+ * on from there too, auto incrementing.
+ */
+typedef struct avr_twi_regs_t {
+	avr_twi_slave_t		slave;
+	uint8_t				reg[256];
+	uint8_t				ro[256 / 8];	// bit set, written bytes are ignored
+	uint8_t				ptr;
+	avr_twi_regs_read_t	read;
+	avr_twi_regs_write_t write;
+	void *				param;
+} avr_twi_regs_t;
+
+int
+avr_twi_regs_init(
+		avr_t * avr,
+		avr_twi_regs_t * r,
+		char name,
+		uint8_t addr,
+		avr_twi_regs_read_t read,
+		avr_twi_regs_write_t write,
+		void * param);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __AVR_TWI_DEVICES_H__ */
@@ -36,6 +36,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include "avr_uart.h"
+#include "sim_snapshot.h"
 #include "sim_hex.h"
 #include "sim_time.h"
 #include "sim_gdb.h"
@@ -498,11 +499,34 @@ static const char * irq_names[UART_IRQ_COUNT] = {
 	[UART_IRQ_OUT_XOFF] = ">xoff",
 };
 
+static const avr_cycle_timer_t _timers[] = {
+	avr_uart_txc_raise,
+	avr_uart_rxc_raise,
+	NULL,
+};
+
+static void
+avr_uart_snapshot(
+		avr_io_t * port,
+		avr_snapshot_t * snap)
+{
+	avr_uart_t * p = (avr_uart_t *)port;
+
+	AVR_SNAPSHOT_FIELD(snap, p->input);
+	AVR_SNAPSHOT_FIELD(snap, p->tx_cnt);
+	AVR_SNAPSHOT_FIELD(snap, p->rx_cnt);
+	AVR_SNAPSHOT_FIELD(snap, p->flags);
+	AVR_SNAPSHOT_FIELD(snap, p->cycles_per_byte);
+	AVR_SNAPSHOT_FIELD(snap, p->rxc_raise_time);
+}
+
 static	avr_io_t	_io = {
 	.kind = "uart",
 	.reset = avr_uart_reset,
 	.ioctl = avr_uart_ioctl,
 	.irq_names = irq_names,
+	.timers = _timers,
+	.snapshot = avr_uart_snapshot,
 };
 
 void
@@ -511,6 +535,7 @@ avr_uart_init(
 		avr_uart_t * p)
 {
 	p->io = _io;
+	p->io.timer_param = p;
 
 //	printf("%s UART%c UDR=%02x\n", __FUNCTION__, p->name, p->r_udr);
 
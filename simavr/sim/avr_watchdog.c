@@ -23,6 +23,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "avr_watchdog.h"
+#include "sim_snapshot.h"
 
 static void avr_watchdog_run_callback_software_reset(avr_t * avr)
 {
@@ -150,8 +151,17 @@ static void avr_watchdog_write(
 }
 
 /*
- * called by the core when a WTD instruction is found
+ * called by the core when a WDR instruction is found
  */
+void avr_watchdog_wdr(
+		avr_watchdog_t * p)
+{
+	if (avr_regbit_get(p->io.avr, p->wde) ||
+			avr_regbit_get(p->io.avr, p->watchdog.enable))
+		avr_cycle_timer_register(p->io.avr, p->cycle_count,
+				avr_watchdog_timer, p);
+}
+
 static int avr_watchdog_ioctl(
 		struct avr_io_t * port, uint32_t ctl, void * io_param)
 {
@@ -159,10 +169,7 @@ static int avr_watchdog_ioctl(
 	int res = -1;
 
 	if (ctl == AVR_IOCTL_WATCHDOG_RESET) {
-		if (avr_regbit_get(p->io.avr, p->wde) ||
-				avr_regbit_get(p->io.avr, p->watchdog.enable))
-			avr_cycle_timer_register(p->io.avr, p->cycle_count,
-					avr_watchdog_timer, p);
+		avr_watchdog_wdr(p);
 		res = 0;
 	}
 
@@ -211,18 +218,39 @@ static void avr_watchdog_reset(avr_io_t * port)
 	avr_irq_register_notify(p->watchdog.irq, avr_watchdog_irq_notify, p);
 }
 
+static const avr_cycle_timer_t _timers[] = {
+	avr_watchdog_timer,
+	avr_wdce_clear,
+	NULL,
+};
+
+static void
+avr_watchdog_snapshot(
+		avr_io_t * port,
+		avr_snapshot_t * snap)
+{
+	avr_watchdog_t * p = (avr_watchdog_t *)port;
+
+	AVR_SNAPSHOT_FIELD(snap, p->cycle_count);
+	AVR_SNAPSHOT_FIELD(snap, p->reset_context.wdrf);
+}
+
 static	avr_io_t	_io = {
 	.kind = "watchdog",
 	.reset = avr_watchdog_reset,
 	.ioctl = avr_watchdog_ioctl,
+	.timers = _timers,
+	.snapshot = avr_watchdog_snapshot,
 };
 
 void avr_watchdog_init(avr_t * avr, avr_watchdog_t * p)
 {
 	p->io = _io;
+	p->io.timer_param = p;
 
 	avr_register_io(avr, &p->io);
 	avr_register_vector(avr, &p->watchdog);
+	avr->watchdog = p;
 
 	avr_register_io_write(avr, p->wdce.reg, avr_watchdog_write, p);
 
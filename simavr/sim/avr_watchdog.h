@@ -52,6 +52,8 @@ typedef struct avr_watchdog_t {
 #define AVR_IOCTL_WATCHDOG_RESET	AVR_IOCTL_DEF('w','d','t','r')
 
 void avr_watchdog_init(avr_t * avr, avr_watchdog_t * p);
+/* WDR, the core calls it directly, same as the ioctl */
+void avr_watchdog_wdr(avr_watchdog_t * p);
 
 
 /*
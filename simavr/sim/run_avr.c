@@ -30,6 +30,15 @@
 #include "sim_gdb.h"
 #include "sim_hex.h"
 #include "sim_vcd_file.h"
+#include "sim_coverage.h"
+#include "sim_profile.h"
+#include "sim_stack.h"
+#include "sim_irqstat.h"
+#include "sim_itrace.h"
+#include "sim_replay.h"
+#include "sim_reverse.h"
+#include "sim_pace.h"
+#include "sim_semihost.h"
 
 #include "sim_core_decl.h"
 
@@ -47,11 +56,7 @@ display_usage(
 		"       [--mcu|-m <device>] Sets the MCU type for an .hex firmware\n"
 		"       [--gdb|-g [<port>]] Listen for gdb connection on <port> "
 		"(default 1234)\n"
-#ifdef CONFIG_SIMAVR_TRACE
 		"       [--trace, -t]       Run full scale decoder trace\n"
-#else
-		"       [--trace, -t]       Run full scale decoder trace (Off)\n"
-#endif // CONFIG_SIMAVR_TRACE
 		"       [-ti <vector>]      Add traces for IRQ vector <vector>\n"
 		"       [--input|-i <file>] A VCD file to use as input signals\n"
 		"       [--output|-o <file>] A VCD file to save the traced signals\n"
@@ -59,6 +64,31 @@ display_usage(
 		"                           Add signal to be included in VCD output\n"
 		"       [-ff <.hex file>]   Load next .hex file as flash\n"
 		"       [-ee <.hex file>]   Load next .hex file as eeprom\n"
+		"       [--coverage|-cov <file>]\n"
+		"                           Write an lcov tracefile of the run,\n"
+		"                           needs an ELF firmware with DWARF info\n"
+		"       [--coverage-map <file>]\n"
+		"                           Accumulate the raw coverage in <file>\n"
+		"       [--profile <file>]  Write a function profile, for pprof if\n"
+		"                           <file> ends in .pb, callgrind otherwise\n"
+		"       [--stack]           Report the stack high-water marks and\n"
+		"                           the heap top at exit\n"
+		"       [--irqstat <file>]  Write interrupt latency and duration\n"
+		"                           histograms to <file>, as JSON\n"
+		"       [--itrace <file>]   Record every instruction to <file>\n"
+		"       [--flight <file>]   Keep the last instructions, written to\n"
+		"                           <file> if the core crashes\n"
+		"       [--flight-size <n>] Number of instructions kept, 1M default\n"
+		"       [--record <file>]   Log the external inputs to <file>\n"
+		"       [--replay <file>]   Replay the inputs logged by --record,\n"
+		"                           as fast as possible\n"
+		"       [--reverse <MB>]    Keep <MB> of execution history for gdb's\n"
+		"                           reverse-step and reverse-continue\n"
+		"       [--pace <ratio>|off] Run at <ratio> times real time, even\n"
+		"                           when not sleeping, or flat out\n"
+		"       [--semihost <dir>]  Answer the firmware's semihosting calls,\n"
+		"                           its files are in <dir>, and its exit\n"
+		"                           status is ours\n"
 		"       <firmware>          A .hex or an ELF file. ELF files are\n"
 		"                           preferred, and can include "
 		"debugging syms\n");
@@ -80,12 +110,83 @@ list_cores()
 }
 
 static avr_t *avr = NULL;
+static const char *firmware_file = NULL;
+static const char *coverage_file = NULL;
+static const char *coverage_map = NULL;
+static const char *profile_file = NULL;
+static avr_profile_t *profile = NULL;
+static int stack_report = 0;
+static avr_stack_t *stack = NULL;
+static const char *irqstat_file = NULL;
+static avr_irqstat_t *irqstat = NULL;
+static const char *itrace_file = NULL;
+static const char *flight_file = NULL;
+static uint32_t flight_size = 0;
+static const char *record_file = NULL;
+static const char *replay_file = NULL;
+static uint32_t reverse_mb = 0;
+static const char *pace = NULL;
+static const char *semihost_root = NULL;
+
+static void
+coverage_done(void)
+{
+	if (!avr || !avr->coverage)
+		return;
+	if (coverage_map)
+		avr_coverage_write(avr, coverage_map, 1);
+	if (coverage_file && firmware_file)
+		avr_coverage_lcov(avr, firmware_file, coverage_file, NULL);
+	avr_coverage_free(avr);
+}
+
+static void
+profile_done(void)
+{
+	if (!profile)
+		return;
+	avr_profile_stop(profile);
+	const char *ext = strrchr(profile_file, '.');
+	if (ext && (!strcmp(ext, ".pb") || !strcmp(ext, ".pprof")))
+		avr_profile_write_pprof(profile, profile_file);
+	else
+		avr_profile_write_callgrind(profile, profile_file);
+	avr_profile_report(profile, stdout, 10);
+	avr_profile_free(profile);
+	profile = NULL;
+}
+
+static void
+stack_done(void)
+{
+	if (!stack)
+		return;
+	avr_stack_report(stack, stdout, 10);
+	avr_stack_free(stack);
+	stack = NULL;
+}
+
+static void
+irqstat_done(void)
+{
+	if (!irqstat)
+		return;
+	avr_irqstat_stop(irqstat);
+	avr_irqstat_write_json(irqstat, irqstat_file);
+	avr_irqstat_report(irqstat, stdout);
+	avr_irqstat_free(irqstat);
+	irqstat = NULL;
+}
 
 static void
 sig_int(
 	int sign)
 {
 	printf("signal caught, simavr terminating\n");
+	coverage_done();
+	profile_done();
+	stack_done();
+	irqstat_done();
 	if (avr)
 		avr_terminate(avr);
 	exit(0);
@@ -93,9 +194,7 @@ sig_int(
 
 int main(int argc, char *argv[])
 {
-#ifdef CONFIG_SIMAVR_TRACE
 	int trace = 0;
-#endif // CONFIG_SIMAVR_TRACE
 	elf_firmware_t f = {{0}};
 	uint32_t f_cpu = 0;
 	int gdb = 0;
@@ -164,14 +263,7 @@ int main(int argc, char *argv[])
 		else if (!strcmp(argv[pi], "-t") ||
 				 !strcmp(argv[pi], "--trace"))
 		{
-#ifdef CONFIG_SIMAVR_TRACE
 			trace++;
-#else
-			fprintf(stderr,
-					"%s: tracing option '%s' requires "
-					"compilation option CONFIG_SIMAVR_TRACE.\n",
-					argv[0], argv[pi]);
-#endif // CONFIG_SIMAVR_TRACE
 		}
 		else if (!strcmp(argv[pi], "-at") ||
 				 !strcmp(argv[pi], "--add-trace"))
@@ -256,6 +348,95 @@ int main(int argc, char *argv[])
 		{
 			log++;
 		}
+		else if (!strcmp(argv[pi], "-cov") ||
+				 !strcmp(argv[pi], "--coverage"))
+		{
+			if (pi < argc - 1)
+				coverage_file = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
+		}
+		else if (!strcmp(argv[pi], "--coverage-map"))
+		{
+			if (pi < argc - 1)
+				coverage_map = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
+		}
+		else if (!strcmp(argv[pi], "--profile"))
+		{
+			if (pi < argc - 1)
+				profile_file = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
+		}
+		else if (!strcmp(argv[pi], "--stack"))
+		{
+			stack_report = 1;
+		}
+		else if (!strcmp(argv[pi], "--irqstat"))
+		{
+			if (pi < argc - 1)
+				irqstat_file = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
+		}
+		else if (!strcmp(argv[pi], "--itrace"))
+		{
+			if (pi < argc - 1)
+				itrace_file = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
+		}
+		else if (!strcmp(argv[pi], "--flight"))
+		{
+			if (pi < argc - 1)
+				flight_file = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
+		}
+		else if (!strcmp(argv[pi], "--flight-size"))
+		{
+			if (pi < argc - 1)
+				flight_size = strtoul(argv[++pi], NULL, 0);
+			else
+				display_usage(basename(argv[0]));
+		}
+		else if (!strcmp(argv[pi], "--record"))
+		{
+			if (pi < argc - 1)
+				record_file = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
+		}
+		else if (!strcmp(argv[pi], "--replay"))
+		{
+			if (pi < argc - 1)
+				replay_file = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
+		}
+		else if (!strcmp(argv[pi], "--reverse"))
+		{
+			if (pi < argc - 1)
+				reverse_mb = strtoul(argv[++pi], NULL, 0);
+			else
+				display_usage(basename(argv[0]));
+		}
+		else if (!strcmp(argv[pi], "--pace"))
+		{
+			if (pi < argc - 1)
+				pace = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
+		}
+		else if (!strcmp(argv[pi], "--semihost"))
+		{
+			if (pi < argc - 1)
+				semihost_root = argv[++pi];
+			else
+				display_usage(basename(argv[0]));
+		}
 		else if (!strcmp(argv[pi], "-ee"))
 		{
 			loadBase = AVR_SEGMENT_OFFSET_EEPROM;
@@ -267,6 +448,7 @@ int main(int argc, char *argv[])
 		else if (argv[pi][0] != '-')
 		{
 			sim_setup_firmware(argv[pi], loadBase, &f, argv[0]);
+			firmware_file = argv[pi];
 		}
 	}
 
@@ -287,9 +469,7 @@ int main(int argc, char *argv[])
 	}
 	avr_init(avr);
 	avr->log = (log > LOG_TRACE ? LOG_TRACE : log);
-#ifdef CONFIG_SIMAVR_TRACE
 	avr->trace = trace;
-#endif // CONFIG_SIMAVR_TRACE
 
 	avr_load_firmware(avr, &f);
 	if (f.flashbase)
@@ -303,7 +483,13 @@ int main(int argc, char *argv[])
 			if (avr->interrupts.vector[vi]->vector == trace_vectors[ti])
 				avr->interrupts.vector[vi]->trace = 1;
 	}
-	if (vcd_input)
+	// the recorded inputs replace the VCD input
+	if (vcd_input && replay_file)
+	{
+		fprintf(stderr, "%s: Warning: VCD input file %s ignored while replaying\n",
+				argv[0], vcd_input);
+	}
+	else if (vcd_input)
 	{
 		static avr_vcd_t input;
 		if (avr_vcd_init_input(avr, vcd_input, &input))
@@ -312,6 +498,52 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (coverage_file || coverage_map)
+		avr_coverage_init(avr);
+	if (profile_file)
+		profile = avr_profile_start(avr);
+	if (stack_report)
+		stack = avr_stack_start(avr);
+	if (irqstat_file)
+		irqstat = avr_irqstat_start(avr);
+	// avr_terminate() flushes and closes these
+	if (itrace_file)
+		avr_itrace_open(avr, itrace_file, 0);
+	else if (flight_file)
+		avr_itrace_flight(avr, flight_file, flight_size);
+	// before the replay and the reverse history, they log its results
+	if (semihost_root)
+		avr_semihost_init(avr, semihost_root);
+	if (record_file || replay_file)
+	{
+		avr_replay_t *r = record_file ?
+				avr_replay_record(avr, record_file) :
+				avr_replay_play(avr, replay_file);
+		if (!r || avr_replay_start(r))
+		{
+			fprintf(stderr, "%s: Unable to %s %s\n", argv[0],
+					record_file ? "record to" : "replay",
+					record_file ? record_file : replay_file);
+			exit(1);
+		}
+	}
+
+	if (reverse_mb && !avr_reverse_init(avr, (uint64_t)reverse_mb << 20, 0))
+		fprintf(stderr, "%s: Warning: no reverse execution history\n", argv[0]);
+	// replaying runs as fast as it can regardless
+	if (pace && !replay_file)
+	{
+		double ratio = strtod(pace, NULL);
+		if (!strcmp(pace, "off"))
+			avr_pace_init(avr, AVR_PACE_OFF, 0);
+		else if (ratio > 0) {
+			if (!avr_pace_init(avr, ratio == 1 ?
+					AVR_PACE_REALTIME : AVR_PACE_RATIO, ratio))
+				fprintf(stderr, "%s: Warning: --pace needs a frequency, see -f\n", argv[0]);
+		} else
+			fprintf(stderr, "%s: Warning: invalid --pace %s\n", argv[0], pace);
+	}
+
 	// even if not setup at startup, activate gdb if crashing
 	avr->gdb_port = port;
 	if (gdb)
@@ -330,5 +562,16 @@ int main(int argc, char *argv[])
 			break;
 	}
 
+	coverage_done();
+	profile_done();
+	stack_done();
+	irqstat_done();
+	if (avr->pace && log > LOG_ERROR)
+		avr_pace_report(avr->pace, stdout);
+	int status = 0;
+	if (avr->semihost && avr->semihost->exited)
+		status = avr->semihost->exit_status;
 	avr_terminate(avr);
+	elf_firmware_free(&f);
+	return status;
 }
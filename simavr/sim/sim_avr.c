@@ -11,6 +11,11 @@
 #include "sim_gdb.h"
 #include "avr_uart.h"
 #include "sim_vcd_file.h"
+#include "sim_itrace.h"
+#include "sim_replay.h"
+#include "sim_reverse.h"
+#include "sim_pace.h"
+#include "sim_semihost.h"
 #include "avr/avr_mcu_section.h"
 
 #define AVR_KIND_DECL
@@ -82,10 +87,8 @@ avr_init(
 	avr->codeend = avr->flashend;
 	avr->data = malloc(avr->ramend + 1);
 	memset(avr->data, 0, avr->ramend + 1);
-#ifdef CONFIG_SIMAVR_TRACE
 	avr->trace_data = calloc(1, sizeof(struct avr_trace_data_t));
         avr->trace_data->data_names_size = avr->ioend + 1;
-#endif
 	avr->data_names = calloc(avr->ioend + 1, sizeof (char *));
 	/* put "something" in the serial number */
 #ifdef _WIN32
@@ -135,10 +138,22 @@ avr_terminate(
 		avr_vcd_close(avr->vcd);
 		avr->vcd = NULL;
 	}
+	if (avr->itrace)
+		avr_itrace_close(avr->itrace);
+	if (avr->reverse)
+		avr_reverse_free(avr->reverse);
+	if (avr->replay)
+		avr_replay_close(avr->replay);
+	if (avr->pace)
+		avr_pace_free(avr->pace);
+	if (avr->semihost)
+		avr_semihost_free(avr->semihost);
 	avr_deallocate_ios(avr);
 
 	if (avr->flash) free(avr->flash);
 	if (avr->data) free(avr->data);
+	free(avr->dwarf_file);
+	avr->dwarf_file = NULL;
 	if (avr->io_console_buffer.buf) {
 		avr->io_console_buffer.len = 0;
 		avr->io_console_buffer.size = 0;
@@ -180,6 +195,9 @@ avr_sadly_crashed(
 		uint8_t signal)
 {
 	AVR_LOG(avr, LOG_ERROR, "%s\n", __FUNCTION__);
+	// the flight recorder has the instructions that led here
+	if (avr->itrace && avr->itrace->dump)
+		avr_itrace_dump(avr->itrace, avr->itrace->dump);
 	avr->state = cpu_Stopped;
 	if (avr->gdb_port) {
 		// enable gdb server, and wait
@@ -292,10 +310,16 @@ avr_callback_run_gdb(
 	avr_flashaddr_t new_pc = avr->pc;
 
 	if (avr->state == cpu_Running) {
-		new_pc = avr_run_one(avr);
-#if CONFIG_SIMAVR_TRACE
-		avr_dump_state(avr);
-#endif
+		// tells the recorder which inputs come from inside an instruction
+		if (unlikely(avr->replay))
+			avr->replay->in_core = 1;
+		if (unlikely(avr->trace)) {
+			new_pc = avr_run_one_trace(avr);
+			avr_dump_state(avr);
+		} else
+			new_pc = avr_run_one(avr);
+		if (unlikely(avr->replay))
+			avr->replay->in_core = 0;
 	}
 
 	// run the cycle timers, get the suggested sleep time
@@ -337,6 +361,11 @@ avr_callback_sleep_raw(
 		avr_t *avr,
 		avr_cycle_count_t how_long)
 {
+	// drift compensated, and for running code too, see sim_pace.h
+	if (avr->pace) {
+		avr_pace_sleep(avr->pace, avr->cycle + how_long);
+		return;
+	}
 	/* figure out how long we should wait to match the sleep deadline */
 	uint64_t deadline_ns = avr_cycles_to_nsec(avr, avr->cycle + how_long);
 	uint64_t runtime_ns = avr_get_time_stamp(avr);
@@ -354,10 +383,16 @@ avr_callback_run_raw(
 	avr_flashaddr_t new_pc = avr->pc;
 
 	if (avr->state == cpu_Running) {
-		new_pc = avr_run_one(avr);
-#if CONFIG_SIMAVR_TRACE
-		avr_dump_state(avr);
-#endif
+		// tells the recorder which inputs come from inside an instruction
+		if (unlikely(avr->replay))
+			avr->replay->in_core = 1;
+		if (unlikely(avr->trace)) {
+			new_pc = avr_run_one_trace(avr);
+			avr_dump_state(avr);
+		} else
+			new_pc = avr_run_one(avr);
+		if (unlikely(avr->replay))
+			avr->replay->in_core = 0;
 	}
 
 	// run the cycle timers, get the suggested sleep time
@@ -394,7 +429,14 @@ int
 avr_run(
 		avr_t * avr)
 {
-	avr->run(avr);
+	if (unlikely(avr->replay))
+		avr_replay_run(avr);
+	else
+		avr->run(avr);
+	// recording is paced, playing back runs flat out
+	if (unlikely(avr->pace) &&
+			!(avr->replay && avr->replay->mode == AVR_REPLAY_PLAY))
+		avr_pace_poll(avr->pace);
 	return avr->state;
 }
 
@@ -92,7 +92,7 @@ enum {
 	cpu_Crashed,    // avr software crashed (watchdog fired)
 };
 
-// this is only ever used if CONFIG_SIMAVR_TRACE is defined
+// this is only filled in while avr->trace is on, by the traced core
 struct avr_trace_data_t {
 	const char **   codeline;       // Text for each Flash address
 	uint32_t        codeline_size;  // Size of codeline table.
@@ -296,6 +296,12 @@ typedef struct avr_t {
 
 	// queue of io modules
 	struct avr_io_t * io_port;
+	/*
+	 * The modules LPM/ELPM/SPM and WDR talk to, if the core has them.
+	 * Set by their init, so these don't walk io_port in avr_ioctl()
+	 */
+	struct avr_flash_t *	selfprog;
+	struct avr_watchdog_t *	watchdog;
 
 	// Builtin and user-defined commands
 	avr_cmd_table_t commands;
@@ -304,11 +310,12 @@ typedef struct avr_t {
 	// interrupt vectors and delivery fifo
 	avr_int_table_t	interrupts;
 
-	// DEBUG ONLY -- value ignored if CONFIG_SIMAVR_TRACE = 0
+	// Runs the traced variant of the core, that prints every instruction.
+	// Can be switched at any time, see avr_run_one_trace()
 	uint8_t	trace : 1,
 			log : 4; // log level, default to 1
 
-	// Only used if CONFIG_SIMAVR_TRACE is defined
+	// Jump history, touched registers and symbol tables for the trace
 	struct avr_trace_data_t *trace_data;
 
 	// VALUE CHANGE DUMP file (waveforms)
@@ -336,8 +343,44 @@ typedef struct avr_t {
 	// Table of register names used by gdb and tracing.
 
 	const char ** data_names;
+
+	// Symbols loaded from the firmware, sorted by address, for
+	// avr_symbol_find(). The names point in the mapped ELF file.
+	const struct avr_symbol_t * symbol;
+	uint32_t	symbolcount;
+	// DWARF line info is only parsed when something asks for it
+	char *		dwarf_file;
+
+	// When set, one byte per flash word, the core ORs AVR_COVERAGE_*
+	// flags in as instructions are executed. See sim_coverage.h
+	uint8_t *	coverage;
+	// Function profiler, the core tells it about calls and returns
+	// when set. See sim_profile.h
+	struct avr_profile_t * profile;
+	// Stack high-water marks, checked after each instruction when set.
+	// See sim_stack.h
+	struct avr_stack_t * stack;
+	// Interrupt latency and duration histograms. See sim_irqstat.h
+	struct avr_irqstat_t * irqstat;
+	// Binary instruction trace, or flight recorder. See sim_itrace.h
+	struct avr_itrace_t * itrace;
+	// Records or replays the external inputs. See sim_replay.h
+	struct avr_replay_t * replay;
+	// Execution history, for gdb's reverse execution. See sim_reverse.h
+	struct avr_reverse_t * reverse;
+	// Real time pacing, when set. See sim_pace.h
+	struct avr_pace_t * pace;
+	// Semihosting calls from the firmware. See sim_semihost.h
+	struct avr_semihost_t * semihost;
 } avr_t;
 
+enum {
+	AVR_COVERAGE_EXEC		= (1 << 0),	// word was executed as an opcode
+	AVR_COVERAGE_TAKEN		= (1 << 1),	// conditional branch/skip was taken
+	AVR_COVERAGE_NOT_TAKEN	= (1 << 2),	// ... and was not taken
+	AVR_COVERAGE_INVALID	= (1 << 7),	// word was an invalid opcode
+};
+
 
 // this is a static constructor for each of the AVR devices
 typedef struct avr_kind_t {
@@ -349,7 +392,7 @@ typedef struct avr_kind_t {
 typedef struct avr_symbol_t {
 	uint32_t	addr;
 	uint32_t	size;
-	const char  symbol[0];
+	const char * symbol;
 } avr_symbol_t;
 
 // locate the maker for mcu "name" and allocates a new avr instance
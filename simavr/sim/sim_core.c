@@ -26,18 +26,33 @@
 #include "sim_avr.h"
 #include "sim_core.h"
 #include "sim_gdb.h"
+#include "sim_vcd_file.h"
+#include "sim_elf.h"
+#include "sim_profile.h"
+#include "sim_itrace.h"
+#include "sim_stack.h"
 #include "avr_flash.h"
 #include "avr_watchdog.h"
 
-// SREG bit names
-const char * _sreg_bit_name = "cznvshti";
+/*
+ * This file is built twice: on its own, for the plain avr_run_one(), and
+ * included by sim_core_trace.c with AVR_CORE_TRACE set, for
+ * avr_run_one_trace(). The decoder, and what it inlines, is in both;
+ * the other functions are only in one of them.
+ */
+#ifndef AVR_CORE_TRACE
+#define AVR_CORE_TRACE 0
+#endif
 
 /*
  * Handle "touching" registers, marking them changed.
  * This is used only for debugging purposes to be able to
  * print the effects of each instructions on registers
  */
-#if CONFIG_SIMAVR_TRACE
+#if AVR_CORE_TRACE
+
+// SREG bit names
+const char * _sreg_bit_name = "cznvshti";
 
 #define T(w) w
 
@@ -71,15 +86,24 @@ int dont_trace(const char * name)
 
 static int donttrace;
 
+/* Name for flash word 'pc', the name tables are built on first use */
+static const char *avr_codeline(avr_t *avr, avr_flashaddr_t pc)
+{
+	if (!avr->trace_data->codeline && (avr->symbolcount || avr->dwarf_file))
+		avr_symbol_load_lines(avr);
+	if (avr->trace_data->codeline && pc < avr->trace_data->codeline_size)
+		return avr->trace_data->codeline[pc];
+	return NULL;
+}
+
 static const char *where(avr_t *avr)
 {
 	avr_flashaddr_t  pc;
 	const char      *s;
 
 	pc = avr->pc >> 1; // Words
-	if (avr->trace_data->codeline &&
-		pc < avr->trace_data->codeline_size) {
-		s = avr->trace_data->codeline[pc];
+	if (avr->trace_data->codeline || avr->symbolcount || avr->dwarf_file) {
+		s = avr_codeline(avr, pc);
 #ifdef RESTRICT_TRACE
 		int	dont = dont_trace(s);
 		if (dont) {
@@ -126,11 +150,16 @@ static const char *get_data_address_string(avr_t* avr, uint16_t addr)
 }
 
 #define DAS(addr) get_data_address_string(avr, addr)
-#define FAS(addr) (((addr >> 1) > avr->trace_data->codeline_size) ? \
-                   "[not loaded]" : avr->trace_data->codeline[addr >> 1])
+#define FAS(addr) (avr_codeline(avr, (addr) >> 1) ? \
+                   avr_codeline(avr, (addr) >> 1) : "[not loaded]")
 
+/* The jump history is only kept by the traced core, so is the dump */
 void crash(avr_t* avr)
 {
+	if (!avr->trace) {
+		avr_sadly_crashed(avr, 0);
+		return;
+	}
 	DUMP_REG();
 	printf("*** CYCLE %" PRI_avr_cycle_count " PC %04x\n", avr->cycle, avr->pc);
 
@@ -138,8 +167,8 @@ void crash(avr_t* avr)
 		int pci = (avr->trace_data->old_pci + i) & 0xf;
 		printf(FONT_RED "*** %04x: %-25s RESET -%d; sp %04x\n" FONT_DEFAULT,
                        avr->trace_data->old[pci].pc,
-                       avr->trace_data->codeline ?
-                           avr->trace_data->codeline[avr->trace_data->old[pci].pc>>1] :
+                       avr_codeline(avr, avr->trace_data->old[pci].pc>>1) ?
+                           avr_codeline(avr, avr->trace_data->old[pci].pc>>1) :
                            "unknown",
                        OLD_PC_SIZE-i,
                        avr->trace_data->old[pci].sp);
@@ -155,12 +184,6 @@ void crash(avr_t* avr)
 #define REG_TOUCH(a, r)
 #define STATE(_f, args...)
 #define SREG()
-
-void crash(avr_t* avr)
-{
-	avr_sadly_crashed(avr, 0);
-
-}
 #endif
 
 static inline uint16_t
@@ -171,6 +194,23 @@ _avr_flash_read16le(
 	return(avr->flash[addr] | (avr->flash[addr + 1] << 8));
 }
 
+/*
+ * LPM/ELPM are a plain flash load, unless SELFPRGEN is set; then the
+ * flash module may return a fuse, lock or signature byte instead.
+ */
+static inline uint8_t
+_avr_lpm(
+	avr_t * avr,
+	avr_flashaddr_t z)
+{
+	uint8_t v = avr->flash[z];
+	avr_flash_t * p = avr->selfprog;
+
+	if (unlikely(p && avr_regbit_get(avr, p->selfprgen)))
+		avr_flash_lpm(p, &v);
+	return v;
+}
+
 static inline void _call_register_irqs(avr_t * avr, uint16_t addr)
 {
 	if (addr > 31 && addr < 31 + MAX_IOs) {
@@ -185,6 +225,7 @@ static inline void _call_register_irqs(avr_t * avr, uint16_t addr)
 	}
 }
 
+#if !AVR_CORE_TRACE
 void avr_core_watch_write(avr_t *avr, uint16_t addr, uint8_t v)
 {
 	if (addr > avr->ramend) {
@@ -217,6 +258,10 @@ void avr_core_watch_write(avr_t *avr, uint16_t addr, uint8_t v)
 	if (avr->gdb) {
 		avr_gdb_handle_watchpoints(avr, addr, AVR_GDB_WATCH_WRITE);
 	}
+	if (unlikely(avr->itrace))
+		avr_itrace_write(avr->itrace, addr, v);
+	if (avr->vcd && avr->vcd->window.write_count)
+		avr_vcd_handle_write(avr->vcd, addr);
 
 	avr->data[addr] = v;
 	_call_register_irqs(avr, addr);
@@ -241,6 +286,7 @@ uint8_t avr_core_watch_read(avr_t *avr, uint16_t addr)
 //	_call_register_irqs(avr, addr);
 	return avr->data[addr];
 }
+#endif
 
 /*
  * Set a register (r < 256)
@@ -250,6 +296,8 @@ uint8_t avr_core_watch_read(avr_t *avr, uint16_t addr)
 static inline void _avr_set_r(avr_t * avr, uint16_t r, uint8_t v)
 {
 	REG_TOUCH(avr, r);
+	if (unlikely(avr->itrace))
+		avr_itrace_write(avr->itrace, r, v);
 
 	if (r == R_SREG) {
 		avr->data[R_SREG] = v;
@@ -293,6 +341,7 @@ _avr_set_r16le_hl(
 	_avr_set_r(avr, r , v);
 }
 
+#if !AVR_CORE_TRACE
 /*
  * Stack pointer access
  */
@@ -305,6 +354,7 @@ inline void _avr_sp_set(avr_t * avr, uint16_t sp)
 {
 	_avr_set_r16le(avr, R_SPL, sp);
 }
+#endif
 
 /*
  * Set any address to a value; split between registers and SRAM
@@ -364,6 +414,7 @@ static inline uint8_t _avr_pop8(avr_t * avr)
 	return res;
 }
 
+#if !AVR_CORE_TRACE
 int _avr_push_addr(avr_t * avr, avr_flashaddr_t addr)
 {
 	uint16_t sp = _avr_sp_get(avr);
@@ -412,16 +463,19 @@ const char * avr_regname(avr_t * avr, unsigned int reg)
 	}
 	return avr->data_names[reg];
 }
+#endif
 
 /*
  * Called when an invalid opcode is decoded
  */
 static void _avr_invalid_opcode(avr_t * avr)
 {
-#if CONFIG_SIMAVR_TRACE
+	if (avr->coverage)
+		avr->coverage[avr->pc >> 1] |= AVR_COVERAGE_INVALID;
+#if AVR_CORE_TRACE
 	printf( FONT_RED "*** %04x: %-25s Invalid Opcode SP=%04x O=%04x \n" FONT_DEFAULT,
                 avr->pc,
-                avr->trace_data->codeline[avr->pc>>1],
+                avr_codeline(avr, avr->pc>>1) ? avr_codeline(avr, avr->pc>>1) : "",
                 _avr_sp_get(avr),
                 _avr_flash_read16le(avr, avr->pc));
 #else
@@ -430,7 +484,7 @@ static void _avr_invalid_opcode(avr_t * avr)
 #endif
 }
 
-#if CONFIG_SIMAVR_TRACE
+#if AVR_CORE_TRACE
 /*
  * Dump changed registers when tracing
  */
@@ -532,7 +586,7 @@ void avr_dump_state(avr_t * avr)
 /*
  * Add a "jump" address to the jump trace buffer
  */
-#if CONFIG_SIMAVR_TRACE
+#if AVR_CORE_TRACE
 #define TRACE_JUMP()\
 	avr->trace_data->old[avr->trace_data->old_pci].pc = avr->pc;\
 	avr->trace_data->old[avr->trace_data->old_pci].sp = _avr_sp_get(avr);\
@@ -550,7 +604,7 @@ void avr_dump_state(avr_t * avr)
 #define STACK_FRAME_PUSH()
 #define STACK_FRAME_POP()
 #endif
-#else /* CONFIG_SIMAVR_TRACE */
+#else /* AVR_CORE_TRACE */
 
 #define TRACE_JUMP()
 #define STACK_FRAME_PUSH()
@@ -689,10 +743,31 @@ static inline int _avr_is_instruction_32_bits(avr_t * avr, avr_flashaddr_t pc)
  * The number of cycles taken by instruction has been added, but might not be
  * entirely accurate.
  */
+/*
+ * Records which way a conditional branch or skip went, when coverage
+ * is on. Done once the decision is known, hence a separate macro.
+ */
+#define COVER_BRANCH(_taken) \
+	if (unlikely(avr->coverage)) \
+		avr->coverage[avr->pc >> 1] |= \
+			(_taken) ? AVR_COVERAGE_TAKEN : AVR_COVERAGE_NOT_TAKEN
+
+/* Calls and returns, for the profiler */
+#define PROFILE_CALL(_target) \
+	if (unlikely(avr->profile)) \
+		avr_profile_call(avr, _target)
+#define PROFILE_RET() \
+	if (unlikely(avr->profile)) \
+		avr_profile_ret(avr)
+
+#if AVR_CORE_TRACE
+avr_flashaddr_t avr_run_one_trace(avr_t * avr)
+#else
 avr_flashaddr_t avr_run_one(avr_t * avr)
+#endif
 {
 run_one_again:
-#if CONFIG_SIMAVR_TRACE
+#if AVR_CORE_TRACE
 	/*
 	 * this traces spurious reset or bad jumps
 	 */
@@ -716,6 +791,10 @@ run_one_again:
 		crash(avr);
 		return 0;
 	}
+	if (unlikely(avr->vcd && avr->vcd->window.pc_count))
+		avr_vcd_handle_pc(avr->vcd, avr->pc);
+	if (unlikely(avr->coverage))
+		avr->coverage[avr->pc >> 1] |= AVR_COVERAGE_EXEC;
 
 	uint32_t		opcode = _avr_flash_read16le(avr, avr->pc);
 	avr_flashaddr_t	new_pc = avr->pc + 2;	// future "default" pc
@@ -835,6 +914,7 @@ run_one_again:
 					get_vd5_vr5(opcode);
 					uint16_t res = vd == vr;
 					STATE("cpse %s[%02x], %s[%02x]\t; Will%s skip\n", AVR_REGNAME(d), avr->data[d], AVR_REGNAME(r), avr->data[r], res ? "":" not");
+					COVER_BRANCH(res);
 					if (res) {
 						if (_avr_is_instruction_32_bits(avr, new_pc)) {
 							new_pc += 4; cycle += 2;
@@ -1026,11 +1106,17 @@ run_one_again:
 				}	break;
 				case 0x95a8: { // WDR -- Watchdog Reset -- 1001 0101 1010 1000
 					STATE("wdr\n");
-					avr_ioctl(avr, AVR_IOCTL_WATCHDOG_RESET, 0);
+					if (avr->watchdog)
+						avr_watchdog_wdr(avr->watchdog);
+					else
+						avr_ioctl(avr, AVR_IOCTL_WATCHDOG_RESET, 0);
 				}	break;
 				case 0x95e8: { // SPM -- Store Program Memory -- 1001 0101 1110 1000
 					STATE("spm\n");
-					avr_ioctl(avr, AVR_IOCTL_FLASH_SPM, 0);
+					if (avr->selfprog)
+						avr_flash_spm(avr->selfprog);
+					else
+						avr_ioctl(avr, AVR_IOCTL_FLASH_SPM, 0);
 				}	break;
 				case 0x9409:   // IJMP -- Indirect jump -- 1001 0100 0000 1001
 				case 0x9419:   // EIJMP -- Indirect jump -- 1001 0100 0001 1001   bit 4 is "indirect"
@@ -1049,6 +1135,8 @@ run_one_again:
 					new_pc = z << 1;
 					cycle++;
 					TRACE_JUMP();
+					if (p)
+						PROFILE_CALL(new_pc);
 				}	break;
 				case 0x9518: 	// RETI -- Return from Interrupt -- 1001 0101 0001 1000
 					avr_sreg_set(avr, S_I, 1);
@@ -1060,13 +1148,13 @@ run_one_again:
 					STATE("ret%s\n", opcode & 0x10 ? "i" : "");
 					TRACE_JUMP();
 					STACK_FRAME_POP();
+					PROFILE_RET();
 				}	break;
 				case 0x95c8: {	// LPM -- Load Program Memory R0 <- (Z) -- 1001 0101 1100 1000
 					uint16_t z = avr->data[R_ZL] | (avr->data[R_ZH] << 8);
 					STATE("lpm %s, (Z[%04x]) \t%s\n",
 					      AVR_REGNAME(0), z, FAS(z));
-					uint8_t v = avr->flash[z];
-					avr_ioctl(avr, AVR_IOCTL_FLASH_LPM, &v);
+					uint8_t v = _avr_lpm(avr, z);
 					_avr_set_r(avr, 0, v);
 					cycle += 2; // 3 cycles
 				}	break;
@@ -1077,8 +1165,7 @@ run_one_again:
 					STATE("elpm %s, (Z[%02x:%04x] \t%s)\n",
 					      AVR_REGNAME(0), z >> 16,
 					      z & 0xffff, FAS(z));
-					uint8_t v = avr->flash[z];
-					avr_ioctl(avr, AVR_IOCTL_FLASH_LPM, &v);
+					uint8_t v = _avr_lpm(avr, z);
 					_avr_set_r(avr, 0, v);
 					cycle += 2; // 3 cycles
 				}	break;
@@ -1100,8 +1187,7 @@ run_one_again:
 							int op = opcode & 1;
 							STATE("lpm %s, (Z[%04x]%s)\t\t%s\n",
 							      AVR_REGNAME(d), z, op ? "+" : "", FAS(z));
-							uint8_t v = avr->flash[z];
-							avr_ioctl(avr, AVR_IOCTL_FLASH_LPM, &v);
+							uint8_t v = _avr_lpm(avr, z);
 							_avr_set_r(avr, d, v);
 							if (op) {
 								z++;
@@ -1118,8 +1204,7 @@ run_one_again:
 							int op = opcode & 1;
 							STATE("elpm %s, (Z[%02x:%04x]%s)\t\t%s\n",
 							      AVR_REGNAME(d), z >> 16, z & 0xffff, op ? "+" : "", FAS(z));
-							uint8_t v = avr->flash[z];
-							avr_ioctl(avr, AVR_IOCTL_FLASH_LPM, &v);
+							uint8_t v = _avr_lpm(avr, z);
 							_avr_set_r(avr, d, v);
 							if (op) {
 								z++;
@@ -1338,6 +1423,7 @@ run_one_again:
 							new_pc = a << 1;
 							TRACE_JUMP();
 							STACK_FRAME_PUSH();
+							PROFILE_CALL(new_pc);
 						}	break;
 
 						default: {
@@ -1375,6 +1461,7 @@ run_one_again:
 									get_io5_b3mask(opcode);
 									uint8_t res = _avr_get_ram(avr, io) & mask;
 									STATE("sbic %s[%04x], 0x%02x\t; Will%s branch\n", AVR_REGNAME(io), avr->data[io], mask, !res?"":" not");
+									COVER_BRANCH(!res);
 									if (!res) {
 										if (_avr_is_instruction_32_bits(avr, new_pc)) {
 											new_pc += 4; cycle += 2;
@@ -1394,6 +1481,7 @@ run_one_again:
 									get_io5_b3mask(opcode);
 									uint8_t res = _avr_get_ram(avr, io) & mask;
 									STATE("sbis %s[%04x], 0x%02x\t; Will%s branch\n", AVR_REGNAME(io), avr->data[io], mask, res?"":" not");
+									COVER_BRANCH(res);
 									if (res) {
 										if (_avr_is_instruction_32_bits(avr, new_pc)) {
 											new_pc += 4; cycle += 2;
@@ -1456,6 +1544,7 @@ run_one_again:
 			if (o != 0) {
 				TRACE_JUMP();
 				STACK_FRAME_PUSH();
+				PROFILE_CALL(new_pc);
 			}
 		}	break;
 
@@ -1491,6 +1580,7 @@ run_one_again:
 					} else {
 						STATE("%s%c .%d [%04x]\t; Will%s branch\n", set ? "brbs" : "brbc", _sreg_bit_name[s], o, new_pc + (o << 1), branch ? "":" not");
 					}
+					COVER_BRANCH(branch);
 					if (branch) {
 						cycle++; // 2 cycles if taken, 1 otherwise
 						new_pc = new_pc + (o << 1);
@@ -1516,6 +1606,7 @@ run_one_again:
 					int set = (opcode & 0x0200) != 0;
 					int branch = ((vd & mask) && set) || (!(vd & mask) && !set);
 					STATE("%s %s[%02x], 0x%02x\t; Will%s branch\n", set ? "sbrs" : "sbrc", AVR_REGNAME(d), vd, mask, branch ? "":" not");
+					COVER_BRANCH(branch);
 					if (branch) {
 						if (_avr_is_instruction_32_bits(avr, new_pc)) {
 							new_pc += 4; cycle += 2;
@@ -1531,9 +1622,14 @@ run_one_again:
 		default: _avr_invalid_opcode(avr);
 
 	}
+	if (unlikely(avr->itrace))
+		avr_itrace_step(avr->itrace, avr, opcode);
+	if (unlikely(avr->stack))
+		avr_stack_step(avr->stack, avr);
 	avr->cycle += cycle;
 
-	if ((avr->state == cpu_Running) &&
+	// the traced core returns after each instruction, for avr_dump_state()
+	if (!AVR_CORE_TRACE && (avr->state == cpu_Running) &&
 		(avr->run_cycle_count > cycle) &&
 		(avr->interrupt_state == 0))
 	{
@@ -40,6 +40,12 @@ extern "C" {
  * Instruction decoder, run ONE instruction
  */
 avr_flashaddr_t avr_run_one(avr_t * avr);
+/*
+ * Same decoder, built a second time with the instruction trace, register
+ * touching and jump history in. avr_run() picks it when avr->trace is set,
+ * so the plain one above has none of it.
+ */
+avr_flashaddr_t avr_run_one_trace(avr_t * avr);
 
 /*
  * These are for internal access to the stack (for interrupts)
@@ -47,17 +53,20 @@ avr_flashaddr_t avr_run_one(avr_t * avr);
 uint16_t _avr_sp_get(avr_t * avr);
 void _avr_sp_set(avr_t * avr, uint16_t sp);
 int _avr_push_addr(avr_t * avr, avr_flashaddr_t addr);
+avr_flashaddr_t _avr_pop_addr(avr_t * avr);
+
+/*
+ * Stops the core, with a dump of the last jumps when tracing
+ */
+void crash(avr_t * avr);
 
 /*
  * Get a "pretty" register name
  */
 const char * avr_regname(avr_t * avr, unsigned int reg);
 
-#if CONFIG_SIMAVR_TRACE
-
 /*
- * DEBUG bits follow
- * These will disappear when gdb arrives
+ * DEBUG bits follow, the traced core fills in what these print
  */
 void avr_dump_state(avr_t * avr);
 
@@ -89,13 +98,6 @@ void avr_dump_state(avr_t * avr);
 #define DUMP_STACK()
 #endif
 
-#else /* CONFIG_SIMAVR_TRACE */
-
-#define DUMP_STACK()
-#define DUMP_REG();
-
-#endif
-
 /**
  * Reconstructs the SREG value from avr->sreg into dst.
  */
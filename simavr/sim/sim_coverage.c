@@ -0,0 +1,438 @@
+/*
+	sim_coverage.c
+
+	Flash coverage map, executed words and branch directions, and its
+	export as lcov tracefiles.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "sim_coverage.h"
+#include "sim_elf.h"
+
+typedef struct avr_coverage_hdr_t {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	size;		// of the map that follows
+	char		mmcu[20];
+} avr_coverage_hdr_t;
+
+int
+avr_coverage_init(
+		avr_t * avr)
+{
+	if (!avr->coverage)
+		avr->coverage = malloc(AVR_COVERAGE_SIZE(avr));
+	if (!avr->coverage)
+		return -1;
+	memset(avr->coverage, 0, AVR_COVERAGE_SIZE(avr));
+	return 0;
+}
+
+void
+avr_coverage_free(
+		avr_t * avr)
+{
+	free(avr->coverage);
+	avr->coverage = NULL;
+}
+
+void
+avr_coverage_merge(
+		uint8_t * dst,
+		const uint8_t * src,
+		uint32_t size)
+{
+	while (size--)
+		*dst++ |= *src++;
+}
+
+static uint8_t *
+_cov_load(
+		avr_t * avr,
+		const char * filename)
+{
+	avr_coverage_hdr_t hdr;
+	uint8_t * map = NULL;
+	FILE * f = fopen(filename, "rb");
+
+	if (!f)
+		return NULL;
+	if (fread(&hdr, sizeof(hdr), 1, f) == 1 &&
+			hdr.magic == AVR_COVERAGE_MAGIC &&
+			hdr.version == AVR_COVERAGE_VERSION &&
+			hdr.size == AVR_COVERAGE_SIZE(avr)) {
+		map = malloc(hdr.size);
+		if (fread(map, 1, hdr.size, f) != hdr.size) {
+			free(map);
+			map = NULL;
+		}
+	}
+	fclose(f);
+	if (!map)
+		AVR_LOG(avr, LOG_WARNING, "COVERAGE: %s is not a coverage map "
+				"for this core\n", filename);
+	return map;
+}
+
+int
+avr_coverage_read(
+		avr_t * avr,
+		const char * filename)
+{
+	uint8_t * map;
+
+	if (!avr->coverage || !(map = _cov_load(avr, filename)))
+		return -1;
+	avr_coverage_merge(avr->coverage, map, AVR_COVERAGE_SIZE(avr));
+	free(map);
+	return 0;
+}
+
+int
+avr_coverage_write(
+		avr_t * avr,
+		const char * filename,
+		int merge)
+{
+	avr_coverage_hdr_t hdr = {
+		.magic = AVR_COVERAGE_MAGIC,
+		.version = AVR_COVERAGE_VERSION,
+		.size = AVR_COVERAGE_SIZE(avr),
+	};
+	uint8_t * map;
+	FILE * f;
+	int res = 0;
+
+	if (!avr->coverage)
+		return -1;
+	strncpy(hdr.mmcu, avr->mmcu ? avr->mmcu : "", sizeof(hdr.mmcu) - 1);
+	if (merge && (map = _cov_load(avr, filename))) {
+		avr_coverage_merge(map, avr->coverage, hdr.size);
+	} else {
+		map = malloc(hdr.size);
+		memcpy(map, avr->coverage, hdr.size);
+	}
+	if (!(f = fopen(filename, "wb"))) {
+		AVR_LOG(avr, LOG_ERROR, "COVERAGE: %s: %s\n",
+				filename, strerror(errno));
+		free(map);
+		return -1;
+	}
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+			fwrite(map, 1, hdr.size, f) != hdr.size)
+		res = -1;
+	if (fclose(f))
+		res = -1;
+	free(map);
+	return res;
+}
+
+/*
+ * lcov export. The DWARF line table rows are collected first, each row
+ * covers the code up to the next one. The flash words of each range are
+ * then walked for executed words and conditional branches, and the
+ * records sorted by file and line.
+ */
+typedef struct cov_row_t {
+	uint32_t	file, line, addr;
+} cov_row_t;
+
+enum {
+	COV_FN = 0, COV_BRANCH, COV_LINE,
+};
+
+typedef struct cov_rec_t {
+	uint32_t	file, kind, line, seq;
+	uint32_t	flags;	// AVR_COVERAGE_* of the word
+	const char * name;	// for COV_FN
+} cov_rec_t;
+
+typedef struct cov_ctx_t {
+	char **		file;
+	uint32_t	file_count;
+	cov_row_t *	row;
+	uint32_t	row_count, row_size;
+	cov_rec_t *	rec;
+	uint32_t	rec_count, rec_size;
+} cov_ctx_t;
+
+static void
+_cov_row(
+		void * param,
+		const char * file,
+		uint32_t line,
+		uint32_t addr)
+{
+	cov_ctx_t * c = param;
+	uint32_t fi = c->file_count;
+
+	// rows of a table mostly come from the same few files
+	while (fi && strcmp(c->file[fi - 1], file))
+		fi--;
+	if (!fi) {
+		c->file = realloc(c->file, (c->file_count + 1) * sizeof(c->file[0]));
+		c->file[c->file_count++] = strdup(file);
+		fi = c->file_count;
+	}
+	if (c->row_count == c->row_size) {
+		c->row_size = c->row_size ? c->row_size * 2 : 1024;
+		c->row = realloc(c->row, c->row_size * sizeof(c->row[0]));
+	}
+	c->row[c->row_count++] = (cov_row_t) {
+		.file = fi - 1, .line = line, .addr = addr };
+}
+
+static cov_rec_t *
+_cov_rec(
+		cov_ctx_t * c,
+		uint32_t file,
+		uint32_t kind,
+		uint32_t line)
+{
+	if (c->rec_count == c->rec_size) {
+		c->rec_size = c->rec_size ? c->rec_size * 2 : 1024;
+		c->rec = realloc(c->rec, c->rec_size * sizeof(c->rec[0]));
+	}
+	cov_rec_t * r = &c->rec[c->rec_count];
+	*r = (cov_rec_t) { .file = file, .kind = kind, .line = line,
+						.seq = c->rec_count };
+	c->rec_count++;
+	return r;
+}
+
+static int
+_cov_rec_cmp(
+		const void * a,
+		const void * b)
+{
+	const cov_rec_t * ra = a, * rb = b;
+
+	if (ra->file != rb->file)
+		return ra->file < rb->file ? -1 : 1;
+	if (ra->kind != rb->kind)
+		return ra->kind < rb->kind ? -1 : 1;
+	if (ra->line != rb->line)
+		return ra->line < rb->line ? -1 : 1;
+	return ra->seq < rb->seq ? -1 : ra->seq > rb->seq;
+}
+
+static int
+_cov_row_cmp(
+		const void * a,
+		const void * b)
+{
+	const cov_row_t * ra = a, * rb = b;
+
+	if (ra->addr != rb->addr)
+		return ra->addr < rb->addr ? -1 : 1;
+	return (ra->line == 0) - (rb->line == 0);	// ends of sequences last
+}
+
+/* CPSE, SBIC/SBIS, BRBC/BRBS and SBRC/SBRS */
+static int
+_cov_is_branch(
+		uint16_t o)
+{
+	return (o & 0xfc00) == 0x1000 ||
+			(o & 0xfd00) == 0x9900 ||
+			(o & 0xf800) == 0xf000 ||
+			(o & 0xfc08) == 0xfc00;
+}
+
+/* LDS/STS, JMP/CALL */
+static int
+_cov_is_32_bits(
+		uint16_t o)
+{
+	return (o & 0xfc0f) == 0x9000 || (o & 0xfe0c) == 0x940c;
+}
+
+static void
+_cov_range(
+		avr_t * avr,
+		cov_ctx_t * c,
+		const cov_row_t * row,
+		uint32_t end)
+{
+	uint32_t flags = 0;
+
+	for (uint32_t a = row->addr; a < end && a < avr->flashend; ) {
+		uint16_t o = avr->flash[a] | (avr->flash[a + 1] << 8);
+
+		flags |= avr->coverage[a >> 1];
+		if (_cov_is_branch(o))
+			_cov_rec(c, row->file, COV_BRANCH, row->line)->flags =
+					avr->coverage[a >> 1];
+		a += _cov_is_32_bits(o) ? 4 : 2;
+	}
+	_cov_rec(c, row->file, COV_LINE, row->line)->flags = flags;
+}
+
+/* Finds the line of 'addr', the row for it, or the closest one below */
+static const cov_row_t *
+_cov_row_find(
+		cov_ctx_t * c,
+		const cov_row_t * sorted,
+		uint32_t addr)
+{
+	int lo = 0, hi = c->row_count;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (sorted[mid].addr <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	while (lo > 0 && sorted[lo - 1].line == 0)
+		lo--;
+	return lo ? &sorted[lo - 1] : NULL;
+}
+
+static void
+_cov_emit(
+		cov_ctx_t * c,
+		FILE * o,
+		const char * test)
+{
+	for (uint32_t i = 0; i < c->rec_count; ) {
+		uint32_t file = c->rec[i].file;
+		int fnf = 0, fnh = 0, brf = 0, brh = 0, lf = 0, lh = 0;
+		int block = 0;
+		uint32_t last = 0;
+
+		fprintf(o, "TN:%s\nSF:%s\n", test ? test : "", c->file[file]);
+		for (; i < c->rec_count && c->rec[i].file == file; i++) {
+			cov_rec_t * r = &c->rec[i];
+			int hit = (r->flags & AVR_COVERAGE_EXEC) != 0;
+			switch (r->kind) {
+				case COV_FN:
+					fprintf(o, "FN:%u,%s\nFNDA:%d,%s\n",
+							r->line, r->name, hit, r->name);
+					fnf++;
+					fnh += hit;
+					break;
+				case COV_BRANCH:
+					block = r->line == last ? block + 1 : 0;
+					last = r->line;
+					if (!hit)
+						fprintf(o, "BRDA:%u,%d,0,-\nBRDA:%u,%d,1,-\n",
+								r->line, block, r->line, block);
+					else
+						fprintf(o, "BRDA:%u,%d,0,%d\nBRDA:%u,%d,1,%d\n",
+								r->line, block,
+								(r->flags & AVR_COVERAGE_TAKEN) != 0,
+								r->line, block,
+								(r->flags & AVR_COVERAGE_NOT_TAKEN) != 0);
+					brf += 2;
+					brh += ((r->flags & AVR_COVERAGE_TAKEN) != 0) +
+							((r->flags & AVR_COVERAGE_NOT_TAKEN) != 0);
+					break;
+				case COV_LINE: {
+					// the same line can have several ranges
+					uint32_t flags = r->flags;
+					while (i + 1 < c->rec_count && c->rec[i + 1].file == file &&
+							c->rec[i + 1].kind == COV_LINE &&
+							c->rec[i + 1].line == r->line)
+						flags |= c->rec[++i].flags;
+					hit = (flags & AVR_COVERAGE_EXEC) != 0;
+					fprintf(o, "DA:%u,%d\n", r->line, hit);
+					lf++;
+					lh += hit;
+				}	break;
+			}
+			// the totals go after each kind of records
+			int next = i + 1 < c->rec_count && c->rec[i + 1].file == file ?
+					c->rec[i + 1].kind : -1;
+			if (next != r->kind) {
+				if (r->kind == COV_FN)
+					fprintf(o, "FNF:%d\nFNH:%d\n", fnf, fnh);
+				else if (r->kind == COV_BRANCH)
+					fprintf(o, "BRF:%d\nBRH:%d\n", brf, brh);
+				else
+					fprintf(o, "LF:%d\nLH:%d\n", lf, lh);
+			}
+		}
+		fprintf(o, "end_of_record\n");
+	}
+}
+
+int
+avr_coverage_lcov(
+		avr_t * avr,
+		const char * elf,
+		const char * filename,
+		const char * test)
+{
+	cov_ctx_t c = { 0 };
+	int res = -1;
+
+	if (!avr->coverage)
+		return -1;
+	if (avr_dwarf_lines(elf, _cov_row, &c) || !c.row_count) {
+		AVR_LOG(avr, LOG_ERROR, "COVERAGE: %s: no DWARF line info\n", elf);
+		goto done;
+	}
+	for (uint32_t i = 0; i < c.row_count; i++) {
+		const cov_row_t * r = &c.row[i];
+		if (!r->line)
+			continue;
+		uint32_t end = r->addr + 2;
+		if (i + 1 < c.row_count && c.row[i + 1].addr >= r->addr)
+			end = c.row[i + 1].addr;
+		if (end > r->addr)
+			_cov_range(avr, &c, r, end);
+	}
+	// functions go to the line of their first instruction
+	cov_row_t * sorted = malloc(c.row_count * sizeof(sorted[0]));
+	memcpy(sorted, c.row, c.row_count * sizeof(sorted[0]));
+	qsort(sorted, c.row_count, sizeof(sorted[0]), _cov_row_cmp);
+	for (int i = 0; i < avr->symbolcount; i++) {
+		const avr_symbol_t * s = &avr->symbol[i];
+		if (!s->size || s->addr >= AVR_SEGMENT_OFFSET_DATA ||
+				s->addr >= avr->flashend)
+			continue;
+		const cov_row_t * r = _cov_row_find(&c, sorted, s->addr);
+		if (!r || r->addr >= s->addr + s->size)
+			continue;
+		cov_rec_t * fn = _cov_rec(&c, r->file, COV_FN, r->line);
+		fn->name = s->symbol;
+		fn->flags = avr->coverage[s->addr >> 1];
+	}
+	free(sorted);
+	qsort(c.rec, c.rec_count, sizeof(c.rec[0]), _cov_rec_cmp);
+
+	FILE * o = fopen(filename, "w");
+	if (!o) {
+		AVR_LOG(avr, LOG_ERROR, "COVERAGE: %s: %s\n", filename, strerror(errno));
+		goto done;
+	}
+	_cov_emit(&c, o, test);
+	res = fclose(o) ? -1 : 0;
+done:
+	for (uint32_t i = 0; i < c.file_count; i++)
+		free(c.file[i]);
+	free(c.file);
+	free(c.row);
+	free(c.rec);
+	return res;
+}
@@ -0,0 +1,92 @@
+/*
+	sim_coverage.h
+
+	Flash coverage map, executed words and branch directions, and its
+	export as lcov tracefiles.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_COVERAGE_H__
+#define __SIM_COVERAGE_H__
+
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define AVR_COVERAGE_MAGIC		0x56434153	// 'SACV'
+#define AVR_COVERAGE_VERSION	1
+
+/* Size of avr->coverage, one byte per flash word */
+#define AVR_COVERAGE_SIZE(_avr)	(((_avr)->flashend + 1) >> 1)
+
+/*
+ * Allocates and clears avr->coverage, the core starts filling it.
+ */
+int
+avr_coverage_init(
+		avr_t * avr);
+void
+avr_coverage_free(
+		avr_t * avr);
+
+/*
+ * The flags are only ever ORed in, so maps from several runs (or of
+ * several avr_t in different threads) merge by ORing them together.
+ */
+void
+avr_coverage_merge(
+		uint8_t * dst,
+		const uint8_t * src,
+		uint32_t size);
+
+/*
+ * Saves the map to 'filename'. When 'merge' is set, and the file
+ * already has a map of the same size, it is merged in first, so a test
+ * suite can accumulate into a single file.
+ */
+int
+avr_coverage_write(
+		avr_t * avr,
+		const char * filename,
+		int merge);
+/*
+ * Merges a map written by avr_coverage_write() into avr->coverage.
+ */
+int
+avr_coverage_read(
+		avr_t * avr,
+		const char * filename);
+
+/*
+ * Writes an lcov tracefile for avr->coverage, using the DWARF line tables
+ * and the symbols of 'elf', the firmware file. 'test' is the TN: name,
+ * or NULL.
+ */
+int
+avr_coverage_lcov(
+		avr_t * avr,
+		const char * elf,
+		const char * filename,
+		const char * test);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_COVERAGE_H__ */
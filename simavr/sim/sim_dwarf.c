@@ -35,6 +35,7 @@
 #include <libdwarf/libdwarf.h>
 
 #include "sim_avr.h"
+#include "sim_elf.h"
 
 //#define VERBOSE
 #define CHECK(fn) \
@@ -64,7 +65,6 @@ static void error(char *fn, Dwarf_Error err)
     fprintf(stderr, "%s() failed: %s\n", fn, dwarf_errmsg(err));
 }
 
-#if CONFIG_SIMAVR_TRACE
 static void set_flash_name(avr_t *avr, Dwarf_Addr symv, const char *name)
 {
     const char **ep;
@@ -76,7 +76,6 @@ static void set_flash_name(avr_t *avr, Dwarf_Addr symv, const char *name)
     if (!*ep)
         *ep = strdup(name);
 }
-#endif
 
 static void process(struct ctx *ctxp, Dwarf_Die die)
 {
@@ -140,26 +139,19 @@ static void process(struct ctx *ctxp, Dwarf_Die die)
                     /* Is it an I/O register or RAM? */
 
                     if (symv > 32 &&
-#if CONFIG_SIMAVR_TRACE
                     symv < avr->trace_data->data_names_size &&
-#else
-                    symv <= avr->ioend &&
-#endif
                         !avr->data_names[symv]) {
                         avr->data_names[symv] = strdup(name);
                     }
                 }
-#if CONFIG_SIMAVR_TRACE
                 else {
                     /* Data address in flash. */
 
                     set_flash_name(avr, symv, name);
                 }
-#endif
             }
         }
         dwarf_loc_head_c_dealloc(head);
-#if CONFIG_SIMAVR_TRACE
     } else if (tag == DW_TAG_subprogram) {
         rv = dwarf_lowpc(die, &addr, &err);
         if (rv == DW_DLV_NO_ENTRY) {
@@ -188,7 +180,6 @@ static void process(struct ctx *ctxp, Dwarf_Die die)
         }
         printf("%s: %#llx - %#llx\n", name, addr, addr2);
 #endif  // VERBOSE
-#endif
     }
  clean:
     dwarf_dealloc(ctxp->db, name, DW_DLA_STRING);
@@ -219,7 +210,6 @@ static void traverse_tree(struct ctx *ctxp, Dwarf_Die start)
     dwarf_dealloc(db, start, DW_DLA_DIE);
 }
 
-#if CONFIG_SIMAVR_TRACE
 static void get_lines(struct ctx *ctxp, Dwarf_Die die)
 {
     Dwarf_Unsigned      version;
@@ -256,7 +246,6 @@ static void get_lines(struct ctx *ctxp, Dwarf_Die die)
     printf("\n");
 #endif
 }
-#endif
 
 int avr_read_dwarf(avr_t *avr, const char *filename)
 {
@@ -303,7 +292,6 @@ int avr_read_dwarf(avr_t *avr, const char *filename)
         rv = dwarf_siblingof_b(ctx.db, NULL, 1, &die, &err);
         CHECK("dwarf_siblingof_b");
 
-#if CONFIG_SIMAVR_TRACE
         const char *last_symbol = NULL;
         int         i, prev_line;
 
@@ -341,9 +329,6 @@ int avr_read_dwarf(avr_t *avr, const char *filename)
         }
         dwarf_dealloc(ctx.db, ctx.cu_name, DW_DLA_STRING);
         dwarf_srclines_dealloc_b(ctx.lc);
-#else
-        traverse_tree(&ctx, die);
-#endif
     }
     dwarf_finish(ctx.db, &err);
     if (rv == DW_DLV_ERROR)
@@ -352,7 +337,82 @@ int avr_read_dwarf(avr_t *avr, const char *filename)
     return 0;
 }
 
+/* Walk all the line tables, for coverage reports. */
+
+int avr_dwarf_lines(const char *filename, avr_dwarf_line_p cb, void *param)
+{
+    struct ctx      ctx, *ctxp;
+    Dwarf_Die       die;
+    Dwarf_Unsigned  next = 0;
+    Dwarf_Half      type;
+    Dwarf_Error     err;
+    int             rv, fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror(filename);
+        return -1;
+    }
+
+    ctx.avr = NULL;
+    rv = dwarf_init_b(fd, DW_DLC_READ, 0, NULL, NULL, &ctx.db, &err);
+    if (rv != DW_DLV_OK) {
+        error("dwarf_init_b", err);
+        close(fd);
+        return -1;
+    }
+
+    if (sigsetjmp(ctx.err_jmp, 0)) {
+        dwarf_finish(ctx.db, &err);
+        close(fd);
+        return -1;
+    }
+    ctxp = &ctx;                // For CHECK macro
+
+    for(;;) {
+        rv = dwarf_next_cu_header_d(ctx.db, 1, NULL, NULL, NULL, NULL, NULL,
+                                    NULL, NULL, NULL, &next, &type, &err);
+        if (rv != DW_DLV_OK)
+            break;
+        rv = dwarf_siblingof_b(ctx.db, NULL, 1, &die, &err);
+        CHECK("dwarf_siblingof_b");
+
+        ctx.line_count = 0;
+        get_lines(&ctx, die);
+        for (int i = 0; i < ctx.line_count; ++i) {
+            Dwarf_Unsigned    lineno;
+            Dwarf_Addr        addr;
+            Dwarf_Bool        end;
+            char             *src;
+
+            rv = dwarf_lineno(ctx.lines[i], &lineno, &err);
+            CHECK("dwarf_lineno");
+            rv = dwarf_lineaddr(ctx.lines[i], &addr, &err);
+            CHECK("dwarf_lineaddr");
+            rv = dwarf_lineendsequence(ctx.lines[i], &end, &err);
+            CHECK("dwarf_lineendsequence");
+            rv = dwarf_linesrc(ctx.lines[i], &src, &err);
+            CHECK("dwarf_linesrc");
+            cb(param, src, end ? 0 : lineno, addr);
+            dwarf_dealloc(ctx.db, src, DW_DLA_STRING);
+        }
+        if (ctx.line_count) {
+            dwarf_dealloc(ctx.db, ctx.cu_name, DW_DLA_STRING);
+            dwarf_srclines_dealloc_b(ctx.lc);
+        }
+        dwarf_dealloc(ctx.db, die, DW_DLA_DIE);
+    }
+    dwarf_finish(ctx.db, &err);
+    close(fd);
+    return 0;
+}
+
 # else // No libdwarf
 #include "sim_avr.h"
+#include "sim_elf.h"
 int avr_read_dwarf(avr_t *avr, const char *filename) { return 0; }
+int avr_dwarf_lines(const char *filename, avr_dwarf_line_p cb, void *param)
+{
+    return -1;
+}
 #endif
@@ -29,10 +29,10 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
 
 #ifdef HAVE_LIBELF
-#include <libelf.h>
-#include <gelf.h>
+#include <elf.h>		// only for the Elf32_* types, parsing is done here
 #else
 #undef ELF_SYMBOLS
 #define ELF_SYMBOLS 0
@@ -47,7 +47,6 @@
 #define O_BINARY 0
 #endif
 
-#if CONFIG_SIMAVR_TRACE && ELF_SYMBOLS
 // Put a symbol name in a table, preferring names without leadling '_'.
 
 static void
@@ -61,9 +60,6 @@ elf_set_preferred(const char **sp, const char *new)
 		prev = *sp;
 		if (prev[0] && (prev[0] != '_' || (new[0] == '_' && prev[1] != '_')))
 			return;
-
-		// Most of array already leaks - FIXME
-		//free((void *)*sp);
 	}
 	*sp = new;
 }
@@ -82,41 +78,59 @@ avr_spread_lines(const char **table, int count)
 			last = table[i];
 	}
 }
-#endif
 
-void
-avr_load_firmware(
+const avr_symbol_t *
+avr_symbol_find(
 		avr_t * avr,
-		elf_firmware_t * firmware)
+		uint32_t addr)
 {
-	if (firmware->frequency)
-		avr->frequency = firmware->frequency;
-	if (firmware->vcc)
-		avr->vcc = firmware->vcc;
-	if (firmware->avcc)
-		avr->avcc = firmware->avcc;
-	if (firmware->aref)
-		avr->aref = firmware->aref;
-#if ELF_SYMBOLS
-#if CONFIG_SIMAVR_TRACE
-	/* Store the symbols read from the ELF file. */
+	int lo = 0, hi = avr->symbolcount;
+
+	// find the first symbol past 'addr', we want the one before it
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (avr->symbol[mid].addr <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (!lo)
+		return NULL;
+	const avr_symbol_t * s = &avr->symbol[lo - 1];
+	if (s->size && addr >= s->addr + s->size)
+		return NULL;
+	return s;
+}
 
-	int           scount = firmware->flashsize >> 1;
-	uint32_t      addr;
+void
+avr_symbol_load_lines(
+		avr_t * avr)
+{
+	int           scount = (avr->flashend + 1) >> 1;
+	uint32_t      addr, highest_data = 0;
 	const char ** table;
 
+	if (avr->trace_data->codeline)
+		return;
 	// Allocate table of Flash address strings.
 
-        table = calloc(scount, sizeof (char *));
+	table = calloc(scount, sizeof (char *));
 	avr->trace_data->codeline = table;
 	avr->trace_data->codeline_size = scount;
 
+	for (int i = 0; i < avr->symbolcount; i++) {
+		addr = avr->symbol[i].addr;
+		if (addr >= AVR_SEGMENT_OFFSET_DATA &&
+				addr < AVR_SEGMENT_OFFSET_EEPROM &&
+				addr + avr->symbol[i].size - AVR_SEGMENT_OFFSET_DATA > highest_data)
+			highest_data = addr + avr->symbol[i].size - AVR_SEGMENT_OFFSET_DATA;
+	}
 	// Re-allocate table of data address strings.
 
-	if (firmware->highest_data_symbol >= avr->trace_data->data_names_size) {
+	if (highest_data >= avr->trace_data->data_names_size) {
 		uint32_t new_size;
 
-		new_size = firmware->highest_data_symbol + 1;
+		new_size = highest_data + 1;
 		avr->data_names = realloc(avr->data_names, new_size * sizeof (char *));
 		memset(avr->data_names + avr->trace_data->data_names_size,
 		       0,
@@ -125,12 +139,12 @@ avr_load_firmware(
 		avr->trace_data->data_names_size = new_size;
 	}
 
-	for (int i = 0; i < firmware->symbolcount; i++) {
+	for (int i = 0; i < avr->symbolcount; i++) {
 		const char **sp, *new;
 
-		new = firmware->symbol[i]->symbol;
-		addr = firmware->symbol[i]->addr;
-		if (addr < firmware->flashsize) {
+		new = avr->symbol[i].symbol;
+		addr = avr->symbol[i].addr;
+		if (addr < (avr->flashend + 1)) {
 			// A code address.
 
 			sp = &table[addr >> 1];
@@ -145,25 +159,40 @@ avr_load_firmware(
 			elf_set_preferred(sp, new);
 		}
 	}
-
 	// Parse given ELF file for DWARF info.
 
-	if (firmware->dwarf_file)
-		avr_read_dwarf(avr, firmware->dwarf_file);
-	free(firmware->dwarf_file);
-
+	if (avr->dwarf_file)
+		avr_read_dwarf(avr, avr->dwarf_file);
+	free(avr->dwarf_file);
+	avr->dwarf_file = NULL;
 	// Fill out the flash and data space name tables with duplicates.
 
 	avr_spread_lines(table, scount);
 	avr_spread_lines(avr->data_names + avr->ioend + 1,
 			 avr->trace_data->data_names_size - (avr->ioend + 1));
-#else
-	// Parse given ELF file for DWARF info.
+}
 
-	if (firmware->dwarf_file)
-		avr_read_dwarf(avr, firmware->dwarf_file);
-	free(firmware->dwarf_file);
-#endif
+void
+avr_load_firmware(
+		avr_t * avr,
+		elf_firmware_t * firmware)
+{
+	if (firmware->frequency)
+		avr->frequency = firmware->frequency;
+	if (firmware->vcc)
+		avr->vcc = firmware->vcc;
+	if (firmware->avcc)
+		avr->avcc = firmware->avcc;
+	if (firmware->aref)
+		avr->aref = firmware->aref;
+#if ELF_SYMBOLS
+	/* The symbol index is shared, the name tables and the DWARF
+	 * line info are only built once tracing asks for them */
+	avr->symbol = firmware->symbol;
+	avr->symbolcount = firmware->symbolcount;
+	free(avr->dwarf_file);
+	avr->dwarf_file = firmware->dwarf_file;
+	firmware->dwarf_file = NULL;
 #endif // ELF_SYMBOLS
 
 	avr_loadcode(avr, firmware->flash,
@@ -367,43 +396,141 @@ elf_parse_mmcu_section(
 }
 
 static int
-elf_copy_segment(int fd, Elf32_Phdr *php, uint8_t **dest)
+elf_copy_segment(
+		elf_firmware_t * firmware,
+		const Elf32_Phdr *php,
+		uint8_t *dest)
 {
-	int rv;
-
-	if (*dest == NULL)
-		*dest = malloc(php->p_filesz);
-	if (!*dest)
-		return -1;
-
-	lseek(fd, php->p_offset, SEEK_SET);
-	rv = read(fd, *dest, php->p_filesz);
-	if (rv != php->p_filesz) {
+	if (php->p_offset + php->p_filesz > firmware->image_size) {
 		AVR_LOG(NULL, LOG_ERROR,
-				"Got %d when reading %d bytes for %x at offset %d "
-				"from ELF file\n",
-				rv, php->p_filesz, php->p_vaddr, php->p_offset);
+				"Truncated ELF file, %d bytes for %x at offset %d\n",
+				php->p_filesz, php->p_vaddr, php->p_offset);
 		return -1;
 	}
+	memcpy(dest, firmware->image + php->p_offset, php->p_filesz);
 	AVR_LOG(NULL, LOG_DEBUG, "Loaded %d bytes at %x\n",
 			php->p_filesz, php->p_vaddr);
 	return 0;
 }
 
+/* Segments other than the flash are not modified, use them in place */
 static int
-elf_handle_segment(int fd, Elf32_Phdr *php, uint8_t **dest, const char *name)
+elf_handle_segment(
+		elf_firmware_t * firmware,
+		const Elf32_Phdr *php,
+		uint8_t **dest,
+		const char *name)
 {
 	if (*dest) {
 		AVR_LOG(NULL, LOG_ERROR,
 				"Unexpected extra %s data: %d bytes at %x.\n",
 				name, php->p_filesz, php->p_vaddr);
 		return -1;
-	} else {
-		elf_copy_segment(fd, php, dest);
-		return 0;
 	}
+	if (php->p_offset + php->p_filesz > firmware->image_size) {
+		AVR_LOG(NULL, LOG_ERROR,
+				"Truncated ELF file, %s data at offset %d\n",
+				name, php->p_offset);
+		return -1;
+	}
+	*dest = (uint8_t *)firmware->image + php->p_offset;
+	return 0;
+}
+
+#if ELF_SYMBOLS
+/*
+ * Order by address; for aliases, the preferred name (the one with the
+ * fewest leading '_') sorts last, as that's the one avr_symbol_find()
+ * returns.
+ */
+static int
+elf_symbol_compare(
+		const void * a,
+		const void * b)
+{
+	const avr_symbol_t * sa = a, * sb = b;
+
+	if (sa->addr != sb->addr)
+		return sa->addr < sb->addr ? -1 : 1;
+	int ua = strspn(sa->symbol, "_"), ub = strspn(sb->symbol, "_");
+	if (ua != ub)
+		return ua > ub ? -1 : 1;
+	return strcmp(sa->symbol, sb->symbol);
 }
 
+static void
+elf_read_symbols(
+		elf_firmware_t * firmware,
+		const Elf32_Shdr * shdr,
+		const Elf32_Shdr * strtab)
+{
+	const Elf32_Sym * sym = (const Elf32_Sym *)(firmware->image + shdr->sh_offset);
+	const char * strings = (const char *)firmware->image + strtab->sh_offset;
+	uint32_t highest_data = 0;
+
+	if (shdr->sh_entsize != sizeof(Elf32_Sym) ||
+			shdr->sh_offset + shdr->sh_size > firmware->image_size ||
+			strtab->sh_offset + strtab->sh_size > firmware->image_size)
+		return;
+	// how many symbols are there? this number comes from the size of
+	// the section divided by the entry size
+	int symbol_count = shdr->sh_size / shdr->sh_entsize;
+
+	free(firmware->symbol);
+	firmware->symbolcount = 0;
+	firmware->symbol = malloc(symbol_count * sizeof(firmware->symbol[0]));
+	if (!firmware->symbol) {
+		AVR_LOG(NULL, LOG_WARNING, "No memory for %d ELF symbols\n",
+				symbol_count);
+		return;
+	}
+
+	for (int i = 0; i < symbol_count; i++, sym++) {
+		if (ELF32_ST_BIND(sym->st_info) != STB_GLOBAL &&
+				ELF32_ST_TYPE(sym->st_info) != STT_FUNC &&
+				ELF32_ST_TYPE(sym->st_info) != STT_OBJECT)
+			continue;
+		if (sym->st_name >= strtab->sh_size)
+			continue;
+		const char * name = strings + sym->st_name;
+#if VERBOSE
+		printf("Symbol %s bind %d type %d value %x size %d\n",
+				name, ELF32_ST_BIND(sym->st_info),
+				ELF32_ST_TYPE(sym->st_info),
+				sym->st_value, sym->st_size);
+#endif
+		// Some names are lengths of data areas
+		// that are not obviously distinguished
+		// from labels like __vectors.
+
+		if (ELF32_ST_TYPE(sym->st_info) == STT_NOTYPE &&
+				sym->st_size == 0) {
+			int n = strlen(name);
+			if (n > 9 && !strcmp(&name[n - 9], "_LENGTH__"))
+				continue;
+		}
+		// Look for the highest RAM sysmbol.
+
+		if (sym->st_value > AVR_SEGMENT_OFFSET_DATA + highest_data &&
+				sym->st_value < AVR_SEGMENT_OFFSET_EEPROM)
+			highest_data = sym->st_value + sym->st_size -
+					AVR_SEGMENT_OFFSET_DATA;
+
+		// if its a bootloader, this symbol will be the entry point we need
+		if (!strcmp(name, "__vectors"))
+			firmware->flashbase = sym->st_value;
+
+		avr_symbol_t * s = &firmware->symbol[firmware->symbolcount++];
+		s->symbol = name;
+		s->addr = sym->st_value;
+		s->size = sym->st_size;
+	}
+	qsort(firmware->symbol, firmware->symbolcount,
+			sizeof(firmware->symbol[0]), elf_symbol_compare);
+	firmware->highest_data_symbol = highest_data;
+}
+#endif // ELF_SYMBOLS
+
 /* The structure *firmware must be pre-initialised to zero, then optionally
  * tracing and VCD information may be added.
  */
@@ -413,51 +540,54 @@ elf_read_firmware(
 	const char * file,
 	elf_firmware_t * firmware)
 {
-	Elf32_Ehdr  elf_header;			/* ELF header */
-	Elf        *elf = NULL;         /* Our Elf pointer for libelf */
-	Elf32_Phdr *php;				/* Program header. */
-	Elf_Scn    *scn = NULL;         /* Section Descriptor */
-	size_t      ph_count;           /* Program Header entry count. */
-	int         fd, i;              /* File Descriptor */
+	const Elf32_Ehdr *eh;			/* ELF header */
+	const Elf32_Phdr *php;			/* Program header. */
+	const Elf32_Shdr *sh;			/* Section headers */
+	struct stat	st;
+	void *		map;
+	int			fd, i;
 
 	if ((fd = open(file, O_RDONLY | O_BINARY)) == -1 ||
-			(read(fd, &elf_header, sizeof(elf_header))) < sizeof(elf_header)) {
+			fstat(fd, &st) || st.st_size < sizeof(Elf32_Ehdr)) {
 		AVR_LOG(NULL, LOG_ERROR, "could not read %s\n", file);
 		perror(file);
-		close(fd);
+		if (fd != -1)
+			close(fd);
+		return -1;
+	}
+	/* The file is mapped, not read; nothing is copied unless it has to be */
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror(file);
 		return -1;
 	}
+	firmware->image = map;
+	firmware->image_size = st.st_size;
+	eh = map;
 
 #if ELF_SYMBOLS
 	firmware->symbolcount = 0;
 	firmware->symbol = NULL;
 #endif
 
-	/* this is actually mandatory !! otherwise elf_begin() fails */
-	if (elf_version(EV_CURRENT) == EV_NONE) {
-		/* library out of date - recover from error */
-		return -1;
-	}
-	// Iterate through section headers again this time well stop when we find symbols
-	elf = elf_begin(fd, ELF_C_READ, NULL);
-	//printf("Loading elf %s : %p\n", file, elf);
-
-	if (!elf)
-		return -1;
-	if (elf_kind(elf) != ELF_K_ELF) {
+	if (memcmp(eh->e_ident, ELFMAG, SELFMAG) ||
+			eh->e_ident[EI_CLASS] != ELFCLASS32 ||
+			eh->e_ident[EI_DATA] != ELFDATA2LSB) {
 		AVR_LOG(NULL, LOG_ERROR, "Unexpected ELF file type\n");
-		return -1;
+		goto error;
 	}
 
 	/* Scan the Program Header Table. */
 
-	if (elf_getphdrnum(elf, &ph_count) != 0 || ph_count == 0 ||
-		(php = elf32_getphdr(elf)) == NULL) {
+	if (eh->e_phnum == 0 || eh->e_phentsize != sizeof(Elf32_Phdr) ||
+			eh->e_phoff + eh->e_phnum * sizeof(Elf32_Phdr) > st.st_size) {
 		AVR_LOG(NULL, LOG_ERROR, "No ELF Program Headers\n");
-		return -1;
+		goto error;
 	}
+	php = (const Elf32_Phdr *)(firmware->image + eh->e_phoff);
 
-	for (i = 0; i < (int)ph_count; ++i, ++php) {
+	for (i = 0; i < (int)eh->e_phnum; ++i, ++php) {
 #if 0
 		printf("Header %d type %d addr %x/%x size %d/%d flags %x\n",
 			   i, php->p_type, php->p_vaddr, php->p_paddr,
@@ -468,8 +598,16 @@ elf_read_firmware(
 		if (php->p_vaddr < 0x800000) {
 			/* Explicit flash section. Load it. */
 
-			if (elf_handle_segment(fd, php, &firmware->flash, "Flash"))
+			if (firmware->flash) {
+				AVR_LOG(NULL, LOG_ERROR,
+						"Unexpected extra Flash data: %d bytes at %x.\n",
+						php->p_filesz, php->p_vaddr);
 				continue;
+			}
+			firmware->flash = malloc(php->p_filesz);
+			if (!firmware->flash ||
+					elf_copy_segment(firmware, php, firmware->flash))
+				goto error;
 			firmware->flashsize = php->p_filesz;
 			firmware->flashbase = php->p_vaddr;
 		} else if (php->p_vaddr < 0x810000) {
@@ -479,14 +617,14 @@ elf_read_firmware(
 			 */
 
 			if (firmware->flash) {
-				uint8_t *where;
-
-				firmware->flash = realloc(firmware->flash,
+				uint8_t * flash = realloc(firmware->flash,
 										  firmware->flashsize + php->p_filesz);
-				if (!firmware->flash)
-					return -1;
-				where = firmware->flash + firmware->flashsize;
-				elf_copy_segment(fd, php, &where);
+				if (flash)
+					firmware->flash = flash;
+				if (!flash ||
+						elf_copy_segment(firmware, php,
+								firmware->flash + firmware->flashsize))
+					goto error;
 				firmware->flashsize += php->p_filesz;
 			} else {
 				/* If this ever happens, add a second pass. */
@@ -494,25 +632,25 @@ elf_read_firmware(
 				AVR_LOG(NULL, LOG_ERROR,
 						"Initialialised data but no flash (%d bytes at %x)!\n",
 						php->p_filesz, php->p_vaddr);
-				return -1;
+				goto error;
 			}
 		} else if (php->p_vaddr < 0x820000) {
 			/* EEPROM. */
 
-			if (elf_handle_segment(fd, php, &firmware->eeprom, "EEPROM"))
+			if (elf_handle_segment(firmware, php, &firmware->eeprom, "EEPROM"))
 				continue;
 			firmware->eesize = php->p_filesz;
 			firmware->eeprombase = php->p_vaddr - 0x820000;
 		} else if (php->p_vaddr < 0x830000) {
 			/* Fuses. */
 
-			if (elf_handle_segment(fd, php, &firmware->fuse, "Fuses"))
+			if (elf_handle_segment(firmware, php, &firmware->fuse, "Fuses"))
 				continue;
 			firmware->fusesize = php->p_filesz;
 		} else if (php->p_vaddr < 0x840000) {
 			/* Lock bits. */
 
-			elf_handle_segment(fd, php, &firmware->lockbits, "Lock bits");
+			elf_handle_segment(firmware, php, &firmware->lockbits, "Lock bits");
 		}
 	}
 
@@ -521,117 +659,50 @@ elf_read_firmware(
 	if (!firmware->dwarf_file)
 		firmware->dwarf_file = strdup(file);	// Parse later.
 
-	while ((scn = elf_nextscn(elf, scn)) != NULL) {
-		GElf_Shdr shdr;                 /* Section Header */
-		gelf_getshdr(scn, &shdr);
-		char * name = elf_strptr(elf, elf_header.e_shstrndx, shdr.sh_name);
+	if (eh->e_shnum == 0 || eh->e_shentsize != sizeof(Elf32_Shdr) ||
+			eh->e_shoff + eh->e_shnum * sizeof(Elf32_Shdr) > st.st_size ||
+			eh->e_shstrndx >= eh->e_shnum)
+		return 0;	// stripped, nothing more to find
+	sh = (const Elf32_Shdr *)(firmware->image + eh->e_shoff);
+
+	const Elf32_Shdr * shstr = &sh[eh->e_shstrndx];
+	for (i = 0; i < eh->e_shnum; i++) {
+		const Elf32_Shdr * shdr = &sh[i];
+		if (shdr->sh_name >= shstr->sh_size ||
+				shstr->sh_offset + shstr->sh_size > st.st_size)
+			continue;
+		const char * name = (const char *)firmware->image +
+				shstr->sh_offset + shdr->sh_name;
 		//	printf("Walking elf section '%s'\n", name);
 
-		if (!strcmp(name, ".mmcu")) {
-			Elf_Data *s = elf_getdata(scn, NULL);
-
-			elf_parse_mmcu_section(firmware, s->d_buf, s->d_size);
-			if (shdr.sh_addr < 0x860000)
+		if (!strcmp(name, ".mmcu") &&
+				shdr->sh_offset + shdr->sh_size <= st.st_size) {
+			elf_parse_mmcu_section(firmware,
+					(uint8_t *)firmware->image + shdr->sh_offset,
+					shdr->sh_size);
+			if (shdr->sh_addr < 0x860000)
 				AVR_LOG(NULL, LOG_WARNING,
 						"Warning: ELF .mmcu section at %x may be loaded.\n",
-						shdr.sh_addr);
-		//	printf("%s: size %ld\n", __FUNCTION__, s->d_size);
-		//	avr->frequency = f_cpu;
+						shdr->sh_addr);
 		}
 
 #if ELF_SYMBOLS
-		// When we find a section header marked SHT_SYMTAB stop and get symbols
-		if (shdr.sh_type == SHT_SYMTAB) {
-			uint32_t highest_data = 0;
-
-			// edata points to our symbol table
-			Elf_Data *edata = elf_getdata(scn, NULL);
-
-			// how many symbols are there? this number comes from the size of
-			// the section divided by the entry size
-			int symbol_count = shdr.sh_size / shdr.sh_entsize;
-
-			// loop through to grab all symbols
-			for (int i = 0; i < symbol_count; i++) {
-				GElf_Sym sym;			/* Symbol */
-				// libelf grabs the symbol data using gelf_getsym()
-				gelf_getsym(edata, i, &sym);
-
-				// print out the value and size
-				if (ELF32_ST_BIND(sym.st_info) == STB_GLOBAL ||
-                                    ELF32_ST_TYPE(sym.st_info) == STT_FUNC ||
-                                    ELF32_ST_TYPE(sym.st_info) == STT_OBJECT) {
-					const char * name = elf_strptr(elf, shdr.sh_link, sym.st_name);
-#if VERBOSE
-					printf("Symbol %s bind %d type %d value %lx size %ld visibility %d\n",
-					       name, ELF32_ST_BIND(sym.st_info),
-					       ELF32_ST_TYPE(sym.st_info),
-                                               sym.st_value, sym.st_size,
-                                               GELF_ST_VISIBILITY(sym.st_other));
-#endif
-					// Some names are lengths of data areas
-					// that are not obviously distinguished
-					// from labels like __vectors.
-
-					if (ELF32_ST_TYPE(sym.st_info) == STT_NOTYPE &&
-					    sym.st_size == 0) {
-						int n;
-
-						n = strlen(name);
-						if (n > 9 &&
-						    !strcmp(&name[n - 9],
-							    "_LENGTH__")) {
-							//printf(" Ignored\n");
-							continue;
-						}
-					}
-
-					// Look for the highest RAM sysmbol.
-
-					if (sym.st_value >
-					    AVR_SEGMENT_OFFSET_DATA +
-					        highest_data &&
-					    sym.st_value <
-					        AVR_SEGMENT_OFFSET_EEPROM) {
-						highest_data =
-                                                    sym.st_value + sym.st_size -
-						    AVR_SEGMENT_OFFSET_DATA;
-					}
-
-					// if its a bootloader, this symbol will be the entry point we need
-					if (!strcmp(name, "__vectors"))
-						firmware->flashbase = sym.st_value;
-					avr_symbol_t * s = malloc(sizeof(avr_symbol_t) + strlen(name) + 1);
-					strcpy((char*)s->symbol, name);
-					s->addr = sym.st_value;
-					s->size = sym.st_size;
-					if (!(firmware->symbolcount % 8))
-						firmware->symbol = realloc(
-							firmware->symbol,
-							(firmware->symbolcount + 8) * sizeof(firmware->symbol[0]));
-
-					// insert new element, keep the array sorted
-					int insert = -1;
-					for (int si = 0; si < firmware->symbolcount && insert == -1; si++)
-						if (firmware->symbol[si]->addr >= s->addr)
-							insert = si;
-					if (insert == -1)
-						insert = firmware->symbolcount;
-					else
-						memmove(firmware->symbol + insert + 1,
-								firmware->symbol + insert,
-								(firmware->symbolcount - insert) * sizeof(firmware->symbol[0]));
-					firmware->symbol[insert] = s;
-					firmware->symbolcount++;
-				}
-			}
-			firmware->highest_data_symbol = highest_data;
-		}
+		// When we find a section header marked SHT_SYMTAB get symbols
+		if (shdr->sh_type == SHT_SYMTAB && shdr->sh_link < eh->e_shnum)
+			elf_read_symbols(firmware, shdr, &sh[shdr->sh_link]);
 #endif // ELF_SYMBOLS
 	}
-	elf_end(elf);
-	close(fd);
 	return 0;
+error:
+	free(firmware->flash);
+	firmware->flash = NULL;
+	firmware->flashsize = 0;
+	// these pointed in the mapping
+	firmware->eeprom = firmware->fuse = firmware->lockbits = NULL;
+	munmap(map, st.st_size);
+	firmware->image = NULL;
+	firmware->image_size = 0;
+	return -1;
 }
 #else //  HAVE_LIBELF not defined.
 int
@@ -641,3 +712,38 @@ elf_read_firmware(const char * file, elf_firmware_t * firmware)
 	return -1;
 }
 #endif
+
+/* Only what was allocated is freed, the rest points in the image */
+static void
+elf_firmware_free_block(
+		elf_firmware_t * firmware,
+		uint8_t * block)
+{
+	if (block && !(block >= firmware->image &&
+			block < firmware->image + firmware->image_size))
+		free(block);
+}
+
+void
+elf_firmware_free(
+		elf_firmware_t * firmware)
+{
+	elf_firmware_free_block(firmware, firmware->flash);
+	elf_firmware_free_block(firmware, firmware->eeprom);
+	elf_firmware_free_block(firmware, firmware->fuse);
+	elf_firmware_free_block(firmware, firmware->lockbits);
+	firmware->flash = firmware->eeprom = NULL;
+	firmware->fuse = firmware->lockbits = NULL;
+	firmware->flashsize = firmware->eesize = firmware->fusesize = 0;
+#if ELF_SYMBOLS
+	free(firmware->symbol);
+	firmware->symbol = NULL;
+	firmware->symbolcount = 0;
+	free(firmware->dwarf_file);
+	firmware->dwarf_file = NULL;
+#endif
+	if (firmware->image)
+		munmap((void *)firmware->image, firmware->image_size);
+	firmware->image = NULL;
+	firmware->image_size = 0;
+}
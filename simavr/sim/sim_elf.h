@@ -22,6 +22,7 @@
 #ifndef __SIM_ELF_H__
 #define __SIM_ELF_H__
 
+#include <stddef.h>
 #include "avr/avr_mcu_section.h"
 
 #ifdef __cplusplus
@@ -79,11 +80,15 @@ typedef struct elf_firmware_t {
 	uint8_t *	lockbits;
 
 #if ELF_SYMBOLS
-	avr_symbol_t **  symbol;
+	avr_symbol_t *	symbol;		// one block, sorted by address
 	uint32_t	symbolcount;
 	uint32_t	highest_data_symbol;
 	char *		dwarf_file;	// Must be dynamically allocated.
 #endif
+	// the .elf file stays mapped read only, symbol names and the
+	// eeprom/fuse/lockbits segments point into it
+	const uint8_t *	image;
+	size_t		image_size;
 } elf_firmware_t ;
 
 /* The structure *firmware must be pre-initialised to zero, then optionally
@@ -95,15 +100,55 @@ elf_read_firmware(
 	const char * file,
 	elf_firmware_t * firmware);
 
+/*
+ * Releases what elf_read_firmware(), sim_setup_firmware() or the firmware
+ * cache allocated or mapped in *firmware. The core shares its symbols,
+ * call it after avr_terminate().
+ */
+void
+elf_firmware_free(
+	elf_firmware_t * firmware);
+
 void
 avr_load_firmware(
 	avr_t * avr,
 	elf_firmware_t * firmware);
 
+/*
+ * Returns the symbol at, or the closest one below 'addr', NULL if there
+ * is none, or if 'addr' is past the end of that symbol's size.
+ * Data addresses use the linker AVR_SEGMENT_OFFSET_DATA convention.
+ */
+const avr_symbol_t *
+avr_symbol_find(
+	avr_t * avr,
+	uint32_t addr);
+
+/*
+ * Builds the trace name tables, parsing the DWARF line info if any.
+ * This is costly, so it's only done the first time tracing needs it.
+ */
+void
+avr_symbol_load_lines(
+	avr_t * avr);
+
 // DWARF, not ELF, but a separate header for this would be silly.
 
 int avr_read_dwarf(avr_t *avr, const char *filename);
 
+/*
+ * Calls 'cb' for every row of the DWARF line tables of 'filename', in
+ * table order; 'line' is 0 for the end of a sequence. Returns -1 if
+ * there is no line info, or no libdwarf.
+ */
+typedef void (*avr_dwarf_line_p)(
+	void * param,
+	const char * file,
+	uint32_t line,
+	uint32_t addr);
+
+int avr_dwarf_lines(const char *filename, avr_dwarf_line_p cb, void *param);
+
 #ifdef __cplusplus
 };
 #endif
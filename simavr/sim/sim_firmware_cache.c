@@ -0,0 +1,309 @@
+/*
+	sim_firmware_cache.c
+
+	Binary cache of prepared firmwares, so the .hex/.elf files don't have
+	to be parsed again on every run.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "sim_firmware_cache.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define FNV_OFFSET	0xcbf29ce484222325ULL
+#define FNV_PRIME	0x100000001b3ULL
+
+static uint64_t
+fw_cache_hash(
+		uint64_t h,
+		const uint8_t * p,
+		size_t len)
+{
+	while (len--)
+		h = (h ^ *p++) * FNV_PRIME;
+	return h;
+}
+
+static uint64_t
+fw_cache_hash_str(
+		uint64_t h,
+		const char * str,
+		size_t size)
+{
+	// the terminator too, so "ab" "c" and "a" "bc" differ
+	h = fw_cache_hash(h, (const uint8_t *)str, strnlen(str, size));
+	return fw_cache_hash(h, (const uint8_t *)"", 1);
+}
+
+#define fw_cache_hash_val(_h, _v) \
+	fw_cache_hash((_h), (const uint8_t *)&(_v), sizeof(_v))
+
+/*
+ * What the caller may have set before loading, field by field; the
+ * padding and the pointers of the struct would make the same firmware
+ * hash differently.
+ */
+static uint64_t
+fw_cache_hash_setup(
+		uint64_t h,
+		const elf_firmware_t * fw)
+{
+	h = fw_cache_hash_str(h, fw->mmcu, sizeof(fw->mmcu));
+	h = fw_cache_hash_val(h, fw->frequency);
+	h = fw_cache_hash_val(h, fw->vcc);
+	h = fw_cache_hash_val(h, fw->avcc);
+	h = fw_cache_hash_val(h, fw->aref);
+	h = fw_cache_hash_str(h, fw->tracename, sizeof(fw->tracename));
+	h = fw_cache_hash_val(h, fw->traceperiod);
+	h = fw_cache_hash_val(h, fw->tracecount);
+	for (int i = 0; i < fw->tracecount && i < ARRAY_SIZE(fw->trace); i++) {
+		h = fw_cache_hash_val(h, fw->trace[i].kind);
+		h = fw_cache_hash_val(h, fw->trace[i].mask);
+		h = fw_cache_hash_val(h, fw->trace[i].addr);
+		h = fw_cache_hash_str(h, fw->trace[i].name, sizeof(fw->trace[i].name));
+	}
+	for (int i = 0; i < ARRAY_SIZE(fw->external_state); i++) {
+		h = fw_cache_hash_val(h, fw->external_state[i].port);
+		h = fw_cache_hash_val(h, fw->external_state[i].mask);
+		h = fw_cache_hash_val(h, fw->external_state[i].value);
+	}
+	h = fw_cache_hash_val(h, fw->command_register_addr);
+	h = fw_cache_hash_val(h, fw->console_register_addr);
+	return h;
+}
+
+static void
+fw_cache_path(
+		char * dst,
+		size_t size,
+		const char * cachedir,
+		uint64_t key)
+{
+	snprintf(dst, size, "%s/%016llx.fwc", cachedir, (unsigned long long)key);
+}
+
+int
+sim_firmware_cache_load(
+		const char * cachedir,
+		const char * file,
+		uint32_t loadbase,
+		elf_firmware_t * firmware,
+		uint64_t * key)
+{
+	struct stat st;
+	void * map;
+	int fd;
+
+	*key = 0;
+	// only a firmware coming from that one file can be cached
+	if (firmware->flash || firmware->eeprom ||
+			firmware->fuse || firmware->lockbits)
+		return -1;
+
+	if ((fd = open(file, O_RDONLY | O_BINARY)) == -1)
+		return -1;
+	if (fstat(fd, &st) || st.st_size == 0) {
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+	uint64_t h = fw_cache_hash(FNV_OFFSET, map, st.st_size);
+	munmap(map, st.st_size);
+	h = fw_cache_hash(h, (uint8_t*)&loadbase, sizeof(loadbase));
+	h = fw_cache_hash_setup(h, firmware);
+	*key = h;
+
+	char path[1024];
+	fw_cache_path(path, sizeof(path), cachedir, h);
+	if ((fd = open(path, O_RDONLY | O_BINARY)) == -1)
+		return -1;
+	if (fstat(fd, &st) || st.st_size < sizeof(sim_firmware_cache_hdr_t)) {
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+
+	const sim_firmware_cache_hdr_t * hdr = map;
+	const uint8_t * base = map;
+	// everything is checked against the file size, a truncated or
+	// mismatched cache file makes for a normal load instead
+	uint64_t size = st.st_size;
+	if (hdr->magic != SIM_FIRMWARE_CACHE_MAGIC ||
+			hdr->version != SIM_FIRMWARE_CACHE_VERSION ||
+			hdr->fw_size != sizeof(elf_firmware_t) ||
+			hdr->size != size || hdr->key != h ||
+			(uint64_t)hdr->flash + hdr->fw.flashsize > size ||
+			(uint64_t)hdr->eeprom + hdr->fw.eesize > size ||
+			(uint64_t)hdr->fuse + hdr->fw.fusesize > size ||
+			(hdr->lockbits && (uint64_t)hdr->lockbits + 1 > size) ||
+			(uint64_t)hdr->strings + hdr->strings_size > size ||
+			(hdr->strings_size && base[hdr->strings + hdr->strings_size - 1]) ||
+			(hdr->symbol && (uint64_t)hdr->symbol +
+				(uint64_t)hdr->fw.symbolcount * 3 * sizeof(uint32_t) > size)) {
+		AVR_LOG(NULL, LOG_WARNING,
+				"Ignoring stale firmware cache %s\n", path);
+		munmap(map, st.st_size);
+		return -1;
+	}
+	*firmware = hdr->fw;
+	firmware->image = base;
+	firmware->image_size = st.st_size;
+	// the images are used in place, only the symbols need fixing up
+	firmware->flash = hdr->flash ? (uint8_t*)base + hdr->flash : NULL;
+	firmware->eeprom = hdr->eeprom ? (uint8_t*)base + hdr->eeprom : NULL;
+	firmware->fuse = hdr->fuse ? (uint8_t*)base + hdr->fuse : NULL;
+	firmware->lockbits = hdr->lockbits ? (uint8_t*)base + hdr->lockbits : NULL;
+#if ELF_SYMBOLS
+	firmware->symbol = NULL;
+	firmware->dwarf_file = hdr->dwarf ? strdup(file) : NULL;
+	if (hdr->symbol && firmware->symbolcount) {
+		const uint32_t * s = (const uint32_t *)(base + hdr->symbol);
+		firmware->symbol = malloc(firmware->symbolcount *
+									sizeof(firmware->symbol[0]));
+		if (!firmware->symbol) {
+			elf_firmware_free(firmware);
+			return -1;
+		}
+		for (int i = 0; i < firmware->symbolcount; i++, s += 3) {
+			firmware->symbol[i].addr = s[0];
+			firmware->symbol[i].size = s[1];
+			firmware->symbol[i].symbol = s[2] < hdr->strings_size ?
+					(const char *)base + hdr->strings + s[2] : "";
+		}
+	} else
+		firmware->symbolcount = 0;
+#endif
+	AVR_LOG(NULL, LOG_TRACE, "Loaded %s from firmware cache %s\n",
+			file, path);
+	return 0;
+}
+
+/* Appends 'len' bytes to the buffer, 8 byte aligned, returns the offset */
+static uint32_t
+fw_cache_append(
+		uint8_t ** buf,
+		uint32_t * size,
+		const void * src,
+		uint32_t len)
+{
+	uint32_t o = (*size + 7) & ~7;
+
+	*buf = realloc(*buf, o + len);
+	memset(*buf + *size, 0, o - *size);
+	if (src)
+		memcpy(*buf + o, src, len);
+	*size = o + len;
+	return o;
+}
+
+int
+sim_firmware_cache_save(
+		const char * cachedir,
+		uint64_t key,
+		const elf_firmware_t * firmware)
+{
+	sim_firmware_cache_hdr_t hdr = {
+		.magic = SIM_FIRMWARE_CACHE_MAGIC,
+		.version = SIM_FIRMWARE_CACHE_VERSION,
+		.fw_size = sizeof(elf_firmware_t),
+		.key = key,
+	};
+	uint8_t * buf = NULL;
+	uint32_t size = 0;
+
+	fw_cache_append(&buf, &size, NULL, sizeof(hdr));
+	if (firmware->flash && firmware->flashsize)
+		hdr.flash = fw_cache_append(&buf, &size,
+						firmware->flash, firmware->flashsize);
+	if (firmware->eeprom && firmware->eesize)
+		hdr.eeprom = fw_cache_append(&buf, &size,
+						firmware->eeprom, firmware->eesize);
+	if (firmware->fuse && firmware->fusesize)
+		hdr.fuse = fw_cache_append(&buf, &size,
+						firmware->fuse, firmware->fusesize);
+	if (firmware->lockbits)
+		hdr.lockbits = fw_cache_append(&buf, &size, firmware->lockbits, 1);
+#if ELF_SYMBOLS
+	if (firmware->symbolcount) {
+		uint32_t strings = 0;
+		for (int i = 0; i < firmware->symbolcount; i++)
+			strings += strlen(firmware->symbol[i].symbol) + 1;
+		hdr.symbol = fw_cache_append(&buf, &size, NULL,
+						firmware->symbolcount * 3 * sizeof(uint32_t));
+		hdr.strings = fw_cache_append(&buf, &size, NULL, strings);
+		hdr.strings_size = strings;
+		uint32_t * s = (uint32_t *)(buf + hdr.symbol);
+		char * str = (char *)buf + hdr.strings, * d = str;
+		for (int i = 0; i < firmware->symbolcount; i++, s += 3) {
+			s[0] = firmware->symbol[i].addr;
+			s[1] = firmware->symbol[i].size;
+			s[2] = d - str;
+			strcpy(d, firmware->symbol[i].symbol);
+			d += strlen(d) + 1;
+		}
+	}
+	hdr.dwarf = firmware->dwarf_file != NULL;
+#endif
+	hdr.size = size;
+	hdr.fw = *firmware;
+	// none of the pointers make sense in the file
+	hdr.fw.flash = hdr.fw.eeprom = hdr.fw.fuse = hdr.fw.lockbits = NULL;
+	hdr.fw.image = NULL;
+	hdr.fw.image_size = 0;
+#if ELF_SYMBOLS
+	hdr.fw.symbol = NULL;
+	hdr.fw.dwarf_file = NULL;
+#endif
+	memcpy(buf, &hdr, sizeof(hdr));
+
+	char path[1024], tmp[1040];
+	int fd, res = -1;
+	fw_cache_path(path, sizeof(path), cachedir, key);
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644)) == -1) {
+		AVR_LOG(NULL, LOG_WARNING, "%s: %s\n", tmp, strerror(errno));
+		free(buf);
+		return -1;
+	}
+	if (write(fd, buf, size) == size)
+		res = 0;
+	close(fd);
+	free(buf);
+	if (res || rename(tmp, path)) {
+		unlink(tmp);
+		return -1;
+	}
+	AVR_LOG(NULL, LOG_TRACE, "Saved firmware cache %s\n", path);
+	return 0;
+}
@@ -0,0 +1,91 @@
+/*
+	sim_firmware_cache.h
+
+	Binary cache of prepared firmwares, so the .hex/.elf files don't have
+	to be parsed again on every run.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_FIRMWARE_CACHE_H__
+#define __SIM_FIRMWARE_CACHE_H__
+
+#include "sim_elf.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * sim_setup_firmware() uses the cache when this environment variable
+ * points to a (writable) directory.
+ */
+#define SIM_FIRMWARE_CACHE_ENV		"SIMAVR_FIRMWARE_CACHE"
+
+#define SIM_FIRMWARE_CACHE_MAGIC	0x57464153	// 'SAFW'
+#define SIM_FIRMWARE_CACHE_VERSION	1
+
+/*
+ * On disk, this header is followed by the flash, eeprom, fuse, lock bits,
+ * symbol and string blobs; 'fw' has its pointers cleared, they are
+ * rebuilt from the offsets (0 when absent) when the file is mapped.
+ */
+typedef struct sim_firmware_cache_hdr_t {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	fw_size;	// sizeof(elf_firmware_t), catches layout changes
+	uint32_t	size;		// whole file
+	uint64_t	key;
+	uint32_t	flash, eeprom, fuse, lockbits;
+	uint32_t	symbol;		// array of { addr, size, name offset }
+	uint32_t	strings, strings_size;
+	uint32_t	dwarf;		// source file had DWARF info
+	elf_firmware_t	fw;
+} sim_firmware_cache_hdr_t;
+
+/*
+ * Looks for a prepared copy of 'file' in 'cachedir'. The key is a hash
+ * of the file content, 'loadbase' and of the fields of *firmware the
+ * caller may have set: mmcu, frequency, vcc/avcc/aref, the trace file,
+ * period and entries, the external pin states and the command and
+ * console registers. It is returned in *key for sim_firmware_cache_save().
+ * Returns 0 if *firmware was filled from the cache, -1 otherwise.
+ * The cache file stays mapped, read only, and is shared between
+ * processes, until elf_firmware_free().
+ */
+int
+sim_firmware_cache_load(
+		const char * cachedir,
+		const char * file,
+		uint32_t loadbase,
+		elf_firmware_t * firmware,
+		uint64_t * key);
+
+/*
+ * Stores the prepared *firmware as 'key'. The file is written under a
+ * temporary name and renamed, so concurrent runs can share a cache.
+ */
+int
+sim_firmware_cache_save(
+		const char * cachedir,
+		uint64_t key,
+		const elf_firmware_t * firmware);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_FIRMWARE_CACHE_H__ */
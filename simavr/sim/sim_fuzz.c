@@ -0,0 +1,357 @@
+/*
+	sim_fuzz.c
+
+	Persistent mode fuzzing support: the firmware is booted once, and
+	each input runs from a snapshot of that booted state.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim_fuzz.h"
+#include "sim_elf.h"
+#include "sim_cmds.h"
+#include "avr_uart.h"
+#include "avr_twi.h"
+#include "avr/avr_mcu_section.h"
+
+static const char * _finding_names[] = {
+	[AVR_FUZZ_OK] = "ok",
+	[AVR_FUZZ_CRASH] = "crash",
+	[AVR_FUZZ_INVALID_OPCODE] = "invalid opcode",
+	[AVR_FUZZ_STACK_OVERFLOW] = "stack overflow",
+	[AVR_FUZZ_STACK_UNDERFLOW] = "stack underflow",
+};
+
+/* the simulated time doesn't need to match the wall clock at all */
+static void
+_fuzz_sleep(
+		avr_t * avr,
+		avr_cycle_count_t howLong)
+{
+}
+
+static int
+_fuzz_cmd_marker(
+		avr_t * avr,
+		uint8_t v,
+		void * param)
+{
+	avr_fuzz_t * f = *(avr_fuzz_t **)param;
+
+	f->marker = 1;
+	return 0;
+}
+
+static const avr_symbol_t *
+_fuzz_symbol(
+		avr_t * avr,
+		const char * name)
+{
+	for (int i = 0; i < avr->symbolcount; i++)
+		if (!strcmp(avr->symbol[i].symbol, name))
+			return &avr->symbol[i];
+	return NULL;
+}
+
+/* Marks the input as used up once everything fed has been read */
+static void
+_fuzz_check_consumed(
+		avr_fuzz_t * f)
+{
+	if (f->consumed || f->uart.pos < f->uart.len || f->twi.pos < f->twi.len)
+		return;
+	f->consumed = f->avr->cycle;
+}
+
+static void
+_fuzz_uart_feed(
+		avr_fuzz_t * f)
+{
+	while (!f->uart.xoff && f->uart.pos < f->uart.len)
+		avr_raise_irq(f->uart.irq, f->uart.data[f->uart.pos++]);
+}
+
+static void
+_fuzz_uart_xon(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	avr_fuzz_t * f = (avr_fuzz_t *)param;
+
+	f->uart.xoff = 0;
+	// the fifo is empty, if there is nothing left to send, it's all read
+	if (f->uart.pos == f->uart.len)
+		_fuzz_check_consumed(f);
+	else
+		_fuzz_uart_feed(f);
+}
+
+static void
+_fuzz_uart_xoff(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	avr_fuzz_t * f = (avr_fuzz_t *)param;
+
+	f->uart.xoff = value;
+}
+
+/*
+ * Fake TWI slave; the firmware is the master, what it reads comes from
+ * the input. It's answered synchronously, like the parts do.
+ */
+static void
+_fuzz_twi_output(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	avr_fuzz_t * f = (avr_fuzz_t *)param;
+	avr_twi_msg_irq_t v;
+
+	v.u.v = value;
+	if (v.u.twi.msg & TWI_COND_STOP)
+		f->twi.selected = 0;
+	if (v.u.twi.msg & TWI_COND_START) {
+		f->twi.selected = (v.u.twi.addr >> 1) == f->twi.addr;
+		if (f->twi.selected)
+			avr_raise_irq(f->twi.irq + TWI_IRQ_INPUT,
+					avr_twi_irq_msg(TWI_COND_ACK, f->twi.addr, 1));
+	}
+	if (!f->twi.selected)
+		return;
+	if (v.u.twi.msg & TWI_COND_WRITE)
+		avr_raise_irq(f->twi.irq + TWI_IRQ_INPUT,
+				avr_twi_irq_msg(TWI_COND_ACK, f->twi.addr, 1));
+	if (v.u.twi.msg & TWI_COND_READ) {
+		uint8_t b = 0xff;	// bus idles high once the input ran out
+		if (f->twi.pos < f->twi.len)
+			b = f->twi.data[f->twi.pos++];
+		avr_raise_irq(f->twi.irq + TWI_IRQ_INPUT,
+				avr_twi_irq_msg(TWI_COND_READ, f->twi.addr, b));
+		_fuzz_check_consumed(f);
+	}
+}
+
+int
+avr_fuzz_init(
+		avr_fuzz_t * f,
+		avr_t * avr)
+{
+	memset(f, 0, sizeof(*f));
+	f->avr = avr;
+	f->budget = avr->frequency;	// one second of simulated time
+	f->coverage_size = (avr->flashend + 1) >> 1;
+	f->coverage = calloc(1, f->coverage_size);
+	avr->coverage = f->coverage;
+
+	avr->sleep = _fuzz_sleep;
+	avr->gdb_port = 0;
+	// the command table owns (and frees) its parameters
+	avr_fuzz_t ** cmd = malloc(sizeof(*cmd));
+	*cmd = f;
+	avr_cmd_register(avr, SIMAVR_CMD_FUZZ_MARKER, _fuzz_cmd_marker, cmd);
+
+	const avr_symbol_t * s = _fuzz_symbol(avr, "__heap_start");
+	if (!s)
+		s = _fuzz_symbol(avr, "_end");
+	if (s && s->addr >= AVR_SEGMENT_OFFSET_DATA &&
+			s->addr < AVR_SEGMENT_OFFSET_EEPROM)
+		f->stack_limit = s->addr - AVR_SEGMENT_OFFSET_DATA;
+	return 0;
+}
+
+int
+avr_fuzz_uart(
+		avr_fuzz_t * f,
+		char name)
+{
+	avr_irq_t * irq = avr_io_getirq(f->avr, AVR_IOCTL_UART_GETIRQ(name), 0);
+
+	if (!irq) {
+		AVR_LOG(f->avr, LOG_ERROR, "FUZZ: no UART%c\n", name);
+		return -1;
+	}
+	f->uart.irq = irq + UART_IRQ_INPUT;
+	avr_irq_register_notify(irq + UART_IRQ_OUT_XON, _fuzz_uart_xon, f);
+	avr_irq_register_notify(irq + UART_IRQ_OUT_XOFF, _fuzz_uart_xoff, f);
+	return 0;
+}
+
+int
+avr_fuzz_twi(
+		avr_fuzz_t * f,
+		char name,
+		uint8_t addr)
+{
+	avr_irq_t * irq = avr_io_getirq(f->avr, AVR_IOCTL_TWI_GETIRQ(name), 0);
+
+	if (!irq) {
+		AVR_LOG(f->avr, LOG_ERROR, "FUZZ: no TWI%c\n", name);
+		return -1;
+	}
+	f->twi.irq = irq;
+	f->twi.addr = addr;
+	avr_irq_register_notify(irq + TWI_IRQ_OUTPUT, _fuzz_twi_output, f);
+	return 0;
+}
+
+int
+avr_fuzz_boot(
+		avr_fuzz_t * f,
+		const char * marker,
+		avr_cycle_count_t max_cycles)
+{
+	avr_t * avr = f->avr;
+	uint32_t pc = ~0;
+
+	if (marker) {
+		const avr_symbol_t * s = _fuzz_symbol(avr, marker);
+		char * e;
+		if (s)
+			pc = s->addr;
+		else {
+			pc = strtoul(marker, &e, 0);
+			if (*e || e == marker) {
+				AVR_LOG(avr, LOG_ERROR, "FUZZ: no symbol '%s'\n", marker);
+				return -1;
+			}
+		}
+	}
+	f->marker = 0;
+	avr_cycle_count_t end = avr->cycle + max_cycles;
+	while (!f->marker && avr->pc != pc) {
+		int state = avr_run(avr);
+		if (state == cpu_Done || state == cpu_Crashed || avr->cycle >= end) {
+			AVR_LOG(avr, LOG_ERROR,
+					"FUZZ: firmware didn't reach its marker (%s)\n",
+					state == cpu_Crashed ? "crashed" : "stopped");
+			return -1;
+		}
+	}
+	if (f->snap)
+		avr_snapshot_free(f->snap);
+	f->snap = avr_snapshot_take(avr);
+	AVR_LOG(avr, LOG_TRACE, "FUZZ: booted at pc %04x, cycle %llu\n",
+			avr->pc, (unsigned long long)avr->cycle);
+	return f->snap ? 0 : -1;
+}
+
+int
+avr_fuzz_run(
+		avr_fuzz_t * f,
+		const uint8_t * data,
+		size_t size)
+{
+	avr_t * avr = f->avr;
+	int res = AVR_FUZZ_OK;
+
+	if (!f->snap || avr_snapshot_restore(avr, f->snap))
+		return AVR_FUZZ_CRASH;
+	memset(f->coverage, 0, f->coverage_size);
+
+	f->uart.data = f->twi.data = data;
+	f->uart.len = f->twi.len = 0;
+	f->uart.pos = f->twi.pos = 0;
+	f->uart.xoff = 0;
+	f->twi.selected = 0;
+	f->consumed = 0;
+	if (f->uart.irq && f->twi.irq && size) {
+		size_t split = (size - 1) * data[0] / 255;
+		f->uart.data = data + 1;
+		f->uart.len = split;
+		f->twi.data = data + 1 + split;
+		f->twi.len = size - 1 - split;
+	} else if (f->uart.irq)
+		f->uart.len = size;
+	else if (f->twi.irq)
+		f->twi.len = size;
+	_fuzz_uart_feed(f);
+	if (!f->uart.irq)
+		_fuzz_check_consumed(f);
+
+	avr_cycle_count_t end = avr->cycle + f->budget;
+	f->sp_min = avr->data[R_SPL] | (avr->data[R_SPH] << 8);
+	while (avr->cycle < end) {
+		int state = avr_run(avr);
+		if (state == cpu_Done)
+			break;
+		if (state == cpu_Crashed) {
+			res = AVR_FUZZ_CRASH;
+			break;
+		}
+		uint16_t sp = avr->data[R_SPL] | (avr->data[R_SPH] << 8);
+		if (sp < f->sp_min)
+			f->sp_min = sp;
+		if (sp < f->stack_limit) {
+			res = AVR_FUZZ_STACK_OVERFLOW;
+			break;
+		}
+		if (sp > avr->ramend) {
+			res = AVR_FUZZ_STACK_UNDERFLOW;
+			break;
+		}
+		if (f->tail && f->consumed && avr->cycle >= f->consumed + f->tail)
+			break;
+	}
+	if (res == AVR_FUZZ_OK) {
+		// coverage_size is a multiple of 8, flash sizes are
+		const uint64_t * c = (const uint64_t *)f->coverage;
+		uint64_t invalid = 0;
+		for (uint32_t i = 0; i < f->coverage_size / 8; i++)
+			invalid |= c[i];
+		if (invalid & (AVR_COVERAGE_INVALID * 0x0101010101010101ULL))
+			res = AVR_FUZZ_INVALID_OPCODE;
+	}
+	return res;
+}
+
+const char *
+avr_fuzz_finding_name(
+		int finding)
+{
+	if (finding < 0 || finding >= ARRAY_SIZE(_finding_names))
+		return "unknown";
+	return _finding_names[finding];
+}
+
+void
+avr_fuzz_free(
+		avr_fuzz_t * f)
+{
+	avr_t * avr = f->avr;
+
+	if (f->uart.irq) {
+		avr_irq_t * irq = f->uart.irq - UART_IRQ_INPUT;
+		avr_irq_unregister_notify(irq + UART_IRQ_OUT_XON, _fuzz_uart_xon, f);
+		avr_irq_unregister_notify(irq + UART_IRQ_OUT_XOFF, _fuzz_uart_xoff, f);
+	}
+	if (f->twi.irq)
+		avr_irq_unregister_notify(f->twi.irq + TWI_IRQ_OUTPUT,
+				_fuzz_twi_output, f);
+	avr_cmd_unregister(avr, SIMAVR_CMD_FUZZ_MARKER);
+	if (avr->coverage == f->coverage)
+		avr->coverage = NULL;
+	free(f->coverage);
+	if (f->snap)
+		avr_snapshot_free(f->snap);
+	memset(f, 0, sizeof(*f));
+}
@@ -0,0 +1,135 @@
+/*
+	sim_fuzz.h
+
+	Persistent mode fuzzing support: the firmware is booted once, and
+	each input runs from a snapshot of that booted state.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_FUZZ_H__
+#define __SIM_FUZZ_H__
+
+#include "sim_avr.h"
+#include "sim_snapshot.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Results of avr_fuzz_run(), anything but AVR_FUZZ_OK is a finding */
+enum {
+	AVR_FUZZ_OK = 0,
+	AVR_FUZZ_CRASH,				// core crashed, cpu_Crashed
+	AVR_FUZZ_INVALID_OPCODE,
+	AVR_FUZZ_STACK_OVERFLOW,	// SP went below the end of .bss/heap start
+	AVR_FUZZ_STACK_UNDERFLOW,	// SP went past ramend
+};
+
+typedef struct avr_fuzz_t {
+	avr_t *				avr;
+	avr_snapshot_t *	snap;		// booted state, restored for each input
+	avr_cycle_count_t	budget;		// maximum cycles per input
+	// keep running that many cycles once the input has been consumed,
+	// 0 always runs the whole budget
+	avr_cycle_count_t	tail;
+	uint16_t			stack_limit;	// lowest valid SP, 0 for none
+
+	// one byte per flash word, AVR_COVERAGE_* flags of the last run
+	uint8_t *			coverage;
+	uint32_t			coverage_size;
+
+	// input currently being fed
+	struct {
+		avr_irq_t *		irq;		// UART_IRQ_INPUT, NULL if not fuzzed
+		int				xoff;
+		const uint8_t *	data;
+		size_t			len, pos;
+	} uart;
+	struct {
+		avr_irq_t *		irq;		// TWI irqs, NULL if not fuzzed
+		uint8_t			addr;		// 7 bits address of our fake slave
+		int				selected;
+		const uint8_t *	data;
+		size_t			len, pos;
+	} twi;
+	avr_cycle_count_t	consumed;	// cycle the input ran out, or 0
+	int					marker;		// SIMAVR_CMD_FUZZ_MARKER was seen
+	uint16_t			sp_min;		// lowest SP of the last run
+} avr_fuzz_t;
+
+/*
+ * Prepares an initialized avr with a loaded firmware for fuzzing.
+ * Sleeping no longer waits for real time, and a crash doesn't start gdb.
+ * The stack limit comes from the __heap_start or _end symbols, if
+ * the firmware has them.
+ */
+int
+avr_fuzz_init(
+		avr_fuzz_t * f,
+		avr_t * avr);
+/*
+ * Feeds the input to UART 'name', as the firmware reads it.
+ */
+int
+avr_fuzz_uart(
+		avr_fuzz_t * f,
+		char name);
+/*
+ * Feeds the input to the firmware reading from a TWI slave at 7 bits
+ * address 'addr', on TWI 'name'; writes are acknowledged and ignored.
+ * When both the UART and TWI are fuzzed, the first byte of the input
+ * tells how it is split between them.
+ */
+int
+avr_fuzz_twi(
+		avr_fuzz_t * f,
+		char name,
+		uint8_t addr);
+/*
+ * Runs the firmware until it's ready for input, and takes the snapshot
+ * that each input starts from. 'marker' is a symbol name or a flash
+ * address; when NULL, the firmware sends SIMAVR_CMD_FUZZ_MARKER.
+ * Returns 0 once there, -1 if it crashed or didn't get there in time.
+ */
+int
+avr_fuzz_boot(
+		avr_fuzz_t * f,
+		const char * marker,
+		avr_cycle_count_t max_cycles);
+/*
+ * Restores the booted state, feeds 'data' and runs it. Returns an
+ * AVR_FUZZ_* code; the coverage of that run is in f->coverage.
+ */
+int
+avr_fuzz_run(
+		avr_fuzz_t * f,
+		const uint8_t * data,
+		size_t size);
+
+const char *
+avr_fuzz_finding_name(
+		int finding);
+
+void
+avr_fuzz_free(
+		avr_fuzz_t * f);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_FUZZ_H__ */
@@ -30,13 +30,16 @@
 #include "sim_avr.h"
 #include "sim_core.h" // for SET_SREG_FROM, READ_SREG_INTO
 #include "sim_hex.h"
+#include "sim_elf.h"
 #include "avr_eeprom.h"
 #include "sim_gdb.h"
+#include "sim_reverse.h"
 
 // For debug printfs: "#define DBG(w) w"
 #define DBG(w)
 
 #define WATCH_LIMIT (32)
+#define GDB_AGENT_SIZE (128)	// bytecode space for conditions & actions
 
 typedef struct {
 	uint32_t len; /**< How many points are taken (points[0] .. points[len - 1]). */
@@ -44,13 +47,46 @@ typedef struct {
 		uint32_t addr; /**< Which address is watched. */
 		uint32_t size; /**< How large is the watched segment. */
 		uint32_t kind; /**< Bitmask of enum avr_gdb_watch_type values. */
+		/** Target side breakpoint conditions, see gdb_parse_agent_list(). */
+		uint16_t cond_len;
+		uint8_t  cond[GDB_AGENT_SIZE];
 	} points[WATCH_LIMIT];
 } avr_gdb_watchpoints_t;
 
+#define TRACEPOINT_LIMIT		16
+#define TRACE_ACTION_LIMIT		8
+#define TRACE_VARIABLE_LIMIT	16
+#define TRACE_BUFFER_SIZE		(64 * 1024)
+#define GDB_REGS_SIZE			(32 + 1 + 2 + 4)	// r0-r31, sreg, sp, pc
+#define GDB_FRAME_HEADER		(2 + 4)		// tracepoint number, frame size
+
+/* Tracepoints don't stop the core, they collect data into frames. */
+typedef struct avr_gdb_tracepoint_t {
+	uint32_t	number;
+	uint32_t	addr;
+	uint8_t		enabled : 1, regs : 1;	// collect the registers
+	uint32_t	pass;		// stop tracing after that many hits, if non-zero
+	uint32_t	hits;
+	uint16_t	cond_len;
+	uint8_t		cond[GDB_AGENT_SIZE];
+	int			mem_count;	// memory to collect
+	struct {
+		int			basereg;	// -1 for absolute addresses
+		int32_t		offset;
+		uint16_t	len;
+	} mem[TRACE_ACTION_LIMIT];
+	uint16_t	expr_len;	// collection expressions
+	uint8_t		expr[GDB_AGENT_SIZE];
+} avr_gdb_tracepoint_t;
+
 /* How many AVR instructions to execute before looking for gdb input. */
 
 #define GDB_BURST 256
 
+/* Largest packet we handle, advertised to gdb in the qSupported reply. */
+
+#define GDB_PACKET_SIZE 8192
+
 typedef struct avr_gdb_t {
 	avr_t * avr;
 	int burst_count;	// Current instruction burst size
@@ -60,10 +96,37 @@ typedef struct avr_gdb_t {
     avr_gdb_watchpoints_t breakpoints;
 	avr_gdb_watchpoints_t watchpoints;
 
+	// reverse step/continue, looking back through the history
+	struct {
+		int			scanning;	// watchpoints don't stop the core
+		int			step;
+		struct {
+			const char *	what;	// NULL, or the watchpoint that triggered
+			uint32_t		addr;
+		} watch, stop;			// ... and why we stop, for the reply
+	} reverse;
+
 	// These are used by gdb's "info io_registers" command.
 
 	uint16_t ior_base;
 	uint8_t  ior_count, mad;
+
+	// received data, packets can span several recv() calls
+	int		rx_len;
+	uint8_t	rx[GDB_PACKET_SIZE * 2];
+
+	struct {
+		int			count;
+		avr_gdb_tracepoint_t	point[TRACEPOINT_LIMIT];
+		int64_t		var[TRACE_VARIABLE_LIMIT];	// trace state variables
+		int			running, collecting;
+		char		stop[24];	// why the trace stopped, for qTStatus
+		int			frame_count;
+		int			frame;		// selected by tfind, -1 is 'live'
+		uint32_t	used;		// bytes used in the buffer
+		uint32_t	current;	// header of the frame being collected
+		uint8_t		buffer[TRACE_BUFFER_SIZE];	// must be last
+	} trace;
 } avr_gdb_t;
 
 
@@ -149,6 +212,7 @@ gdb_watch_add_or_update(
 	w->points[i].kind = kind;
 	w->points[i].addr = addr;
 	w->points[i].size = size;
+	w->points[i].cond_len = 0;
 
 	return 0;
 }
@@ -193,11 +257,11 @@ gdb_send_reply(
 		avr_gdb_t * g,
 		char * cmd )
 {
-	uint8_t reply[1024];
+	uint8_t reply[GDB_PACKET_SIZE + 5];
 	uint8_t * dst = reply;
 	uint8_t check = 0;
 	*dst++ = '$';
-	while (*cmd) {
+	while (*cmd && dst < reply + GDB_PACKET_SIZE + 1) {
 		check += *cmd;
 		*dst++ = *cmd++;
 	}
@@ -229,6 +293,8 @@ gdb_send_stop_status(
 	if (reason) {
 		if (pp)
 			sprintf(cmd + n, "%s:%x;", reason, *pp);
+		else if (strchr(reason, ':'))	// "replaylog:begin"
+			sprintf(cmd + n, "%s;", reason);
 		else
 			sprintf(cmd + n, "%s:;", reason);
 	}
@@ -314,6 +380,38 @@ gdb_read_register(
 	return strlen(rep);
 }
 
+/*
+ * Write to flash, SRAM or EEPROM, using gdb's address spaces.
+ * Returns -1 if the destination is out of bounds, 0 otherwise.
+ */
+static int
+gdb_write_memory(
+		avr_gdb_t * g,
+		uint32_t addr,
+		uint8_t * src,
+		uint32_t len )
+{
+	avr_t * avr = g->avr;
+
+	if (addr < 0x800000) {
+		if (addr + len > avr->flashend + 1)
+			return -1;
+		memcpy(avr->flash + addr, src, len);
+		if (addr + len > avr->codeend) // Checked by sim_core.c
+			avr->codeend = addr + len;
+	} else if (addr >= 0x800000 && (addr - 0x800000) <= avr->ramend) {
+		if (addr - 0x800000 + len > avr->ramend + 1)
+			return -1;
+		memcpy(avr->data + addr - 0x800000, src, len);
+	} else if (addr >= 0x810000 && (addr - 0x810000) <= avr->e2end) {
+		avr_eeprom_desc_t ee = {.offset = (addr - 0x810000), .size = len, .ee = src };
+		if (avr_ioctl(avr, AVR_IOCTL_EEPROM_SET, &ee) != 0)
+			return -1;
+	} else
+		return -1;
+	return 0;
+}
+
 static int tohex(const char *in, char *out, unsigned int len)
 {
 	int n = 0;
@@ -327,6 +425,15 @@ static int tohex(const char *in, char *out, unsigned int len)
  * is ignored.
  */
 
+/* gdb changed the core, going back must not re-execute over that */
+static void
+gdb_reverse_changed(
+		avr_gdb_t * g)
+{
+	if (g->avr->reverse)
+		avr_reverse_checkpoint(g->avr->reverse);
+}
+
 static void message(avr_gdb_t * g, const char *m)
 {
 	char buff[256];
@@ -364,10 +471,41 @@ handle_monitor(avr_t * avr, avr_gdb_t * g, char * cmd)
 		if (strncmp(ip, "reset", 5) == 0) {
 			avr_reset(avr);
 			avr->state = cpu_Stopped;
+			gdb_reverse_changed(g);
 			ip += 5;
 		} else if (strncmp(ip, "halt", 4) == 0) {
 			avr->state = cpu_Stopped;
 			ip += 4;
+		} else if (strncmp(ip, "trace", 5) == 0) {
+			// "trace on|off", switches to the traced core and back
+			ip += 5;
+			while (*ip == ' ' || *ip == '\t')
+				++ip;
+			if (strncmp(ip, "on", 2) == 0) {
+				avr->trace = 1;
+				ip += 2;
+			} else if (strncmp(ip, "off", 3) == 0) {
+				avr->trace = 0;
+				ip += 3;
+			} else
+				return 1;
+		} else if (strncmp(ip, "reverse", 7) == 0) {
+			// "reverse <MB>|off", keeps that much execution history
+			unsigned int mb;
+			int n = 0;
+			ip += 7;
+			while (*ip == ' ' || *ip == '\t')
+				++ip;
+			if (strncmp(ip, "off", 3) == 0) {
+				avr_reverse_free(avr->reverse);
+				ip += 3;
+			} else if (sscanf(ip, "%u%n", &mb, &n) == 1 && mb) {
+				avr_reverse_free(avr->reverse);
+				if (!avr_reverse_init(avr, (uint64_t)mb << 20, 0))
+					return 4;
+				ip += n;
+			} else
+				return 1;
 		} else if (strncmp(ip, "ior", 3) == 0) {
 			unsigned int base;
 			int          n, m, count;
@@ -399,7 +537,7 @@ handle_monitor(avr_t * avr, avr_gdb_t * g, char * cmd)
 			ip += strlen(ip);
 		)
 		} else {
-			tohex("Monitor subcommands are: ior halt reset" DBG(" say") "\n",
+			tohex("Monitor subcommands are: ior halt reset reverse trace" DBG(" say") "\n",
 				  dehex, sizeof dehex);
 			gdb_send_reply(g, dehex);
 			return -1;
@@ -433,6 +571,9 @@ handle_io_registers(avr_t * avr, avr_gdb_t * g, char * cmd)
 
 			// Send names and values.
 			addr += 32 + g->ior_base;
+			// the DWARF names are only loaded on demand
+			if (avr->symbolcount || avr->dwarf_file)
+				avr_symbol_load_lines(avr);
 
 			if (addr + count > avr->ioend)
 				count = avr->ioend + 1 - addr;
@@ -516,6 +657,7 @@ handle_v(avr_t * avr, avr_gdb_t * g, char * cmd, int length)
 		}
 	} else if (strncmp(cmd, "FlashDone", 9) == 0) {
 		DBG(printf("FlashDone\n");) //Remove
+		gdb_reverse_changed(g);
 	} else {
 		gdb_send_reply(g, "");
 		return;
@@ -531,6 +673,715 @@ handle_v(avr_t * avr, avr_gdb_t * g, char * cmd, int length)
 	}
 }
 
+/*
+ * Read a byte using gdb's address spaces, for agent expressions and
+ * tracepoint collection. Returns -1 if out of bounds.
+ */
+static int
+gdb_read_byte(
+		avr_gdb_t * g,
+		uint32_t addr,
+		uint8_t * v )
+{
+	avr_t * avr = g->avr;
+
+	addr &= 0xffffff;
+	if (addr < avr->flashend) {
+		*v = avr->flash[addr];
+	} else if (addr >= 0x800000 && (addr - 0x800000) <= avr->ramend) {
+		*v = avr->data[addr - 0x800000];
+	} else if (addr >= 0x810000 && (addr - 0x810000) <= avr->e2end) {
+		avr_eeprom_desc_t ee = {.offset = (addr - 0x810000)};
+		avr_ioctl(avr, AVR_IOCTL_EEPROM_GET, &ee);
+		if (!ee.ee)
+			return -1;
+		*v = *ee.ee;
+	} else
+		return -1;
+	return 0;
+}
+
+/* Register value, using gdb's numbering */
+static uint32_t
+gdb_get_register(
+		avr_gdb_t * g,
+		int regi )
+{
+	avr_t * avr = g->avr;
+
+	switch (regi) {
+		case 0 ... 31:
+			return avr->data[regi];
+		case 32: {
+			uint8_t sreg;
+			READ_SREG_INTO(avr, sreg);
+			return sreg;
+		}
+		case 33:
+			return avr->data[R_SPL] | (avr->data[R_SPH] << 8);
+		case 34:
+			return avr->pc;
+	}
+	return 0;
+}
+
+/*
+ * Allocate 'size' bytes in the trace buffer, stops the trace when full
+ */
+static uint8_t *
+gdb_trace_alloc(
+		avr_gdb_t * g,
+		uint32_t size )
+{
+	if (g->trace.used + size > TRACE_BUFFER_SIZE) {
+		if (g->trace.running)
+			snprintf(g->trace.stop, sizeof(g->trace.stop), "tfull:0");
+		g->trace.running = 0;
+		return NULL;
+	}
+	uint8_t * res = g->trace.buffer + g->trace.used;
+	g->trace.used += size;
+	return res;
+}
+
+/*
+ * Collect 'len' bytes of memory into the current trace frame. Blocks
+ * are 'M', then the address (32 bits) and length (16 bits) little endian.
+ */
+static void
+gdb_trace_collect_mem(
+		avr_gdb_t * g,
+		uint32_t addr,
+		uint32_t len )
+{
+	if (!g->trace.collecting)
+		return;
+	if (len > 0xffff)
+		len = 0xffff;
+	uint8_t * d = gdb_trace_alloc(g, 7 + len);
+	if (!d)
+		return;
+	*d++ = 'M';
+	for (int i = 0; i < 4; i++)
+		*d++ = addr >> (i * 8);
+	*d++ = len;
+	*d++ = len >> 8;
+	for (uint32_t i = 0; i < len; i++, d++)
+		if (gdb_read_byte(g, addr + i, d))
+			*d = 0;
+}
+
+/*
+ * Collect trace state variable 'n' into the current trace frame. Blocks
+ * are 'V', then the number (16 bits) and the value (64 bits) little endian.
+ */
+static void
+gdb_trace_collect_var(
+		avr_gdb_t * g,
+		int n )
+{
+	if (!g->trace.collecting)
+		return;
+	uint8_t * d = gdb_trace_alloc(g, 11);
+	if (!d)
+		return;
+	*d++ = 'V';
+	*d++ = n;
+	*d++ = n >> 8;
+	for (int i = 0; i < 8; i++)
+		*d++ = (uint64_t)g->trace.var[n] >> (i * 8);
+}
+
+/*
+ * Collect all the registers into the current trace frame. The block is
+ * 'R', then the registers in the same order and size as a 'g' reply.
+ */
+static void
+gdb_trace_collect_regs(
+		avr_gdb_t * g )
+{
+	avr_t * avr = g->avr;
+	uint8_t * d = gdb_trace_alloc(g, 1 + GDB_REGS_SIZE);
+
+	if (!d)
+		return;
+	*d++ = 'R';
+	memcpy(d, avr->data, 32);
+	d += 32;
+	*d++ = gdb_get_register(g, 32);
+	*d++ = avr->data[R_SPL];
+	*d++ = avr->data[R_SPH];
+	for (int i = 0; i < 4; i++)
+		*d++ = avr->pc >> (i * 8);
+}
+
+#define GDB_AGENT_STACK	32
+#define GDB_AGENT_STEPS	10000	// goto can loop, gdb gets an error past that
+
+/*
+ * Evaluate a gdb agent expression (see GDB User Manual, Appendix F).
+ * Everything but floats and printf is handled; the trace opcodes only
+ * collect memory and variables when a tracepoint is being hit.
+ * Returns -1 on error, or after GDB_AGENT_STEPS opcodes, otherwise 0
+ * and the top of the stack in 'result'.
+ */
+static int
+gdb_agent_eval(
+		avr_gdb_t * g,
+		const uint8_t * code,
+		int len,
+		int64_t * result )
+{
+	int64_t stack[GDB_AGENT_STACK];
+	int sp = 0, pc = 0, steps = 0;
+
+#define NEED(_n)	if (sp < (_n)) return -1
+#define PUSH(_v)	{ int64_t _p = (_v); \
+						if (sp == GDB_AGENT_STACK) return -1; \
+						stack[sp++] = _p; }
+#define ARG(_n)		({ int64_t _a = 0; if (pc + (_n) > len) return -1; \
+						for (int _i = 0; _i < (_n); _i++) { \
+							_a = (_a << 8) | code[pc++]; } \
+						_a; })
+#define BINOP(_op)	{ NEED(2); sp--; stack[sp-1] = stack[sp-1] _op stack[sp]; }
+#define UBINOP(_op)	{ NEED(2); sp--; stack[sp-1] = \
+						(uint64_t)stack[sp-1] _op (uint64_t)stack[sp]; }
+
+	while (pc < len) {
+		uint8_t op = code[pc++];
+		if (++steps > GDB_AGENT_STEPS) {
+			AVR_LOG(g->avr, LOG_WARNING,
+					"GDB: agent expression still running after %d steps\n",
+					GDB_AGENT_STEPS);
+			return -1;
+		}
+		switch (op) {
+			case 0x02: BINOP(+); break;			// add
+			case 0x03: BINOP(-); break;			// sub
+			case 0x04: BINOP(*); break;			// mul
+			case 0x05:							// div_signed
+			case 0x06:							// div_unsigned
+			case 0x07:							// rem_signed
+			case 0x08:							// rem_unsigned
+				NEED(2);
+				if (!stack[sp-1])
+					return -1;
+				switch (op) {
+					case 0x05: BINOP(/); break;
+					case 0x06: UBINOP(/); break;
+					case 0x07: BINOP(%); break;
+					case 0x08: UBINOP(%); break;
+				}
+				break;
+			case 0x09: BINOP(<<); break;		// lsh
+			case 0x0a: BINOP(>>); break;		// rsh_signed
+			case 0x0b: UBINOP(>>); break;		// rsh_unsigned
+			case 0x0c:							// trace
+			case 0x2f:							// tracenz
+				NEED(2);
+				sp -= 2;
+				if (op == 0x2f) {	// up to, and including a zero
+					uint8_t v = 1;
+					int64_t l = 0;
+					while (l < stack[sp+1] && v &&
+							!gdb_read_byte(g, stack[sp] + l, &v))
+						l++;
+					stack[sp+1] = l;
+				}
+				gdb_trace_collect_mem(g, stack[sp], stack[sp+1]);
+				break;
+			case 0x0d:							// trace_quick
+			case 0x30: {						// trace16
+				int64_t n = ARG(op == 0x0d ? 1 : 2);
+				NEED(1);
+				gdb_trace_collect_mem(g, stack[sp-1], n);
+			}	break;
+			case 0x0e: NEED(1); stack[sp-1] = !stack[sp-1]; break;	// log_not
+			case 0x0f: BINOP(&); break;			// bit_and
+			case 0x10: BINOP(|); break;			// bit_or
+			case 0x11: BINOP(^); break;			// bit_xor
+			case 0x12: NEED(1); stack[sp-1] = ~stack[sp-1]; break;	// bit_not
+			case 0x13: BINOP(==); break;		// equal
+			case 0x14: BINOP(<); break;			// less_signed
+			case 0x15: UBINOP(<); break;		// less_unsigned
+			case 0x16: {						// ext
+				int n = ARG(1);
+				NEED(1);
+				if (n > 0 && n < 64)
+					stack[sp-1] = (int64_t)((uint64_t)stack[sp-1] << (64 - n)) >> (64 - n);
+			}	break;
+			case 0x2a: {						// zero_ext
+				int n = ARG(1);
+				NEED(1);
+				if (n > 0 && n < 64)
+					stack[sp-1] &= (1ULL << n) - 1;
+			}	break;
+			case 0x17:							// ref8
+			case 0x18:							// ref16
+			case 0x19:							// ref32
+			case 0x1a: {						// ref64
+				int n = 1 << (op - 0x17);
+				uint64_t v = 0;
+				NEED(1);
+				for (int i = n - 1; i >= 0; i--) {	// little endian target
+					uint8_t b;
+					if (gdb_read_byte(g, stack[sp-1] + i, &b))
+						return -1;
+					v = (v << 8) | b;
+				}
+				stack[sp-1] = v;
+			}	break;
+			case 0x20: {						// if_goto
+				int to = ARG(2);
+				NEED(1);
+				if (stack[--sp])
+					pc = to;
+			}	break;
+			case 0x21:							// goto
+				pc = ARG(2);
+				break;
+			case 0x22: PUSH(ARG(1)); break;		// const8
+			case 0x23: PUSH(ARG(2)); break;		// const16
+			case 0x24: PUSH(ARG(4)); break;		// const32
+			case 0x25: PUSH(ARG(8)); break;		// const64
+			case 0x26: PUSH(gdb_get_register(g, ARG(2))); break;	// reg
+			case 0x27:							// end
+				*result = sp ? stack[sp-1] : 0;
+				return 0;
+			case 0x28: NEED(1); PUSH(stack[sp-1]); break;	// dup
+			case 0x29: NEED(1); sp--; break;	// pop
+			case 0x2b: {						// swap
+				NEED(2);
+				int64_t t = stack[sp-1];
+				stack[sp-1] = stack[sp-2];
+				stack[sp-2] = t;
+			}	break;
+			case 0x2c:							// getv
+			case 0x2d:							// setv
+			case 0x2e: {						// tracev
+				int n = ARG(2);
+				if (n >= TRACE_VARIABLE_LIMIT)
+					return -1;
+				if (op == 0x2c)
+					PUSH(g->trace.var[n])
+				else if (op == 0x2d) {
+					NEED(1);
+					g->trace.var[n] = stack[sp-1];
+				} else
+					gdb_trace_collect_var(g, n);
+			}	break;
+			case 0x32: {						// pick
+				int n = ARG(1);
+				NEED(n + 1);
+				PUSH(stack[sp-1-n]);
+			}	break;
+			case 0x33: {						// rot
+				NEED(3);
+				int64_t c = stack[sp-1];
+				stack[sp-1] = stack[sp-2];
+				stack[sp-2] = stack[sp-3];
+				stack[sp-3] = c;
+			}	break;
+			default:
+				DBG(printf("%s unsupported opcode %02x\n", __func__, op);)
+				return -1;
+		}
+	}
+#undef NEED
+#undef PUSH
+#undef ARG
+#undef BINOP
+#undef UBINOP
+	return -1;	// no 'end'
+}
+
+/*
+ * Evaluate a list of conditions, as stored by gdb_parse_agent_list().
+ * An empty list, any true condition, or an error means 'stop here'.
+ */
+static int
+gdb_agent_cond(
+		avr_gdb_t * g,
+		const uint8_t * cond,
+		int len )
+{
+	if (!len)
+		return 1;
+	for (int o = 0; o + 2 <= len; ) {
+		int l = cond[o] | (cond[o + 1] << 8);
+		int64_t res;
+
+		o += 2;
+		if (gdb_agent_eval(g, cond + o, l, &res) || res)
+			return 1;
+		o += l;
+	}
+	return 0;
+}
+
+/*
+ * Parse a list of "X<len>,<hex bytecode>" agent expressions, as sent
+ * for breakpoint conditions and tracepoints, separated or not by ';'.
+ * They are appended to 'dst', each prefixed with its 16 bits length.
+ * Returns the end of the list, or NULL on error.
+ */
+static const char *
+gdb_parse_agent_list(
+		const char * src,
+		uint8_t * dst,
+		uint16_t * dst_len,
+		int size )
+{
+	for (;;) {
+		unsigned int l;
+		int n = 0;
+
+		while (*src == ';')
+			src++;
+		if (*src != 'X')
+			return src;
+		if (sscanf(src, "X%x,%n", &l, &n) != 1 || !n ||
+				*dst_len + 2 + l > size)
+			return NULL;
+		src += n;
+		dst[(*dst_len)++] = l;
+		dst[(*dst_len)++] = l >> 8;
+		if (read_hex_string(src, dst + *dst_len, l) != l)
+			return NULL;
+		*dst_len += l;
+		src += l * 2;
+	}
+}
+
+/* Called when tracing, collect a frame for all the tracepoints at PC */
+static void
+gdb_trace_hit(
+		avr_gdb_t * g )
+{
+	avr_t * avr = g->avr;
+
+	for (int i = 0; i < g->trace.count && g->trace.running; i++) {
+		avr_gdb_tracepoint_t * t = &g->trace.point[i];
+
+		if (!t->enabled || t->addr != avr->pc)
+			continue;
+		if (t->cond_len && !gdb_agent_cond(g, t->cond, t->cond_len))
+			continue;
+		t->hits++;
+		// frame header is the tracepoint number and the frame size
+		uint8_t * h = gdb_trace_alloc(g, GDB_FRAME_HEADER);
+		if (!h)
+			return;
+		g->trace.current = h - g->trace.buffer;
+		g->trace.collecting = 1;
+		if (t->regs)
+			gdb_trace_collect_regs(g);
+		for (int mi = 0; mi < t->mem_count; mi++) {
+			uint32_t addr = t->mem[mi].offset;
+			// register relative ones are in data space
+			if (t->mem[mi].basereg != -1)
+				addr = 0x800000 + gdb_get_register(g, t->mem[mi].basereg) +
+						t->mem[mi].offset;
+			gdb_trace_collect_mem(g, addr, t->mem[mi].len);
+		}
+		for (int o = 0; o + 2 <= t->expr_len; ) {
+			int l = t->expr[o] | (t->expr[o + 1] << 8);
+			int64_t res;
+			gdb_agent_eval(g, t->expr + o + 2, l, &res);
+			o += 2 + l;
+		}
+		g->trace.collecting = 0;
+		uint32_t size = g->trace.used - g->trace.current;
+		h[0] = t->number;
+		h[1] = t->number >> 8;
+		for (int bi = 0; bi < 4; bi++)
+			h[2 + bi] = size >> (bi * 8);
+		g->trace.frame_count++;
+
+		if (t->pass && t->hits >= t->pass) {
+			snprintf(g->trace.stop, sizeof(g->trace.stop),
+					"tpasscount:%x", t->number);
+			g->trace.running = 0;
+		}
+	}
+}
+
+/* Returns the header of trace frame 'n', or NULL */
+static uint8_t *
+gdb_trace_get_frame(
+		avr_gdb_t * g,
+		int n )
+{
+	uint32_t o = 0;
+
+	if (n < 0 || n >= g->trace.frame_count)
+		return NULL;
+	for (int i = 0; i < n; i++) {
+		uint8_t * f = g->trace.buffer + o;
+		o += f[2] | (f[3] << 8) | (f[4] << 16) | (f[5] << 24);
+	}
+	return g->trace.buffer + o;
+}
+
+/*
+ * Find a block of the selected trace frame; registers if 'kind' is 'R',
+ * trace state variable 'addr' if it's 'V', otherwise memory covering
+ * addr..addr+len. Returns the block data.
+ */
+static uint8_t *
+gdb_trace_frame_block(
+		avr_gdb_t * g,
+		uint8_t kind,
+		uint32_t addr,
+		uint32_t len )
+{
+	uint8_t * f = gdb_trace_get_frame(g, g->trace.frame);
+
+	if (!f)
+		return NULL;
+	uint8_t * end = f + (f[2] | (f[3] << 8) | (f[4] << 16) | (f[5] << 24));
+	uint8_t * b = f + GDB_FRAME_HEADER;
+	while (b < end) {
+		if (*b == 'R') {
+			if (kind == 'R')
+				return b + 1;
+			b += 1 + GDB_REGS_SIZE;
+		} else if (*b == 'V') {
+			if (kind == 'V' && addr == (b[1] | (b[2] << 8)))
+				return b + 3;
+			b += 11;
+		} else {
+			uint32_t ba = b[1] | (b[2] << 8) | (b[3] << 16) | (b[4] << 24);
+			uint32_t bl = b[5] | (b[6] << 8);
+			if (kind == 'M' && addr >= ba && addr + len <= ba + bl)
+				return b + 7 + (addr - ba);
+			b += 7 + bl;
+		}
+	}
+	return NULL;
+}
+
+/* Same as gdb_read_register(), from the selected trace frame */
+static int
+gdb_read_frame_register(
+		avr_gdb_t * g,
+		int regi,
+		char * rep )
+{
+	uint8_t * r = gdb_trace_frame_block(g, 'R', 0, 0);
+	int o = regi <= 33 ? regi : 35;
+	int n = regi < 33 ? 1 : regi == 33 ? 2 : 4;
+
+	if (regi > 34)
+		return 0;
+	for (int i = 0; i < n; i++) {
+		if (r)	// not collected is 'unavailable'
+			sprintf(rep + (i * 2), "%02x", r[o + i]);
+		else
+			strcpy(rep + (i * 2), "xx");
+	}
+	return n * 2;
+}
+
+/* Handles the Q/qT* tracepoint packets. Returns 0 if not a trace packet */
+static int
+gdb_handle_trace(
+		avr_gdb_t * g,
+		uint8_t command,
+		char * cmd,
+		char * rep,
+		int size )
+{
+	if (command == 'Q' && !strcmp(cmd, "Tinit")) {
+		memset(&g->trace, 0, sizeof(g->trace) - sizeof(g->trace.buffer));
+		g->trace.frame = -1;
+		snprintf(g->trace.stop, sizeof(g->trace.stop), "tnotrun:0");
+		gdb_send_reply(g, "OK");
+	} else if (command == 'Q' && !strncmp(cmd, "TDP:-", 5)) {
+		// more actions for an existing tracepoint
+		unsigned int number, addr;
+		int n = 0;
+		sscanf(cmd + 5, "%x:%x:%n", &number, &addr, &n);
+		avr_gdb_tracepoint_t * t = NULL;
+		for (int i = 0; i < g->trace.count; i++)
+			if (g->trace.point[i].number == number)
+				t = &g->trace.point[i];
+		if (!t || !n) {
+			gdb_send_reply(g, "E01");
+			return 1;
+		}
+		const char * p = cmd + 5 + n;
+		while (p && *p && *p != '-') {
+			if (*p == 'R') {	// register mask, we collect them all
+				t->regs = 1;
+				strtoul(p + 1, (char**)&p, 16);
+			} else if (*p == 'M') {
+				char * e;
+				uint32_t basereg = strtoul(p + 1, &e, 16);
+				uint32_t offset = strtoull(e + 1, &e, 16);
+				uint32_t len = strtoul(e + 1, &e, 16);
+				if (t->mem_count < TRACE_ACTION_LIMIT) {
+					t->mem[t->mem_count].basereg = basereg == 0xffffffff ?
+							-1 : (int)basereg;
+					t->mem[t->mem_count].offset = offset;
+					t->mem[t->mem_count].len = len;
+					t->mem_count++;
+				}
+				p = e;
+			} else if (*p == 'X') {
+				p = gdb_parse_agent_list(p, t->expr, &t->expr_len,
+						sizeof(t->expr));
+			} else	// 'S' while-stepping actions are not supported
+				break;
+		}
+		gdb_send_reply(g, p ? "OK" : "E01");
+	} else if (command == 'Q' && !strncmp(cmd, "TDP:", 4)) {
+		// QTDP:<n>:<addr>:<E|D>:<step>:<pass>[:X<len>,<cond>][-]
+		unsigned int number, addr, step, pass;
+		char ena;
+		int n = 0;
+		if (sscanf(cmd + 4, "%x:%x:%c:%x:%x%n",
+				&number, &addr, &ena, &step, &pass, &n) != 5 ||
+				g->trace.count == TRACEPOINT_LIMIT) {
+			gdb_send_reply(g, "E01");
+			return 1;
+		}
+		avr_gdb_tracepoint_t * t = &g->trace.point[g->trace.count];
+		memset(t, 0, sizeof(*t));
+		t->number = number;
+		t->addr = addr;
+		t->enabled = ena == 'E';
+		t->pass = pass;
+		const char * c = strstr(cmd + 4 + n, ":X");
+		if (c && !gdb_parse_agent_list(c + 1, t->cond, &t->cond_len,
+				sizeof(t->cond))) {
+			gdb_send_reply(g, "E02");
+			return 1;
+		}
+		g->trace.count++;
+		gdb_send_reply(g, "OK");
+	} else if (command == 'Q' && (!strncmp(cmd, "TEnable:", 8) ||
+			!strncmp(cmd, "TDisable:", 9))) {
+		unsigned int number;
+		sscanf(strchr(cmd, ':') + 1, "%x", &number);
+		for (int i = 0; i < g->trace.count; i++)
+			if (g->trace.point[i].number == number)
+				g->trace.point[i].enabled = cmd[1] == 'E';
+		gdb_send_reply(g, "OK");
+	} else if (command == 'Q' && !strncmp(cmd, "TDV:", 4)) {
+		unsigned int number;
+		unsigned long long value;
+		if (sscanf(cmd + 4, "%x:%llx", &number, &value) == 2 &&
+				number < TRACE_VARIABLE_LIMIT)
+			g->trace.var[number] = value;
+		gdb_send_reply(g, "OK");
+	} else if (command == 'Q' && !strcmp(cmd, "TStart")) {
+		g->trace.used = g->trace.frame_count = 0;
+		g->trace.frame = -1;
+		for (int i = 0; i < g->trace.count; i++)
+			g->trace.point[i].hits = 0;
+		g->trace.running = 1;
+		gdb_send_reply(g, "OK");
+	} else if (command == 'Q' && !strcmp(cmd, "TStop")) {
+		if (g->trace.running)
+			snprintf(g->trace.stop, sizeof(g->trace.stop), "tstop::0");
+		g->trace.running = 0;
+		gdb_send_reply(g, "OK");
+	} else if (command == 'Q' && !strncmp(cmd, "TFrame:", 7)) {
+		// QTFrame:<n>, QTFrame:pc:<addr> or QTFrame:tdp:<n>
+		unsigned int v = 0;
+		int frame = -1;
+		if (!strncmp(cmd + 7, "pc:", 3) || !strncmp(cmd + 7, "tdp:", 4)) {
+			int pc = cmd[7] == 'p';
+			sscanf(strchr(cmd + 7, ':') + 1, "%x", &v);
+			for (int i = g->trace.frame + 1; i < g->trace.frame_count; i++) {
+				uint8_t * f = gdb_trace_get_frame(g, i);
+				g->trace.frame = i;
+				uint8_t * r = gdb_trace_frame_block(g, 'R', 0, 0);
+				if (pc ? (r && (r[35] | (r[36] << 8) | (r[37] << 16)) == v) :
+						(f[0] | (f[1] << 8)) == v) {
+					frame = i;
+					break;
+				}
+			}
+		} else if (sscanf(cmd + 7, "%x", &v) == 1 && v < g->trace.frame_count)
+			frame = v;
+		g->trace.frame = frame;
+		if (frame == -1)
+			gdb_send_reply(g, "F-1");
+		else {
+			uint8_t * f = gdb_trace_get_frame(g, frame);
+			snprintf(rep, size, "F%xT%x", frame, f[0] | (f[1] << 8));
+			gdb_send_reply(g, rep);
+		}
+	} else if (command == 'Q' && (!strncmp(cmd, "Tro", 3) ||
+			!strncmp(cmd, "TBuffer", 7) || !strncmp(cmd, "TNotes", 6) ||
+			!strncmp(cmd, "TDisconnected", 13) || !strncmp(cmd, "TDPsrc", 6))) {
+		gdb_send_reply(g, "OK");
+	} else if (command == 'q' && !strcmp(cmd, "TStatus")) {
+		snprintf(rep, size,
+				"T%d;%s;tframes:%x;tcreated:%x;tfree:%x;tsize:%x;"
+				"circular:0;disconn:0",
+				g->trace.running, g->trace.stop[0] ? g->trace.stop : "tnotrun:0",
+				g->trace.frame_count, g->trace.frame_count,
+				TRACE_BUFFER_SIZE - g->trace.used, TRACE_BUFFER_SIZE);
+		gdb_send_reply(g, rep);
+	} else if (command == 'q' && !strncmp(cmd, "TV:", 3)) {
+		unsigned int number = TRACE_VARIABLE_LIMIT;
+		sscanf(cmd + 3, "%x", &number);
+		if (number < TRACE_VARIABLE_LIMIT && g->trace.frame != -1) {
+			// the value collected by that frame, if any
+			uint8_t * v = gdb_trace_frame_block(g, 'V', number, 0);
+			uint64_t val = 0;
+			for (int i = 7; v && i >= 0; i--)
+				val = (val << 8) | v[i];
+			if (v) {
+				snprintf(rep, size, "V%llx", (unsigned long long)val);
+				gdb_send_reply(g, rep);
+			} else
+				gdb_send_reply(g, "U");
+		} else if (number < TRACE_VARIABLE_LIMIT) {
+			snprintf(rep, size, "V%llx", (unsigned long long)g->trace.var[number]);
+			gdb_send_reply(g, rep);
+		} else
+			gdb_send_reply(g, "U");
+	} else if (command == 'q' && (!strcmp(cmd, "TfP") || !strcmp(cmd, "TsP") ||
+			!strcmp(cmd, "TfV") || !strcmp(cmd, "TsV"))) {
+		gdb_send_reply(g, "l");	// nothing to upload
+	} else
+		return 0;
+	return 1;
+}
+
+/*
+ * Called while looking back through the history, before and after each
+ * instruction. Breakpoints are checked before, watchpoints after.
+ */
+static int
+gdb_reverse_stop(
+		avr_t * avr,
+		void * param,
+		int after)
+{
+	avr_gdb_t * g = (avr_gdb_t *)param;
+
+	if (after) {
+		if (!g->reverse.watch.what)
+			return 0;
+		g->reverse.stop = g->reverse.watch;
+		g->reverse.watch.what = NULL;
+		return 1;
+	}
+	if (g->reverse.step)
+		return 1;
+	int bp = gdb_watch_find(&g->breakpoints, avr->pc);
+	if (bp == -1 || !gdb_agent_cond(g, g->breakpoints.points[bp].cond,
+			g->breakpoints.points[bp].cond_len))
+		return 0;
+	g->reverse.stop.what = "hwbreak";
+	return 1;
+}
+
 static void
 gdb_handle_command(
 		avr_gdb_t * g,
@@ -538,16 +1389,27 @@ gdb_handle_command(
 		int         length)
 {
 	avr_t * avr = g->avr;
-	char rep[1024];
+	char rep[GDB_PACKET_SIZE + 1];
 	uint8_t command = *cmd++;
 	switch (command) {
+		case 'Q':
+			if (!gdb_handle_trace(g, command, cmd, rep, sizeof(rep)))
+				gdb_send_reply(g, "");
+			break;
 		case 'q':
-			if (strncmp(cmd, "Supported", 9) == 0) {
+			if (cmd[0] == 'T' && gdb_handle_trace(g, command, cmd, rep, sizeof(rep))) {
+				break;
+			} else if (strncmp(cmd, "Supported", 9) == 0) {
 				/* If GDB asked what features we support, report back
 				 * the features we support, which is just memory layout
 				 * information and stop reasons for now.
 				 */
-				gdb_send_reply(g, "qXfer:memory-map:read+;swbreak+;hwbreak+");
+				snprintf(rep, sizeof(rep),
+						"PacketSize=%x;qXfer:memory-map:read+;swbreak+;hwbreak+;"
+						"ConditionalBreakpoints+;EnableDisableTracepoints+;tracenz+%s",
+						GDB_PACKET_SIZE,
+						avr->reverse ? ";ReverseStep+;ReverseContinue+" : "");
+				gdb_send_reply(g, rep);
 				break;
 			} else if (strncmp(cmd, "Attached", 8) == 0) {
 				/* Respond that we are attached to an existing process..
@@ -560,15 +1422,35 @@ gdb_handle_command(
 			//	gdb_send_reply(g, "Text=0;Data=800000;Bss=800000");
 			//	break;
 			} else if (strncmp(cmd, "Xfer:memory-map:read", 20) == 0) {
-				snprintf(rep, sizeof(rep),
-						"l<memory-map>\n"
+				char map[512], ee[64] = "";
+				unsigned int offset = 0, len = sizeof(rep) - 2;
+
+				if (avr->e2end)
+					snprintf(ee, sizeof(ee),
+						" <memory type='ram' start='0x810000' length='%#x'/>\n",
+						avr->e2end + 1);
+				int size = snprintf(map, sizeof(map),
+						"<memory-map>\n"
 						" <memory type='ram' start='0x800000' length='%#x'/>\n"
+						"%s"
 						" <memory type='flash' start='0' length='%#x'>\n"
 						"  <property name='blocksize'>0x80</property>\n"
 						" </memory>\n"
 						"</memory-map>",
-						g->avr->ramend + 1, g->avr->flashend + 1);
-
+						g->avr->ramend + 1, ee, g->avr->flashend + 1);
+				// qXfer:memory-map:read::<offset>,<length>
+				sscanf(cmd + 20, "::%x,%x", &offset, &len);
+				if (len > sizeof(rep) - 2)
+					len = sizeof(rep) - 2;
+				if (offset >= size) {
+					gdb_send_reply(g, "l");
+					break;
+				}
+				if (len > size - offset)
+					len = size - offset;
+				rep[0] = offset + len < size ? 'm' : 'l';
+				memcpy(rep + 1, map + offset, len);
+				rep[len + 1] = 0;
 				gdb_send_reply(g, rep);
 				break;
 			} else if (strncmp(cmd, "RegisterInfo", 12) == 0) {
@@ -624,18 +1506,24 @@ gdb_handle_command(
 			uint8_t *src = (uint8_t*)rep;
 			for (int i = 0; i < 35; i++)
 				src += gdb_write_register(g, i, src);
+			gdb_reverse_changed(g);
 			gdb_send_reply(g, "OK");
 		}	break;
 		case 'g': {	// read all general purpose registers
 			char * dst = rep;
 			for (int i = 0; i < 35; i++)
-				dst += gdb_read_register(g, i, dst);
+				dst += g->trace.frame != -1 ?
+						gdb_read_frame_register(g, i, dst) :
+						gdb_read_register(g, i, dst);
 			gdb_send_reply(g, rep);
 		}	break;
 		case 'p': {	// read register
 			unsigned int regi = 0;
 			sscanf(cmd, "%x", &regi);
-			gdb_read_register(g, regi, rep);
+			if (g->trace.frame != -1)
+				gdb_read_frame_register(g, regi, rep);
+			else
+				gdb_read_register(g, regi, rep);
 			gdb_send_reply(g, rep);
 		}	break;
 		case 'P': {	// write register
@@ -647,6 +1535,7 @@ gdb_handle_command(
 			sscanf(cmd, "%x", &regi);
 			read_hex_string(val, (uint8_t*)rep, strlen(val));
 			gdb_write_register(g, regi, (uint8_t*)rep);
+			gdb_reverse_changed(g);
 			gdb_send_reply(g, "OK");
 		}	break;
 		case 'm': {	// read memory
@@ -656,10 +1545,24 @@ gdb_handle_command(
 			uint8_t * src = NULL;
 			/* GDB seems to also use 0x1800000 for sram ?!?! */
 			addr &= 0xffffff;
-			if (addr < avr->flashend) {
+			if (len > (sizeof(rep) - 1) / 2)
+				len = (sizeof(rep) - 1) / 2;
+			if (g->trace.frame != -1) {
+				// looking at a trace frame, only what was collected
+				src = gdb_trace_frame_block(g, 'M', addr, len);
+				if (!src) {
+					gdb_send_reply(g, "E01");
+					break;
+				}
+			} else if (addr < avr->flashend) {
 				src = avr->flash + addr;
+				// gdb copes with short reads
+				if (addr + len > avr->flashend + 1)
+					len = avr->flashend + 1 - addr;
 			} else if (addr >= 0x800000 && (addr - 0x800000) <= avr->ramend) {
 				src = avr->data + addr - 0x800000;
+				if (addr - 0x800000 + len > avr->ramend + 1)
+					len = avr->ramend + 1 - (addr - 0x800000);
 			} else if (addr == (0x800000 + avr->ramend + 1) && len == 2) {
 				// Allow GDB to read a value just after end of stack.
 				// This is necessary to make instruction stepping work when stack is empty
@@ -676,6 +1579,8 @@ gdb_handle_command(
 					gdb_send_reply(g, "E01");
 					break;
 				}
+				if (ee.offset + len > avr->e2end + 1)
+					len = avr->e2end + 1 - ee.offset;
 			} else {
 				AVR_LOG(avr, LOG_ERROR,
 						"GDB: read memory error %08x, %08x (ramend %04x)\n",
@@ -683,10 +1588,11 @@ gdb_handle_command(
 				gdb_send_reply(g, "E01");
 				break;
 			}
+			static const char hex[] = "0123456789abcdef";
 			char * dst = rep;
 			while (len--) {
-				sprintf(dst, "%02x", *src++);
-				dst += 2;
+				*dst++ = hex[*src >> 4];
+				*dst++ = hex[*src++ & 0xf];
 			}
 			*dst = 0;
 			gdb_send_reply(g, rep);
@@ -699,21 +1605,45 @@ gdb_handle_command(
 				gdb_send_reply(g, "E01");
 				break;
 			}
-			if (addr < 0xffff) {
-				read_hex_string(start + 1, avr->flash + addr, strlen(start+1));
-				gdb_send_reply(g, "OK");
-			} else if (addr >= 0x800000 && (addr - 0x800000) <= avr->ramend) {
-				read_hex_string(start + 1, avr->data + addr - 0x800000, strlen(start+1));
-				gdb_send_reply(g, "OK");
-			} else if (addr >= 0x810000 && (addr - 0x810000) <= avr->e2end) {
-				read_hex_string(start + 1, (uint8_t*)rep, strlen(start+1));
-				avr_eeprom_desc_t ee = {.offset = (addr - 0x810000), .size = len, .ee = (uint8_t*)rep };
-				avr_ioctl(avr, AVR_IOCTL_EEPROM_SET, &ee);
-				gdb_send_reply(g, "OK");
-			} else {
+			if (len > sizeof(rep) ||
+					read_hex_string(start + 1, (uint8_t*)rep, len) != len ||
+					gdb_write_memory(g, addr, (uint8_t*)rep, len)) {
+				AVR_LOG(avr, LOG_ERROR, "GDB: write memory error %08x, %08x\n", addr, len);
+				gdb_send_reply(g, "E01");
+				break;
+			}
+			if (len)
+				gdb_reverse_changed(g);
+			gdb_send_reply(g, "OK");
+		}	break;
+		case 'X': {	// write memory, binary data
+			uint32_t addr, len;
+			int n = 0;
+			sscanf(cmd, "%x,%x:%n", &addr, &len, &n);
+			if (!n || len > sizeof(rep)) {
+				gdb_send_reply(g, "E01");
+				break;
+			}
+			// data is escaped with '}' and can contain zeroes
+			char * src = cmd + n, * end = cmd - 1 + length;
+			uint8_t * dst = (uint8_t*)rep;
+			while (src < end && dst < (uint8_t*)rep + len) {
+				if (*src == '}' && src + 1 < end) {
+					*dst++ = src[1] ^ 0x20;
+					src += 2;
+				} else
+					*dst++ = *src++;
+			}
+			// a zero length write is gdb probing for X support
+			if (dst - (uint8_t*)rep != len ||
+					(len && gdb_write_memory(g, addr, (uint8_t*)rep, len))) {
 				AVR_LOG(avr, LOG_ERROR, "GDB: write memory error %08x, %08x\n", addr, len);
 				gdb_send_reply(g, "E01");
+				break;
 			}
+			if (len)
+				gdb_reverse_changed(g);
+			gdb_send_reply(g, "OK");
 		}	break;
 		case 'c': {	// continue
 			avr->state = cpu_Running;
@@ -721,9 +1651,31 @@ gdb_handle_command(
 		case 's': {	// step
 			avr->state = cpu_Step;
 		}	break;
+		case 'b': {	// bs, bc: reverse step and continue
+			if (!avr->reverse || (cmd[0] != 's' && cmd[0] != 'c')) {
+				gdb_send_reply(g, "");
+				break;
+			}
+			g->reverse.step = cmd[0] == 's';
+			g->reverse.watch.what = g->reverse.stop.what = NULL;
+			g->reverse.scanning = 1;
+			int res = avr_reverse_find(avr->reverse, gdb_reverse_stop, g);
+			g->reverse.scanning = 0;
+			if (res == -1)
+				gdb_send_reply(g, "E01");
+			else if (res == 0)
+				gdb_send_stop_status(g, 5, "replaylog:begin", NULL);
+			else if (g->reverse.stop.what)
+				gdb_send_stop_status(g, 5, g->reverse.stop.what,
+						!strcmp(g->reverse.stop.what, "hwbreak") ?
+							NULL : &g->reverse.stop.addr);
+			else
+				gdb_send_quick_status(g, 5);
+		}	break;
 		case 'r': {	// deprecated, suggested for AVRStudio compatibility
 			avr_reset(avr);
 			avr->state = cpu_Stopped;
+			gdb_reverse_changed(g);
 		}	break;
 		case 'Z': 	// set clear break/watchpoint
 		case 'z': {
@@ -739,7 +1691,18 @@ gdb_handle_command(
 						gdb_send_reply(g, "E01");
 						break;
 					}
-
+					if (set) {	// ;X<len>,<expr>... target side conditions
+						int i = gdb_watch_find(&g->breakpoints, addr);
+						char * c = strchr(cmd, ';');
+						g->breakpoints.points[i].cond_len = 0;
+						if (c && !gdb_parse_agent_list(c,
+								g->breakpoints.points[i].cond,
+								&g->breakpoints.points[i].cond_len,
+								sizeof(g->breakpoints.points[i].cond))) {
+							gdb_send_reply(g, "E02");
+							break;
+						}
+					}
 					gdb_send_reply(g, "OK");
 					break;
 				case 2: // write watchpoint
@@ -820,17 +1783,19 @@ gdb_network_handler(
 	}
 
 	if (g->s != -1 && FD_ISSET(g->s, &read_set)) {
-		uint8_t buffer[1024];
-
-		ssize_t r = recv(g->s, buffer, sizeof(buffer)-1, 0);
+		ssize_t r = recv(g->s, g->rx + g->rx_len,
+						sizeof(g->rx) - g->rx_len - 1, 0);
 
 		if (r == 0) {
 			DBG(printf("%s connection closed\n", __FUNCTION__);)
 			close(g->s);
 			gdb_watch_clear(&g->breakpoints);
 			gdb_watch_clear(&g->watchpoints);
+			g->trace.running = 0;
+			g->trace.frame = -1;
 			g->avr->state = cpu_Running;	// resume
 			g->s = -1;
+			g->rx_len = 0;
 			return 1;
 		}
 		if (r == -1) {
@@ -838,40 +1803,47 @@ gdb_network_handler(
 			sleep(1);
 			return 1;
 		}
-		buffer[r] = 0;
-
-		uint8_t * src = buffer;
-		while (*src == '+' || *src == '-')
-			src++;
-		DBG(
-			if (!strncmp("$vFlashWrite", (char *)src, 12)) {
-				printf("%s: received Flashwrite command %ld bytes\n",
-					   __FUNCTION__, r);
-			} else {
-				printf("%s: received command %ld bytes\n'%s'\n",
-					   __FUNCTION__, r, buffer);
-			})
-		// hdump("gdb", buffer, r);
-		// control C -- lets send the guy a nice status packet
-		if (*src == 3) {
-			src++;
-			gdb_send_quick_status(g, 2); // SIGINT
-			g->avr->state = cpu_Stopped;
-			printf("GDB hit control-c\n");
-		} else if (*src == '$') {
-			// strip checksum
-			uint8_t * end = buffer + r - 1;
-			while (end > src && *end != '#')
-				*end-- = 0;
+		g->rx_len += r;
+
+		uint8_t * src = g->rx;
+		uint8_t * limit = g->rx + g->rx_len;
+		DBG(printf("%s: received %ld bytes, %d buffered\n",
+				__FUNCTION__, r, g->rx_len);)
+		// hdump("gdb", g->rx, g->rx_len);
+		while (src < limit) {
+			// control C -- lets send the guy a nice status packet
+			if (*src == 3) {
+				src++;
+				gdb_send_quick_status(g, 2); // SIGINT
+				g->avr->state = cpu_Stopped;
+				printf("GDB hit control-c\n");
+				continue;
+			}
+			if (*src != '$') {	// acks, or noise
+				src++;
+				continue;
+			}
+			/* '#' is always escaped in binary data, so the first one
+			 * is the end of the packet, followed by the checksum */
+			uint8_t * end = memchr(src, '#', limit - src);
+			if (!end || end + 3 > limit)
+				break;	// wait for the rest of it
 			*end = 0;
 			src++;
 			DBG(
-				if (strncmp("vFlashWrite", (char *)src, 11))
+				if (strncmp("vFlashWrite", (char *)src, 11) && *src != 'X')
 					printf("GDB command = '%s'\n", src);)
 			send(g->s, "+", 1, 0);
 			if (end > src)
 				gdb_handle_command(g, (char*)src, end - src);
+			src = end + 3;
+		}
+		g->rx_len = limit - src;
+		if (g->rx_len == sizeof(g->rx) - 1) {
+			AVR_LOG(g->avr, LOG_ERROR, "GDB: packet too large, dropped\n");
+			g->rx_len = 0;
 		}
+		memmove(g->rx, src, g->rx_len);
 	}
 	return 1;
 }
@@ -915,6 +1887,12 @@ avr_gdb_handle_watchpoints(
 		what = (kind & AVR_GDB_WATCH_ACCESS) ? "awatch" :
 			(kind & AVR_GDB_WATCH_WRITE) ? "watch" : "rwatch";
 		false_addr = addr + 0x800000;
+		// looking back, only note it, see gdb_reverse_stop()
+		if (g->reverse.scanning) {
+			g->reverse.watch.what = what;
+			g->reverse.watch.addr = false_addr;
+			return;
+		}
 		gdb_send_stop_status(g, 5, what, &false_addr);
 		avr->state = cpu_Stopped;
 	}
@@ -928,9 +1906,20 @@ avr_gdb_processor(
 	if (!avr || !avr->gdb)
 		return 0;
 	avr_gdb_t * g = avr->gdb;
-
-	if (avr->state == cpu_Running &&
-			gdb_watch_find(&g->breakpoints, avr->pc) != -1) {
+	int bp = -1;
+
+	if (avr->reverse && avr->state != cpu_Stopped)
+		avr_reverse_poll(avr->reverse);
+	if (avr->state == cpu_Running) {
+		if (g->trace.running)
+			gdb_trace_hit(g);
+		bp = gdb_watch_find(&g->breakpoints, avr->pc);
+		// conditions are evaluated here, not by a round trip to gdb
+		if (bp != -1 && !gdb_agent_cond(g, g->breakpoints.points[bp].cond,
+				g->breakpoints.points[bp].cond_len))
+			bp = -1;
+	}
+	if (bp != -1) {
 		DBG(printf("avr_gdb_processor hit breakpoint at %08x\n", avr->pc);)
 		gdb_send_stop_status(g, 5, "hwbreak", NULL);
 		avr->state = cpu_Stopped;
@@ -958,6 +1947,7 @@ avr_gdb_init(
 	memset(g, 0, sizeof(avr_gdb_t));
 
 	avr->gdb = NULL;
+	g->trace.frame = -1;
 
 	if ( network_init() ) {
 		AVR_LOG(avr, LOG_ERROR, "GDB: Can't initialize network");
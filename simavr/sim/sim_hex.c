@@ -24,6 +24,7 @@
 #include <string.h>
 #include "sim_hex.h"
 #include "sim_elf.h"
+#include "sim_firmware_cache.h"
 
 // friendly hex dump
 void hdump(const char *w, uint8_t *b, size_t l)
@@ -196,6 +197,8 @@ read_ihex_file(
  * the simulated MCU.  Progname is the current program name for error messages.
  *
  * Included here as it mostly specific to HEX files.
+ *
+ * If SIMAVR_FIRMWARE_CACHE is set, prepared firmwares are cached there.
  */
 
 void
@@ -203,6 +206,12 @@ sim_setup_firmware(const char * filename, uint32_t loadBase,
                    elf_firmware_t * fp, const char * progname)
 {
 	char * suffix = strrchr(filename, '.');
+	const char * cachedir = getenv(SIM_FIRMWARE_CACHE_ENV);
+	uint64_t key = 0;
+
+	if (cachedir && *cachedir &&
+			!sim_firmware_cache_load(cachedir, filename, loadBase, fp, &key))
+		return;
 
 	if (suffix && !strcasecmp(suffix, ".hex")) {
 		if (!(fp->mmcu[0] && fp->frequency > 0)) {
@@ -265,6 +274,8 @@ sim_setup_firmware(const char * filename, uint32_t loadBase,
 			exit(1);
 		}
 	}
+	if (key)
+		sim_firmware_cache_save(cachedir, key, fp);
 }
 
 #ifdef IHEX_TEST
@@ -27,6 +27,10 @@
 #include "sim_interrupts.h"
 #include "sim_avr.h"
 #include "sim_core.h"
+#include "sim_profile.h"
+#include "sim_itrace.h"
+#include "sim_stack.h"
+#include "sim_irqstat.h"
 
 DEFINE_FIFO(avr_int_vector_p, avr_int_pending);
 
@@ -54,6 +58,10 @@ avr_interrupt_reset(
 	avr->interrupt_state = 0;
 	for (int i = 0; i < table->vector_count; i++)
 		table->vector[i]->pending = 0;
+	if (avr->stack)
+		avr_stack_reset(avr->stack);
+	if (avr->irqstat)
+		avr_irqstat_reset(avr->irqstat);
 }
 
 void
@@ -141,6 +149,8 @@ avr_raise_interrupt(
 	if (avr_regbit_get(avr, vector->enable)) {
 		// Mark the interrupt as pending
 		vector->pending = 1;
+		if (avr->irqstat)
+			avr_irqstat_raise(avr->irqstat, vector->vector);
 
 		avr_int_table_p table = &avr->interrupts;
 
@@ -221,6 +231,10 @@ avr_interrupt_reti(
 		avr_int_vector_t * vector = table->running[--table->running_ptr];
 		avr_raise_irq(vector->irq + AVR_INT_IRQ_RUNNING, 0);
 	}
+	if (avr->stack)
+		avr_stack_reti(avr->stack);
+	if (avr->irqstat)
+		avr_irqstat_reti(avr->irqstat);
 	avr_raise_irq(table->irq + AVR_INT_IRQ_RUNNING,
 			table->running_ptr > 0 ?
 					table->running[table->running_ptr-1]->vector : 0);
@@ -282,6 +296,15 @@ avr_service_interrupts(
 		_avr_push_addr(avr, avr->pc);
 		avr_sreg_set(avr, S_I, 0);
 		avr->pc = vector->vector * avr->vector_size;
+		if (avr->profile)
+			avr_profile_irq(avr, vector->vector);
+		if (avr->stack)
+			avr_stack_irq(avr->stack, vector->vector);
+		if (avr->irqstat)
+			avr_irqstat_enter(avr->irqstat, vector->vector);
+		// the return address push isn't part of the next instruction
+		if (avr->itrace)
+			avr->itrace->write_addr = AVR_ITRACE_NO_WRITE;
 
 		avr_raise_irq(vector->irq + AVR_INT_IRQ_RUNNING, 1);
 		avr_raise_irq(table->irq + AVR_INT_IRQ_RUNNING, vector->vector);
@@ -0,0 +1,249 @@
+/*
+	sim_irqstat.c
+
+	Interrupt latency and duration histograms, per vector.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "sim_irqstat.h"
+
+uint32_t
+avr_irqstat_bucket_min(
+		int b)
+{
+	return b ? 1u << (b - 1) : 0;
+}
+
+static void
+_irqstat_add(
+		avr_irqstat_hist_t * h,
+		avr_cycle_count_t cycles)
+{
+	uint32_t v = cycles > 0xffffffff ? 0xffffffff : cycles;
+	int b = 0;
+
+	while (b < AVR_IRQSTAT_BUCKETS - 1 && v >= avr_irqstat_bucket_min(b + 1))
+		b++;
+	h->bucket[b]++;
+	if (!h->count || v < h->min)
+		h->min = v;
+	if (v > h->max)
+		h->max = v;
+	h->count++;
+	h->sum += v;
+}
+
+void
+avr_irqstat_raise(
+		avr_irqstat_t * st,
+		int vector)
+{
+	avr_irqstat_vector_t * v = &st->vector[vector];
+
+	v->pending = 1;
+	v->raised = st->avr->cycle;
+}
+
+/* The vector is taken, avr->pc is already its address */
+void
+avr_irqstat_enter(
+		avr_irqstat_t * st,
+		int vector)
+{
+	avr_t * avr = st->avr;
+	avr_irqstat_vector_t * v = &st->vector[vector];
+
+	if (v->pending) {
+		avr_cycle_count_t latency = avr->cycle - v->raised;
+		_irqstat_add(&v->latency, latency);
+		if (v->deadline && latency > v->deadline) {
+			if (!v->missed++) {
+				v->missed_cycle = avr->cycle;
+				AVR_LOG(avr, LOG_WARNING,
+						"IRQSTAT: IRQ%d taken %llu cycles after being raised, "
+						"deadline %u, at cycle %llu\n", vector,
+						(unsigned long long)latency, v->deadline,
+						(unsigned long long)avr->cycle);
+			}
+		}
+		v->pending = 0;
+	}
+	if (st->depth)
+		v->nested++;
+	if (st->depth == ARRAY_SIZE(st->level))
+		return;
+	st->level[st->depth].vector = vector;
+	st->level[st->depth].entry = avr->cycle;
+	if (++st->depth > v->nest_max)
+		v->nest_max = st->depth;
+}
+
+void
+avr_irqstat_reti(
+		avr_irqstat_t * st)
+{
+	if (!st->depth)
+		return;
+	st->depth--;
+	_irqstat_add(&st->vector[st->level[st->depth].vector].duration,
+			st->avr->cycle - st->level[st->depth].entry);
+}
+
+/*
+ * What was pending or running is gone, and the cycle count restarts.
+ * Called before avr_reset() clears avr->cycle, so the run so far is kept.
+ */
+void
+avr_irqstat_reset(
+		avr_irqstat_t * st)
+{
+	for (int i = 0; i < ARRAY_SIZE(st->vector); i++)
+		st->vector[i].pending = 0;
+	st->depth = 0;
+	st->elapsed += st->avr->cycle - st->start;
+	st->start = 0;
+}
+
+avr_irqstat_t *
+avr_irqstat_start(
+		avr_t * avr)
+{
+	avr_irqstat_t * st = calloc(1, sizeof(*st));
+
+	st->avr = avr;
+	st->start = avr->cycle;
+	avr->irqstat = st;
+	return st;
+}
+
+void
+avr_irqstat_stop(
+		avr_irqstat_t * st)
+{
+	if (st->avr->irqstat == st)
+		st->avr->irqstat = NULL;
+}
+
+void
+avr_irqstat_free(
+		avr_irqstat_t * st)
+{
+	avr_irqstat_stop(st);
+	free(st);
+}
+
+void
+avr_irqstat_deadline(
+		avr_irqstat_t * st,
+		int vector,
+		uint32_t cycles)
+{
+	if (vector < 0 || vector >= ARRAY_SIZE(st->vector))
+		return;
+	st->vector[vector].deadline = cycles;
+	st->vector[vector].missed = 0;
+}
+
+static void
+_irqstat_json_hist(
+		FILE * o,
+		const char * name,
+		avr_irqstat_hist_t * h)
+{
+	int last = AVR_IRQSTAT_BUCKETS;
+
+	// the buckets are listed up to the last one used
+	while (last && !h->bucket[last - 1])
+		last--;
+	fprintf(o, "\"%s\": { \"count\": %llu, \"sum\": %llu, "
+			"\"min\": %u, \"max\": %u, \"buckets\": [", name,
+			(unsigned long long)h->count, (unsigned long long)h->sum,
+			h->min, h->max);
+	for (int b = 0; b < last; b++)
+		fprintf(o, "%s%llu", b ? ", " : "", (unsigned long long)h->bucket[b]);
+	fprintf(o, "] }");
+}
+
+int
+avr_irqstat_write_json(
+		avr_irqstat_t * st,
+		const char * filename)
+{
+	avr_t * avr = st->avr;
+	FILE * o = fopen(filename, "w");
+
+	if (!o) {
+		AVR_LOG(avr, LOG_ERROR, "IRQSTAT: %s: %s\n", filename, strerror(errno));
+		return -1;
+	}
+	fprintf(o, "{\n  \"mmcu\": \"%s\",\n  \"frequency\": %u,\n"
+			"  \"cycles\": %llu,\n  \"bucket_min\": [", avr->mmcu,
+			avr->frequency,
+			(unsigned long long)(st->elapsed + avr->cycle - st->start));
+	for (int b = 0; b < AVR_IRQSTAT_BUCKETS; b++)
+		fprintf(o, "%s%u", b ? ", " : "", avr_irqstat_bucket_min(b));
+	fprintf(o, "],\n  \"vectors\": [");
+	int first = 1;
+	for (int i = 0; i < ARRAY_SIZE(st->vector); i++) {
+		avr_irqstat_vector_t * v = &st->vector[i];
+		if (!v->latency.count && !v->duration.count)
+			continue;
+		fprintf(o, "%s\n    { \"vector\": %d, \"nested\": %llu, "
+				"\"nest_max\": %u,\n      ", first ? "" : ",", i,
+				(unsigned long long)v->nested, v->nest_max);
+		if (v->deadline)
+			fprintf(o, "\"deadline\": %u, \"missed\": %llu, ", v->deadline,
+					(unsigned long long)v->missed);
+		_irqstat_json_hist(o, "latency", &v->latency);
+		fprintf(o, ",\n      ");
+		_irqstat_json_hist(o, "duration", &v->duration);
+		fprintf(o, " }");
+		first = 0;
+	}
+	fprintf(o, "\n  ]\n}\n");
+	fclose(o);
+	return 0;
+}
+
+void
+avr_irqstat_report(
+		avr_irqstat_t * st,
+		FILE * o)
+{
+	fprintf(o, "%6s %10s %24s %24s %4s %8s\n", "vector", "taken",
+			"latency min/avg/max", "duration min/avg/max", "nest", "missed");
+	for (int i = 0; i < ARRAY_SIZE(st->vector); i++) {
+		avr_irqstat_vector_t * v = &st->vector[i];
+		avr_irqstat_hist_t * l = &v->latency, * d = &v->duration;
+		char lat[32], dur[32], missed[24] = "-";
+		if (!l->count && !d->count)
+			continue;
+		snprintf(lat, sizeof(lat), "%u/%llu/%u", l->min,
+				(unsigned long long)(l->count ? l->sum / l->count : 0), l->max);
+		snprintf(dur, sizeof(dur), "%u/%llu/%u", d->min,
+				(unsigned long long)(d->count ? d->sum / d->count : 0), d->max);
+		if (v->deadline)
+			snprintf(missed, sizeof(missed), "%llu",
+					(unsigned long long)v->missed);
+		fprintf(o, "%6d %10llu %24s %24s %4u %8s\n", i,
+				(unsigned long long)l->count, lat, dur, v->nest_max, missed);
+	}
+}
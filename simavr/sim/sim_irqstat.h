@@ -0,0 +1,139 @@
+/*
+	sim_irqstat.h
+
+	Interrupt statistics: for each vector, histograms of the latency,
+	from being raised to being taken, and of the handler duration, to
+	its RETI, with how deep they nest; for checking real time deadlines
+	without reading traces.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_IRQSTAT_H__
+#define __SIM_IRQSTAT_H__
+
+#include <stdio.h>
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Bucket 0 counts 0 cycles, bucket n from 2^(n-1) to 2^n - 1 cycles,
+ * the last one everything above.
+ */
+#define AVR_IRQSTAT_BUCKETS		24
+
+typedef struct avr_irqstat_hist_t {
+	uint64_t			count;
+	uint64_t			sum;
+	uint32_t			min, max;
+	uint64_t			bucket[AVR_IRQSTAT_BUCKETS];
+} avr_irqstat_hist_t;
+
+typedef struct avr_irqstat_vector_t {
+	int					pending;
+	avr_cycle_count_t	raised;		// when it was, if pending
+	/*
+	 * The latency includes the time the interrupts were disabled, and
+	 * the time spent in other handlers; the duration includes the
+	 * handlers that interrupted this one.
+	 */
+	avr_irqstat_hist_t	latency;
+	avr_irqstat_hist_t	duration;
+	uint64_t			nested;		// times it was taken inside another
+	uint32_t			nest_max;	// deepest level it ran at, 1 not nested
+
+	uint32_t			deadline;	// max latency, 0 for none
+	uint64_t			missed;
+	avr_cycle_count_t	missed_cycle;	// first one
+} avr_irqstat_vector_t;
+
+typedef struct avr_irqstat_t {
+	avr_t *				avr;
+	avr_cycle_count_t	start;		// avr->cycle when started, or reset
+	avr_cycle_count_t	elapsed;	// cycles run before the last reset
+	avr_irqstat_vector_t	vector[64];
+	// handlers being run
+	struct {
+		uint8_t				vector;
+		avr_cycle_count_t	entry;
+	} level[64];
+	int					depth;
+} avr_irqstat_t;
+
+/*
+ * Starts collecting for 'avr' from now on, kept in avr->irqstat.
+ */
+avr_irqstat_t *
+avr_irqstat_start(
+		avr_t * avr);
+/*
+ * Stops collecting, the statistics can still be written, then freed.
+ */
+void
+avr_irqstat_stop(
+		avr_irqstat_t * st);
+void
+avr_irqstat_free(
+		avr_irqstat_t * st);
+/*
+ * Counts, and logs the first time, 'vector' being taken more than
+ * 'cycles' after it was raised; 0 removes the deadline.
+ */
+void
+avr_irqstat_deadline(
+		avr_irqstat_t * st,
+		int vector,
+		uint32_t cycles);
+/* Lower bound of histogram bucket 'b', in cycles */
+uint32_t
+avr_irqstat_bucket_min(
+		int b);
+
+/* Writes the vectors that were raised and their histograms as JSON */
+int
+avr_irqstat_write_json(
+		avr_irqstat_t * st,
+		const char * filename);
+/* Prints a line per vector, with the latency and duration ranges */
+void
+avr_irqstat_report(
+		avr_irqstat_t * st,
+		FILE * o);
+
+/* Called by sim_interrupts, when avr->irqstat is set */
+void
+avr_irqstat_raise(
+		avr_irqstat_t * st,
+		int vector);
+void
+avr_irqstat_enter(
+		avr_irqstat_t * st,
+		int vector);
+void
+avr_irqstat_reti(
+		avr_irqstat_t * st);
+void
+avr_irqstat_reset(
+		avr_irqstat_t * st);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_IRQSTAT_H__ */
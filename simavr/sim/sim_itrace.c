@@ -0,0 +1,459 @@
+/*
+	sim_itrace.c
+
+	Binary instruction trace, and the disassembler used to decode it.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "sim_itrace.h"
+#include "sim_elf.h"
+
+static int
+_itrace_write(
+		int fd,
+		const void * buf,
+		size_t len)
+{
+	while (len) {
+		ssize_t w = write(fd, buf, len);
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf = (const uint8_t *)buf + w;
+		len -= w;
+	}
+	return 0;
+}
+
+static int
+_itrace_header(
+		avr_t * avr,
+		int fd)
+{
+	avr_itrace_header_t h = {
+		.magic = AVR_ITRACE_MAGIC,
+		.version = AVR_ITRACE_VERSION,
+		.rec_size = sizeof(avr_itrace_rec_t),
+		.frequency = avr->frequency,
+	};
+	if (avr->mmcu)
+		strncpy(h.mmcu, avr->mmcu, sizeof(h.mmcu) - 1);
+	return _itrace_write(fd, &h, sizeof(h));
+}
+
+static avr_itrace_t *
+_itrace_new(
+		avr_t * avr,
+		uint32_t size)
+{
+	avr_itrace_t * t = calloc(1, sizeof(*t));
+
+	t->avr = avr;
+	t->size = size;
+	t->rec = malloc(size * sizeof(t->rec[0]));
+	t->fd = -1;
+	t->write_addr = AVR_ITRACE_NO_WRITE;
+	if (!t->rec) {
+		AVR_LOG(avr, LOG_ERROR, "ITRACE: can't allocate %u records\n", size);
+		free(t);
+		return NULL;
+	}
+	return t;
+}
+
+avr_itrace_t *
+avr_itrace_open(
+		avr_t * avr,
+		const char * filename,
+		uint32_t size)
+{
+	int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (fd < 0 || _itrace_header(avr, fd)) {
+		AVR_LOG(avr, LOG_ERROR, "ITRACE: %s: %s\n", filename, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return NULL;
+	}
+	avr_itrace_t * t = _itrace_new(avr, size ? size : AVR_ITRACE_FILE_SIZE);
+	if (!t) {
+		close(fd);
+		return NULL;
+	}
+	t->fd = fd;
+	avr->itrace = t;
+	return t;
+}
+
+avr_itrace_t *
+avr_itrace_flight(
+		avr_t * avr,
+		const char * dump,
+		uint32_t size)
+{
+	uint32_t s = 1024;
+
+	if (!size)
+		size = AVR_ITRACE_FLIGHT_SIZE;
+	while (s < size)
+		s <<= 1;
+	avr_itrace_t * t = _itrace_new(avr, s);
+	if (!t)
+		return NULL;
+	t->dump = dump ? strdup(dump) : NULL;
+	avr->itrace = t;
+	return t;
+}
+
+int
+avr_itrace_flush(
+		avr_itrace_t * t)
+{
+	if (t->fd < 0 || !t->pos)
+		return 0;
+	int res = _itrace_write(t->fd, t->rec, t->pos * sizeof(t->rec[0]));
+	if (res) {
+		AVR_LOG(t->avr, LOG_ERROR, "ITRACE: write: %s, stopping\n",
+				strerror(errno));
+		// still attached, so avr_terminate() frees it, the ring just wraps
+		close(t->fd);
+		t->fd = -1;
+	}
+	t->pos = 0;
+	return res;
+}
+
+void
+avr_itrace_full(
+		avr_itrace_t * t)
+{
+	if (t->fd < 0)
+		t->pos = 0;		// the ring wraps around
+	else
+		avr_itrace_flush(t);
+}
+
+int
+avr_itrace_dump(
+		avr_itrace_t * t,
+		const char * filename)
+{
+	int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	int res = -1;
+
+	if (fd < 0 || _itrace_header(t->avr, fd))
+		goto out;
+	if (t->count > t->pos &&	// wrapped, the oldest are after pos
+			_itrace_write(fd, t->rec + t->pos,
+				(t->size - t->pos) * sizeof(t->rec[0])))
+		goto out;
+	res = _itrace_write(fd, t->rec, t->pos * sizeof(t->rec[0]));
+out:
+	if (res)
+		AVR_LOG(t->avr, LOG_ERROR, "ITRACE: %s: %s\n", filename, strerror(errno));
+	else
+		AVR_LOG(t->avr, LOG_OUTPUT, "ITRACE: last %llu instructions in %s\n",
+				(unsigned long long)(t->count < t->size ? t->count : t->size),
+				filename);
+	if (fd >= 0)
+		close(fd);
+	return res;
+}
+
+void
+avr_itrace_close(
+		avr_itrace_t * t)
+{
+	if (!t)
+		return;
+	if (t->avr->itrace == t)
+		t->avr->itrace = NULL;
+	if (t->fd >= 0) {
+		avr_itrace_flush(t);
+		close(t->fd);
+	}
+	free(t->dump);
+	free(t->rec);
+	free(t);
+}
+
+/*
+ * Disassembler. The operand letters of the table are:
+ * d/r  5 bits registers		D/R  r16..r31		f/g  r16..r23
+ * M/N  movw register pairs		w    adiw pair		W    adiw constant
+ * K    8 bits constant			x    des round		q    ldd/std offset
+ * A    in/out io address		a    sbi/cbi io address
+ * b    bit number				j    rjmp/rcall target
+ * J    jmp/call target			S    lds/sts address (second word)
+ * Anything else is copied as is. Branches and SREG bit set/clear
+ * are decoded on their own, to use their usual names.
+ */
+typedef struct itrace_op_t {
+	uint16_t		mask, match;
+	const char *	name;
+	const char *	args;
+} itrace_op_t;
+
+static const itrace_op_t _itrace_ops[] = {
+	{ 0xffff, 0x0000, "nop", "" },
+	{ 0xffff, 0x9508, "ret", "" },
+	{ 0xffff, 0x9518, "reti", "" },
+	{ 0xffff, 0x9588, "sleep", "" },
+	{ 0xffff, 0x9598, "break", "" },
+	{ 0xffff, 0x95a8, "wdr", "" },
+	{ 0xffff, 0x95c8, "lpm", "" },
+	{ 0xffff, 0x95d8, "elpm", "" },
+	{ 0xffff, 0x95e8, "spm", "" },
+	{ 0xffff, 0x95f8, "spm", "Z+" },
+	{ 0xffff, 0x9409, "ijmp", "" },
+	{ 0xffff, 0x9419, "eijmp", "" },
+	{ 0xffff, 0x9509, "icall", "" },
+	{ 0xffff, 0x9519, "eicall", "" },
+	{ 0xff00, 0x0100, "movw", "M, N" },
+	{ 0xff00, 0x0200, "muls", "D, R" },
+	{ 0xff88, 0x0300, "mulsu", "f, g" },
+	{ 0xff88, 0x0308, "fmul", "f, g" },
+	{ 0xff88, 0x0380, "fmuls", "f, g" },
+	{ 0xff88, 0x0388, "fmulsu", "f, g" },
+	{ 0xfc00, 0x0400, "cpc", "d, r" },
+	{ 0xfc00, 0x0800, "sbc", "d, r" },
+	{ 0xfc00, 0x0c00, "add", "d, r" },
+	{ 0xfc00, 0x1000, "cpse", "d, r" },
+	{ 0xfc00, 0x1400, "cp", "d, r" },
+	{ 0xfc00, 0x1800, "sub", "d, r" },
+	{ 0xfc00, 0x1c00, "adc", "d, r" },
+	{ 0xfc00, 0x2000, "and", "d, r" },
+	{ 0xfc00, 0x2400, "eor", "d, r" },
+	{ 0xfc00, 0x2800, "or", "d, r" },
+	{ 0xfc00, 0x2c00, "mov", "d, r" },
+	{ 0xf000, 0x3000, "cpi", "D, K" },
+	{ 0xf000, 0x4000, "sbci", "D, K" },
+	{ 0xf000, 0x5000, "subi", "D, K" },
+	{ 0xf000, 0x6000, "ori", "D, K" },
+	{ 0xf000, 0x7000, "andi", "D, K" },
+	{ 0xfe0f, 0x9000, "lds", "d, S" },
+	{ 0xfe0f, 0x9001, "ld", "d, Z+" },
+	{ 0xfe0f, 0x9002, "ld", "d, -Z" },
+	{ 0xfe0f, 0x9004, "lpm", "d, Z" },
+	{ 0xfe0f, 0x9005, "lpm", "d, Z+" },
+	{ 0xfe0f, 0x9006, "elpm", "d, Z" },
+	{ 0xfe0f, 0x9007, "elpm", "d, Z+" },
+	{ 0xfe0f, 0x9009, "ld", "d, Y+" },
+	{ 0xfe0f, 0x900a, "ld", "d, -Y" },
+	{ 0xfe0f, 0x900c, "ld", "d, X" },
+	{ 0xfe0f, 0x900d, "ld", "d, X+" },
+	{ 0xfe0f, 0x900e, "ld", "d, -X" },
+	{ 0xfe0f, 0x900f, "pop", "d" },
+	{ 0xfe0f, 0x9200, "sts", "S, d" },
+	{ 0xfe0f, 0x9201, "st", "Z+, d" },
+	{ 0xfe0f, 0x9202, "st", "-Z, d" },
+	{ 0xfe0f, 0x9204, "xch", "Z, d" },
+	{ 0xfe0f, 0x9205, "las", "Z, d" },
+	{ 0xfe0f, 0x9206, "lac", "Z, d" },
+	{ 0xfe0f, 0x9207, "lat", "Z, d" },
+	{ 0xfe0f, 0x9209, "st", "Y+, d" },
+	{ 0xfe0f, 0x920a, "st", "-Y, d" },
+	{ 0xfe0f, 0x920c, "st", "X, d" },
+	{ 0xfe0f, 0x920d, "st", "X+, d" },
+	{ 0xfe0f, 0x920e, "st", "-X, d" },
+	{ 0xfe0f, 0x920f, "push", "d" },
+	{ 0xd208, 0x8000, "ldd", "d, Z+q" },
+	{ 0xd208, 0x8008, "ldd", "d, Y+q" },
+	{ 0xd208, 0x8200, "std", "Z+q, d" },
+	{ 0xd208, 0x8208, "std", "Y+q, d" },
+	{ 0xfe0f, 0x9400, "com", "d" },
+	{ 0xfe0f, 0x9401, "neg", "d" },
+	{ 0xfe0f, 0x9402, "swap", "d" },
+	{ 0xfe0f, 0x9403, "inc", "d" },
+	{ 0xfe0f, 0x9405, "asr", "d" },
+	{ 0xfe0f, 0x9406, "lsr", "d" },
+	{ 0xfe0f, 0x9407, "ror", "d" },
+	{ 0xfe0f, 0x940a, "dec", "d" },
+	{ 0xff0f, 0x940b, "des", "x" },
+	{ 0xfe0e, 0x940c, "jmp", "J" },
+	{ 0xfe0e, 0x940e, "call", "J" },
+	{ 0xff00, 0x9600, "adiw", "w, W" },
+	{ 0xff00, 0x9700, "sbiw", "w, W" },
+	{ 0xff00, 0x9800, "cbi", "a, b" },
+	{ 0xff00, 0x9900, "sbic", "a, b" },
+	{ 0xff00, 0x9a00, "sbi", "a, b" },
+	{ 0xff00, 0x9b00, "sbis", "a, b" },
+	{ 0xfc00, 0x9c00, "mul", "d, r" },
+	{ 0xf800, 0xb000, "in", "d, A" },
+	{ 0xf800, 0xb800, "out", "A, d" },
+	{ 0xf000, 0xc000, "rjmp", "j" },
+	{ 0xf000, 0xd000, "rcall", "j" },
+	{ 0xf000, 0xe000, "ldi", "D, K" },
+	{ 0xfe08, 0xf800, "bld", "d, b" },
+	{ 0xfe08, 0xfa00, "bst", "d, b" },
+	{ 0xfe08, 0xfc00, "sbrc", "d, b" },
+	{ 0xfe08, 0xfe00, "sbrs", "d, b" },
+	{ 0 },
+};
+
+/* brbs/brbc, bset/bclr by SREG bit */
+static const char * _itrace_brbs[8] = {
+	"brcs", "breq", "brmi", "brvs", "brlt", "brhs", "brts", "brie" };
+static const char * _itrace_brbc[8] = {
+	"brcc", "brne", "brpl", "brvc", "brge", "brhc", "brtc", "brid" };
+static const char * _itrace_sreg = "cznvshti";
+
+int
+avr_itrace_disasm(
+		uint16_t o,
+		uint16_t op2,
+		uint32_t pc,
+		char * buf,
+		size_t size)
+{
+	const itrace_op_t * op = _itrace_ops;
+	int d = (o >> 4) & 0x1f, r = (o & 0xf) | ((o >> 5) & 0x10);
+
+	if ((o & 0xf800) == 0xf000) {
+		int k = ((int16_t)(o << 6) >> 9) * 2;
+		snprintf(buf, size, "%-7s .%+d [%04x]",
+				(o & 0x0400 ? _itrace_brbc : _itrace_brbs)[o & 7], k,
+				pc + 2 + k);
+		return 1;
+	}
+	if ((o & 0xff0f) == 0x9408) {	// bset, bclr
+		snprintf(buf, size, "%s%c", o & 0x80 ? "cl" : "se",
+				_itrace_sreg[(o >> 4) & 7]);
+		return 1;
+	}
+	// the usual aliases
+	if (((o & 0xfc00) == 0x0c00 || (o & 0xfc00) == 0x1c00 ||
+			(o & 0xfc00) == 0x2000 || (o & 0xfc00) == 0x2400) && d == r) {
+		const char * alias = (o & 0xfc00) == 0x0c00 ? "lsl" :
+				(o & 0xfc00) == 0x1c00 ? "rol" :
+				(o & 0xfc00) == 0x2000 ? "tst" : "clr";
+		snprintf(buf, size, "%-7s r%d", alias, d);
+		return 1;
+	}
+	while (op->mask && (o & op->mask) != op->match)
+		op++;
+	if (!op->mask) {
+		snprintf(buf, size, "%-7s 0x%04x", ".word", o);
+		return 1;
+	}
+	if (op->mask == 0xd208 && !((o & 7) | ((o >> 7) & 0x18) | ((o >> 8) & 0x20))) {
+		// ldd/std with no offset are ld/st
+		char p = o & 8 ? 'Y' : 'Z';
+		if (o & 0x0200)
+			snprintf(buf, size, "%-7s %c, r%d", "st", p, d);
+		else
+			snprintf(buf, size, "%-7s r%d, %c", "ld", d, p);
+		return 1;
+	}
+	int len = snprintf(buf, size, "%-7s ", op->name);
+	int words = 1;
+	for (const char * a = op->args; *a && len < size; a++) {
+		int v = -1;
+		const char * fmt = "r%d";
+		switch (*a) {
+			case 'd': v = d; break;
+			case 'r': v = r; break;
+			case 'D': v = 16 + ((o >> 4) & 0xf); break;
+			case 'R': v = 16 + (o & 0xf); break;
+			case 'f': v = 16 + ((o >> 4) & 7); break;
+			case 'g': v = 16 + (o & 7); break;
+			case 'M': v = (o >> 3) & 0x1e; break;
+			case 'N': v = (o << 1) & 0x1e; break;
+			case 'w': v = 24 + ((o >> 3) & 6); break;
+			case 'W': v = ((o >> 2) & 0x30) | (o & 0xf); fmt = "%d"; break;
+			case 'K': v = ((o >> 4) & 0xf0) | (o & 0xf); fmt = "0x%02x"; break;
+			case 'x': v = (o >> 4) & 0xf; fmt = "%d"; break;
+			case 'q': v = (o & 7) | ((o >> 7) & 0x18) | ((o >> 8) & 0x20);
+				fmt = "%d"; break;
+			case 'A': v = ((o >> 5) & 0x30) | (o & 0xf); fmt = "0x%02x"; break;
+			case 'a': v = (o >> 3) & 0x1f; fmt = "0x%02x"; break;
+			case 'b': v = o & 7; fmt = "%d"; break;
+			case 'j': v = (pc + 2 + ((int16_t)(o << 4) >> 3)) & 0xffffff;
+				fmt = "0x%04x"; break;
+			case 'J': v = ((((o & 0x01f0) >> 3) | (o & 1)) << 16 | op2) << 1;
+				fmt = "0x%04x"; words = 2; break;
+			case 'S': v = op2; fmt = "0x%04x"; words = 2; break;
+		}
+		if (v >= 0)
+			len += snprintf(buf + len, size - len, fmt, v);
+		else
+			buf[len++] = *a;
+	}
+	if (len >= size)
+		len = size - 1;
+	while (len && buf[len - 1] == ' ')
+		len--;
+	buf[len] = 0;
+	return words;
+}
+
+/* "symbol+offset" for a flash address, or just the address */
+static const char *
+_itrace_where(
+		avr_t * avr,
+		uint32_t addr,
+		char * buf,
+		size_t size)
+{
+	const avr_symbol_t * s = avr ? avr_symbol_find(avr, addr) : NULL;
+
+	if (!s || s->addr >= AVR_SEGMENT_OFFSET_DATA)
+		snprintf(buf, size, "%04x", addr);
+	else if (addr == s->addr)
+		snprintf(buf, size, "%s", s->symbol);
+	else
+		snprintf(buf, size, "%s+0x%x", s->symbol, addr - s->addr);
+	return buf;
+}
+
+void
+avr_itrace_print(
+		const avr_itrace_rec_t * r,
+		avr_t * avr,
+		FILE * o)
+{
+	uint32_t pc = AVR_ITRACE_PC(r);
+	char text[64], where[64], sreg[9];
+
+	avr_itrace_disasm(r->opcode, r->op2, pc, text, sizeof(text));
+	// name the target of the jumps and calls
+	const char * t = strrchr(text, ' ');
+	if (avr && avr->symbolcount && t && !strncmp(t, " 0x", 3) &&
+			((r->opcode & 0xe000) == 0xc000 || (r->opcode & 0xfe0c) == 0x940c)) {
+		size_t l = strlen(text);
+		char target[48];
+		snprintf(text + l, sizeof(text) - l, " <%s>",
+				_itrace_where(avr, strtoul(t + 1, NULL, 16), target, sizeof(target)));
+	}
+	for (int i = 0; i < 8; i++)
+		sreg[i] = r->sreg & (1 << i) ? _itrace_sreg[i] - 'a' + 'A' : '.';
+	sreg[8] = 0;
+	fprintf(o, "%12llu %04x %-24s %-32s %s",
+			(unsigned long long)AVR_ITRACE_CYCLE(r), pc,
+			_itrace_where(avr, pc, where, sizeof(where)), text, sreg);
+	if (r->addr != AVR_ITRACE_NO_WRITE)
+		fprintf(o, " [%04x]=%02x", r->addr, r->value);
+	fprintf(o, "\n");
+}
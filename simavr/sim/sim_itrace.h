@@ -0,0 +1,188 @@
+/*
+	sim_itrace.h
+
+	Binary instruction trace: one small record per instruction, streamed
+	to a file in large blocks, or kept in a "flight recorder" ring that
+	is dumped when the core crashes. The records are decoded offline.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_ITRACE_H__
+#define __SIM_ITRACE_H__
+
+#include <stdio.h>
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define AVR_ITRACE_MAGIC		0x52544153	// 'SATR'
+#define AVR_ITRACE_VERSION		1
+#define AVR_ITRACE_NO_WRITE		0xffff
+
+/* Default buffer, in records, 1MB for a file, 16MB for the flight recorder */
+#define AVR_ITRACE_FILE_SIZE	(64 * 1024)
+#define AVR_ITRACE_FLIGHT_SIZE	(1024 * 1024)
+
+typedef struct avr_itrace_header_t {
+	uint32_t	magic;
+	uint16_t	version;
+	uint16_t	rec_size;	// sizeof(avr_itrace_rec_t)
+	uint32_t	frequency;
+	uint32_t	reserved;
+	char		mmcu[16];
+} avr_itrace_header_t;
+
+/*
+ * One executed instruction. The cycle is the one it started at, modulo
+ * 2^40 (19 hours at 16MHz). The second flash word is always recorded,
+ * so 32 bits instructions can be decoded without the firmware.
+ */
+typedef struct avr_itrace_rec_t {
+	uint64_t	cycle_pc;	// cycle << 24 | pc, pc in bytes
+	uint16_t	opcode, op2;
+	uint16_t	addr;		// data address written, or AVR_ITRACE_NO_WRITE
+	uint8_t		value;		// ... and the value written there
+	uint8_t		sreg;		// after the instruction
+} avr_itrace_rec_t;
+
+#define AVR_ITRACE_CYCLE(_r)	((_r)->cycle_pc >> 24)
+#define AVR_ITRACE_PC(_r)		((uint32_t)((_r)->cycle_pc & 0xffffff))
+
+typedef struct avr_itrace_t {
+	avr_t *				avr;
+	avr_itrace_rec_t *	rec;
+	uint32_t			size;		// records, a power of two for the ring
+	uint32_t			pos;		// next record
+	uint64_t			count;		// recorded since start
+	int					fd;			// stream file, -1 for the flight recorder
+	char *				dump;		// flight recorder dump file
+
+	// write of the current instruction, see avr_itrace_write()
+	uint16_t			write_addr;
+	uint8_t				write_value;
+} avr_itrace_t;
+
+/*
+ * Records every instruction to 'filename', 'size' records are buffered
+ * and written in one go. 0 picks the default.
+ */
+avr_itrace_t *
+avr_itrace_open(
+		avr_t * avr,
+		const char * filename,
+		uint32_t size);
+/*
+ * Only keeps the last 'size' (rounded up to a power of two) instructions
+ * in memory, they are written to 'dump' when the core crashes, or by
+ * avr_itrace_dump().
+ */
+avr_itrace_t *
+avr_itrace_flight(
+		avr_t * avr,
+		const char * dump,
+		uint32_t size);
+/* Writes the flight recorder ring, oldest first */
+int
+avr_itrace_dump(
+		avr_itrace_t * t,
+		const char * filename);
+/*
+ * Writes what's buffered, for the stream; the ring is left alone.
+ * On a write error the file is closed, and nothing more is written.
+ */
+int
+avr_itrace_flush(
+		avr_itrace_t * t);
+/* Flushes and detaches from the avr, then frees */
+void
+avr_itrace_close(
+		avr_itrace_t * t);
+
+/* Called by the core when avr->itrace is set */
+void
+avr_itrace_full(
+		avr_itrace_t * t);
+
+/*
+ * Keeps the first write of the instruction, but SP updates give way to
+ * anything else, so push/pop/call show the data and not the SP.
+ */
+static inline void
+avr_itrace_write(
+		avr_itrace_t * t,
+		uint16_t addr,
+		uint8_t v)
+{
+	if (t->write_addr == AVR_ITRACE_NO_WRITE ||
+			((t->write_addr == R_SPL || t->write_addr == R_SPH) &&
+				addr != R_SPL && addr != R_SPH)) {
+		t->write_addr = addr;
+		t->write_value = v;
+	}
+}
+
+static inline void
+avr_itrace_step(
+		avr_itrace_t * t,
+		avr_t * avr,
+		uint16_t opcode)
+{
+	avr_itrace_rec_t * r = &t->rec[t->pos];
+	uint8_t sreg = 0;
+
+	for (int i = 0; i < 8; i++)
+		sreg |= (avr->sreg[i] != 0) << i;
+	r->cycle_pc = (uint64_t)avr->cycle << 24 | avr->pc;
+	r->opcode = opcode;
+	r->op2 = avr->flash[avr->pc + 2] | (avr->flash[avr->pc + 3] << 8);
+	r->addr = t->write_addr;
+	r->value = t->write_value;
+	r->sreg = sreg;
+	t->write_addr = AVR_ITRACE_NO_WRITE;
+	t->count++;
+	if (++t->pos == t->size)
+		avr_itrace_full(t);
+}
+
+/*
+ * Disassembles an instruction at byte address 'pc' into 'buf', returns
+ * its size in words.
+ */
+int
+avr_itrace_disasm(
+		uint16_t opcode,
+		uint16_t op2,
+		uint32_t pc,
+		char * buf,
+		size_t size);
+/*
+ * Prints a record as a line of text; when 'avr' has symbols they are
+ * used for the pc and the jump targets.
+ */
+void
+avr_itrace_print(
+		const avr_itrace_rec_t * r,
+		avr_t * avr,
+		FILE * o);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_ITRACE_H__ */
@@ -0,0 +1,265 @@
+/*
+	sim_pace.c
+
+	Real time pacing, with drift compensation.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sim_pace.h"
+
+static uint64_t
+_pace_now(void)
+{
+	struct timespec tp;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (uint64_t)tp.tv_sec * 1000000000ULL + tp.tv_nsec;
+}
+
+/*
+ * An absolute deadline doesn't drift when the thread is woken up late,
+ * or interrupted by a signal.
+ */
+static void
+_pace_sleep_until(
+		uint64_t deadline)
+{
+#if defined(TIMER_ABSTIME) && !defined(__APPLE__)
+	struct timespec ts = {
+		.tv_sec = deadline / 1000000000ULL,
+		.tv_nsec = deadline % 1000000000ULL,
+	};
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+#else
+	uint64_t now = _pace_now();
+	if (deadline > now)
+		usleep((deadline - now) / 1000);
+#endif
+}
+
+static void
+_pace_rebase(
+		avr_pace_t * p,
+		uint64_t now)
+{
+	avr_t * avr = p->avr;
+	double ratio = p->mode == AVR_PACE_REALTIME ? 1.0 : p->ratio;
+
+	p->base_ns = now;
+	p->base_cycle = avr->cycle;
+	p->frequency = avr->frequency;
+	p->lag = 0;
+	if (p->mode == AVR_PACE_OFF || !avr->frequency) {
+		p->next = ~(avr_cycle_count_t)0;
+		return;
+	}
+	p->ns_per_cycle = 1E9 / (avr->frequency * ratio);
+	p->step = p->quantum / p->ns_per_cycle;
+	if (!p->step)
+		p->step = 1;
+	p->next = p->base_cycle + p->step;
+}
+
+/* Returns non zero if the time base had to change */
+static int
+_pace_check(
+		avr_pace_t * p,
+		uint64_t now)
+{
+	avr_t * avr = p->avr;
+
+	// reset, snapshot restored, new frequency...
+	if (avr->cycle < p->base_cycle || avr->frequency != p->frequency) {
+		_pace_rebase(p, now);
+		return 1;
+	}
+	return p->mode == AVR_PACE_OFF || !p->frequency;
+}
+
+static void
+_pace_until(
+		avr_pace_t * p,
+		avr_cycle_count_t cycle)
+{
+	uint64_t now = _pace_now();
+	uint64_t deadline = p->base_ns +
+			(uint64_t)((cycle - p->base_cycle) * p->ns_per_cycle);
+
+	p->stats.checks++;
+	if (now < deadline) {
+		_pace_sleep_until(deadline);
+		uint64_t woke = _pace_now();
+		p->stats.waits++;
+		p->stats.slept += woke - now;
+		// made up at the next deadline, as that one is absolute too
+		if (woke > deadline && woke - deadline > p->stats.oversleep_max)
+			p->stats.oversleep_max = woke - deadline;
+		p->lag = 0;
+		return;
+	}
+	p->lag = now - deadline;
+	p->stats.late++;
+	if (p->lag > p->stats.lag_max)
+		p->stats.lag_max = p->lag;
+	// the host can't keep up, catching up later would run flat out
+	if (p->lag > p->max_lag) {
+		AVR_LOG(p->avr, LOG_TRACE, "PACE: %lluus behind, skipped\n",
+				(unsigned long long)p->lag / 1000);
+		p->stats.overruns++;
+		p->stats.dropped += p->lag;
+		p->base_ns = now;
+		p->base_cycle = cycle;
+		p->lag = 0;
+	}
+}
+
+static void
+_pace_next(
+		avr_pace_t * p)
+{
+	avr_cycle_count_t done = p->avr->cycle - p->base_cycle;
+
+	// frames stay aligned on the time base
+	p->next = p->base_cycle + (done / p->step + 1) * p->step;
+}
+
+void
+avr_pace_wait(
+		avr_pace_t * p)
+{
+	if (_pace_check(p, _pace_now()))
+		return;
+	if (p->mode == AVR_PACE_FRAME && p->frame)
+		p->frame(p->avr, p->frame_param);
+	_pace_until(p, p->avr->cycle);
+	_pace_next(p);
+}
+
+void
+avr_pace_sleep(
+		avr_pace_t * p,
+		avr_cycle_count_t cycle)
+{
+	if (_pace_check(p, _pace_now()))
+		return;
+	// the frames the core sleeps through still get shown
+	if (p->mode == AVR_PACE_FRAME) {
+		while (p->next <= cycle) {
+			_pace_until(p, p->next);
+			if (p->frame)
+				p->frame(p->avr, p->frame_param);
+			p->next += p->step;
+		}
+	}
+	_pace_until(p, cycle);
+}
+
+void
+avr_pace_set(
+		avr_pace_t * p,
+		int mode,
+		double ratio)
+{
+	p->mode = mode;
+	p->ratio = ratio > 0 ? ratio : 1.0;
+	_pace_rebase(p, _pace_now());
+}
+
+void
+avr_pace_frame(
+		avr_pace_t * p,
+		uint64_t period,
+		avr_pace_frame_t frame,
+		void * param)
+{
+	p->quantum = period ? period : AVR_PACE_QUANTUM;
+	p->frame = frame;
+	p->frame_param = param;
+	_pace_rebase(p, _pace_now());
+}
+
+avr_pace_t *
+avr_pace_init(
+		avr_t * avr,
+		int mode,
+		double ratio)
+{
+	avr_pace_t * p = avr->pace;
+
+	// there is no time base to follow
+	if (!avr->frequency && mode != AVR_PACE_OFF) {
+		AVR_LOG(avr, LOG_ERROR, "PACE: the core frequency isn't set\n");
+		return NULL;
+	}
+	if (!p) {
+		p = calloc(1, sizeof(*p));
+		p->avr = avr;
+		p->quantum = AVR_PACE_QUANTUM;
+		p->max_lag = AVR_PACE_MAX_LAG;
+		avr->pace = p;
+	}
+	avr_pace_set(p, mode, ratio);
+	return p;
+}
+
+void
+avr_pace_free(
+		avr_pace_t * p)
+{
+	if (!p)
+		return;
+	if (p->avr->pace == p)
+		p->avr->pace = NULL;
+	free(p);
+}
+
+void
+avr_pace_report(
+		avr_pace_t * p,
+		FILE * out)
+{
+	static const char * mode[] = {
+		[AVR_PACE_OFF] = "off",
+		[AVR_PACE_REALTIME] = "real time",
+		[AVR_PACE_RATIO] = "ratio",
+		[AVR_PACE_FRAME] = "frames",
+	};
+	avr_pace_stats_t * s = &p->stats;
+
+	fprintf(out, "pacing: %s", mode[p->mode]);
+	if (p->mode == AVR_PACE_RATIO || p->mode == AVR_PACE_FRAME)
+		fprintf(out, " x%g", p->ratio);
+	fprintf(out, ", %llu checks every %lluus\n",
+			(unsigned long long)s->checks,
+			(unsigned long long)p->quantum / 1000);
+	fprintf(out, "  ahead %llu times, slept %llums, oversleep max %lluus\n",
+			(unsigned long long)s->waits,
+			(unsigned long long)s->slept / 1000000,
+			(unsigned long long)s->oversleep_max / 1000);
+	fprintf(out, "  behind %llu times, lag max %lluus, "
+			"%llu overruns gave up %llums\n",
+			(unsigned long long)s->late,
+			(unsigned long long)s->lag_max / 1000,
+			(unsigned long long)s->overruns,
+			(unsigned long long)s->dropped / 1000000);
+}
@@ -0,0 +1,145 @@
+/*
+	sim_pace.h
+
+	Real time pacing: keeps the simulated time in step with the wall
+	clock, or a multiple of it. The core is checked every so many cycles,
+	running or sleeping, against an absolute deadline, so time lost to
+	scheduling or oversleeping is made up on the next check instead of
+	accumulating.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_PACE_H__
+#define __SIM_PACE_H__
+
+#include <stdio.h>
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define AVR_PACE_QUANTUM	1000000		// ns of wall clock between checks
+#define AVR_PACE_MAX_LAG	100000000	// ns, more than that is given up
+
+enum {
+	AVR_PACE_OFF = 0,		// as fast as possible, sleeping too
+	AVR_PACE_REALTIME,
+	AVR_PACE_RATIO,			// 'ratio' times real time, 0.25, 10...
+	AVR_PACE_FRAME,			// whole frames, see avr_pace_frame()
+};
+
+/* Called at the start of each frame, in AVR_PACE_FRAME mode */
+typedef void (*avr_pace_frame_t)(
+		struct avr_t * avr,
+		void * param);
+
+typedef struct avr_pace_stats_t {
+	uint64_t	checks;
+	uint64_t	waits;			// times the core was ahead
+	uint64_t	slept;			// ns
+	uint64_t	oversleep_max;	// ns, woken up past the deadline
+	uint64_t	late;			// times the core was behind
+	uint64_t	lag_max;		// ns
+	uint64_t	overruns;		// times it was too far behind to catch up
+	uint64_t	dropped;		// ns given up by these
+} avr_pace_stats_t;
+
+typedef struct avr_pace_t {
+	avr_t *				avr;
+	int					mode;
+	double				ratio;
+	uint64_t			quantum;	// ns of wall clock between checks
+	uint64_t			max_lag;	// ns
+
+	avr_pace_frame_t	frame;
+	void *				frame_param;
+
+	/*
+	 * The deadline of cycle c is base_ns + (c - base_cycle) * ns_per_cycle,
+	 * these change only when the mode, ratio or frequency do.
+	 */
+	uint64_t			base_ns;
+	avr_cycle_count_t	base_cycle;
+	double				ns_per_cycle;
+	uint32_t			frequency;
+	avr_cycle_count_t	step;		// cycles between checks
+	avr_cycle_count_t	next;		// cycle of the next check
+
+	uint64_t			lag;		// ns behind at the last check
+	avr_pace_stats_t	stats;
+} avr_pace_t;
+
+/*
+ * Paces 'avr' from now on; 'ratio' is only used by AVR_PACE_RATIO and
+ * AVR_PACE_FRAME, 0 means 1. Returns NULL if avr->frequency isn't set.
+ */
+avr_pace_t *
+avr_pace_init(
+		avr_t * avr,
+		int mode,
+		double ratio);
+void
+avr_pace_free(
+		avr_pace_t * p);
+/* Changes the mode, the wall clock is in step with the core from now */
+void
+avr_pace_set(
+		avr_pace_t * p,
+		int mode,
+		double ratio);
+/*
+ * Frame locked pacing: the core runs 'period' ns worth of cycles (times
+ * the ratio), 'frame' is called, then it waits for the next frame of
+ * the wall clock. For UIs that refresh at a fixed rate.
+ */
+void
+avr_pace_frame(
+		avr_pace_t * p,
+		uint64_t period,
+		avr_pace_frame_t frame,
+		void * param);
+
+/* Waits for the wall clock to catch up with the core, if it's ahead */
+void
+avr_pace_wait(
+		avr_pace_t * p);
+/* The core is sleeping until 'cycle', waits for its deadline */
+void
+avr_pace_sleep(
+		avr_pace_t * p,
+		avr_cycle_count_t cycle);
+
+/* Called by avr_run() between instructions */
+static inline void
+avr_pace_poll(
+		avr_pace_t * p)
+{
+	if (p->avr->cycle >= p->next)
+		avr_pace_wait(p);
+}
+
+void
+avr_pace_report(
+		avr_pace_t * p,
+		FILE * out);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_PACE_H__ */
@@ -0,0 +1,131 @@
+/*
+	sim_persist.c
+
+	Memories mapped from files, synced a dirty page at a time.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sim_persist.h"
+
+int
+avr_persist_open(
+		avr_t * avr,
+		avr_persist_t * p,
+		const char * filename,
+		uint32_t size,
+		uint32_t slack,
+		const uint8_t * init)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	struct stat st;
+
+	memset(p, 0, sizeof(*p));
+	p->avr = avr;
+	p->size = size;
+	while ((1L << p->page_shift) < page)
+		p->page_shift++;
+	p->map_size = (size + slack + page - 1) & ~(page - 1);
+	p->pages = (size + page - 1) >> p->page_shift;
+
+	p->fd = open(filename, O_RDWR | O_CREAT, 0644);
+	if (p->fd < 0 || fstat(p->fd, &st))
+		goto error;
+	if (st.st_size < size && ftruncate(p->fd, size))
+		goto error;
+	/*
+	 * The slack past the file is anonymous memory, so the whole range
+	 * is reserved first and the file mapped over its start.
+	 */
+	p->mem = mmap(NULL, p->map_size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p->mem == MAP_FAILED ||
+			mmap(p->mem, size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_FIXED, p->fd, 0) == MAP_FAILED)
+		goto error;
+	p->dirty = calloc(1, (p->pages + 7) / 8);
+	if (st.st_size < size) {
+		if (init)
+			memcpy(p->mem + st.st_size, init + st.st_size, size - st.st_size);
+		avr_persist_dirty(p, st.st_size, size - st.st_size);
+	}
+	if (init && slack)
+		memcpy(p->mem + size, init + size, slack);
+	AVR_LOG(avr, LOG_TRACE, "PERSIST: %s, %u bytes, %s\n", filename, size,
+			st.st_size ? "loaded" : "created");
+	return 0;
+error:
+	AVR_LOG(avr, LOG_ERROR, "PERSIST: %s: %s\n", filename, strerror(errno));
+	if (p->mem && p->mem != MAP_FAILED)
+		munmap(p->mem, p->map_size);
+	p->mem = NULL;
+	if (p->fd >= 0)
+		close(p->fd);
+	p->fd = -1;
+	return -1;
+}
+
+void
+avr_persist_flush(
+		avr_persist_t * p)
+{
+	if (!p->dirty_count)
+		return;
+	p->stats.flushes++;
+	for (uint32_t i = 0; i < p->pages && p->dirty_count; i++) {
+		if (!(p->dirty[i / 8] & (1 << (i % 8))))
+			continue;
+		// runs of dirty pages go in one call
+		uint32_t end = i;
+		while (end < p->pages && (p->dirty[end / 8] & (1 << (end % 8)))) {
+			p->dirty[end / 8] &= ~(1 << (end % 8));
+			p->dirty_count--;
+			end++;
+		}
+		uint32_t start = i << p->page_shift;
+		uint32_t len = (end << p->page_shift) - start;
+		if (start + len > p->size)
+			len = p->size - start;
+		if (msync(p->mem + start, len, MS_SYNC))
+			AVR_LOG(p->avr, LOG_WARNING, "PERSIST: msync: %s\n",
+					strerror(errno));
+		p->stats.pages += end - i;
+		i = end;
+	}
+}
+
+void
+avr_persist_close(
+		avr_persist_t * p)
+{
+	if (!p->mem)
+		return;
+	avr_persist_flush(p);
+	munmap(p->mem, p->map_size);
+	close(p->fd);
+	free(p->dirty);
+	p->mem = NULL;
+	p->dirty = NULL;
+	p->fd = -1;
+}
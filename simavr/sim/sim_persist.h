@@ -0,0 +1,102 @@
+/*
+	sim_persist.h
+
+	Persistent memories: a buffer mapped MAP_SHARED from a file, with a
+	dirty bit per system page. The owner marks what it writes, and
+	flushes when it sees fit; only the dirty pages are synced, so
+	opening and closing are independent of the size of the memory.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_PERSIST_H__
+#define __SIM_PERSIST_H__
+
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define AVR_PERSIST_PERIOD	100000	// us of simulated time a page stays dirty
+
+typedef struct avr_persist_t {
+	avr_t *		avr;
+	uint8_t *	mem;
+	uint32_t	size;		// in the file
+	uint32_t	map_size;	// with the slack, and rounded to pages
+	int			fd;
+	uint32_t	page_shift;
+	uint32_t	pages;
+	uint8_t *	dirty;		// a bit per page
+	uint32_t	dirty_count;
+	struct {
+		uint64_t	flushes;
+		uint64_t	pages;		// synced
+	} stats;
+} avr_persist_t;
+
+/*
+ * Maps 'size' bytes of 'filename', followed by 'slack' bytes that are
+ * in memory only. If the file is new, or shorter, what's missing is
+ * taken from 'init' (the buffer being replaced) and the file is
+ * extended; otherwise the file wins. Returns 0, or -1 with an error
+ * logged and 'p' left closed.
+ */
+int
+avr_persist_open(
+		avr_t * avr,
+		avr_persist_t * p,
+		const char * filename,
+		uint32_t size,
+		uint32_t slack,
+		const uint8_t * init);
+/* Marks 'len' bytes from 'offset' as to be flushed, returns 1 if the
+ * memory was clean until now */
+static inline int
+avr_persist_dirty(
+		avr_persist_t * p,
+		uint32_t offset,
+		uint32_t len)
+{
+	int was_clean = !p->dirty_count;
+
+	if (!len || offset >= p->size)
+		return 0;
+	if (offset + len > p->size)
+		len = p->size - offset;
+	for (uint32_t i = offset >> p->page_shift;
+			i <= (offset + len - 1) >> p->page_shift; i++)
+		if (!(p->dirty[i / 8] & (1 << (i % 8)))) {
+			p->dirty[i / 8] |= 1 << (i % 8);
+			p->dirty_count++;
+		}
+	return was_clean;
+}
+/* Syncs the dirty pages to the file, and waits for it */
+void
+avr_persist_flush(
+		avr_persist_t * p);
+/* Flushes and unmaps */
+void
+avr_persist_close(
+		avr_persist_t * p);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_PERSIST_H__ */
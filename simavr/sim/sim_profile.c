@@ -0,0 +1,546 @@
+/*
+	sim_profile.c
+
+	Function level cycle profiler, follows calls, returns and interrupts
+	and writes callgrind or pprof profiles.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "sim_profile.h"
+#include "sim_elf.h"
+
+#define PROF_ROOT		0
+#define PROF_IRQ_ROOT	1
+
+static uint32_t
+_prof_fn_add(
+		avr_profile_t * p,
+		uint32_t addr,
+		const char * name)
+{
+	if (p->fn_count == p->fn_size) {
+		p->fn_size = p->fn_size ? p->fn_size * 2 : 64;
+		p->fn = realloc(p->fn, p->fn_size * sizeof(p->fn[0]));
+	}
+	p->fn[p->fn_count] = (avr_profile_fn_t) { .addr = addr, .name = name };
+	return p->fn_count++;
+}
+
+/* Function containing flash byte address 'addr' */
+static uint32_t
+_prof_fn(
+		avr_profile_t * p,
+		uint32_t addr)
+{
+	avr_t * avr = p->avr;
+	const avr_symbol_t * s = avr_symbol_find(avr, addr);
+
+	if (s && s->addr < AVR_SEGMENT_OFFSET_DATA) {
+		uint32_t si = s - avr->symbol;
+		if (!p->sym_fn[si])
+			p->sym_fn[si] = _prof_fn_add(p, s->addr, s->symbol) + 1;
+		return p->sym_fn[si] - 1;
+	}
+	for (uint32_t i = 0; i < p->fn_count; i++)
+		if (!p->fn[i].name && p->fn[i].addr == addr)
+			return i;
+	return _prof_fn_add(p, addr, NULL);
+}
+
+static uint32_t
+_prof_node(
+		avr_profile_t * p,
+		uint32_t parent,
+		uint32_t fn)
+{
+	for (uint32_t c = p->node[parent].child; c; c = p->node[c].next)
+		if (p->node[c].fn == fn)
+			return c;
+	if (p->node_count == p->node_size) {
+		p->node_size *= 2;
+		p->node = realloc(p->node, p->node_size * sizeof(p->node[0]));
+	}
+	uint32_t n = p->node_count++;
+	p->node[n] = (avr_profile_node_t) {
+		.fn = fn, .parent = parent, .next = p->node[parent].child };
+	p->node[parent].child = n;
+	return n;
+}
+
+static inline uint16_t
+_prof_sp(
+		avr_t * avr)
+{
+	return avr->data[R_SPL] | (avr->data[R_SPH] << 8);
+}
+
+/* Charges the cycles since the last event to the function on top */
+static inline void
+_prof_charge(
+		avr_profile_t * p)
+{
+	uint32_t n = p->depth ? p->stack[p->depth - 1].node : PROF_ROOT;
+
+	p->node[n].self += p->avr->cycle - p->last;
+	p->last = p->avr->cycle;
+}
+
+static void
+_prof_push(
+		avr_profile_t * p,
+		uint32_t node)
+{
+	if (p->depth == p->stack_size) {
+		p->stack_size = p->stack_size ? p->stack_size * 2 : 64;
+		p->stack = realloc(p->stack, p->stack_size * sizeof(p->stack[0]));
+	}
+	p->node[node].calls++;
+	p->stack[p->depth++] = (avr_profile_frame_t) {
+		.node = node, .sp = _prof_sp(p->avr) };
+}
+
+void
+avr_profile_call(
+		avr_t * avr,
+		avr_flashaddr_t target)
+{
+	avr_profile_t * p = avr->profile;
+
+	_prof_charge(p);
+	uint32_t top = p->depth ? p->stack[p->depth - 1].node : PROF_ROOT;
+	_prof_push(p, _prof_node(p, top, _prof_fn(p, target)));
+}
+
+void
+avr_profile_ret(
+		avr_t * avr)
+{
+	avr_profile_t * p = avr->profile;
+	uint16_t sp = _prof_sp(avr);
+
+	_prof_charge(p);
+	// pop every frame whose return address is now above the stack, so
+	// code fiddling with the stack doesn't leave stale frames behind
+	while (p->depth && p->stack[p->depth - 1].sp < sp)
+		p->depth--;
+}
+
+void
+avr_profile_irq(
+		avr_t * avr,
+		int vector)
+{
+	avr_profile_t * p = avr->profile;
+	uint32_t target = avr->pc;
+	uint16_t o = avr->flash[target] | (avr->flash[target + 1] << 8);
+
+	// the vector is a jmp, or rjmp, to the handler
+	if ((o & 0xfe0e) == 0x940c)
+		target = ((((o & 0x01f0) >> 3) | (o & 1)) << 16 |
+				avr->flash[target + 2] | (avr->flash[target + 3] << 8)) << 1;
+	else if ((o & 0xf000) == 0xc000)
+		target = target + 2 + ((int16_t)(o << 4) >> 3);
+	_prof_charge(p);
+	_prof_push(p, _prof_node(p, PROF_IRQ_ROOT, _prof_fn(p, target)));
+}
+
+avr_profile_t *
+avr_profile_start(
+		avr_t * avr)
+{
+	avr_profile_t * p = calloc(1, sizeof(*p));
+
+	p->avr = avr;
+	p->start = p->last = avr->cycle;
+	p->sym_fn = calloc(avr->symbolcount + 1, sizeof(p->sym_fn[0]));
+	p->node_size = 256;
+	p->node = calloc(p->node_size, sizeof(p->node[0]));
+	p->node_count = 2;
+	p->node[PROF_ROOT].fn = _prof_fn(p, avr->pc);
+	p->node[PROF_IRQ_ROOT].fn = _prof_fn_add(p, 0, "[interrupts]");
+	p->node[PROF_IRQ_ROOT].parent = PROF_IRQ_ROOT;
+	avr->profile = p;
+	return p;
+}
+
+void
+avr_profile_stop(
+		avr_profile_t * p)
+{
+	if (p->avr->profile != p)
+		return;
+	_prof_charge(p);
+	p->avr->profile = NULL;
+}
+
+void
+avr_profile_free(
+		avr_profile_t * p)
+{
+	avr_profile_stop(p);
+	free(p->fn);
+	free(p->sym_fn);
+	free(p->node);
+	free(p->stack);
+	free(p);
+}
+
+static const char *
+_prof_name(
+		avr_profile_t * p,
+		uint32_t fn,
+		char * buf,
+		size_t size)
+{
+	if (p->fn[fn].name)
+		return p->fn[fn].name;
+	snprintf(buf, size, "0x%04x", p->fn[fn].addr);
+	return buf;
+}
+
+/* Inclusive cycles of each node: its own plus all its subtree's */
+static avr_cycle_count_t *
+_prof_totals(
+		avr_profile_t * p)
+{
+	avr_cycle_count_t * total = calloc(p->node_count, sizeof(total[0]));
+
+	// children are always created after their parent
+	for (uint32_t i = p->node_count; i-- > 0; ) {
+		total[i] += p->node[i].self;
+		if (p->node[i].parent != i)
+			total[p->node[i].parent] += total[i];
+	}
+	return total;
+}
+
+/* Is 'n' called, directly or not, from another instance of its function? */
+static int
+_prof_recursed(
+		avr_profile_t * p,
+		uint32_t n)
+{
+	uint32_t fn = p->node[n].fn;
+
+	while (p->node[n].parent != n) {
+		n = p->node[n].parent;
+		if (p->node[n].fn == fn)
+			return 1;
+	}
+	return 0;
+}
+
+typedef struct prof_edge_t {
+	uint32_t			caller, callee;
+	uint64_t			calls;
+	avr_cycle_count_t	incl;
+} prof_edge_t;
+
+static int
+_prof_edge_cmp(
+		const void * a,
+		const void * b)
+{
+	const prof_edge_t * ea = a, * eb = b;
+
+	if (ea->caller != eb->caller)
+		return ea->caller < eb->caller ? -1 : 1;
+	return ea->callee < eb->callee ? -1 : ea->callee > eb->callee;
+}
+
+int
+avr_profile_write_callgrind(
+		avr_profile_t * p,
+		const char * filename)
+{
+	FILE * o = fopen(filename, "w");
+
+	if (!o) {
+		AVR_LOG(p->avr, LOG_ERROR, "PROFILE: %s: %s\n", filename, strerror(errno));
+		return -1;
+	}
+	if (p->avr->profile == p)
+		_prof_charge(p);
+	avr_cycle_count_t * total = _prof_totals(p);
+	avr_cycle_count_t * self = calloc(p->fn_count, sizeof(self[0]));
+	prof_edge_t * edge = calloc(p->node_count, sizeof(edge[0]));
+	uint8_t * named = calloc(p->fn_count, 1);
+	uint32_t edges = 0;
+
+	for (uint32_t i = 0; i < p->node_count; i++) {
+		self[p->node[i].fn] += p->node[i].self;
+		if (p->node[i].parent != i)
+			edge[edges++] = (prof_edge_t) {
+				.caller = p->node[p->node[i].parent].fn,
+				.callee = p->node[i].fn,
+				.calls = p->node[i].calls, .incl = total[i] };
+	}
+	qsort(edge, edges, sizeof(edge[0]), _prof_edge_cmp);
+
+	fprintf(o, "# callgrind format\nversion: 1\ncreator: simavr\n");
+	fprintf(o, "cmd: %s\npositions: instr\nevents: Cycles\n",
+			p->avr->mmcu ? p->avr->mmcu : "avr");
+	fprintf(o, "summary: %llu\n",
+			(unsigned long long)(total[PROF_ROOT] + total[PROF_IRQ_ROOT]));
+
+	char buf[16];
+#define CG_NAME(_key, _fn) \
+	if (named[_fn]) \
+		fprintf(o, _key "=(%u)\n", (_fn) + 1); \
+	else { \
+		named[_fn] = 1; \
+		fprintf(o, _key "=(%u) %s\n", (_fn) + 1, \
+				_prof_name(p, _fn, buf, sizeof(buf))); \
+	}
+	for (uint32_t f = 0, e = 0; f < p->fn_count; f++) {
+		fprintf(o, "\n");
+		CG_NAME("fn", f);
+		fprintf(o, "0x%x %llu\n", p->fn[f].addr, (unsigned long long)self[f]);
+		for (; e < edges && edge[e].caller == f; e++) {
+			prof_edge_t c = edge[e];
+			// merge the nodes calling the same function
+			while (e + 1 < edges && !_prof_edge_cmp(&c, &edge[e + 1])) {
+				e++;
+				c.calls += edge[e].calls;
+				c.incl += edge[e].incl;
+			}
+			CG_NAME("cfn", c.callee);
+			fprintf(o, "calls=%llu 0x%x\n", (unsigned long long)c.calls,
+					p->fn[c.callee].addr);
+			fprintf(o, "0x%x %llu\n", p->fn[f].addr, (unsigned long long)c.incl);
+		}
+	}
+#undef CG_NAME
+	free(named);
+	free(edge);
+	free(self);
+	free(total);
+	return fclose(o) ? -1 : 0;
+}
+
+/*
+ * Minimal protobuf encoder, for the few messages of profile.proto
+ * pprof needs.
+ */
+typedef struct pb_t {
+	uint8_t *	b;
+	size_t		len, size;
+} pb_t;
+
+static void
+pb_raw(
+		pb_t * b,
+		const void * data,
+		size_t len)
+{
+	if (b->len + len > b->size) {
+		while (b->len + len > b->size)
+			b->size = b->size ? b->size * 2 : 256;
+		b->b = realloc(b->b, b->size);
+	}
+	memcpy(b->b + b->len, data, len);
+	b->len += len;
+}
+
+static void
+pb_varint(
+		pb_t * b,
+		uint64_t v)
+{
+	uint8_t buf[10];
+	int l = 0;
+
+	do {
+		buf[l++] = (v & 0x7f) | (v > 0x7f ? 0x80 : 0);
+		v >>= 7;
+	} while (v);
+	pb_raw(b, buf, l);
+}
+
+static void
+pb_uint(
+		pb_t * b,
+		int field,
+		uint64_t v)
+{
+	pb_varint(b, field << 3);
+	pb_varint(b, v);
+}
+
+static void
+pb_bytes(
+		pb_t * b,
+		int field,
+		const void * data,
+		size_t len)
+{
+	pb_varint(b, (field << 3) | 2);
+	pb_varint(b, len);
+	pb_raw(b, data, len);
+}
+
+/* Appends 'sub' as a nested message, and empties it for reuse */
+static void
+pb_msg(
+		pb_t * b,
+		int field,
+		pb_t * sub)
+{
+	pb_bytes(b, field, sub->b, sub->len);
+	sub->len = 0;
+}
+
+int
+avr_profile_write_pprof(
+		avr_profile_t * p,
+		const char * filename)
+{
+	// string table: "", then the sample types, then the function names
+	enum { STR_CYCLES = 1, STR_CALLS, STR_FN };
+	pb_t out = {0}, m = {0}, sub = {0}, packed = {0};
+	char buf[16];
+
+	if (p->avr->profile == p)
+		_prof_charge(p);
+	pb_uint(&sub, 1, STR_CYCLES);
+	pb_uint(&sub, 2, STR_CYCLES);
+	pb_msg(&out, 1, &sub);			// sample_type
+	pb_uint(&sub, 1, STR_CALLS);
+	pb_uint(&sub, 2, STR_CALLS);
+	pb_msg(&out, 1, &sub);
+
+	for (uint32_t n = 0; n < p->node_count; n++) {
+		if (!p->node[n].self && !p->node[n].calls)
+			continue;
+		// the stack, leaf first; locations are functions + 1
+		for (uint32_t a = n; ; a = p->node[a].parent) {
+			pb_varint(&packed, p->node[a].fn + 1);
+			if (p->node[a].parent == a)
+				break;
+		}
+		pb_msg(&m, 1, &packed);		// location_id
+		pb_varint(&packed, p->node[n].self);
+		pb_varint(&packed, p->node[n].calls);
+		pb_msg(&m, 2, &packed);		// value
+		pb_msg(&out, 2, &m);		// sample
+	}
+	for (uint32_t f = 0; f < p->fn_count; f++) {
+		pb_uint(&sub, 1, f + 1);
+		pb_uint(&sub, 2, 1);
+		pb_msg(&m, 4, &sub);		// line
+		pb_uint(&m, 1, f + 1);
+		pb_uint(&m, 3, p->fn[f].addr);
+		pb_msg(&out, 4, &m);		// location
+		pb_uint(&m, 1, f + 1);
+		pb_uint(&m, 2, STR_FN + f);
+		pb_uint(&m, 3, STR_FN + f);
+		pb_uint(&m, 5, 1);
+		pb_msg(&out, 5, &m);		// function
+	}
+	pb_bytes(&out, 6, "", 0);
+	pb_bytes(&out, 6, "cycles", 6);
+	pb_bytes(&out, 6, "calls", 5);
+	for (uint32_t f = 0; f < p->fn_count; f++) {
+		const char * name = _prof_name(p, f, buf, sizeof(buf));
+		pb_bytes(&out, 6, name, strlen(name));
+	}
+	if (p->avr->frequency)
+		pb_uint(&out, 10, (p->last - p->start) * 1000000000ULL /
+				p->avr->frequency);	// duration_nanos
+	pb_uint(&sub, 1, STR_CYCLES);
+	pb_uint(&sub, 2, STR_CYCLES);
+	pb_msg(&out, 11, &sub);			// period_type
+	pb_uint(&out, 12, 1);			// period
+
+	int res = -1;
+	FILE * o = fopen(filename, "wb");
+	if (o) {
+		res = fwrite(out.b, 1, out.len, o) == out.len ? 0 : -1;
+		if (fclose(o))
+			res = -1;
+	} else
+		AVR_LOG(p->avr, LOG_ERROR, "PROFILE: %s: %s\n", filename, strerror(errno));
+	free(out.b);
+	free(m.b);
+	free(sub.b);
+	free(packed.b);
+	return res;
+}
+
+typedef struct prof_line_t {
+	uint32_t			fn;
+	uint64_t			calls;
+	avr_cycle_count_t	self, incl;
+} prof_line_t;
+
+static int
+_prof_line_cmp(
+		const void * a,
+		const void * b)
+{
+	const prof_line_t * la = a, * lb = b;
+
+	return la->self < lb->self ? 1 : la->self > lb->self ? -1 : 0;
+}
+
+void
+avr_profile_report(
+		avr_profile_t * p,
+		FILE * o,
+		int count)
+{
+	if (p->avr->profile == p)
+		_prof_charge(p);
+	avr_cycle_count_t * total = _prof_totals(p);
+	prof_line_t * line = calloc(p->fn_count, sizeof(line[0]));
+	avr_cycle_count_t all = total[PROF_ROOT] + total[PROF_IRQ_ROOT];
+	char buf[16];
+
+	for (uint32_t f = 0; f < p->fn_count; f++)
+		line[f].fn = f;
+	for (uint32_t n = 0; n < p->node_count; n++) {
+		prof_line_t * l = &line[p->node[n].fn];
+		l->self += p->node[n].self;
+		l->calls += p->node[n].calls;
+		if (!_prof_recursed(p, n))
+			l->incl += total[n];
+	}
+	qsort(line, p->fn_count, sizeof(line[0]), _prof_line_cmp);
+
+	fprintf(o, "%llu cycles, %llu in interrupts (%.1f%%)\n",
+			(unsigned long long)all,
+			(unsigned long long)total[PROF_IRQ_ROOT],
+			all ? 100.0 * total[PROF_IRQ_ROOT] / all : 0.0);
+	fprintf(o, "%12s %6s %12s %10s  %s\n",
+			"self", "%", "inclusive", "calls", "function");
+	for (int i = 0; i < p->fn_count && i < count; i++) {
+		if (!line[i].self)
+			break;
+		fprintf(o, "%12llu %6.2f %12llu %10llu  %s\n",
+				(unsigned long long)line[i].self,
+				all ? 100.0 * line[i].self / all : 0.0,
+				(unsigned long long)line[i].incl,
+				(unsigned long long)line[i].calls,
+				_prof_name(p, line[i].fn, buf, sizeof(buf)));
+	}
+	free(line);
+	free(total);
+}
@@ -0,0 +1,127 @@
+/*
+	sim_profile.h
+
+	Function level cycle profiler, follows calls, returns and interrupts
+	and writes callgrind or pprof profiles.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_PROFILE_H__
+#define __SIM_PROFILE_H__
+
+#include <stdio.h>
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A function, from the ELF symbols, or just an address without them */
+typedef struct avr_profile_fn_t {
+	uint32_t		addr;
+	const char *	name;	// NULL when there is no symbol
+} avr_profile_fn_t;
+
+/*
+ * Calling context tree node: one per distinct call path. Cycles are
+ * charged to the node on top of the stack; inclusive times are summed
+ * from the tree when writing the profiles.
+ */
+typedef struct avr_profile_node_t {
+	uint32_t			fn;
+	uint32_t			parent;
+	uint32_t			child, next;	// first child, next sibling, 0 for none
+	uint64_t			calls;
+	avr_cycle_count_t	self;
+} avr_profile_node_t;
+
+typedef struct avr_profile_frame_t {
+	uint32_t	node;
+	uint16_t	sp;		// where the return address was pushed
+} avr_profile_frame_t;
+
+/*
+ * Node 0 is the code running when the profile started, node 1 the root
+ * of all interrupt handlers, so ISR time is never part of the inclusive
+ * time of the code it interrupted.
+ */
+typedef struct avr_profile_t {
+	avr_t *					avr;
+	avr_cycle_count_t		start, last;
+
+	avr_profile_fn_t *		fn;
+	uint32_t				fn_count, fn_size;
+	uint32_t *				sym_fn;		// symbol index to fn+1, 0 when not seen
+
+	avr_profile_node_t *	node;
+	uint32_t				node_count, node_size;
+
+	avr_profile_frame_t *	stack;
+	uint32_t				depth, stack_size;
+} avr_profile_t;
+
+/*
+ * Starts profiling 'avr' from now on; its symbols should be loaded.
+ */
+avr_profile_t *
+avr_profile_start(
+		avr_t * avr);
+/*
+ * Stops collecting, the profile can still be written, then freed.
+ */
+void
+avr_profile_stop(
+		avr_profile_t * p);
+void
+avr_profile_free(
+		avr_profile_t * p);
+
+/* Writes a callgrind.out file, for kcachegrind & co */
+int
+avr_profile_write_callgrind(
+		avr_profile_t * p,
+		const char * filename);
+/* Writes an (uncompressed) profile.proto file, for 'pprof' */
+int
+avr_profile_write_pprof(
+		avr_profile_t * p,
+		const char * filename);
+/* Prints the 'count' functions with the most exclusive cycles */
+void
+avr_profile_report(
+		avr_profile_t * p,
+		FILE * o,
+		int count);
+
+/* Called by the core, when avr->profile is set */
+void
+avr_profile_call(
+		avr_t * avr,
+		avr_flashaddr_t target);
+void
+avr_profile_ret(
+		avr_t * avr);
+void
+avr_profile_irq(
+		avr_t * avr,
+		int vector);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_PROFILE_H__ */
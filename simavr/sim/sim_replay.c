@@ -0,0 +1,546 @@
+/*
+	sim_replay.c
+
+	Record/replay of the external inputs of a run.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim_replay.h"
+#include "sim_io.h"
+#include "avr_ioport.h"
+#include "avr_uart.h"
+#include "avr_adc.h"
+#include "avr_acomp.h"
+#include "avr_spi.h"
+#include "avr_twi.h"
+#include "sim_semihost.h"
+
+#define FNV_OFFSET	0xcbf29ce484222325ULL
+#define FNV_PRIME	0x100000001b3ULL
+
+/* What the END record holds, to tell if the replay went the same way */
+static uint64_t
+_replay_hash(
+		avr_t * avr)
+{
+	uint64_t h = FNV_OFFSET;
+
+	for (int i = 0; i <= avr->ramend; i++)
+		h = (h ^ avr->data[i]) * FNV_PRIME;
+	for (int i = 0; i < 8; i++)
+		h = (h ^ avr->sreg[i]) * FNV_PRIME;
+	return (h ^ avr->pc) * FNV_PRIME;
+}
+
+static void
+_replay_put_num(
+		FILE * f,
+		uint64_t v)
+{
+	do {
+		uint8_t b = v & 0x7f;
+		v >>= 7;
+		fputc(b | (v ? 0x80 : 0), f);
+	} while (v);
+}
+
+static int
+_replay_get_num(
+		FILE * f,
+		uint64_t * v)
+{
+	*v = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		int b = fgetc(f);
+		if (b == EOF)
+			return -1;
+		*v |= (uint64_t)(b & 0x7f) << shift;
+		if (!(b & 0x80))
+			return 0;
+	}
+	return -1;
+}
+
+static void
+_replay_put(
+		avr_replay_t * r,
+		uint8_t phase,
+		uint32_t input,
+		int floating,
+		uint64_t value)
+{
+	avr_t * avr = r->avr;
+
+	if (!r->f) {
+		if (r->log_count == r->log_size) {
+			r->log_size = r->log_size ? r->log_size * 2 : 1024;
+			r->log = realloc(r->log, r->log_size * sizeof(r->log[0]));
+		}
+		r->log[r->log_count++] = (avr_replay_rec_t) {
+			.cycle = avr->cycle, .value = value, .input = input,
+			.phase = phase, .floating = floating };
+		return;
+	}
+	_replay_put_num(r->f, avr->cycle - r->last);
+	_replay_put_num(r->f, (input << 3) | (floating << 2) | phase);
+	_replay_put_num(r->f, value);
+	r->last = avr->cycle;
+}
+
+static void
+_replay_notify(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	avr_replay_input_t * in = (avr_replay_input_t *)param;
+	avr_replay_t * r = in->r;
+
+	if (r->mode != AVR_REPLAY_RECORD)
+		return;
+	// the port driving its own pins, or a timer/USI driving an output
+	if (in->port && (((in->port->internal >> irq->irq) & 1) ||
+			(value & AVR_IOPORT_OUTPUT)))
+		return;
+	_replay_put(r, !r->in_run ? AVR_REPLAY_OUTSIDE :
+					r->in_core ? AVR_REPLAY_CORE : AVR_REPLAY_TIMER,
+			in->index, !!(irq->flags & IRQ_FLAG_FLOATING), value);
+}
+
+/* Reads the next record to inject, if any */
+static void
+_replay_next(
+		avr_replay_t * r)
+{
+	uint64_t delta, code, value;
+
+	r->next.valid = 0;
+	if (!r->f) {
+		if (r->log_pos == r->log_count)
+			return;
+		avr_replay_rec_t * l = &r->log[r->log_pos++];
+		r->next.cycle = l->cycle;
+		r->next.phase = l->phase;
+		r->next.floating = l->floating;
+		r->next.input = l->input;
+		r->next.value = l->value;
+		r->next.valid = 1;
+		return;
+	}
+	if (_replay_get_num(r->f, &delta) || _replay_get_num(r->f, &code) ||
+			_replay_get_num(r->f, &value)) {
+		AVR_LOG(r->avr, LOG_TRACE, "REPLAY: end of the log at cycle %llu\n",
+				(unsigned long long)r->avr->cycle);
+		return;
+	}
+	r->next.cycle += delta;
+	r->next.phase = code & 3;
+	r->next.floating = (code >> 2) & 1;
+	r->next.input = code >> 3;
+	r->next.value = value;
+	if (r->next.phase != AVR_REPLAY_END && r->next.input >= r->input_count) {
+		AVR_LOG(r->avr, LOG_ERROR, "REPLAY: invalid input %u in the log\n",
+				r->next.input);
+		return;
+	}
+	r->next.valid = 1;
+}
+
+static void
+_replay_inject(
+		avr_replay_t * r)
+{
+	avr_irq_t * irq = r->input[r->next.input]->irq;
+	uint32_t v = r->next.value;
+
+	// the value was recorded after the IRQ's own inversion
+	if (irq->flags & IRQ_FLAG_NOT)
+		v = !v;
+	avr_raise_irq_float(irq, v, r->next.floating);
+	r->injected++;
+	_replay_next(r);
+}
+
+/* Core records are injected just after the instruction they happened in */
+static avr_cycle_count_t
+_replay_target(
+		avr_replay_t * r)
+{
+	return r->next.cycle + (r->next.phase == AVR_REPLAY_CORE);
+}
+
+static int
+_replay_timed(
+		avr_replay_t * r)
+{
+	return r->next.valid && (r->next.phase == AVR_REPLAY_CORE ||
+				r->next.phase == AVR_REPLAY_TIMER);
+}
+
+static avr_cycle_count_t
+_replay_timer(
+		struct avr_t * avr,
+		avr_cycle_count_t when,
+		void * param)
+{
+	avr_replay_t * r = (avr_replay_t *)param;
+
+	while (_replay_timed(r) && _replay_target(r) <= avr->cycle)
+		_replay_inject(r);
+	r->armed = _replay_timed(r);
+	return r->armed ? _replay_target(r) : 0;
+}
+
+static void
+_replay_arm(
+		avr_replay_t * r)
+{
+	avr_t * avr = r->avr;
+
+	if (r->armed || !_replay_timed(r))
+		return;
+	avr_cycle_count_t target = _replay_target(r);
+	r->armed = 1;
+	avr_cycle_timer_register(avr,
+			target > avr->cycle ? target - avr->cycle : 0, _replay_timer, r);
+}
+
+int
+avr_replay_input(
+		avr_replay_t * r,
+		avr_irq_t * irq)
+{
+	if (!irq || r->started)
+		return -1;
+	if ((r->input_count % 32) == 0)
+		r->input = realloc(r->input,
+						(r->input_count + 32) * sizeof(r->input[0]));
+	avr_replay_input_t * in = calloc(1, sizeof(*in));
+	in->r = r;
+	in->irq = irq;
+	in->index = r->input_count;
+	r->input[r->input_count++] = in;
+	return in->index;
+}
+
+static void
+_replay_io_inputs(
+		avr_replay_t * r,
+		avr_io_t * io,
+		int first,
+		int last)
+{
+	for (int i = first; i <= last && i < io->irq_count; i++)
+		avr_replay_input(r, io->irq + i);
+}
+
+/* The input IRQs of the IO modules, in the order they were registered */
+static void
+_replay_add_io(
+		avr_replay_t * r)
+{
+	for (avr_io_t * io = r->avr->io_port; io; io = io->next) {
+		if (!io->irq || !io->kind)
+			continue;
+		if (!strcmp(io->kind, "port")) {
+			int first = r->input_count;
+			_replay_io_inputs(r, io, IOPORT_IRQ_PIN0, IOPORT_IRQ_PIN7);
+			_replay_io_inputs(r, io, IOPORT_IRQ_PIN_ALL_IN, IOPORT_IRQ_PIN_ALL_IN);
+			for (int i = first; i < r->input_count; i++)
+				r->input[i]->port = (avr_ioport_t *)io;
+		} else if (!strcmp(io->kind, "uart"))
+			_replay_io_inputs(r, io, UART_IRQ_INPUT, UART_IRQ_INPUT);
+		else if (!strcmp(io->kind, "adc"))
+			_replay_io_inputs(r, io, ADC_IRQ_ADC0, ADC_IRQ_TEMP);
+		else if (!strcmp(io->kind, "ac"))
+			_replay_io_inputs(r, io, ACOMP_IRQ_AIN0, ACOMP_IRQ_ADC15);
+		else if (!strcmp(io->kind, "spi"))
+			_replay_io_inputs(r, io, SPI_IRQ_INPUT, SPI_IRQ_INPUT);
+		else if (!strcmp(io->kind, "twi"))
+			_replay_io_inputs(r, io, TWI_IRQ_INPUT, TWI_IRQ_INPUT);
+	}
+	// what the host returned to the firmware
+	if (r->avr->semihost)
+		avr_replay_input(r, r->avr->semihost->irq + SEMIHOST_IRQ_RESULT);
+}
+
+static avr_replay_t *
+_replay_new(
+		avr_t * avr,
+		const char * filename,
+		int mode)
+{
+	FILE * f = NULL;
+
+	if (avr->replay) {
+		AVR_LOG(avr, LOG_ERROR, "REPLAY: already recording or replaying\n");
+		return NULL;
+	}
+	if (filename &&
+			!(f = fopen(filename, mode == AVR_REPLAY_RECORD ? "wb" : "rb"))) {
+		AVR_LOG(avr, LOG_ERROR, "REPLAY: can't open %s\n", filename);
+		return NULL;
+	}
+	avr_replay_t * r = calloc(1, sizeof(*r));
+	r->avr = avr;
+	r->mode = mode;
+	r->f = f;
+	_replay_add_io(r);
+	avr->replay = r;
+	return r;
+}
+
+avr_replay_t *
+avr_replay_record(
+		avr_t * avr,
+		const char * filename)
+{
+	return _replay_new(avr, filename, AVR_REPLAY_RECORD);
+}
+
+avr_replay_t *
+avr_replay_play(
+		avr_t * avr,
+		const char * filename)
+{
+	return _replay_new(avr, filename, AVR_REPLAY_PLAY);
+}
+
+avr_replay_t *
+avr_replay_memory(
+		avr_t * avr)
+{
+	avr_replay_t * r = _replay_new(avr, NULL, AVR_REPLAY_RECORD);
+
+	if (r && avr_replay_start(r)) {
+		avr_replay_close(r);
+		r = NULL;
+	}
+	return r;
+}
+
+void
+avr_replay_seek(
+		avr_replay_t * r,
+		uint32_t pos)
+{
+	// restoring a snapshot drops the timer, but it might be left armed
+	avr_cycle_timer_cancel(r->avr, _replay_timer, r);
+	r->armed = 0;
+	r->mode = AVR_REPLAY_PLAY;
+	r->log_pos = pos < r->log_count ? pos : r->log_count;
+	_replay_next(r);
+}
+
+void
+avr_replay_truncate(
+		avr_replay_t * r)
+{
+	avr_cycle_timer_cancel(r->avr, _replay_timer, r);
+	r->armed = 0;
+	// the next record was read, but not injected
+	if (r->mode == AVR_REPLAY_PLAY)
+		r->log_count = r->next.valid ? r->log_pos - 1 : r->log_pos;
+	r->next.valid = 0;
+	r->mode = AVR_REPLAY_RECORD;
+}
+
+void
+avr_replay_discard(
+		avr_replay_t * r,
+		uint32_t count)
+{
+	if (count > r->log_count)
+		count = r->log_count;
+	memmove(r->log, r->log + count,
+			(r->log_count - count) * sizeof(r->log[0]));
+	r->log_count -= count;
+	r->log_pos = r->log_pos > count ? r->log_pos - count : 0;
+}
+
+/* Replays run flat out */
+static void
+_replay_sleep(
+		avr_t * avr,
+		avr_cycle_count_t how_long)
+{
+}
+
+static int
+_replay_start_record(
+		avr_replay_t * r)
+{
+	avr_t * avr = r->avr;
+	avr_replay_header_t h = {
+		.magic = AVR_REPLAY_MAGIC,
+		.version = AVR_REPLAY_VERSION,
+		.inputs = r->input_count,
+		.frequency = avr->frequency,
+	};
+	memcpy(h.serial, avr->serial, sizeof(h.serial));
+	if (avr->mmcu)
+		strncpy(h.mmcu, avr->mmcu, sizeof(h.mmcu) - 1);
+	if (r->f)
+		fwrite(&h, sizeof(h), 1, r->f);
+	for (int i = 0; i < r->input_count; i++) {
+		avr_irq_t * irq = r->input[i]->irq;
+		const char * name = irq->name ? irq->name : "";
+		if (r->f)
+			fwrite(name, strlen(name) + 1, 1, r->f);
+		avr_irq_register_notify(irq, _replay_notify, r->input[i]);
+	}
+	r->last = avr->cycle;
+	return r->f && ferror(r->f) ? -1 : 0;
+}
+
+static int
+_replay_start_play(
+		avr_replay_t * r)
+{
+	avr_t * avr = r->avr;
+	avr_replay_header_t h;
+
+	if (fread(&h, sizeof(h), 1, r->f) != 1 || h.magic != AVR_REPLAY_MAGIC ||
+			h.version != AVR_REPLAY_VERSION) {
+		AVR_LOG(avr, LOG_ERROR, "REPLAY: not a recording\n");
+		return -1;
+	}
+	if (strncmp(h.mmcu, avr->mmcu ? avr->mmcu : "", sizeof(h.mmcu)) ||
+			h.frequency != avr->frequency) {
+		AVR_LOG(avr, LOG_ERROR, "REPLAY: recorded on a %.16s at %u Hz\n",
+				h.mmcu, h.frequency);
+		return -1;
+	}
+	if (h.inputs != r->input_count) {
+		AVR_LOG(avr, LOG_ERROR, "REPLAY: recorded with %u inputs, not %u\n",
+				h.inputs, r->input_count);
+		return -1;
+	}
+	for (int i = 0; i < r->input_count; i++) {
+		char name[128];
+		int c, l = 0;
+		while ((c = fgetc(r->f)) != EOF && c)
+			if (l < sizeof(name) - 1)
+				name[l++] = c;
+		name[l] = 0;
+		const char * want = r->input[i]->irq->name ?
+								r->input[i]->irq->name : "";
+		if (c == EOF || strncmp(name, want, sizeof(name) - 1)) {
+			AVR_LOG(avr, LOG_ERROR, "REPLAY: input %d is '%s', not '%s'\n",
+					i, name, want);
+			return -1;
+		}
+	}
+	memcpy(avr->serial, h.serial, sizeof(avr->serial));
+	if (avr->sleep == avr_callback_sleep_raw)
+		avr->sleep = _replay_sleep;
+	r->next.cycle = avr->cycle;
+	_replay_next(r);
+	return 0;
+}
+
+int
+avr_replay_start(
+		avr_replay_t * r)
+{
+	if (!r || r->started)
+		return -1;
+	int res = r->mode == AVR_REPLAY_RECORD ?
+					_replay_start_record(r) : _replay_start_play(r);
+	if (res)
+		return res;
+	r->started = 1;
+	AVR_LOG(r->avr, LOG_TRACE, "REPLAY: %s %u inputs\n",
+			r->mode == AVR_REPLAY_RECORD ? "recording" : "replaying",
+			r->input_count);
+	return 0;
+}
+
+int
+avr_replay_run(
+		avr_t * avr)
+{
+	avr_replay_t * r = avr->replay;
+
+	if (r->mode == AVR_REPLAY_PLAY && r->started) {
+		while (r->next.valid && r->next.phase == AVR_REPLAY_OUTSIDE &&
+				avr->cycle >= r->next.cycle)
+			_replay_inject(r);
+		// nothing more to reproduce, avr_replay_close() checks the state
+		if (r->next.valid && r->next.phase == AVR_REPLAY_END &&
+				avr->cycle >= r->next.cycle) {
+			avr->state = cpu_Done;
+			return avr->state;
+		}
+		_replay_arm(r);
+	}
+	r->in_run = 1;
+	avr->run(avr);
+	r->in_run = 0;
+	return avr->state;
+}
+
+void
+avr_replay_close(
+		avr_replay_t * r)
+{
+	if (!r)
+		return;
+	avr_t * avr = r->avr;
+
+	// the in memory log is hooked even while it replays
+	int hooked = r->started && (r->mode == AVR_REPLAY_RECORD || !r->f);
+	if (r->started && r->f && r->mode == AVR_REPLAY_RECORD)
+		_replay_put(r, AVR_REPLAY_END, 0, 0, _replay_hash(avr));
+	if (hooked)
+		for (int i = 0; i < r->input_count; i++)
+			avr_irq_unregister_notify(r->input[i]->irq,
+					_replay_notify, r->input[i]);
+	if (r->started && r->mode == AVR_REPLAY_PLAY) {
+		avr_cycle_timer_cancel(avr, _replay_timer, r);
+		if (r->next.valid && r->next.phase == AVR_REPLAY_END) {
+			if (r->next.cycle != avr->cycle)
+				AVR_LOG(avr, LOG_ERROR,
+						"REPLAY: stopped at cycle %llu instead of %llu\n",
+						(unsigned long long)avr->cycle,
+						(unsigned long long)r->next.cycle);
+			else if (r->next.value != _replay_hash(avr))
+				AVR_LOG(avr, LOG_ERROR,
+						"REPLAY: diverged, the state differs at cycle %llu\n",
+						(unsigned long long)avr->cycle);
+			else
+				AVR_LOG(avr, LOG_OUTPUT,
+						"REPLAY: reproduced %llu cycles, %llu inputs\n",
+						(unsigned long long)avr->cycle,
+						(unsigned long long)r->injected);
+		}
+		if (avr->sleep == _replay_sleep)
+			avr->sleep = avr_callback_sleep_raw;
+	}
+	if (avr->replay == r)
+		avr->replay = NULL;
+	if (r->f)
+		fclose(r->f);
+	for (int i = 0; i < r->input_count; i++)
+		free(r->input[i]);
+	free(r->input);
+	free(r->log);
+	free(r);
+}
@@ -0,0 +1,187 @@
+/*
+	sim_replay.h
+
+	Record/replay of the external inputs of a run. Recording logs every
+	raise of the input IRQs (UART bytes, ADC and comparator samples, pin
+	changes...) with the cycle it happened at; replaying injects them back
+	at the same point of the run, without any of the original sources,
+	and as fast as possible.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_REPLAY_H__
+#define __SIM_REPLAY_H__
+
+#include <stdio.h>
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define AVR_REPLAY_MAGIC		0x50524153	// 'SARP'
+#define AVR_REPLAY_VERSION		1
+
+enum {
+	AVR_REPLAY_RECORD = 1,
+	AVR_REPLAY_PLAY,
+};
+
+/*
+ * Where the raise happened, which is where it is injected back:
+ * between two avr_run() calls, during an instruction (a part answering
+ * the firmware right away), or in the cycle timers and interrupts.
+ */
+enum {
+	AVR_REPLAY_OUTSIDE = 0,
+	AVR_REPLAY_CORE,
+	AVR_REPLAY_TIMER,
+	AVR_REPLAY_END,			// last record, the value is a hash of the state
+};
+
+/*
+ * The header is followed by 'inputs' NUL terminated IRQ names, then by
+ * the records, each one is three unsigned LEB128 numbers:
+ * cycle delta, input << 3 | floating << 2 | phase, value.
+ */
+typedef struct avr_replay_header_t {
+	uint32_t	magic;
+	uint16_t	version;
+	uint16_t	inputs;
+	uint32_t	frequency;
+	uint8_t		serial[9];	// avr->serial is random otherwise
+	uint8_t		reserved[3];
+	char		mmcu[16];
+} avr_replay_header_t;
+
+/* A record of the in memory log, see avr_replay_memory() */
+typedef struct avr_replay_rec_t {
+	avr_cycle_count_t	cycle;
+	uint32_t			value;
+	uint16_t			input;
+	uint8_t				phase, floating;
+} avr_replay_rec_t;
+
+typedef struct avr_replay_input_t {
+	struct avr_replay_t *	r;
+	avr_irq_t *				irq;
+	uint16_t				index;
+	// set for the IO port pins, their own raises aren't inputs
+	struct avr_ioport_t *	port;
+} avr_replay_input_t;
+
+typedef struct avr_replay_t {
+	avr_t *					avr;
+	int						mode;
+	FILE *					f;			// NULL for the in memory log
+	int						started;
+	avr_replay_input_t **	input;
+	uint32_t				input_count;
+
+	uint8_t					in_run;		// set by avr_replay_run()
+	uint8_t					in_core;	// set by the run callbacks
+	avr_cycle_count_t		last;		// cycle of the previous record
+
+	// replay: next record to inject
+	struct {
+		int					valid;
+		avr_cycle_count_t	cycle;
+		uint32_t			input;
+		uint8_t				phase, floating;
+		uint64_t			value;
+	} next;
+	int						armed;		// cycle timer is registered
+	uint64_t				injected;
+
+	// in memory log
+	avr_replay_rec_t *		log;
+	uint32_t				log_count, log_size;
+	uint32_t				log_pos;	// next record to replay
+} avr_replay_t;
+
+/*
+ * Starts a recording to 'filename'. The input IRQs of the IO modules
+ * are added, more can be with avr_replay_input(), then avr_replay_start()
+ * must be called before the firmware runs.
+ */
+avr_replay_t *
+avr_replay_record(
+		avr_t * avr,
+		const char * filename);
+/*
+ * Opens a recording to replay. The same inputs must be declared, in the
+ * same order, as when it was recorded. The sources of these inputs
+ * (pty, VCD input...) should not be attached.
+ */
+avr_replay_t *
+avr_replay_play(
+		avr_t * avr,
+		const char * filename);
+/*
+ * Records to memory instead, already started. Used by sim_reverse.c to
+ * re-execute parts of the run, see avr_replay_seek().
+ */
+avr_replay_t *
+avr_replay_memory(
+		avr_t * avr);
+/*
+ * In memory log: replays from record 'pos' on. The core must be in the
+ * state it was in when that record was the next one.
+ */
+void
+avr_replay_seek(
+		avr_replay_t * r,
+		uint32_t pos);
+/* In memory log: drops what wasn't replayed yet, and records again */
+void
+avr_replay_truncate(
+		avr_replay_t * r);
+/* In memory log: forgets the first 'count' records */
+void
+avr_replay_discard(
+		avr_replay_t * r,
+		uint32_t count);
+/* Adds an input IRQ, before avr_replay_start() */
+int
+avr_replay_input(
+		avr_replay_t * r,
+		avr_irq_t * irq);
+/*
+ * Record: writes the header and hooks the inputs. Replay: checks the
+ * header, restores the serial number and turns off real time pacing.
+ */
+int
+avr_replay_start(
+		avr_replay_t * r);
+/*
+ * Record: writes the final record. Replay: checks the state matches the
+ * recorded one, if the run got that far. Detaches and frees.
+ */
+void
+avr_replay_close(
+		avr_replay_t * r);
+
+/* avr_run() when avr->replay is set */
+int
+avr_replay_run(
+		avr_t * avr);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_REPLAY_H__ */
@@ -0,0 +1,267 @@
+/*
+	sim_reverse.c
+
+	Execution history for reverse debugging.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim_reverse.h"
+#include "sim_pace.h"
+
+static uint64_t
+_reverse_log_size(
+		avr_reverse_t * rv)
+{
+	return rv->log ? rv->log->log_count * sizeof(avr_replay_rec_t) : 0;
+}
+
+static void
+_reverse_drop(
+		avr_reverse_t * rv,
+		int i)
+{
+	rv->used -= rv->point[i].snap->size;
+	avr_snapshot_free(rv->point[i].snap);
+	memmove(&rv->point[i], &rv->point[i + 1],
+			(rv->count - i - 1) * sizeof(rv->point[0]));
+	rv->count--;
+}
+
+/*
+ * Every other checkpoint of the older half goes first, so the recent
+ * history stays dense and the older one gets sparser. The oldest one
+ * only goes when there are just a few left, with the inputs before the
+ * next one.
+ */
+static void
+_reverse_trim(
+		avr_reverse_t * rv)
+{
+	while (rv->used + _reverse_log_size(rv) > rv->budget && rv->count > 1) {
+		if (rv->count > 3) {
+			for (int i = 1; i < rv->count / 2; i++)
+				_reverse_drop(rv, i);
+			continue;
+		}
+		_reverse_drop(rv, 0);
+		if (rv->log) {
+			uint32_t base = rv->point[0].log;
+			avr_replay_discard(rv->log, base);
+			for (int i = 0; i < rv->count; i++)
+				rv->point[i].log -= base;
+		}
+	}
+}
+
+void
+avr_reverse_checkpoint(
+		avr_reverse_t * rv)
+{
+	avr_t * avr = rv->avr;
+
+	// same cycle, gdb changed the core since the last one
+	if (rv->count && rv->point[rv->count - 1].cycle == avr->cycle)
+		_reverse_drop(rv, rv->count - 1);
+	if (rv->count == rv->size) {
+		rv->size = rv->size ? rv->size * 2 : 64;
+		rv->point = realloc(rv->point, rv->size * sizeof(rv->point[0]));
+	}
+	avr_reverse_point_t * p = &rv->point[rv->count++];
+	p->cycle = avr->cycle;
+	p->snap = avr_snapshot_take(avr);
+	p->log = rv->log ? rv->log->log_count : 0;
+	rv->used += p->snap->size;
+	rv->next = avr->cycle + rv->interval;
+	_reverse_trim(rv);
+}
+
+avr_reverse_t *
+avr_reverse_init(
+		avr_t * avr,
+		uint64_t budget,
+		avr_cycle_count_t interval)
+{
+	if (avr->reverse)
+		return avr->reverse;
+	// re-executing would need to seek in the recording
+	if (avr->replay) {
+		AVR_LOG(avr, LOG_ERROR,
+				"REVERSE: not available while recording or replaying\n");
+		return NULL;
+	}
+	avr_reverse_t * rv = calloc(1, sizeof(*rv));
+	rv->avr = avr;
+	rv->budget = budget ? budget : AVR_REVERSE_BUDGET;
+	rv->interval = interval ? interval : AVR_REVERSE_INTERVAL;
+	rv->log = avr_replay_memory(avr);
+	if (!rv->log)
+		AVR_LOG(avr, LOG_WARNING,
+				"REVERSE: inputs not logged, going back may not be exact\n");
+	avr->reverse = rv;
+	avr_reverse_checkpoint(rv);
+	AVR_LOG(avr, LOG_TRACE, "REVERSE: %lluKB of history, every %llu cycles\n",
+			(unsigned long long)rv->budget / 1024,
+			(unsigned long long)rv->interval);
+	return rv;
+}
+
+void
+avr_reverse_free(
+		avr_reverse_t * rv)
+{
+	if (!rv)
+		return;
+	while (rv->count)
+		_reverse_drop(rv, rv->count - 1);
+	free(rv->point);
+	if (rv->log)
+		avr_replay_close(rv->log);
+	if (rv->avr->reverse == rv)
+		rv->avr->reverse = NULL;
+	free(rv);
+}
+
+/* Going back runs flat out */
+static void
+_reverse_sleep(
+		avr_t * avr,
+		avr_cycle_count_t how_long)
+{
+}
+
+static void
+_reverse_enter(
+		avr_reverse_t * rv)
+{
+	avr_t * avr = rv->avr;
+
+	// the gdb callbacks would poll the network, and take checkpoints
+	rv->run = avr->run;
+	rv->sleep = avr->sleep;
+	avr->run = avr_callback_run_raw;
+	avr->sleep = _reverse_sleep;
+	rv->pace = avr->pace;
+	avr->pace = NULL;
+	rv->scanning = 1;
+}
+
+static void
+_reverse_leave(
+		avr_reverse_t * rv)
+{
+	avr_t * avr = rv->avr;
+
+	// what follows is no longer the past
+	while (rv->count > 1 && rv->point[rv->count - 1].cycle > avr->cycle)
+		_reverse_drop(rv, rv->count - 1);
+	if (rv->log)
+		avr_replay_truncate(rv->log);
+	rv->next = rv->point[rv->count - 1].cycle + rv->interval;
+	rv->scanning = 0;
+	avr->run = rv->run;
+	avr->sleep = rv->sleep;
+	avr->pace = rv->pace;
+	// the wall clock goes on from where the core is now
+	if (avr->pace)
+		avr_pace_set(avr->pace, avr->pace->mode, avr->pace->ratio);
+	avr->state = cpu_Stopped;
+}
+
+static int
+_reverse_restore(
+		avr_reverse_t * rv,
+		int k)
+{
+	avr_t * avr = rv->avr;
+
+	if (avr_snapshot_restore(avr, rv->point[k].snap))
+		return -1;
+	// gdb had the core stopped, or stepping, for some of them
+	if (avr->state != cpu_Sleeping)
+		avr->state = cpu_Running;
+	if (rv->log)
+		avr_replay_seek(rv->log, rv->point[k].log);
+	return 0;
+}
+
+static int
+_reverse_step(
+		avr_reverse_t * rv)
+{
+	int state = avr_run(rv->avr);
+
+	return state == cpu_Running || state == cpu_Sleeping;
+}
+
+static int
+_reverse_goto(
+		avr_reverse_t * rv,
+		int k,
+		avr_cycle_count_t cycle)
+{
+	if (_reverse_restore(rv, k))
+		return -1;
+	while (rv->avr->cycle < cycle && _reverse_step(rv))
+		;
+	return 0;
+}
+
+int
+avr_reverse_find(
+		avr_reverse_t * rv,
+		avr_reverse_stop_t stop,
+		void * param)
+{
+	avr_t * avr = rv->avr;
+	avr_cycle_count_t end = avr->cycle;
+	int k = rv->count - 1, res = 0;
+
+	_reverse_enter(rv);
+	while (k >= 0 && rv->point[k].cycle >= end)
+		k--;
+	// the last segment first, then the one before...
+	for (; k >= 0 && res == 0; k--) {
+		avr_cycle_count_t found = 0;
+		int hit = 0, running = 1;
+
+		if (_reverse_restore(rv, k)) {
+			res = -1;
+			break;
+		}
+		while (running && avr->cycle < end) {
+			avr_cycle_count_t start = avr->cycle;
+			if (stop(avr, param, 0))
+				hit = 1, found = start;
+			running = _reverse_step(rv);
+			if (stop(avr, param, 1))
+				hit = 1, found = start;
+		}
+		if (hit)
+			res = _reverse_goto(rv, k, found) ? -1 : 1;
+		else
+			end = rv->point[k].cycle;
+	}
+	if (res == 0 && _reverse_goto(rv, 0, rv->point[0].cycle))
+		res = -1;
+	_reverse_leave(rv);
+	if (res == -1)
+		AVR_LOG(avr, LOG_ERROR, "REVERSE: can't restore the history\n");
+	return res;
+}
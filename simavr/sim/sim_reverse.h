@@ -0,0 +1,131 @@
+/*
+	sim_reverse.h
+
+	Execution history for reverse debugging: snapshots of the whole core
+	are taken every so many cycles, and the external inputs are logged in
+	between, so any past instruction can be reached again by restoring a
+	snapshot and running forward from it.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_REVERSE_H__
+#define __SIM_REVERSE_H__
+
+#include "sim_avr.h"
+#include "sim_snapshot.h"
+#include "sim_replay.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define AVR_REVERSE_BUDGET		(64 * 1024 * 1024)
+#define AVR_REVERSE_INTERVAL	1000000
+
+typedef struct avr_reverse_point_t {
+	avr_cycle_count_t	cycle;
+	avr_snapshot_t *	snap;
+	uint32_t			log;		// first input record after the snapshot
+} avr_reverse_point_t;
+
+typedef struct avr_reverse_t {
+	avr_t *					avr;
+	uint64_t				budget;		// bytes, snapshots and input log
+	uint64_t				used;
+	avr_cycle_count_t		interval;
+	avr_cycle_count_t		next;		// cycle of the next checkpoint
+
+	avr_reverse_point_t *	point;		// oldest first
+	int						count, size;
+	avr_replay_t *			log;		// NULL if the inputs aren't logged
+
+	int						scanning;	// re-executing the past
+	// saved while re-executing
+	void (*run)(avr_t * avr);
+	void (*sleep)(avr_t * avr, avr_cycle_count_t howLong);
+	struct avr_pace_t *		pace;
+} avr_reverse_t;
+
+/*
+ * Called before and after each instruction while looking back, 'after'
+ * tells which. Returns non zero if execution should stop at the start
+ * of that instruction.
+ */
+typedef int (*avr_reverse_stop_t)(
+		avr_t * avr,
+		void * param,
+		int after);
+
+/*
+ * Starts keeping the history of 'avr'; a snapshot is taken every
+ * 'interval' cycles, and the older ones are thinned out to stay within
+ * 'budget' bytes. 0 picks the defaults.
+ */
+avr_reverse_t *
+avr_reverse_init(
+		avr_t * avr,
+		uint64_t budget,
+		avr_cycle_count_t interval);
+void
+avr_reverse_free(
+		avr_reverse_t * rv);
+
+/* Takes a checkpoint now, between two instructions */
+void
+avr_reverse_checkpoint(
+		avr_reverse_t * rv);
+
+/* Called between instructions, takes a checkpoint when one is due */
+static inline void
+avr_reverse_poll(
+		avr_reverse_t * rv)
+{
+	if (rv->avr->cycle >= rv->next)
+		avr_reverse_checkpoint(rv);
+}
+
+/*
+ * Non zero while going back re-executes the past. The logged inputs are
+ * injected again then, and the outputs were already sent the first time;
+ * parts talking to the outside (pty, sockets...) should neither read
+ * nor write it meanwhile, as uart_pty does. The VCD output is muted too,
+ * but a VCD input isn't rewound, and injects its own events again.
+ */
+static inline int
+avr_reverse_scanning(
+		avr_t * avr)
+{
+	return avr->reverse && avr->reverse->scanning;
+}
+
+/*
+ * Goes back to the last instruction before the current one where 'stop'
+ * said so. Returns 1 if one was found, 0 if the start of the history was
+ * reached instead, and the core is left there. The history after that
+ * point is dropped, running again is live.
+ */
+int
+avr_reverse_find(
+		avr_reverse_t * rv,
+		avr_reverse_stop_t stop,
+		void * param);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_REVERSE_H__ */
@@ -0,0 +1,289 @@
+/*
+	sim_semihost.c
+
+	Semihosting calls from the firmware, through the command register.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "sim_semihost.h"
+#include "sim_replay.h"
+#include "avr/avr_mcu_section.h"
+
+/* SRAM range of a block or buffer, in place; NULL if it's not all in it */
+static uint8_t *
+_semihost_mem(
+		avr_semihost_t * sh,
+		uint16_t addr,
+		uint16_t len)
+{
+	avr_t * avr = sh->avr;
+
+	if (addr <= avr->ioend || (uint32_t)addr + len > avr->ramend + 1) {
+		AVR_LOG(avr, LOG_ERROR, "SEMIHOST: %04x+%u isn't in SRAM\n",
+				addr, len);
+		return NULL;
+	}
+	return avr->data + addr;
+}
+
+static FILE *
+_semihost_file(
+		avr_semihost_t * sh,
+		uint8_t fd)
+{
+	return fd < AVR_SEMIHOST_FILES ? sh->file[fd] : NULL;
+}
+
+/*
+ * Paths are relative to the root, and can't climb out of it
+ */
+static int
+_semihost_open(
+		avr_semihost_t * sh,
+		const char * path,
+		uint8_t mode)
+{
+	static const char * modes[] = {
+		[SIMAVR_SEMIHOST_O_READ] = "rb",
+		[SIMAVR_SEMIHOST_O_WRITE] = "wb",
+		[SIMAVR_SEMIHOST_O_APPEND] = "ab",
+	};
+	if (!sh->root || mode > SIMAVR_SEMIHOST_O_APPEND || !path[0] ||
+			path[0] == '/')
+		return -1;
+	const char * p = path;
+	do {
+		if (p[0] == '.' && p[1] == '.' && (!p[2] || p[2] == '/'))
+			return -1;
+		p = strchr(p, '/');
+	} while (p++);
+	int fd = 3;
+	while (fd < AVR_SEMIHOST_FILES && sh->file[fd])
+		fd++;
+	if (fd == AVR_SEMIHOST_FILES)
+		return -1;
+	char name[1024];
+	snprintf(name, sizeof(name), "%s/%s", sh->root, path);
+	sh->file[fd] = fopen(name, modes[mode]);
+	AVR_LOG(sh->avr, LOG_TRACE, "SEMIHOST: open %s %s: %d\n", name,
+			modes[mode], sh->file[fd] ? fd : -1);
+	return sh->file[fd] ? fd : -1;
+}
+
+/* Hands what a call wrote back to SRAM to the replay log */
+static void
+_semihost_result(
+		avr_semihost_t * sh,
+		uint16_t addr,
+		uint16_t len)
+{
+	avr_t * avr = sh->avr;
+
+	if (!avr->replay || avr->replay->mode != AVR_REPLAY_RECORD)
+		return;
+	for (uint32_t i = 0; i < len; i++)
+		avr_raise_irq(sh->irq + SEMIHOST_IRQ_RESULT,
+				((addr + i) << 8) | avr->data[addr + i]);
+}
+
+/* Replaying, the logged bytes are written back */
+static void
+_semihost_replayed(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	avr_semihost_t * sh = (avr_semihost_t *)param;
+	uint8_t * p = _semihost_mem(sh, value >> 8, 1);
+
+	if (p && sh->avr->replay && sh->avr->replay->mode == AVR_REPLAY_PLAY)
+		*p = value;
+}
+
+static void
+_semihost_put64(
+		uint8_t * dst,
+		uint64_t v)
+{
+	for (int i = 0; i < 8; i++, v >>= 8)
+		dst[i] = v;
+}
+
+static int16_t
+_semihost_call(
+		avr_semihost_t * sh,
+		uint8_t * b)
+{
+	avr_t * avr = sh->avr;
+	uint8_t op = b[0], fd = b[1];
+	uint16_t buf = b[2] | (b[3] << 8);
+	uint16_t len = b[4] | (b[5] << 8);
+	FILE * f = _semihost_file(sh, fd);
+	uint8_t * p;
+
+	sh->stats.calls++;
+	switch (op) {
+		case SIMAVR_SEMIHOST_WRITE:
+			if (!f || !(p = _semihost_mem(sh, buf, len)))
+				return -1;
+			sh->stats.written += len;
+			return fwrite(p, 1, len, f);
+		case SIMAVR_SEMIHOST_READ: {
+			if (!f || !(p = _semihost_mem(sh, buf, len)))
+				return -1;
+			size_t r = fread(p, 1, len, f);
+			sh->stats.read += r;
+			_semihost_result(sh, buf, r);
+			return r || !ferror(f) ? (int16_t)r : -1;
+		}
+		case SIMAVR_SEMIHOST_OPEN:
+			if (!(p = _semihost_mem(sh, buf, len)) || !memchr(p, 0, len))
+				return -1;
+			return _semihost_open(sh, (const char *)p, fd);
+		case SIMAVR_SEMIHOST_CLOSE:
+			if (fd < 3 || !f)
+				return -1;
+			fclose(f);
+			sh->file[fd] = NULL;
+			return 0;
+		case SIMAVR_SEMIHOST_TIME: {
+			struct timeval tv;
+			if (!(p = _semihost_mem(sh, buf, 8)))
+				return -1;
+			gettimeofday(&tv, NULL);
+			_semihost_put64(p, (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec);
+			_semihost_result(sh, buf, 8);
+			return 0;
+		}
+		case SIMAVR_SEMIHOST_CYCLES:
+			if (!(p = _semihost_mem(sh, buf, 8)))
+				return -1;
+			_semihost_put64(p, avr->cycle);
+			_semihost_result(sh, buf, 8);
+			return 0;
+		case SIMAVR_SEMIHOST_EXIT:
+			sh->exited = 1;
+			sh->exit_status = (int16_t)len;
+			AVR_LOG(avr, LOG_TRACE, "SEMIHOST: exit %d at cycle %llu\n",
+					sh->exit_status, (unsigned long long)avr->cycle);
+			fflush(sh->file[1]);
+			avr->state = cpu_Done;
+			return 0;
+	}
+	AVR_LOG(avr, LOG_ERROR, "SEMIHOST: unknown call %d\n", op);
+	return -1;
+}
+
+/* The command, then the block address, low byte first */
+static int
+_semihost_cmd(
+		avr_t * avr,
+		uint8_t v,
+		void * param)
+{
+	avr_semihost_t * sh = *(avr_semihost_t **)param;
+
+	switch (sh->state++) {
+		case 0:
+			return 1;
+		case 1:
+			sh->block = v;
+			return 1;
+	}
+	sh->state = 0;
+	sh->block |= v << 8;
+
+	uint8_t * b = _semihost_mem(sh, sh->block, sizeof(simavr_semihost_t));
+	if (!b)
+		return 0;
+	// the host was called already, the log has what it returned
+	if (avr->replay && avr->replay->mode == AVR_REPLAY_PLAY &&
+			b[0] != SIMAVR_SEMIHOST_EXIT) {
+		sh->stats.calls++;
+		return 0;
+	}
+	int16_t ret = _semihost_call(sh, b);
+	b[6] = ret;
+	b[7] = ret >> 8;
+	_semihost_result(sh, sh->block + 6, 2);
+	return 0;
+}
+
+avr_semihost_t *
+avr_semihost_init(
+		avr_t * avr,
+		const char * root)
+{
+	avr_semihost_t * sh = calloc(1, sizeof(*sh));
+
+	static const char * names[SEMIHOST_IRQ_COUNT] = {
+		[SEMIHOST_IRQ_RESULT] = "32<semihost.result",
+	};
+
+	sh->avr = avr;
+	sh->irq = avr_alloc_irq(&avr->irq_pool, 0, SEMIHOST_IRQ_COUNT, names);
+	avr_irq_register_notify(sh->irq + SEMIHOST_IRQ_RESULT,
+			_semihost_replayed, sh);
+	// the replay adds it itself if it's started later
+	if (avr->replay && avr_replay_input(avr->replay,
+			sh->irq + SEMIHOST_IRQ_RESULT) < 0)
+		AVR_LOG(avr, LOG_WARNING,
+				"SEMIHOST: started after the replay, results not logged\n");
+	sh->root = root ? strdup(root) : NULL;
+	sh->file[0] = stdin;
+	sh->file[1] = stdout;
+	sh->file[2] = stderr;
+	// the command table owns (and frees) its parameters
+	avr_semihost_t ** cmd = malloc(sizeof(*cmd));
+	*cmd = sh;
+	avr_cmd_register(avr, SIMAVR_CMD_SEMIHOST, _semihost_cmd, cmd);
+	avr->semihost = sh;
+	return sh;
+}
+
+void
+avr_semihost_log(
+		avr_semihost_t * sh,
+		FILE * out)
+{
+	if (sh->file[1] != stdout)
+		fclose(sh->file[1]);
+	sh->file[1] = out ? out : stdout;
+}
+
+void
+avr_semihost_free(
+		avr_semihost_t * sh)
+{
+	avr_t * avr = sh->avr;
+
+	avr_cmd_unregister(avr, SIMAVR_CMD_SEMIHOST);
+	for (int i = 3; i < AVR_SEMIHOST_FILES; i++)
+		if (sh->file[i])
+			fclose(sh->file[i]);
+	avr_semihost_log(sh, NULL);
+	fflush(stdout);
+	if (avr->semihost == sh)
+		avr->semihost = NULL;
+	avr_free_irq(sh->irq, SEMIHOST_IRQ_COUNT);
+	free(sh->root);
+	free(sh);
+}
@@ -0,0 +1,93 @@
+/*
+	sim_semihost.h
+
+	Semihosting: the firmware asks simavr to do things on the host
+	through the command register, writing logs at memory speed, reading
+	and writing host files, getting the wall clock, or exiting with a
+	status for test suites. The protocol, and the firmware side, are in
+	avr/avr_mcu_section.h; the firmware must declare its command
+	register with AVR_MCU_SIMAVR_COMMAND().
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_SEMIHOST_H__
+#define __SIM_SEMIHOST_H__
+
+#include <stdio.h>
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define AVR_SEMIHOST_FILES	16		// including stdin, the log and stderr
+
+enum {
+	/*
+	 * A byte a call wrote back to SRAM, address << 8 | value; raised
+	 * while recording, so sim_replay logs them.
+	 */
+	SEMIHOST_IRQ_RESULT = 0,
+	SEMIHOST_IRQ_COUNT
+};
+
+typedef struct avr_semihost_t {
+	avr_t *		avr;
+	avr_irq_t *	irq;
+	char *		root;		// host files are opened from there, if set
+	FILE *		file[AVR_SEMIHOST_FILES];	// 1 is the log, stdout
+
+	int			state;		// bytes of the command received
+	uint16_t	block;		// its address
+
+	int			exited;
+	int			exit_status;
+	struct {
+		uint64_t	calls;
+		uint64_t	written;	// bytes
+		uint64_t	read;
+	} stats;
+} avr_semihost_t;
+
+/*
+ * Answers SIMAVR_CMD_SEMIHOST for 'avr', from now on. The firmware can
+ * only open files below 'root', and none if it's NULL. Kept in
+ * avr->semihost, avr_terminate() frees it.
+ *
+ * What the calls return is recorded by sim_replay, and by the reverse
+ * execution history, if this is called before they start. When a log
+ * plays back the calls don't touch the host, their results come from
+ * it; only SIMAVR_SEMIHOST_EXIT still stops the core.
+ */
+avr_semihost_t *
+avr_semihost_init(
+		avr_t * avr,
+		const char * root);
+/* Sends the log somewhere else than stdout, it's closed with the rest */
+void
+avr_semihost_log(
+		avr_semihost_t * sh,
+		FILE * out);
+void
+avr_semihost_free(
+		avr_semihost_t * sh);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_SEMIHOST_H__ */
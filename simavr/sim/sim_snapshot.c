@@ -0,0 +1,517 @@
+/*
+	sim_snapshot.c
+
+	Saves and restores the complete state of a running avr_t, core,
+	memories, interrupts, cycle timers and IO modules.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sim_snapshot.h"
+#include "sim_io.h"
+
+// we need the pending vector fifo accessors
+DEFINE_FIFO(avr_int_vector_p, avr_int_pending);
+
+#define SNAP_TAG(_a,_b,_c,_d) AVR_IOCTL_DEF(_a,_b,_c,_d)
+
+enum {
+	SNAP_TIMER_RAW = 0,		// function/param pointers, same process only
+	SNAP_TIMER_IO,			// module index, callback index
+};
+
+/*
+ * Saved in the header, raw pointers are only restored if the snapshot
+ * was taken by this process, on this avr
+ */
+typedef struct avr_snapshot_hdr_t {
+	uint32_t	magic;
+	uint32_t	version;
+	char		mmcu[32];
+	uint32_t	ramend, flashend, e2end;
+	uint32_t	pid;
+	uint64_t	owner;
+} avr_snapshot_hdr_t;
+
+static void
+_snap_put(
+		avr_snapshot_t * snap,
+		const void * data,
+		uint32_t size)
+{
+	if (snap->len + size > snap->size) {
+		while (snap->len + size > snap->size)
+			snap->size = snap->size ? snap->size * 2 : 4096;
+		snap->buf = realloc(snap->buf, snap->size);
+	}
+	memcpy(snap->buf + snap->len, data, size);
+	snap->len += size;
+}
+
+static int
+_snap_get(
+		avr_snapshot_t * snap,
+		void * data,
+		uint32_t size)
+{
+	if (snap->pos + size > snap->len) {
+		snap->error++;
+		return -1;
+	}
+	memcpy(data, snap->buf + snap->pos, size);
+	snap->pos += size;
+	return 0;
+}
+
+void
+avr_snapshot_field(
+		avr_snapshot_t * snap,
+		void * data,
+		uint32_t size)
+{
+	if (snap->restore)
+		_snap_get(snap, data, size);
+	else
+		_snap_put(snap, data, size);
+}
+
+/* Chunks are a tag and a size, so the reader can check it's in sync */
+static uint32_t
+_snap_chunk_begin(
+		avr_snapshot_t * snap,
+		uint32_t tag)
+{
+	uint32_t o = snap->len, size = 0;
+	_snap_put(snap, &tag, sizeof(tag));
+	_snap_put(snap, &size, sizeof(size));
+	return o;
+}
+
+static void
+_snap_chunk_end(
+		avr_snapshot_t * snap,
+		uint32_t o)
+{
+	uint32_t size = snap->len - o - 8;
+	memcpy(snap->buf + o + 4, &size, sizeof(size));
+}
+
+/* Returns the end offset of the chunk, 0 if 'tag' isn't the next chunk */
+static uint32_t
+_snap_chunk_open(
+		avr_snapshot_t * snap,
+		uint32_t tag)
+{
+	uint32_t t, size;
+
+	if (_snap_get(snap, &t, sizeof(t)) || _snap_get(snap, &size, sizeof(size)) ||
+			t != tag || snap->pos + size > snap->len) {
+		snap->error++;
+		return 0;
+	}
+	return snap->pos + size;
+}
+
+/* Finds which IO module owns that timer, returns -1 if none does */
+static int
+_snap_timer_owner(
+		avr_t * avr,
+		avr_cycle_timer_slot_p t,
+		uint16_t * index)
+{
+	int mod = 0;
+
+	for (avr_io_t * io = avr->io_port; io; io = io->next, mod++) {
+		if (!io->timers || t->param != io->timer_param)
+			continue;
+		for (int i = 0; io->timers[i]; i++)
+			if (io->timers[i] == t->timer) {
+				*index = i;
+				return mod;
+			}
+	}
+	return -1;
+}
+
+static void
+_snap_timers_save(
+		avr_t * avr,
+		avr_snapshot_t * snap)
+{
+	uint32_t count = 0;
+
+	for (avr_cycle_timer_slot_p t = avr->cycle_timers.timer; t; t = t->next)
+		count++;
+	_snap_put(snap, &count, sizeof(count));
+	// the list is sorted, so this also preserves the firing order
+	for (avr_cycle_timer_slot_p t = avr->cycle_timers.timer; t; t = t->next) {
+		uint16_t index = 0;
+		int mod = _snap_timer_owner(avr, t, &index);
+		uint8_t kind = mod == -1 ? SNAP_TIMER_RAW : SNAP_TIMER_IO;
+		uint64_t delay = t->when > avr->cycle ? t->when - avr->cycle : 0;
+
+		_snap_put(snap, &kind, sizeof(kind));
+		if (kind == SNAP_TIMER_IO) {
+			uint16_t m = mod;
+			_snap_put(snap, &m, sizeof(m));
+			_snap_put(snap, &index, sizeof(index));
+		} else {
+			uint64_t fn = (uintptr_t)t->timer, param = (uintptr_t)t->param;
+			_snap_put(snap, &fn, sizeof(fn));
+			_snap_put(snap, &param, sizeof(param));
+		}
+		_snap_put(snap, &delay, sizeof(delay));
+	}
+}
+
+static void
+_snap_timers_restore(
+		avr_t * avr,
+		avr_snapshot_t * snap,
+		int same_owner)
+{
+	static int warned;
+	uint32_t count = 0;
+
+	if (_snap_get(snap, &count, sizeof(count)))
+		return;
+	for (int i = 0; i < count && !snap->error; i++) {
+		uint8_t kind = 0;
+		avr_cycle_timer_t timer = NULL;
+		void * param = NULL;
+		uint64_t delay = 0;
+
+		// a short read leaves snap->error set, and no timer half restored
+		if (_snap_get(snap, &kind, sizeof(kind)))
+			return;
+		if (kind == SNAP_TIMER_IO) {
+			uint16_t mod = 0, index = 0;
+			if (_snap_get(snap, &mod, sizeof(mod)) ||
+					_snap_get(snap, &index, sizeof(index)))
+				return;
+			avr_io_t * io = avr->io_port;
+			while (io && mod--)
+				io = io->next;
+			if (io && io->timers) {
+				int n = 0;
+				while (io->timers[n])
+					n++;
+				if (index < n) {
+					timer = io->timers[index];
+					param = io->timer_param;
+				}
+			}
+		} else {
+			uint64_t fn = 0, p = 0;
+			if (_snap_get(snap, &fn, sizeof(fn)) ||
+					_snap_get(snap, &p, sizeof(p)))
+				return;
+			if (same_owner) {
+				timer = (avr_cycle_timer_t)(uintptr_t)fn;
+				param = (void*)(uintptr_t)p;
+			}
+		}
+		if (_snap_get(snap, &delay, sizeof(delay)))
+			return;
+		if (timer)
+			avr_cycle_timer_register(avr, delay, timer, param);
+		else if (!warned) {
+			warned = 1;	// fuzz loops restore thousands of times
+			AVR_LOG(avr, LOG_WARNING,
+					"SNAPSHOT: dropped a cycle timer not owned by an IO module\n");
+		}
+	}
+}
+
+static void
+_snap_interrupts(
+		avr_t * avr,
+		avr_snapshot_t * snap)
+{
+	avr_int_table_p table = &avr->interrupts;
+	uint8_t pending[64], running[64];
+	uint8_t pcount = 0;
+
+	// vectors are saved by number, the fifo and stack hold pointers
+	if (!snap->restore) {
+		for (int i = 0; i < avr_int_pending_get_read_size(&table->pending); i++)
+			pending[pcount++] = avr_int_pending_read_at(&table->pending, i)->vector;
+		for (int i = 0; i < table->running_ptr; i++)
+			running[i] = table->running[i]->vector;
+		for (int i = 0; i < table->vector_count; i++) {
+			uint8_t p = table->vector[i]->pending;
+			_snap_put(snap, &p, 1);
+		}
+	} else {
+		for (int i = 0; i < table->vector_count; i++) {
+			uint8_t p = 0;
+			_snap_get(snap, &p, 1);
+			table->vector[i]->pending = p;
+		}
+	}
+	// the counts index fixed arrays, a bad file must not overflow them
+	AVR_SNAPSHOT_FIELD(snap, pcount);
+	if (pcount >= avr_int_pending_fifo_size) {
+		snap->error++;
+		return;
+	}
+	avr_snapshot_field(snap, pending, pcount);
+	uint8_t rcount = table->running_ptr;
+	AVR_SNAPSHOT_FIELD(snap, rcount);
+	if (rcount > ARRAY_SIZE(table->running)) {
+		snap->error++;
+		return;
+	}
+	avr_snapshot_field(snap, running, rcount);
+	if (!snap->restore || snap->error)
+		return;
+
+	table->running_ptr = rcount;
+
+	avr_int_pending_reset(&table->pending);
+	for (int i = 0; i < pcount + table->running_ptr; i++) {
+		uint8_t v = i < pcount ? pending[i] : running[i - pcount];
+		avr_int_vector_t * vector = NULL;
+		for (int vi = 0; vi < table->vector_count && !vector; vi++)
+			if (table->vector[vi]->vector == v)
+				vector = table->vector[vi];
+		if (!vector) {
+			snap->error++;
+			return;
+		}
+		if (i < pcount)
+			avr_int_pending_write(&table->pending, vector);
+		else
+			table->running[i - pcount] = vector;
+	}
+}
+
+/* Values and floating state of every IRQ, in pool order */
+static void
+_snap_irqs(
+		avr_t * avr,
+		avr_snapshot_t * snap)
+{
+	uint32_t count = avr->irq_pool.count;
+
+	AVR_SNAPSHOT_FIELD(snap, count);
+	if (count != avr->irq_pool.count) {
+		snap->error++;
+		return;
+	}
+	for (int i = 0; i < count; i++) {
+		avr_irq_t * irq = avr->irq_pool.irq[i];
+		uint32_t value = irq ? irq->value : 0;
+		uint8_t flags = irq ? irq->flags & (IRQ_FLAG_INIT | IRQ_FLAG_FLOATING) : 0;
+
+		AVR_SNAPSHOT_FIELD(snap, value);
+		AVR_SNAPSHOT_FIELD(snap, flags);
+		if (snap->restore && irq) {
+			irq->value = value;
+			irq->flags = (irq->flags & ~(IRQ_FLAG_INIT | IRQ_FLAG_FLOATING)) | flags;
+		}
+	}
+}
+
+static void
+_snap_core(
+		avr_t * avr,
+		avr_snapshot_t * snap)
+{
+	AVR_SNAPSHOT_FIELD(snap, avr->state);
+	AVR_SNAPSHOT_FIELD(snap, avr->cycle);
+	AVR_SNAPSHOT_FIELD(snap, avr->pc);
+	AVR_SNAPSHOT_FIELD(snap, avr->reset_pc);
+	AVR_SNAPSHOT_FIELD(snap, avr->codeend);
+	AVR_SNAPSHOT_FIELD(snap, avr->sreg);
+	AVR_SNAPSHOT_FIELD(snap, avr->interrupt_state);
+	AVR_SNAPSHOT_FIELD(snap, avr->fuse);
+	AVR_SNAPSHOT_FIELD(snap, avr->lockbits);
+	AVR_SNAPSHOT_FIELD(snap, avr->sleep_usec);
+	avr_snapshot_field(snap, avr->data, avr->ramend + 1);
+	avr_snapshot_field(snap, avr->flash, avr->flashend + 1);
+}
+
+avr_snapshot_t *
+avr_snapshot_take(
+		avr_t * avr)
+{
+	avr_snapshot_t * snap = calloc(1, sizeof(*snap));
+	avr_snapshot_hdr_t hdr = {
+		.magic = AVR_SNAPSHOT_MAGIC,
+		.version = AVR_SNAPSHOT_VERSION,
+		.ramend = avr->ramend,
+		.flashend = avr->flashend,
+		.e2end = avr->e2end,
+		.pid = getpid(),
+		.owner = (uintptr_t)avr,
+	};
+	uint32_t o;
+
+	strncpy(hdr.mmcu, avr->mmcu ? avr->mmcu : "", sizeof(hdr.mmcu) - 1);
+	_snap_put(snap, &hdr, sizeof(hdr));
+
+	o = _snap_chunk_begin(snap, SNAP_TAG('C','O','R','E'));
+	_snap_core(avr, snap);
+	_snap_chunk_end(snap, o);
+
+	o = _snap_chunk_begin(snap, SNAP_TAG('I','N','T','S'));
+	_snap_interrupts(avr, snap);
+	_snap_chunk_end(snap, o);
+
+	o = _snap_chunk_begin(snap, SNAP_TAG('I','R','Q','S'));
+	_snap_irqs(avr, snap);
+	_snap_chunk_end(snap, o);
+
+	for (avr_io_t * io = avr->io_port; io; io = io->next) {
+		char kind[16] = {0};
+		strncpy(kind, io->kind ? io->kind : "", sizeof(kind) - 1);
+		o = _snap_chunk_begin(snap, SNAP_TAG('I','O','M','D'));
+		_snap_put(snap, kind, sizeof(kind));
+		if (io->snapshot)
+			io->snapshot(io, snap);
+		_snap_chunk_end(snap, o);
+	}
+	// last, as restoring modules may re-arm some timers
+	o = _snap_chunk_begin(snap, SNAP_TAG('T','I','M','R'));
+	_snap_timers_save(avr, snap);
+	_snap_chunk_end(snap, o);
+
+	return snap;
+}
+
+int
+avr_snapshot_restore(
+		avr_t * avr,
+		avr_snapshot_t * snap)
+{
+	avr_snapshot_hdr_t hdr;
+	uint32_t end;
+
+	snap->pos = 0;
+	snap->error = 0;
+	snap->restore = 1;
+	if (_snap_get(snap, &hdr, sizeof(hdr)) ||
+			hdr.magic != AVR_SNAPSHOT_MAGIC ||
+			hdr.version != AVR_SNAPSHOT_VERSION ||
+			strncmp(hdr.mmcu, avr->mmcu ? avr->mmcu : "", sizeof(hdr.mmcu) - 1) ||
+			hdr.ramend != avr->ramend || hdr.flashend != avr->flashend ||
+			hdr.e2end != avr->e2end) {
+		AVR_LOG(avr, LOG_ERROR, "SNAPSHOT: not a snapshot of this core\n");
+		goto error;
+	}
+
+	if (!(end = _snap_chunk_open(snap, SNAP_TAG('C','O','R','E'))))
+		goto error;
+	_snap_core(avr, snap);
+	snap->pos = end;
+
+	if (!(end = _snap_chunk_open(snap, SNAP_TAG('I','N','T','S'))))
+		goto error;
+	_snap_interrupts(avr, snap);
+	snap->pos = end;
+
+	if (!(end = _snap_chunk_open(snap, SNAP_TAG('I','R','Q','S'))))
+		goto error;
+	_snap_irqs(avr, snap);
+	snap->pos = end;
+
+	// modules may re-arm their own timers, the saved ones are added after
+	avr_cycle_count_t limit = avr->run_cycle_limit;
+	avr_cycle_timer_reset(avr);
+	avr->run_cycle_limit = limit;
+
+	for (avr_io_t * io = avr->io_port; io && !snap->error; io = io->next) {
+		char kind[16] = {0}, saved[16];
+		strncpy(kind, io->kind ? io->kind : "", sizeof(kind) - 1);
+		if (!(end = _snap_chunk_open(snap, SNAP_TAG('I','O','M','D'))))
+			break;
+		_snap_get(snap, saved, sizeof(saved));
+		if (memcmp(kind, saved, sizeof(kind))) {
+			AVR_LOG(avr, LOG_ERROR,
+					"SNAPSHOT: IO module '%s' where '%s' was expected\n",
+					kind, saved);
+			goto error;
+		}
+		if (io->snapshot)
+			io->snapshot(io, snap);
+		if (snap->pos > end)
+			snap->error++;
+		snap->pos = end;
+	}
+	if (snap->error ||
+			!(end = _snap_chunk_open(snap, SNAP_TAG('T','I','M','R'))))
+		goto error;
+	_snap_timers_restore(avr, snap,
+			hdr.pid == getpid() && hdr.owner == (uintptr_t)avr);
+	if (snap->error)
+		goto error;
+	snap->restore = 0;
+	return 0;
+error:
+	AVR_LOG(avr, LOG_ERROR, "SNAPSHOT: restore failed, state is undefined\n");
+	snap->restore = 0;
+	return -1;
+}
+
+int
+avr_snapshot_write(
+		avr_snapshot_t * snap,
+		const char * filename)
+{
+	FILE * f = fopen(filename, "wb");
+
+	if (!f) {
+		perror(filename);
+		return -1;
+	}
+	int res = fwrite(snap->buf, 1, snap->len, f) == snap->len ? 0 : -1;
+	fclose(f);
+	return res;
+}
+
+avr_snapshot_t *
+avr_snapshot_read(
+		const char * filename)
+{
+	FILE * f = fopen(filename, "rb");
+
+	if (!f) {
+		perror(filename);
+		return NULL;
+	}
+	avr_snapshot_t * snap = calloc(1, sizeof(*snap));
+	uint8_t b[4096];
+	size_t r;
+	while ((r = fread(b, 1, sizeof(b), f)) > 0)
+		_snap_put(snap, b, r);
+	fclose(f);
+	return snap;
+}
+
+void
+avr_snapshot_free(
+		avr_snapshot_t * snap)
+{
+	if (!snap)
+		return;
+	free(snap->buf);
+	free(snap);
+}
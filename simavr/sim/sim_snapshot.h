@@ -0,0 +1,97 @@
+/*
+	sim_snapshot.h
+
+	Saves and restores the complete state of a running avr_t, core,
+	memories, interrupts, cycle timers and IO modules.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_SNAPSHOT_H__
+#define __SIM_SNAPSHOT_H__
+
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define AVR_SNAPSHOT_MAGIC		0x4e534153	// 'SASN'
+#define AVR_SNAPSHOT_VERSION	2
+
+/*
+ * A snapshot is a flat buffer of tagged chunks, so it can be kept in
+ * memory, or written to a file and restored by another process running
+ * the same simavr build and core.
+ */
+typedef struct avr_snapshot_t {
+	uint8_t *	buf;
+	uint32_t	size;		// allocated
+	uint32_t	len;		// used
+	uint32_t	pos;		// read position, when restoring
+	int			restore;	// direction for avr_snapshot_field()
+	int			error;		// set when a restore ran past a chunk
+} avr_snapshot_t;
+
+/*
+ * Takes a snapshot of 'avr'. Returns a newly allocated snapshot.
+ */
+avr_snapshot_t *
+avr_snapshot_take(
+		avr_t * avr);
+/*
+ * Restores 'avr' to the state in 'snap'. 'avr' must be the same core,
+ * initialized, and with the same IO modules and external parts attached.
+ * Cycle timers no IO module owns (see avr_io_t 'timers') are only restored
+ * in the process that took the snapshot.
+ * Returns 0 on success, -1 if the snapshot doesn't match.
+ */
+int
+avr_snapshot_restore(
+		avr_t * avr,
+		avr_snapshot_t * snap);
+
+int
+avr_snapshot_write(
+		avr_snapshot_t * snap,
+		const char * filename);
+avr_snapshot_t *
+avr_snapshot_read(
+		const char * filename);
+void
+avr_snapshot_free(
+		avr_snapshot_t * snap);
+
+/*
+ * Used by the IO modules snapshot() callback: copies 'size' bytes from
+ * 'data' to the snapshot, or back from it when restoring. The callback
+ * is called in the same way to save and restore, so it just lists the
+ * fields it needs.
+ */
+void
+avr_snapshot_field(
+		avr_snapshot_t * snap,
+		void * data,
+		uint32_t size);
+
+#define AVR_SNAPSHOT_FIELD(_snap, _f) \
+		avr_snapshot_field(_snap, &(_f), sizeof(_f))
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_SNAPSHOT_H__ */
@@ -0,0 +1,311 @@
+/*
+	sim_stack.c
+
+	Stack high-water marks, by function and by interrupt vector, and
+	heap tracking.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim_stack.h"
+#include "sim_elf.h"
+
+static inline uint16_t
+_stack_sp(
+		avr_t * avr)
+{
+	return avr->data[R_SPL] | (avr->data[R_SPH] << 8);
+}
+
+/* Data address of symbol 'name', 0 if it's not there */
+static uint16_t
+_stack_symbol(
+		avr_t * avr,
+		const char * name)
+{
+	for (int i = 0; i < avr->symbolcount; i++)
+		if (!strcmp(avr->symbol[i].symbol, name)) {
+			uint32_t addr = avr->symbol[i].addr;
+			if (addr < AVR_SEGMENT_OFFSET_DATA ||
+					addr >= AVR_SEGMENT_OFFSET_EEPROM)
+				return 0;
+			return addr - AVR_SEGMENT_OFFSET_DATA;
+		}
+	return 0;
+}
+
+static const char *
+_stack_name(
+		avr_t * avr,
+		avr_flashaddr_t pc,
+		char * buf,
+		size_t size)
+{
+	const avr_symbol_t * s = avr_symbol_find(avr, pc);
+
+	if (s && s->addr < AVR_SEGMENT_OFFSET_DATA) {
+		if (s->addr == pc)
+			return s->symbol;
+		snprintf(buf, size, "%s+0x%x", s->symbol, pc - s->addr);
+	} else
+		snprintf(buf, size, "0x%04x", pc);
+	return buf;
+}
+
+/* Only the first one is logged, the rest would be the same overflow */
+static void
+_stack_collision(
+		avr_stack_t * s,
+		uint16_t sp)
+{
+	avr_t * avr = s->avr;
+	char buf[64];
+
+	if (s->collided)
+		return;
+	s->collided = 1;
+	s->collision_pc = avr->pc;
+	s->collision_cycle = avr->cycle;
+	AVR_LOG(avr, LOG_ERROR,
+			"STACK: SP %04x ran into the %s (%04x) at %s, cycle %llu\n",
+			sp, s->brk ? "heap" : "static data", s->limit,
+			_stack_name(avr, avr->pc, buf, sizeof(buf)),
+			(unsigned long long)avr->cycle);
+}
+
+void
+avr_stack_low(
+		avr_stack_t * s,
+		uint16_t sp)
+{
+	avr_t * avr = s->avr;
+	uint16_t * m = &s->pc_min[avr->pc >> 1];
+
+	if (sp < *m)
+		*m = sp;
+	if (sp < s->level_min) {
+		s->level_min = s->level[s->depth].min_sp = sp;
+		avr_stack_vector_t * v = &s->vector[s->level[s->depth].vector];
+		uint16_t entry = s->level[s->depth].entry;
+		if (sp < v->min_sp)
+			v->min_sp = sp;
+		if (entry > sp && entry - sp > v->depth) {
+			v->depth = entry - sp;
+			v->pc = avr->pc;
+		}
+	}
+	if (sp < s->min_sp) {
+		s->min_sp = sp;
+		s->min_pc = avr->pc;
+		s->min_cycle = avr->cycle;
+	}
+	if (sp < s->limit)
+		_stack_collision(s, sp);
+}
+
+void
+avr_stack_heap(
+		avr_stack_t * s,
+		uint16_t brk)
+{
+	// __brkval stays 0 until the first malloc()
+	s->brk = brk;
+	s->limit = brk ? brk : s->data_end;
+	if (s->limit > s->brk_max)
+		s->brk_max = s->limit;
+	if (_stack_sp(s->avr) < s->limit)
+		_stack_collision(s, _stack_sp(s->avr));
+}
+
+/* The return address is pushed, and avr->pc is the vector already */
+void
+avr_stack_irq(
+		avr_stack_t * s,
+		int vector)
+{
+	avr_t * avr = s->avr;
+	uint16_t sp = _stack_sp(avr);
+
+	s->vector[vector + 1].calls++;
+	if (s->depth == AVR_STACK_NEST) {
+		s->overflow++;
+		return;
+	}
+	s->depth++;
+	s->level[s->depth].vector = vector + 1;
+	s->level[s->depth].entry = sp + avr->address_size;
+	s->level[s->depth].min_sp = 0xffff;
+	s->level_min = 0xffff;
+	avr_stack_low(s, sp);
+}
+
+void
+avr_stack_reti(
+		avr_stack_t * s)
+{
+	// the levels that didn't fit return first
+	if (s->overflow) {
+		s->overflow--;
+		return;
+	}
+	if (s->depth)
+		s->depth--;
+	s->level_min = s->level[s->depth].min_sp;
+}
+
+void
+avr_stack_reset(
+		avr_stack_t * s)
+{
+	s->depth = s->overflow = 0;
+	s->level_min = s->level[0].min_sp;
+}
+
+avr_stack_t *
+avr_stack_start(
+		avr_t * avr)
+{
+	avr_stack_t * s = calloc(1, sizeof(*s));
+
+	s->avr = avr;
+	s->pc_count = (avr->flashend + 1) >> 1;
+	s->pc_min = malloc(s->pc_count * sizeof(s->pc_min[0]));
+	memset(s->pc_min, 0xff, s->pc_count * sizeof(s->pc_min[0]));
+	s->min_sp = 0xffff;
+	for (int i = 0; i < ARRAY_SIZE(s->vector); i++)
+		s->vector[i].min_sp = 0xffff;
+	s->level[0].entry = avr->ramend;
+	s->level[0].min_sp = s->level_min = 0xffff;
+
+	s->data_end = _stack_symbol(avr, "__heap_start");
+	if (!s->data_end)
+		s->data_end = _stack_symbol(avr, "_end");
+	s->brkval = _stack_symbol(avr, "__brkval");
+	s->limit = s->brk_max = s->data_end;
+	if (s->brkval)
+		avr_stack_heap(s, avr->data[s->brkval] |
+				(avr->data[s->brkval + 1] << 8));
+	AVR_LOG(avr, LOG_TRACE, "STACK: data end %04x, __brkval %04x\n",
+			s->data_end, s->brkval);
+	avr->stack = s;
+	return s;
+}
+
+void
+avr_stack_stop(
+		avr_stack_t * s)
+{
+	if (s->avr->stack == s)
+		s->avr->stack = NULL;
+}
+
+void
+avr_stack_free(
+		avr_stack_t * s)
+{
+	avr_stack_stop(s);
+	free(s->pc_min);
+	free(s);
+}
+
+typedef struct stack_line_t {
+	avr_flashaddr_t	addr;		// of the function, or the first word
+	uint16_t		min_sp;
+} stack_line_t;
+
+static int
+_stack_line_cmp(
+		const void * a,
+		const void * b)
+{
+	const stack_line_t * la = a, * lb = b;
+
+	return la->min_sp < lb->min_sp ? -1 : la->min_sp > lb->min_sp ? 1 : 0;
+}
+
+void
+avr_stack_report(
+		avr_stack_t * s,
+		FILE * o,
+		int count)
+{
+	avr_t * avr = s->avr;
+	char buf[64];
+
+	if (s->min_sp == 0xffff) {
+		fprintf(o, "stack: nothing ran\n");
+		return;
+	}
+	fprintf(o, "stack: %u bytes deep at most, SP %04x at %s, cycle %llu\n",
+			avr->ramend - s->min_sp, s->min_sp,
+			_stack_name(avr, s->min_pc, buf, sizeof(buf)),
+			(unsigned long long)s->min_cycle);
+	if (s->data_end)
+		fprintf(o, "static data ends at %04x, heap top %04x at most, "
+				"%d bytes never used\n", s->data_end, s->brk_max,
+				(int)s->min_sp - s->brk_max);
+	if (s->collided)
+		fprintf(o, "stack collision at %s, cycle %llu\n",
+				_stack_name(avr, s->collision_pc, buf, sizeof(buf)),
+				(unsigned long long)s->collision_cycle);
+
+	/*
+	 * Functions are runs of words with the same symbol; the symbols are
+	 * sorted, so a function's words are all together.
+	 */
+	stack_line_t * line = calloc(s->pc_count, sizeof(line[0]));
+	const avr_symbol_t * last = NULL;
+	uint32_t lines = 0;
+	for (uint32_t w = 0; w < s->pc_count; w++) {
+		if (s->pc_min[w] == 0xffff)
+			continue;
+		const avr_symbol_t * sym = avr_symbol_find(avr, w << 1);
+		if (sym && sym->addr >= AVR_SEGMENT_OFFSET_DATA)
+			sym = NULL;
+		if (!lines || sym != last || (!sym &&
+				s->pc_min[w - 1] == 0xffff)) {
+			line[lines++] = (stack_line_t) {
+				.addr = sym ? sym->addr : w << 1, .min_sp = 0xffff };
+			last = sym;
+		}
+		if (s->pc_min[w] < line[lines - 1].min_sp)
+			line[lines - 1].min_sp = s->pc_min[w];
+	}
+	qsort(line, lines, sizeof(line[0]), _stack_line_cmp);
+	fprintf(o, "%8s %6s  %s\n", "depth", "SP", "function");
+	for (int i = 0; i < lines && i < count; i++)
+		fprintf(o, "%8u %6.4x  %s\n", avr->ramend - line[i].min_sp,
+				line[i].min_sp,
+				_stack_name(avr, line[i].addr, buf, sizeof(buf)));
+	free(line);
+
+	fprintf(o, "%8s %10s %8s %6s  %s\n",
+			"vector", "calls", "depth", "SP", "deepest at");
+	for (int i = 0; i < ARRAY_SIZE(s->vector); i++) {
+		avr_stack_vector_t * v = &s->vector[i];
+		if (i && !v->calls)
+			continue;
+		char name[8];
+		if (i)
+			snprintf(name, sizeof(name), "%d", i - 1);
+		fprintf(o, "%8s %10llu %8u %6.4x  %s\n", i ? name : "main",
+				(unsigned long long)v->calls, v->depth, v->min_sp,
+				v->depth ? _stack_name(avr, v->pc, buf, sizeof(buf)) : "-");
+	}
+}
@@ -0,0 +1,147 @@
+/*
+	sim_stack.h
+
+	Stack high-water marks: the lowest SP reached overall, by each
+	function and by each interrupt vector, and the heap top from the
+	avr-libc malloc, to size the RAM of a part and catch the stack
+	running into the heap or the static data.
+
+ 	This file is part of simavr.
+
+	simavr is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	simavr is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with simavr.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIM_STACK_H__
+#define __SIM_STACK_H__
+
+#include <stdio.h>
+#include "sim_avr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define AVR_STACK_NEST		64		// as avr_int_table_t running[]
+
+/* The main code, or one interrupt vector */
+typedef struct avr_stack_vector_t {
+	uint64_t			calls;
+	uint16_t			min_sp;
+	uint16_t			depth;		// max, from the SP it was entered with
+	avr_flashaddr_t		pc;			// where that was
+} avr_stack_vector_t;
+
+typedef struct avr_stack_t {
+	avr_t *				avr;
+
+	uint16_t			min_sp;
+	avr_flashaddr_t		min_pc;
+	avr_cycle_count_t	min_cycle;
+	// lowest SP after each instruction, by flash word, 0xffff if never run
+	uint16_t *			pc_min;
+	uint32_t			pc_count;
+
+	// 0 is the main code, vectors are +1
+	avr_stack_vector_t	vector[65];
+	// interrupts being run, 0 is the main code
+	struct {
+		uint8_t			vector;
+		uint16_t		entry;		// SP before the return address push
+		uint16_t		min_sp;
+	} level[AVR_STACK_NEST + 1];
+	int					depth;
+	int					overflow;	// nested past AVR_STACK_NEST, not in level[]
+	uint16_t			level_min;	// level[depth].min_sp, for avr_stack_step()
+
+	// from the ELF symbols, 0 when missing
+	uint16_t			data_end;	// __heap_start, or _end
+	uint16_t			brkval;		// address of the malloc __brkval
+	uint16_t			brk, brk_max;
+	uint16_t			limit;		// the SP must stay above, heap top or data end
+
+	int					collided;
+	avr_flashaddr_t		collision_pc;
+	avr_cycle_count_t	collision_cycle;
+} avr_stack_t;
+
+/*
+ * Starts watching the stack of 'avr' from now on; its symbols should be
+ * loaded, or there is no heap tracking and no function names.
+ */
+avr_stack_t *
+avr_stack_start(
+		avr_t * avr);
+/*
+ * Stops watching, the report can still be printed, then freed.
+ */
+void
+avr_stack_stop(
+		avr_stack_t * s);
+void
+avr_stack_free(
+		avr_stack_t * s);
+/*
+ * Prints the overall high-water mark, the heap and the margin between
+ * them, the 'count' functions going deepest and every vector that ran.
+ * Can be called while running.
+ */
+void
+avr_stack_report(
+		avr_stack_t * s,
+		FILE * o,
+		int count);
+
+/* Called by the core, when avr->stack is set */
+void
+avr_stack_low(
+		avr_stack_t * s,
+		uint16_t sp);
+void
+avr_stack_heap(
+		avr_stack_t * s,
+		uint16_t brk);
+void
+avr_stack_irq(
+		avr_stack_t * s,
+		int vector);
+void
+avr_stack_reti(
+		avr_stack_t * s);
+/* The core was reset, back to the main code */
+void
+avr_stack_reset(
+		avr_stack_t * s);
+
+/* After each instruction, before avr->pc moves on */
+static inline void
+avr_stack_step(
+		avr_stack_t * s,
+		avr_t * avr)
+{
+	uint16_t sp = avr->data[R_SPL] | (avr->data[R_SPH] << 8);
+
+	if (sp < s->level_min || sp < s->pc_min[avr->pc >> 1])
+		avr_stack_low(s, sp);
+	if (s->brkval) {
+		uint16_t brk = avr->data[s->brkval] | (avr->data[s->brkval + 1] << 8);
+		if (brk != s->brk)
+			avr_stack_heap(s, brk);
+	}
+}
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif /* __SIM_STACK_H__ */
@@ -28,6 +28,14 @@ avr_cycles_to_nsec(struct avr_t * avr, avr_cycle_count_t cycles)
 	return (uint64_t)1E6 * (uint64_t)cycles / (avr->frequency/1000);
 }
 
+// converts a number of nsecs to cycles; split to avoid overflow and drift
+static inline avr_cycle_count_t
+avr_nsec_to_cycles(struct avr_t * avr, uint64_t nsec)
+{
+	return (nsec / 1000000000ULL) * avr->frequency +
+			((nsec % 1000000000ULL) * avr->frequency) / 1000000000ULL;
+}
+
 // converts a number of hz (to megahertz etc) to a number of cycle
 static inline avr_cycle_count_t
 avr_hz_to_cycles(avr_t * avr, uint32_t hz)
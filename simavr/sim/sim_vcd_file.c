@@ -4,10 +4,15 @@
 #include <inttypes.h>
 #include <ctype.h>
 #include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "sim_vcd_file.h"
 #include "sim_avr.h"
 #include "sim_time.h"
-#include "sim_utils.h"
+#include "sim_io.h"
+#include "sim_reverse.h"
 
 DEFINE_FIFO(avr_vcd_log_t, avr_vcd_fifo);
 
@@ -18,6 +23,15 @@ _avr_vcd_notify(
 		struct avr_irq_t * irq,
 		uint32_t value,
 		void * param);
+static void
+_avr_vcd_trigger_notify(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param);
+static void
+_avr_vcd_ring_push(
+		avr_vcd_t * vcd,
+		avr_vcd_log_t l);
 
 int
 avr_vcd_init(
@@ -34,136 +48,194 @@ avr_vcd_init(
 }
 
 /*
- * Parse a VCD 'timing' line. The lines are assumed to be:
- * #<absolute timestamp>[\n][<value x/z/0/1><signal alias character>|
- * 		b[x/z/0/1]?<space><signal alias character|
- *		r<real value><space><signal alias character]+
- * For example:
- * #1234 1' 0$
- * Or:
- * #1234
- * b1101x1 '
- * 0$
- *
- * This function tries to handle this transparently, and pushes the
- * signal/values into the FIFO for processing by the timer when
- * convenient.
- * NOTE: Add 'floating' support here. Also, FIX THE TIMING.
+ * Return the next whitespace separated token of the input file, or NULL
+ * at the end of it. Tokens point straight into the mmap()ed file, and are
+ * NOT zero terminated.
  */
-static avr_cycle_count_t
-avr_vcd_input_parse_line(
+static const char *
+_avr_vcd_input_token(
+		avr_vcd_t * vcd,
+		size_t * len)
+{
+	const char * p = vcd->input_pos;
+	const char * end = vcd->input + vcd->input_size;
+
+	while (p < end && (uint8_t)*p <= ' ')
+		p++;
+	const char * s = p;
+	while (p < end && (uint8_t)*p > ' ')
+		p++;
+	vcd->input_pos = p;
+	*len = p - s;
+	return *len ? s : NULL;
+}
+
+static int
+_avr_vcd_token_is(
+		const char * t,
+		size_t len,
+		const char * what)
+{
+	return t && len == strlen(what) && !memcmp(t, what, len);
+}
+
+/* FNV-1a of the alias, any length */
+static uint32_t
+_avr_vcd_alias_hash(
+		const char * alias,
+		size_t len)
+{
+	uint32_t h = 2166136261u;
+	while (len--)
+		h = (h ^ (uint8_t)*alias++) * 16777619u;
+	return h;
+}
+
+static void
+_avr_vcd_hash_signal(
 		avr_vcd_t * vcd,
-		argv_p v )
+		int index)
 {
-	uint64_t res = 0;
-	int vi = 0;
+	const char * alias = vcd->signal[index].alias;
+	uint32_t h = _avr_vcd_alias_hash(alias, strlen(alias));
 
-	if (v->argc == 0)
-		return res;
+	while (vcd->signal_hash[h & (AVR_VCD_HASH_SIZE-1)])
+		h++;
+	vcd->signal_hash[h & (AVR_VCD_HASH_SIZE-1)] = index + 1;
+}
 
-	if (v->argv[0][0] == '#') {
-		res = atoll(v->argv[0] + 1) * vcd->vcd_to_ns;
-		vcd->start = vcd->period;
-		vcd->period = res;
-		vi++;
+static int
+_avr_vcd_find_signal(
+		avr_vcd_t * vcd,
+		const char * alias,
+		size_t len)
+{
+	uint32_t h = _avr_vcd_alias_hash(alias, len);
+	uint8_t si;
+
+	while ((si = vcd->signal_hash[h & (AVR_VCD_HASH_SIZE-1)]) != 0) {
+		const char * a = vcd->signal[si - 1].alias;
+		if (!strncmp(a, alias, len) && !a[len])
+			return si - 1;
+		h++;
 	}
-	for (int i = vi; i < v->argc; i++) {
-		char * a = v->argv[i];
+	return -1;
+}
+
+/*
+ * Parse the next few value changes of the file, and push them into the
+ * FIFO for processing by the timer when convenient. The changes are:
+ * #<absolute timestamp>
+ * <value x/z/0/1><signal alias>
+ * b<x/z/0/1 string><space><signal alias>
+ * r<real value><space><signal alias>
+ * All of these can be on the same line, or not.
+ * Loops back to the first value change of the file if required.
+ */
+static int
+avr_vcd_input_read(
+		avr_vcd_t * vcd )
+{
+	int wrapped = 0, count = 0;
+	size_t len;
+	const char * t;
+
+	while (!avr_vcd_fifo_isfull(&vcd->log)) {
+		t = _avr_vcd_input_token(vcd, &len);
+		if (!t) {
+			/* don't loop over empty files, or files without a period */
+			if (!vcd->input_loop || !vcd->input_stamp || (wrapped && !count))
+				break;
+			wrapped = 1;
+			count = 0;
+			vcd->input_base += vcd->input_stamp;
+			vcd->input_stamp = 0;
+			vcd->input_pos = vcd->input_data;
+			continue;
+		}
 		uint32_t val = 0;
 		int floating = 0;
-		char name = 0;
-		int sigindex;
-
-		if (*a == 'b' || *a == 'B') {	// Binary string
-			a++;
-			while (*a) {
-				if (*a == 'x' || *a == 'z') {
+		const char * name = NULL;
+		size_t name_len = 0;
+
+		switch (*t) {
+			case '#': {
+				uint64_t stamp = 0;
+				for (size_t i = 1; i < len && isdigit(t[i]); i++)
+					stamp = (stamp * 10) + (t[i] - '0');
+				vcd->input_stamp = stamp * vcd->vcd_to_ns;
+			}	continue;
+			case '$':	// $dumpvars, $end etc are just ignored
+				if (_avr_vcd_token_is(t, len, "$comment"))
+					while ((t = _avr_vcd_input_token(vcd, &len)) != NULL &&
+							!_avr_vcd_token_is(t, len, "$end"))
+						;
+				continue;
+			case 'b': case 'B':	// Binary string
+				for (size_t i = 1; i < len; i++) {
 					val <<= 1;
-					floating |= (floating << 1) | 1;
-				} else if (*a == '0' || *a == '1') {
-					val = (val << 1) | (*a - '0');
 					floating <<= 1;
-				} else {
-					name = *a;
-					break;
+					if (t[i] == '1')
+						val |= 1;
+					else if (t[i] != '0')
+						floating |= 1;
 				}
-				a++;
-			}
-		} else if (*a == '0' || *a == '1' || *a == 'x' || *a == 'z') {
-			if (*a == 'x' || *a == 'z')
+				break;
+			case 'r': case 'R': {
+				char real[32];
+				size_t l = len - 1 < sizeof(real) - 1 ?
+								len - 1 : sizeof(real) - 1;
+				memcpy(real, t + 1, l);
+				real[l] = 0;
+				val = (uint32_t)strtod(real, NULL);
+			}	break;
+			case '0': case '1':
+				val = *t - '0';
+				name = t + 1;
+				name_len = len - 1;
+				break;
+			case 'x': case 'X': case 'z': case 'Z':
 				floating = 1;
-			else
-				val = *a++ - '0';
-			if (*a && *a > ' ')
-				name = *a;
-		} else if (*a == 'r' || *a == 'R') {
-			val = (uint32_t)strtod(++a, NULL);
-		}
-
-		if (!name && (i < v->argc - 1)) {
-			const char *n = v->argv[i+1];
-			if (strlen(n) == 1) {
-				// we've got a name, it was not attached
-				name = *n;
-				i++;	// skip that one
-			}
-		}
-		sigindex = -1;
-		if (name) {
-			for (int si = 0;
-						si < vcd->signal_count &&
-						sigindex == -1; si++) {
-				if (vcd->signal[si].alias == name)
-					sigindex = si;
-			}
+				name = t + 1;
+				name_len = len - 1;
+				break;
+			default:
+				AVR_LOG(vcd->avr, LOG_WARNING,
+						"%s: unexpected token '%.*s'\n",
+						vcd->filename, (int)len, t);
+				continue;
 		}
+		// vectors, or scalars with their alias not attached
+		if (!name_len)
+			name = _avr_vcd_input_token(vcd, &name_len);
+		int sigindex = name ? _avr_vcd_find_signal(vcd, name, name_len) : -1;
 		if (sigindex == -1) {
-			printf("Signal name '%c' value %x not found\n",
-					name? name : '?', val);
+			AVR_LOG(vcd->avr, LOG_WARNING,
+					"%s: signal '%.*s' value %x not found\n",
+					vcd->filename, name ? (int)name_len : 1,
+					name ? name : "?", val);
 			continue;
 		}
 		avr_vcd_log_t e = {
-				.when = vcd->period,
+				.when = vcd->input_base + vcd->input_stamp,
 				.sigindex = sigindex,
 				.floating = !!floating,
 				.value = val,
 		};
-	//	printf("%10u %d\n", e.when, e.value);
 		avr_vcd_fifo_write(&vcd->log, e);
-	}
-	return res;
-}
-
-/*
- * Read some signals from the file and fill the FIFO with it, we read
- * a completely arbitrary amount of stuff to fill the FIFO reasonably well
- */
-static int
-avr_vcd_input_read(
-		avr_vcd_t * vcd )
-{
-	char line[1024];
-
-	while (fgets(line, sizeof(line), vcd->input)) {
-	//	printf("%s", line);
-		if (!line[0])	// technically can't happen, but make sure next line works
-			continue;
-		vcd->input_line = argv_parse(vcd->input_line, line);
-		avr_vcd_input_parse_line(vcd, vcd->input_line);
-		/* stop once the fifo is full enough */
-		if (avr_vcd_fifo_get_read_size(&vcd->log) >= 128)
-			break;
+		count++;
 	}
 	return avr_vcd_fifo_isempty(&vcd->log);
 }
 
 /*
  * This is called when we need to change the state of one or more IRQ,
- * so look in the FIFO to know 'our' stamp time, read as much as we can
- * that is still on that same timestamp.
- * When when the FIFO content has too far in the future, re-schedule the
- * timer for that time and shoot off.
- * Also try to top up the FIFO with new read stuff when it's drained
+ * so look in the FIFO to know 'our' stamp time, raise all the values
+ * that are due at this cycle.
+ * When the FIFO content is in the future, re-schedule the timer for
+ * that time and shoot off. The cycle is recalculated from the absolute
+ * nS timestamp every time, so rounding errors don't accumulate.
+ * Also top up the FIFO with the next changes when it's half drained.
  */
 static avr_cycle_count_t
 _avr_vcd_input_timer(
@@ -171,44 +243,59 @@ _avr_vcd_input_timer(
 		avr_cycle_count_t when,
 		void * param)
 {
-	avr_cycle_count_t next;
 	avr_vcd_t * vcd = param;
 
-again:
-	// get some more if needed
-	if (avr_vcd_fifo_get_read_size(&vcd->log) < (vcd->signal_count * 16))
-		avr_vcd_input_read(vcd);
-
-	if (avr_vcd_fifo_isempty(&vcd->log)) {
-		printf("%s DONE but why are we here?\n", __func__);
-		return 0;
-	}
+	for (;;) {
+		if (avr_vcd_fifo_get_read_size(&vcd->log) < avr_vcd_fifo_fifo_size / 2)
+			avr_vcd_input_read(vcd);
 
-	avr_vcd_log_t log = avr_vcd_fifo_read_at(&vcd->log, 0);
-	uint64_t stamp = log.when;
-	while (!avr_vcd_fifo_isempty(&vcd->log)) {
-		log = avr_vcd_fifo_read_at(&vcd->log, 0);
-		if (log.when != stamp)	// leave those in the FIFO
-			break;
-		// we already have it
-		avr_vcd_fifo_read_offset(&vcd->log, 1);
-		avr_vcd_signal_p signal = &vcd->signal[log.sigindex];
-		avr_raise_irq_float(&signal->irq, log.value, log.floating);
+		if (avr_vcd_fifo_isempty(&vcd->log)) {
+			AVR_LOG(vcd->avr, LOG_TRACE,
+					"%s Finished reading, ending simavr\n",
+					vcd->filename);
+			avr->state = cpu_Done;
+			return 0;
+		}
+		avr_vcd_log_t log = avr_vcd_fifo_read_at(&vcd->log, 0);
+		avr_cycle_count_t next = vcd->start + avr_nsec_to_cycles(avr, log.when);
+		if (next > when)
+			return next;
+
+		uint64_t stamp = log.when;
+		do {
+			avr_vcd_fifo_read_offset(&vcd->log, 1);
+			avr_vcd_signal_p signal = &vcd->signal[log.sigindex];
+			avr_raise_irq_float(&signal->irq, log.value, log.floating);
+			if (avr_vcd_fifo_isempty(&vcd->log))
+				break;
+			log = avr_vcd_fifo_read_at(&vcd->log, 0);
+		} while (log.when == stamp);
 	}
+}
 
-	if (avr_vcd_fifo_isempty(&vcd->log)) {
-		AVR_LOG(vcd->avr, LOG_TRACE,
-				"%s Finished reading, ending simavr\n",
-				vcd->filename);
-		avr->state = cpu_Done;
-		return 0;
-	}
-	log = avr_vcd_fifo_read_at(&vcd->log, 0);
+/*
+ * Parse a header keyword, all the tokens up to its $end.
+ * Returns the number of tokens found, excluding the $end
+ */
+#define VCD_MAX_TOKENS	8
+typedef struct avr_vcd_token_t {
+	const char *	s;
+	size_t			len;
+} avr_vcd_token_t;
 
-	next = (log.when * avr->frequency) / (1000*1000*1000);
-	if (next <= when)
-		goto again;
-	return next;
+static int
+_avr_vcd_input_keyword(
+		avr_vcd_t * vcd,
+		avr_vcd_token_t * tok)
+{
+	int count = 0;
+	avr_vcd_token_t t;
+
+	while ((t.s = _avr_vcd_input_token(vcd, &t.len)) != NULL &&
+			!_avr_vcd_token_is(t.s, t.len, "$end"))
+		if (count < VCD_MAX_TOKENS)
+			tok[count++] = t;
+	return count;
 }
 
 int
@@ -221,86 +308,102 @@ avr_vcd_init_input(
 	vcd->avr = avr;
 	vcd->filename = strdup(filename);
 
-	vcd->input = fopen(vcd->filename, "r");
-	if (!vcd->input) {
+	int fd = open(vcd->filename, O_RDONLY);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) == -1) {
 		perror(filename);
+		if (fd != -1)
+			close(fd);
 		return -1;
 	}
-	char line[1024];
-	argv_p v = NULL;
-
-	while (fgets(line, sizeof(line), vcd->input)) {
-		if (!line[0])	// technically can't happen, but make sure next line works
-			continue;
-		v = argv_parse(v, line);
-
-		// we are done reading headers, got our first timestamp
-		if (v->line[0] == '#') {
-			uint64_t when;
-
-			vcd->start = 0;
-			avr_vcd_input_parse_line(vcd, v);
-			when = (vcd->period * vcd->avr->frequency) /
-				(1000*1000*1000);
-			avr_cycle_timer_register(vcd->avr, when,
-						 _avr_vcd_input_timer, vcd);
-			break;
-		}
-		// ignore multiline stuff
-		if (v->line[0] != '$')
-			continue;
+	if (st.st_size == 0) {
+		AVR_LOG(avr, LOG_ERROR, "%s: empty VCD file\n", filename);
+		close(fd);
+		return -1;
+	}
+	void * map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror(filename);
+		return -1;
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	vcd->input = vcd->input_pos = map;
+	vcd->input_size = st.st_size;
+	vcd->vcd_to_ns = 1;
 
-		const char * end = !strcmp(v->argv[v->argc - 1], "$end") ?
-								v->argv[v->argc - 1] : NULL;
-		const char *keyword = v->argv[0];
+	avr_vcd_token_t tok[VCD_MAX_TOKENS];
+	const char * t;
+	size_t len;
 
-		if (keyword == end)
-			keyword = NULL;
-		if (!keyword)
+	while ((t = _avr_vcd_input_token(vcd, &len)) != NULL) {
+		if (*t != '$')	// ignore stray stuff
 			continue;
+		avr_vcd_token_t keyword = { t, len };
+		int count = _avr_vcd_input_keyword(vcd, tok);
 
-		if (!strcmp(keyword, "$timescale")) {
-			// sim_vcd header allows only integer factors of ns: 1ns, 2us, 3ms, 10s, ...
+		// we are done reading headers
+		if (_avr_vcd_token_is(keyword.s, keyword.len, "$enddefinitions"))
+			break;
+		if (_avr_vcd_token_is(keyword.s, keyword.len, "$timescale") && count) {
+			// <number><unit> or <number> <unit>
 			uint64_t cnt = 0;
-			char *si = v->argv[1];
+			const char * si = tok[0].s;
+			size_t sl = tok[0].len;
 
-			vcd->vcd_to_ns = 1;
-			while (si && *si && isdigit(*si))
+			while (sl && isdigit(*si)) {
 				cnt = (cnt * 10) + (*si++ - '0');
-			while (si && *si == ' ')
-				si++;
-			if (si && !*si)
-				si = v->argv[2];
-			if (!strcmp(si, "ns")) {
-				// no calculation here
-				vcd->vcd_to_ns = cnt;
-			} else if (!strcmp(si, "us")) {
-				cnt*=1000;
-				vcd->vcd_to_ns = cnt;
-			} else if (!strcmp(si, "ms")) {
-				cnt*=1000*1000;
-				vcd->vcd_to_ns = cnt;
-			} else if (!strcmp(si, "s")) {
-				cnt*=1000*1000*1000;
-				vcd->vcd_to_ns = cnt;
+				sl--;
 			}
-			// printf("cnt %dus; unit %s\n", (int)cnt, si);
-		} else if (!strcmp(keyword, "$var")) {
-			const char *name = v->argv[4];
-
-			vcd->signal[vcd->signal_count].alias = v->argv[3][0];
-			vcd->signal[vcd->signal_count].size = atoi(v->argv[2]);
-			strncpy(vcd->signal[vcd->signal_count].name, name,
-						sizeof(vcd->signal[0].name));
-
+			if (!sl && count > 1) {
+				si = tok[1].s;
+				sl = tok[1].len;
+			}
+			static const struct {
+				const char * unit;
+				uint64_t ns;
+			} units[] = {
+				{ "ns", 1 }, { "us", 1000 }, { "ms", 1000 * 1000 },
+				{ "s", 1000 * 1000 * 1000 },
+			};
+			int ui;
+			for (ui = 0; ui < (int)(sizeof(units) / sizeof(units[0])); ui++)
+				if (_avr_vcd_token_is(si, sl, units[ui].unit))
+					break;
+			if (ui == sizeof(units) / sizeof(units[0])) {
+				AVR_LOG(avr, LOG_WARNING,
+						"%s: unsupported timescale '%.*s', using ns\n",
+						filename, (int)sl, si);
+				ui = 0;
+			}
+			vcd->vcd_to_ns = (cnt ? cnt : 1) * units[ui].ns;
+		} else if (_avr_vcd_token_is(keyword.s, keyword.len, "$var") &&
+				count >= 4) {
+			// <type> <size> <alias> <name> [<range>]
+			if (vcd->signal_count == AVR_VCD_MAX_SIGNALS ||
+					tok[2].len >= AVR_VCD_ALIAS_SIZE) {
+				AVR_LOG(avr, LOG_ERROR,
+						"%s: unable to add signal '%.*s'\n",
+						filename, (int)tok[3].len, tok[3].s);
+				continue;
+			}
+			avr_vcd_signal_t * s = &vcd->signal[vcd->signal_count];
+			size_t nl = tok[3].len < sizeof(s->name) - 1 ?
+							tok[3].len : sizeof(s->name) - 1;
+
+			memcpy(s->alias, tok[2].s, tok[2].len);
+			s->alias[tok[2].len] = 0;
+			memcpy(s->name, tok[3].s, nl);
+			s->name[nl] = 0;
+			s->size = atoi(tok[1].s);
+			_avr_vcd_hash_signal(vcd, vcd->signal_count);
 			vcd->signal_count++;
 		}
 	}
-	// reuse this one
-	vcd->input_line = v;
+	vcd->input_data = vcd->input_pos;
 
 	for (int i = 0; i < vcd->signal_count; i++) {
-		AVR_LOG(vcd->avr, LOG_TRACE, "%s %2d '%c' %s : size %d\n",
+		AVR_LOG(vcd->avr, LOG_TRACE, "%s %2d '%s' %s : size %d\n",
 				__func__, i,
 				vcd->signal[i].alias, vcd->signal[i].name,
 				vcd->signal[i].size);
@@ -330,6 +433,14 @@ avr_vcd_init_input(
 					vcd->signal[i].name);
 		}
 	}
+	vcd->start = avr->cycle;
+	avr_vcd_input_read(vcd);
+	if (!avr_vcd_fifo_isempty(&vcd->log)) {
+		avr_vcd_log_t log = avr_vcd_fifo_read_at(&vcd->log, 0);
+		avr_cycle_timer_register(vcd->avr,
+				avr_nsec_to_cycles(avr, log.when),
+				_avr_vcd_input_timer, vcd);
+	}
 	return 0;
 }
 
@@ -345,6 +456,19 @@ avr_vcd_close(
 
 		avr_free_irq(&s->irq, 1);
 	}
+	for (int i = 0; i < vcd->window.trigger_count; i++) {
+		avr_vcd_trigger_t * t = &vcd->window.trigger[i];
+
+		if (t->kind == AVR_VCD_TRIGGER_IRQ)
+			avr_irq_unregister_notify(t->irq,
+					_avr_vcd_trigger_notify, t);
+	}
+	vcd->window.trigger_count = 0;
+	vcd->window.pc_count = vcd->window.write_count = 0;
+	if (vcd->window.ring) {
+		free(vcd->window.ring);
+		vcd->window.ring = NULL;
+	}
 
 	if (vcd->filename) {
 		free(vcd->filename);
@@ -366,8 +490,7 @@ _avr_vcd_get_float_signal_text(
 		*dst++ = 'x';
 	if (s->size > 1)
 		*dst++ = ' ';
-	*dst++ = s->alias;
-	*dst = 0;
+	strcpy(dst, s->alias);
 	return out;
 }
 
@@ -386,8 +509,7 @@ _avr_vcd_get_signal_text(
 		*dst++ = value & (1 << (i-1)) ? '1' : '0';
 	if (s->size > 1)
 		*dst++ = ' ';
-	*dst++ = s->alias;
-	*dst = 0;
+	strcpy(dst, s->alias);
 	return out;
 }
 
@@ -472,6 +594,9 @@ _avr_vcd_notify(
 				__FUNCTION__);
 		return;
 	}
+	// that part of the trace was written already
+	if (avr_reverse_scanning(vcd->avr))
+		return;
 
 	avr_vcd_signal_t * s = (avr_vcd_signal_t*)irq;
 	avr_vcd_log_t l = {
@@ -480,6 +605,14 @@ _avr_vcd_notify(
 		.value = value,
 		.floating = !!(avr_irq_get_flags(irq) & IRQ_FLAG_FLOATING),
 	};
+	if (vcd->window.ring) {
+		// outside of a trigger window, just keep the history
+		if (vcd->avr->cycle >= vcd->window.until) {
+			_avr_vcd_ring_push(vcd, l);
+			return;
+		}
+		vcd->window.base[l.sigindex] = l;
+	}
 	if (avr_vcd_fifo_isfull(&vcd->log)) {
 		AVR_LOG(vcd->avr, LOG_WARNING,
 				"%s FIFO Overload, flushing!\n",
@@ -510,7 +643,8 @@ avr_vcd_add_signal(
 	avr_vcd_signal_t * s = &vcd->signal[index];
 	strncpy(s->name, name, sizeof(s->name));
 	s->size = signal_bit_size;
-	s->alias = ' ' + vcd->signal_count ;
+	s->alias[0] = ' ' + vcd->signal_count;
+	s->alias[1] = 0;
 
 	/* manufacture a nice IRQ name */
 	int l = strlen(name);
@@ -536,9 +670,6 @@ avr_vcd_start(
 {
 	time_t now;
 
-	vcd->start = vcd->avr->cycle;
-	avr_vcd_fifo_reset(&vcd->log);
-
 	if (vcd->input) {
 		/*
 		 * nothing to do here, the first cycle timer will take care
@@ -546,6 +677,10 @@ avr_vcd_start(
 		 */
 		return 0;
 	}
+	vcd->start = vcd->avr->cycle;
+	avr_vcd_fifo_reset(&vcd->log);
+	vcd->window.head = vcd->window.count = 0;
+	vcd->window.until = 0;
 	if (vcd->output)
 		avr_vcd_stop(vcd);
 	vcd->output = fopen(vcd->filename, "w");
@@ -560,7 +695,7 @@ avr_vcd_start(
 	fprintf(vcd->output, "$scope module logic $end\n");
 
 	for (int i = 0; i < vcd->signal_count; i++) {
-		fprintf(vcd->output, "$var wire %d %c %s $end\n",
+		fprintf(vcd->output, "$var wire %d %s %s $end\n",
 			vcd->signal[i].size, vcd->signal[i].alias, vcd->signal[i].name);
 	}
 
@@ -588,16 +723,245 @@ avr_vcd_stop(
 
 	avr_vcd_flush_log(vcd);
 
-	if (vcd->input_line)
-		free(vcd->input_line);
-	vcd->input_line = NULL;
 	if (vcd->input)
-		fclose(vcd->input);
-	vcd->input = NULL;
+		munmap((void *)vcd->input, vcd->input_size);
+	vcd->input = vcd->input_pos = vcd->input_data = NULL;
 	if (vcd->output)
 		fclose(vcd->output);
 	vcd->output = NULL;
 	return 0;
 }
 
+/*
+ * Move the ring entries older than 'since' into the base values, also
+ * make sure there are no more than 'keep' entries left
+ */
+static void
+_avr_vcd_ring_expire(
+		avr_vcd_t * vcd,
+		avr_cycle_count_t since,
+		uint32_t keep)
+{
+	while (vcd->window.count) {
+		uint32_t tail = (vcd->window.head - vcd->window.count) &
+							(vcd->window.ring_size - 1);
+		avr_vcd_log_t * l = &vcd->window.ring[tail];
+		if (l->when >= since && vcd->window.count <= keep)
+			break;
+		vcd->window.base[l->sigindex] = *l;
+		vcd->window.count--;
+	}
+}
+
+static void
+_avr_vcd_ring_push(
+		avr_vcd_t * vcd,
+		avr_vcd_log_t l)
+{
+	avr_cycle_count_t since = l.when > vcd->window.pre ?
+									l.when - vcd->window.pre : 0;
+
+	_avr_vcd_ring_expire(vcd, since, vcd->window.ring_size - 1);
+	vcd->window.ring[vcd->window.head] = l;
+	vcd->window.head = (vcd->window.head + 1) & (vcd->window.ring_size - 1);
+	vcd->window.count++;
+}
+
+/*
+ * A trigger happened; if we are not in a window already, write out the
+ * state of all the signals at the start of the window, followed by the
+ * history of changes, then record normally until the window is over.
+ */
+static void
+_avr_vcd_trigger(
+		avr_vcd_t * vcd)
+{
+	avr_cycle_count_t now = vcd->avr->cycle;
+
+	if (!vcd->window.ring || !vcd->output || avr_reverse_scanning(vcd->avr))
+		return;
+	if (now < vcd->window.until) {
+		vcd->window.until = now + vcd->window.post;
+		return;
+	}
+	avr_cycle_count_t since = now > vcd->window.pre ? now - vcd->window.pre : 0;
+	// don't go back before the previous window, nor the start of the file
+	if (since < vcd->window.until)
+		since = vcd->window.until;
+	if (since < vcd->start)
+		since = vcd->start;
+	_avr_vcd_ring_expire(vcd, since, vcd->window.ring_size);
+
+	AVR_LOG(vcd->avr, LOG_TRACE, "VCD: trigger at cycle %" PRI_avr_cycle_count
+			", %d changes in window\n", now, vcd->window.count);
+	for (int i = 0; i < vcd->signal_count; i++) {
+		avr_vcd_log_t l = vcd->window.base[i];
+		l.when = since;
+		if (avr_vcd_fifo_isfull(&vcd->log))
+			avr_vcd_flush_log(vcd);
+		avr_vcd_fifo_write(&vcd->log, l);
+	}
+	while (vcd->window.count) {
+		uint32_t tail = (vcd->window.head - vcd->window.count) &
+							(vcd->window.ring_size - 1);
+		avr_vcd_log_t l = vcd->window.ring[tail];
+		vcd->window.base[l.sigindex] = l;
+		vcd->window.count--;
+		if (avr_vcd_fifo_isfull(&vcd->log))
+			avr_vcd_flush_log(vcd);
+		avr_vcd_fifo_write(&vcd->log, l);
+	}
+	vcd->window.until = now + vcd->window.post;
+}
+
+int
+avr_vcd_set_window(
+		avr_vcd_t * vcd,
+		uint32_t pre_usec,
+		uint32_t post_usec,
+		uint32_t ring_size)
+{
+	uint32_t size = 16;
+
+	while (size < ring_size)
+		size <<= 1;
+	if (vcd->window.ring)
+		free(vcd->window.ring);
+	vcd->window.ring = malloc(size * sizeof(vcd->window.ring[0]));
+	if (!vcd->window.ring) {
+		AVR_LOG(vcd->avr, LOG_ERROR, "VCD: %s unable to allocate %d entries\n",
+				__func__, size);
+		return -1;
+	}
+	vcd->window.ring_size = size;
+	vcd->window.head = vcd->window.count = 0;
+	vcd->window.until = 0;
+	vcd->window.pre = avr_usec_to_cycles(vcd->avr, pre_usec);
+	vcd->window.post = avr_usec_to_cycles(vcd->avr, post_usec);
+	// nothing is known about the signals before they change
+	for (int i = 0; i < AVR_VCD_MAX_SIGNALS; i++) {
+		vcd->window.base[i] = (avr_vcd_log_t) {
+			.sigindex = i,
+			.floating = 1,
+		};
+	}
+	return 0;
+}
 
+static avr_vcd_trigger_t *
+_avr_vcd_add_trigger(
+		avr_vcd_t * vcd,
+		uint8_t kind)
+{
+	if (vcd->window.trigger_count == AVR_VCD_MAX_TRIGGERS) {
+		AVR_LOG(vcd->avr, LOG_ERROR, "VCD: %s too many triggers\n",
+				__func__);
+		return NULL;
+	}
+	avr_vcd_trigger_t * t = &vcd->window.trigger[vcd->window.trigger_count++];
+	memset(t, 0, sizeof(*t));
+	t->vcd = vcd;
+	t->kind = kind;
+	return t;
+}
+
+static void
+_avr_vcd_trigger_notify(
+		struct avr_irq_t * irq,
+		uint32_t value,
+		void * param)
+{
+	avr_vcd_trigger_t * t = (avr_vcd_trigger_t *)param;
+
+	if ((value & t->mask) == (t->value & t->mask))
+		_avr_vcd_trigger(t->vcd);
+}
+
+int
+avr_vcd_trigger_irq(
+		avr_vcd_t * vcd,
+		avr_irq_t * irq,
+		uint32_t value,
+		uint32_t mask)
+{
+	if (!irq)
+		return -1;
+	avr_vcd_trigger_t * t = _avr_vcd_add_trigger(vcd, AVR_VCD_TRIGGER_IRQ);
+	if (!t)
+		return -1;
+	t->irq = irq;
+	t->value = value;
+	t->mask = mask;
+	avr_irq_register_notify(irq, _avr_vcd_trigger_notify, t);
+	return 0;
+}
+
+int
+avr_vcd_trigger_pc(
+		avr_vcd_t * vcd,
+		uint32_t pc)
+{
+	if (vcd->avr->vcd != vcd)
+		AVR_LOG(vcd->avr, LOG_WARNING,
+				"VCD: %s %s is not attached to the core\n",
+				__func__, vcd->filename);
+	avr_vcd_trigger_t * t = _avr_vcd_add_trigger(vcd, AVR_VCD_TRIGGER_PC);
+	if (!t)
+		return -1;
+	t->addr = pc;
+	vcd->window.pc_count++;
+	return 0;
+}
+
+int
+avr_vcd_trigger_write(
+		avr_vcd_t * vcd,
+		uint16_t addr)
+{
+	avr_t * avr = vcd->avr;
+
+	// the register file is written without going thru the core write hook
+	if (addr < 32) {
+		AVR_LOG(avr, LOG_ERROR,
+				"VCD: %s: can't trigger on writes to r%d\n", __func__, addr);
+		return -1;
+	}
+	// IO registers don't all go thru the core write hook, use their IRQ
+	if (addr > 31 && addr <= avr->ioend)
+		return avr_vcd_trigger_irq(vcd,
+				avr_iomem_getirq(avr, addr, NULL, AVR_IOMEM_IRQ_ALL), 0, 0);
+	if (avr->vcd != vcd)
+		AVR_LOG(avr, LOG_WARNING,
+				"VCD: %s %s is not attached to the core\n",
+				__func__, vcd->filename);
+	avr_vcd_trigger_t * t = _avr_vcd_add_trigger(vcd, AVR_VCD_TRIGGER_WRITE);
+	if (!t)
+		return -1;
+	t->addr = addr;
+	vcd->window.write_count++;
+	return 0;
+}
+
+void
+avr_vcd_handle_pc(
+		avr_vcd_t * vcd,
+		uint32_t pc)
+{
+	for (int i = 0; i < vcd->window.trigger_count; i++) {
+		avr_vcd_trigger_t * t = &vcd->window.trigger[i];
+		if (t->kind == AVR_VCD_TRIGGER_PC && t->addr == pc)
+			_avr_vcd_trigger(vcd);
+	}
+}
+
+void
+avr_vcd_handle_write(
+		avr_vcd_t * vcd,
+		uint16_t addr)
+{
+	for (int i = 0; i < vcd->window.trigger_count; i++) {
+		avr_vcd_trigger_t * t = &vcd->window.trigger[i];
+		if (t->kind == AVR_VCD_TRIGGER_WRITE && t->addr == addr)
+			_avr_vcd_trigger(vcd);
+	}
+}
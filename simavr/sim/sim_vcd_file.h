@@ -27,6 +27,7 @@
 
 #include <stdio.h>
 #include "sim_irq.h"
+#include "sim_avr_types.h"
 #include "fifo_declare.h"
 
 #ifdef __cplusplus
@@ -42,12 +43,20 @@ extern "C" {
  *
  * It can also do the reverse, load a VCD file generated by for example
  * sigrock signal analyzer, and 'replay' digital input with the proper
- * timing.
+ * timing. The input file is mmap()ed and parsed as a stream, as the
+ * timer consumes the values, so large captures are fine. Set 'input_loop'
+ * after avr_vcd_init_input() to replay the file continuously; the last
+ * timestamp of the file is then taken as the loop period.
  *
- * TODO: Add support for 'looping' a VCD input.
+ * For output, capture can also be 'triggered': the changes are kept in
+ * an in-memory ring, and only the window around each trigger (an IRQ
+ * value, an instruction address or a write to a data address) makes
+ * it to the file. See avr_vcd_set_window().
  */
 
 #define AVR_VCD_MAX_SIGNALS 64
+#define AVR_VCD_ALIAS_SIZE	8	// max alias length, including the zero
+#define AVR_VCD_HASH_SIZE	256	// alias lookup table, power of two
 
 typedef struct avr_vcd_signal_t {
 	/*
@@ -55,7 +64,7 @@ typedef struct avr_vcd_signal_t {
 	 * For VCD input, this is the IRQ we broadcast the values to
 	 */
 	avr_irq_t 		irq;
-	char 			alias;			// vcd one character alias
+	char 			alias[AVR_VCD_ALIAS_SIZE];	// vcd identifier
 	uint8_t			size;			// in bits
 	char 			name[32];		// full human name
 } avr_vcd_signal_t, *avr_vcd_signal_p;
@@ -70,7 +79,21 @@ typedef struct avr_vcd_log_t {
 
 DECLARE_FIFO(avr_vcd_log_t, avr_vcd_fifo, 256);
 
-struct argv_t;
+#define AVR_VCD_MAX_TRIGGERS	8
+
+enum {
+	AVR_VCD_TRIGGER_IRQ = 0,	// IRQ value matches 'value' under 'mask'
+	AVR_VCD_TRIGGER_PC,			// instruction at 'addr' is executed
+	AVR_VCD_TRIGGER_WRITE,		// data (SRAM) 'addr' is written to
+};
+
+typedef struct avr_vcd_trigger_t {
+	struct avr_vcd_t *	vcd;
+	uint8_t			kind;
+	avr_irq_t *		irq;			// for IRQ triggers
+	uint32_t		addr;			// flash (byte) or data address
+	uint32_t		value, mask;
+} avr_vcd_trigger_t;
 
 typedef struct avr_vcd_t {
 	struct avr_t *	avr;	// AVR we are attaching timers to..
@@ -78,17 +101,39 @@ typedef struct avr_vcd_t {
 	char *			filename;		// .vcd filename
 	/* can be input OR output, not both */
 	FILE * 			output;
-	FILE * 			input;
-	struct argv_t	* input_line;
+	const char *	input;			// mmap()ed input file
+	size_t			input_size;
+	const char *	input_pos;		// parser position
+	const char *	input_data;		// first value change, for looping
+	uint64_t		input_stamp;	// current file timestamp, in ns
+	uint64_t		input_base;		// added to stamps when looping, in ns
+	int				input_loop;		// replay the input once it's done
 
 	int 				signal_count;
 	avr_vcd_signal_t	signal[AVR_VCD_MAX_SIGNALS];
+	// alias hash -> signal index + 1, for input
+	uint8_t				signal_hash[AVR_VCD_HASH_SIZE];
 
 	uint64_t 		start;
 	uint64_t 		period;		// for output cycles
 	uint64_t 		vcd_to_ns;	// for input unit mapping
 
 	avr_vcd_fifo_t	log;
+
+	/* triggered capture, only used if 'ring' is allocated */
+	struct {
+		avr_cycle_count_t	pre, post;	// window around a trigger, in cycles
+		avr_cycle_count_t	until;		// end of current post-trigger window
+		avr_vcd_log_t *		ring;		// pre-trigger history
+		uint32_t			ring_size;	// power of two
+		uint32_t			head, count;
+		// value of each signal just before the oldest entry of the ring
+		avr_vcd_log_t		base[AVR_VCD_MAX_SIGNALS];
+		int					trigger_count;
+		int					pc_count;	// fast check for the core hooks
+		int					write_count;
+		avr_vcd_trigger_t	trigger[AVR_VCD_MAX_TRIGGERS];
+	} window;
 } avr_vcd_t;
 
 // initializes a new VCD trace file, and returns zero if all is well
@@ -124,6 +169,50 @@ int
 avr_vcd_stop(
 		avr_vcd_t * vcd);
 
+/*
+ * Switch to triggered capture. Changes are kept in a ring of 'ring_size'
+ * entries (rounded up to a power of two), and only the ones 'pre_usec'
+ * before and 'post_usec' after a trigger are written to the file.
+ * Triggers that happen during a post-trigger window extend it.
+ */
+int
+avr_vcd_set_window(
+		avr_vcd_t * vcd,
+		uint32_t pre_usec,
+		uint32_t post_usec,
+		uint32_t ring_size);
+// trigger when (irq value & mask) == (value & mask). mask == 0 is any change
+int
+avr_vcd_trigger_irq(
+		avr_vcd_t * vcd,
+		avr_irq_t * irq,
+		uint32_t value,
+		uint32_t mask);
+/*
+ * PC and data write triggers are checked by the core, so they only work
+ * with the VCD file attached as avr->vcd. Writes to IO registers are
+ * turned into IRQ triggers on that register; the register file, below
+ * 32, can't be watched and returns -1.
+ */
+int
+avr_vcd_trigger_pc(
+		avr_vcd_t * vcd,
+		uint32_t pc);
+int
+avr_vcd_trigger_write(
+		avr_vcd_t * vcd,
+		uint16_t addr);
+
+// called by the core when PC/write triggers are set
+void
+avr_vcd_handle_pc(
+		avr_vcd_t * vcd,
+		uint32_t pc);
+void
+avr_vcd_handle_write(
+		avr_vcd_t * vcd,
+		uint16_t addr);
+
 #ifdef __cplusplus
 };
 #endif